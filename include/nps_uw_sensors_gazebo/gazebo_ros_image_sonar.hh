@@ -29,6 +29,9 @@
 #include <sensor_msgs/CameraInfo.h>
 #include <sensor_msgs/fill_image.h>
 #include <std_msgs/Float64.h>
+#include <std_msgs/Float64MultiArray.h>
+#include <std_msgs/UInt64.h>
+#include <std_msgs/UInt64MultiArray.h>
 #include <image_transport/image_transport.h>
 #include <acoustic_msgs/SonarImage.h>
 
@@ -46,8 +49,13 @@
 #include <complex>
 #include <valarray>
 #include <sstream>
+#include <atomic>
 #include <chrono>
+#include <deque>
+#include <mutex>
 #include <string>
+#include <utility>
+#include <vector>
 
 // gazebo stuff
 #include <sdf/Param.hh>
@@ -58,6 +66,20 @@
 #include <gazebo/sensors/SensorTypes.hh>
 #include <gazebo/plugins/DepthCameraPlugin.hh>
 
+#include <nps_uw_sensors_gazebo/sonar_bottom_detect.hh>
+#include <nps_uw_sensors_gazebo/sonar_cfar.hh>
+#include <nps_uw_sensors_gazebo/sonar_executor.hh>
+#include <nps_uw_sensors_gazebo/sonar_gain.hh>
+#include <nps_uw_sensors_gazebo/sonar_material_map.hh>
+#include <nps_uw_sensors_gazebo/sonar_ray_lod.hh>
+#include <nps_uw_sensors_gazebo/sonar_refraction.hh>
+#include <nps_uw_sensors_gazebo/sonar_result_cache.hh>
+#include <nps_uw_sensors_gazebo/sonar_reverberation.hh>
+#include <nps_uw_sensors_gazebo/sonar_tile_tracker.hh>
+#include <nps_uw_sensors_gazebo/sonar_stitching.hh>
+#include <nps_uw_sensors_gazebo/sonar_table_cache.hh>
+#include <nps_uw_sensors_gazebo/sonar_waveform.hh>
+
 
 namespace gazebo
 {
@@ -98,14 +120,124 @@ namespace gazebo
                                             unsigned int _depth,
                                             const std::string &_format);
 
+    /// \brief Everything a frame task reads from the rendering thread,
+    /// copied when the frame is handed to the executor
+    private: struct FrameInput
+    {
+      cv::Mat depth_image;
+      cv::Mat material_image;
+      common::Time update_time;
+      NpsGazeboSonar::SonarCacheKey cacheKey;
+      /// \brief Camera orientation at the measurement time
+      ignition::math::Quaterniond rotation;
+      /// \brief Camera depth below the surface [m] and declination of its
+      /// axis [rad] at the measurement time
+      double depth = 0.0;
+      double declination = 0.0;
+      /// \brief Range and material images of each stitched camera
+      std::vector<std::pair<cv::Mat, cv::Mat>> stitched;
+    };
+
+    /// \brief Hand a complete frame to the executor
+    private: void DispatchFrame(const FrameInput &_frame);
+
+    /// \brief Hand off the pending frame once every stitched camera has a
+    /// frame measured within stitchWindow of it. Runs on the rendering
+    /// thread, so no executor thread waits for the other cameras.
+    private: void DispatchStitched();
+
     /// \brief Compute a normal texture and implement sonar model
-    private: void ComputeSonarImage(const float *_src);
+    /// Runs as a stage task on the shared sonar executor
+    private: void ComputeSonarImage(const FrameInput &_frame);
+
+    /// \brief Run the sonar model on this frame's views, alone or batched
+    /// with other sonars. OnBeams finishes the frame.
+    private: void ComputeBeams(const FrameInput &_frame);
+
+    /// \brief Update the level of detail and statistics from the engine's
+    /// result and publish the frame
+    private: void OnBeams(const FrameInput &_frame,
+                          cv::Mat _normal_image,
+                          const std::vector<cv::Mat> &_ranges,
+                          std::chrono::high_resolution_clock::time_point _start,
+                          NpsGazeboSonar::SonarResult &_result);
+
+    /// \brief Add speckle and reverberation to the beam spectra and publish
+    /// the raw, fan, depth and normal images. Ends the in-flight frame.
+    private: void PublishSonarImage(const FrameInput &_frame,
+                                    CArray2D &beams,
+                                    cv::Mat normal_image,
+                                    bool cached);
+
+    /// \brief Count a frame that was not computed, publish the count and
+    /// warn at most every few seconds
+    private: void DropFrame(const std::string &_reason);
+
+    /// \brief Run the CFAR detector on every beam and publish the
+    /// detections as a point cloud in the sonar frame with the fields
+    /// x, y, z, beam, range, intensity and snr
+    private: void PublishDetections(const CArray2D &_beams,
+                                    common::Time _update_time);
+
+    /// \brief Publish the beam returns as a point cloud in the sonar
+    /// frame (fields x, y, z, beam, range, intensity) and the altitude
+    /// below the return of the beam closest to nadir
+    /// \param[in] _hasReturn Non-zero for the beams with a return
+    private: void PublishReturns(
+        const std::vector<NpsGazeboSonar::SonarReturn> &_returns,
+        const std::vector<unsigned char> &_hasReturn,
+        const FrameInput &_frame);
+
+    /// \brief Key of the current frame for the result cache: sensor pose,
+    /// poses of the models in the FOV and configuration. Called on the
+    /// rendering thread.
+    private: NpsGazeboSonar::SonarCacheKey CacheKey();
+
+    /// \brief Queue a sound speed profile of depth, speed pairs for the
+    /// next frame
+    private: void OnSoundSpeedProfile(
+        const std_msgs::Float64MultiArrayConstPtr &_msg);
+
+    /// \brief Swap in a queued profile's table and interpolate the slice
+    /// of the frame's depth and tilt
+    /// \return True if the slice changed
+    private: bool UpdateRefraction(double _depth, double _declination);
     private: void ComputePointCloud(const float *_src);
+
+    /// \brief Get the shared tables for a fan of _hFOV [rad] and size
+    /// everything that depends on nBeams. Called once, after stitching is
+    /// configured. Stitched fans render their beams uniformly over _hFOV.
+    private: void AcquireTables(double _hFOV, bool _stitched);
+
+    /// \brief Depth camera stitched into this sonar's fan
+    private: struct StitchCamera
+    {
+      std::string name;
+      sensors::DepthCameraSensorPtr sensor;
+      event::ConnectionPtr connection;
+      std::unique_ptr<NpsGazeboSonar::SonarMaterialPass> materialPass;
+      NpsGazeboSonar::SonarColumnMap columns;
+      /// \brief Horizontal field of view of this camera [rad]
+      double hFOV;
+      /// \brief Focal length of this camera [px]
+      double focalLength;
+      /// \brief Latest range and material images with their measurement
+      /// time [s], used on the rendering thread only
+      std::deque<std::pair<double, std::pair<cv::Mat, cv::Mat>>> frames;
+    };
+
+    /// \brief Resolve the stitched cameras and build the column maps.
+    /// Called on the rendering thread with the first frame.
+    /// \return False if a camera is not available yet
+    private: bool SetupStitching();
+
+    /// \brief Store a stitched camera's frame for DispatchStitched
+    private: void OnStitchDepthFrame(StitchCamera *_camera,
+                                     const float *_image);
     private: double ComputeIncidence(double azimuth,
                                      double elevation,
                                      cv::Vec3f normal);
-    private: cv::Mat ComputeNormalImage(cv::Mat& depth);
-    private: void ComputeCorrector();
+    private: cv::Mat ComputeNormalImage(cv::Mat& depth, double focalLength);
 
     /// \brief Parameters for sonar properties
     private: double sonarFreq;
@@ -115,23 +247,120 @@ namespace gazebo
     private: double sourceLevel;
     private: bool constMu;
     private: double absorption;
-    private: double attenuation;
+    /// \brief Amplitude attenuation of each frequency bin [Np/m]
+    private: std::vector<float> attenuationTable;
     private: double mu;  // surface reflectivity
-    private: float* rangeVector;
-    private: float* window;
-    private: float** beamCorrector;
-    private: float beamCorrectorSum;
+    /// \brief Material ID mask renderer for constantReflectivity=false,
+    /// created on the rendering thread with the first frame
+    private: std::unique_ptr<NpsGazeboSonar::SonarMaterialPass> materialPass;
+    private: std::vector<float> reflectivityTable;
+    /// \brief Range vector, window, beam corrector and scan conversion
+    /// map, shared with every other sonar of identical configuration
+    private: NpsGazeboSonar::SonarTablesPtr tables;
+    /// \brief Transmit waveform, its per-bin transmit x window and
+    /// matched filter, both empty for the flat spectrum
+    private: NpsGazeboSonar::SonarWaveform waveform;
+    private: std::vector<NpsGazeboSonar::Complex> waveformTransmit;
+    private: std::vector<NpsGazeboSonar::Complex> matchedFilter;
+    /// \brief Time varying gain and compression of the published
+    /// intensities, null when <tvg> is off
+    private: bool tvg;
+    private: NpsGazeboSonar::SonarGainConfig gainConfig;
+    private: std::unique_ptr<NpsGazeboSonar::SonarGainStage> gainStage;
+    /// \brief Amplitude at full level, 0 for each frame's peak
+    private: float gainCeiling;
+    /// \brief Water column reverberation, null when <reverberation> is
+    /// off, and the first hard return of each beam shadowing it [m]
+    private: bool volumeReverb;
+    private: NpsGazeboSonar::SonarReverberationConfig reverbConfig;
+    private: std::unique_ptr<NpsGazeboSonar::SonarReverberation>
+                 reverberation;
+    private: std::vector<float> beamFirstReturn;
+    /// \brief Shared bent-ray table of the sound speed profile, null for
+    /// straight rays, and its slice at the last sensor depth and tilt
+    private: NpsGazeboSonar::SonarRefractionPtr refractionTable;
+    private: std::vector<float> refractionPath;
+    private: std::vector<float> refractionDelay;
+    private: double refractionDepth;
+    private: double refractionDeclination;
+    /// \brief Profile received on the topic, swapped in by the next frame
+    private: std::mutex profileMutex;
+    private: std::unique_ptr<NpsGazeboSonar::SoundSpeedProfile>
+                 pendingProfile;
+    private: std::atomic<uint64_t> profileRevision;
     private: int nFreq;
     private: double df;
     private: int nBeams;
     private: int nRays;
     private: int beamSkips;
     private: int raySkips;
+    /// \brief Range dependent or stratified row sampling, null for fixed
+    /// raySkips
+    private: std::unique_ptr<NpsGazeboSonar::SonarRayLOD> rayLOD;
+    /// \brief Changed tile detection and device state of incremental
+    /// updates, null when every frame is recomputed
+    private: std::unique_ptr<NpsGazeboSonar::SonarTileTracker> tileTracker;
+    private: std::shared_ptr<NpsGazeboSonar::SonarIncrementalState>
+                 incrementalState;
+    private: uint64_t materialRevision;
+    /// \brief Noise free spectra reused while the scene is static, null
+    /// when every frame is recomputed
+    private: std::unique_ptr<NpsGazeboSonar::SonarResultCache> resultCache;
+    private: cv::Mat cachedNormalImage;
+    /// \brief Process normals, noise and echo synthesis in tiles that
+    /// stay in cache, host bands are sized to tileCacheBytes
+    private: bool tiledProcessing;
+    private: size_t tileCacheBytes;
+    /// \brief Precision tier of the sonar model
+    private: NpsGazeboSonar::SonarPrecision precision;
+    /// \brief Screen-space second bounce, its march budget [steps],
+    /// surface thickness relative to depth and specular reflection loss
+    private: bool multipath;
+    private: int multipathSteps;
+    private: double multipathThickness;
+    private: double multipathLoss;
+    /// \brief Detector along range publishing sparse detections, null
+    /// when disabled
+    private: std::unique_ptr<NpsGazeboSonar::SonarCfar> cfar;
+    /// \brief Per beam return extraction, null when disabled
+    private: std::unique_ptr<NpsGazeboSonar::SonarBottomDetector>
+                 bottomDetector;
+    /// \brief Field of view of this depth camera [rad], read once at load
+    /// so frame tasks never query the camera
+    private: double cameraHFOV;
+    private: double cameraVFOV;
     private: int ray_nAzimuthRays;
     private: int ray_nElevationRays;
     private: int plotScaler;
     protected: bool debugFlag;
 
+    /// \brief Task group of this sonar on the process-wide executor.
+    /// At most one sonar frame per sensor is in flight, from hand-off to
+    /// publishing, which may end on another sonar's batch thread.
+    private: std::unique_ptr<NpsGazeboSonar::SonarTaskGroup> taskGroup;
+    private: std::atomic<bool> frameInFlight;
+    private: std::atomic<uint64_t> droppedFrames;
+
+    /// \brief Compute frames together with the frames other sonars handed
+    /// off for the same simulation time, without waiting for them
+    private: bool batchSensors;
+
+    /// \brief Extra depth cameras of a fan, synchronized to this sensor's
+    /// measurement time within stitchWindow [s], half an update period
+    /// unless set
+    private: std::vector<std::string> stitchNames;
+    private: std::vector<std::unique_ptr<StitchCamera>> stitchCameras;
+    private: NpsGazeboSonar::SonarColumnMap primaryColumns;
+    private: double stitchWindow;
+    private: bool stitchReady;
+    /// \brief Frame waiting for the stitched cameras, rendering thread only
+    private: FrameInput pendingFrame;
+    private: bool framePending;
+    /// \brief Horizontal field of view of the sonar fan [rad]
+    private: double sonarHFOV;
+    /// \brief SDF beamAngles: pinhole, uniform or a list of angles [deg]
+    private: std::string beamAnglesSpec;
+
     /// \brief CSV log writing stream for verifications
     protected: std::ofstream writeLog;
     protected: u_int64_t writeCounter;
@@ -139,11 +368,12 @@ namespace gazebo
     protected: u_int64_t writeInterval;
     protected: bool writeLogFlag;
 
-    /// \brief Keep track of number of connctions for plugin outputs
-    private: int depth_image_connect_count_;
-    private: int depth_info_connect_count_;
-    private: int point_cloud_connect_count_;
-    private: int sonar_image_connect_count_;
+    /// \brief Keep track of number of connctions for plugin outputs,
+    /// changed by ROS callbacks while frames are rendered
+    private: std::atomic<int> depth_image_connect_count_;
+    private: std::atomic<int> depth_info_connect_count_;
+    private: std::atomic<int> point_cloud_connect_count_;
+    private: std::atomic<int> sonar_image_connect_count_;
     private: void DepthImageConnect();
     private: void DepthImageDisconnect();
     private: void DepthInfoConnect();
@@ -165,14 +395,27 @@ namespace gazebo
     private: ros::Publisher point_cloud_pub_;
     private: ros::Publisher sonar_image_raw_pub_;
     private: ros::Publisher sonar_image_pub_;
+    /// \brief Fraction of rays contributing to each frame
+    private: ros::Publisher sonar_occupancy_pub_;
+    /// \brief Result cache hits and misses
+    private: ros::Publisher sonar_cache_pub_;
+    /// \brief Frames dropped so far
+    private: ros::Publisher sonar_dropped_pub_;
+    /// \brief Secondary hits, march steps and device time of the second
+    /// bounce of each frame
+    private: ros::Publisher sonar_multipath_pub_;
+    /// \brief Runtime sound speed profile
+    private: ros::Subscriber sound_speed_sub_;
+    /// \brief CFAR detections of each frame
+    private: ros::Publisher sonar_detections_pub_;
+    /// \brief Beam returns and nadir altitude of each frame
+    private: ros::Publisher sonar_returns_pub_;
+    private: ros::Publisher sonar_altitude_pub_;
 
-    private: sensor_msgs::Image depth_image_msg_;
-    private: sensor_msgs::Image normal_image_msg_;
     private: sensor_msgs::PointCloud2 point_cloud_msg_;
-    private: acoustic_msgs::SonarImage sonar_image_raw_msg_;
-    private: sensor_msgs::Image sonar_image_msg_;
     private: cv::Mat point_cloud_image_;
 
+    /// \brief Reverberation draws, used only by the frame task
     std::default_random_engine generator;
 
     using GazeboRosCameraUtils::PublishCameraInfo;
@@ -184,6 +427,14 @@ namespace gazebo
     private: std::string point_cloud_topic_name_;
     private: std::string sonar_image_raw_topic_name_;
     private: std::string sonar_image_topic_name_;
+    private: std::string sonar_occupancy_topic_name_;
+    private: std::string sonar_cache_topic_name_;
+    private: std::string sonar_dropped_topic_name_;
+    private: std::string sonar_multipath_topic_name_;
+    private: std::string sound_speed_topic_name_;
+    private: std::string sonar_detections_topic_name_;
+    private: std::string sonar_returns_topic_name_;
+    private: std::string sonar_altitude_topic_name_;
 
     private: double point_cloud_cutoff_;
 
@@ -203,12 +454,11 @@ namespace gazebo
     private: event::ConnectionPtr newDepthFrameConnection;
     private: event::ConnectionPtr newImageFrameConnection;
     private: event::ConnectionPtr newRGBPointCloudConnection;
-    private: event::ConnectionPtr newSonarImageConnection;
 
     // A couple of "convenience" functions for computing azimuth & elevation
     private: inline double Azimuth(int col)
     {
-      double hfov = this->parentSensor->DepthCamera()->HFOV().Radian();
+      double hfov = this->cameraHFOV;
       double fl = static_cast<double>(this->width) / (2.0 * tan(hfov/2.0));
       double azimuth;
       if (this->width > 1)
@@ -221,7 +471,7 @@ namespace gazebo
 
     private: inline double Elevation(int row)
     {
-      double hfov = this->parentSensor->DepthCamera()->HFOV().Radian();
+      double hfov = this->cameraHFOV;
       double fl = static_cast<double>(this->width) / (2.0 * tan(hfov/2.0));
       double elevation;
       if (this->height > 1)
@@ -236,17 +486,7 @@ namespace gazebo
   ///////////////////////////////////////////
   inline double unnormalized_sinc(double t)
   {
-    try
-    {
-      double results = sin(t)/t;
-      if (results != results)
-        return 1.0;
-      else
-        return sin(t)/t;
-    }catch(int expn)
-    {
-      return 1.0;
-    }
+    return (fabs(t) < 1E-8) ? 1.0 : sin(t)/t;
   }
 }
 #endif
@@ -34,6 +34,7 @@
 #include <sensor_msgs/CameraInfo.h>
 #include <sensor_msgs/fill_image.h>
 #include <std_msgs/Float64.h>
+#include <acoustic_msgs/SonarImage.h>
 #include <image_transport/image_transport.h>
 
 // dynamic reconfigure stuff
@@ -55,7 +56,11 @@
 #include <gazebo/sensors/SensorTypes.hh>
 #include <gazebo/plugins/DepthCameraPlugin.hh>
 
+#include <memory>
 #include <string>
+#include <vector>
+
+#include <nps_uw_sensors_gazebo/sonar_echogram.hh>
 
 namespace gazebo
 {
@@ -104,6 +109,10 @@ namespace gazebo
     /// \brief push normals image data into ros topic
     private: void FillNormalsImage(const float *_src);
 
+    /// \brief Add the depth frame as one ping of the echogram and push
+    /// the ping's time series and the echogram into ros topics
+    private: void FillEchogram(const float *_src);
+
     /// \brief Keep track of number of connctions for point clouds
     private: int point_cloud_connect_count_;
     private: void PointCloudConnect();
@@ -176,6 +185,22 @@ namespace gazebo
     protected: ros::Publisher depth_image_camera_info_pub_;
 
     private: event::ConnectionPtr load_connection_;
+
+    /// \brief Echogram of the last pings, null when <echogram> is off
+    private: std::unique_ptr<NpsGazeboSonar::SonarEchogram> echogram_;
+    private: float echogram_gain_;
+    private: std::string echogram_topic_name_;
+    private: std::string ping_topic_name_;
+    private: ros::Publisher echogram_pub_;
+    private: ros::Publisher ping_pub_;
+
+    /// \brief Range over depth of each pixel (width x height)
+    private: std::vector<float> range_scale_;
+
+    /// \brief Messages allocated at load and reused for every ping, the
+    /// echogram draws straight into the image message
+    private: sensor_msgs::Image echogram_msg_;
+    private: acoustic_msgs::SonarImage ping_msg_;
   };
 
 }
@@ -26,9 +26,13 @@
 #include <ros/ros.h>
 #include <ros/advertise_options.h>
 #include <sensor_msgs/LaserScan.h>
+#include <sensor_msgs/Image.h>
+#include <acoustic_msgs/SonarImage.h>
 #include <gazebo_plugins/PubQueue.h>
 
+#include <memory>
 #include <string>
+#include <vector>
 
 #include <gazebo/physics/physics.hh>
 #include <gazebo/transport/TransportTypes.hh>
@@ -41,6 +45,8 @@
 
 #include <sdf/sdf.hh>
 
+#include <nps_uw_sensors_gazebo/sonar_echogram.hh>
+
 
 namespace gazebo
 {
@@ -95,6 +101,23 @@ namespace gazebo
     private: gazebo::transport::SubscriberPtr laser_scan_sub_;
     private: void OnScan(ConstLaserScanStampedPtr &_msg);
 
+    /// \brief Add the scan as one ping of the echogram and publish the
+    /// ping's time series and the echogram
+    private: void PublishEchogram(ConstLaserScanStampedPtr &_msg);
+
+    /// \brief Echogram of the last pings, null when <echogram> is off
+    private: std::unique_ptr<NpsGazeboSonar::SonarEchogram> echogram_;
+    private: float echogram_gain_;
+    private: std::string echogram_topic_name_;
+    private: std::string ping_topic_name_;
+    private: ros::Publisher echogram_pub_;
+    private: ros::Publisher ping_pub_;
+
+    /// \brief Messages allocated at load and reused for every ping, the
+    /// echogram draws straight into the image message
+    private: sensor_msgs::Image echogram_msg_;
+    private: acoustic_msgs::SonarImage ping_msg_;
+
     /// \brief prevents blocking
     private: PubMultiQueue pmq;
   };
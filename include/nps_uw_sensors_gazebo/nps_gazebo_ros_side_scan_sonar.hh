@@ -0,0 +1,149 @@
+/*
+ * Copyright 2020 Naval Postgraduate School
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+
+#ifndef NPS_GAZEBO_ROS_SIDE_SCAN_SONAR_HH
+#define NPS_GAZEBO_ROS_SIDE_SCAN_SONAR_HH
+
+#include <ros/ros.h>
+#include <sensor_msgs/Image.h>
+#include <acoustic_msgs/SonarImage.h>
+
+#include <opencv2/core.hpp>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <sdf/Param.hh>
+#include <gazebo/common/Plugin.hh>
+#include <gazebo/common/Time.hh>
+#include <gazebo/rendering/DepthCamera.hh>
+#include <gazebo/sensors/SensorTypes.hh>
+
+#include <nps_uw_sensors_gazebo/sonar_calculation_cuda.cuh>
+#include <nps_uw_sensors_gazebo/sonar_executor.hh>
+#include <nps_uw_sensors_gazebo/sonar_gain.hh>
+#include <nps_uw_sensors_gazebo/sonar_table_cache.hh>
+#include <nps_uw_sensors_gazebo/sonar_waterfall.hh>
+#include <nps_uw_sensors_gazebo/sonar_waveform.hh>
+
+namespace gazebo
+{
+  /// \brief Side-scan sonar with one fan shaped beam per side. Each side
+  /// is a depth camera looking abeam whose rows span the wide vertical
+  /// fan and whose columns span the narrow along track beam width. The
+  /// plugin is attached to the port camera, <starboardCamera> names the
+  /// other one. Every ping runs both sides through the point scattering
+  /// engine in one batch as single beam sonars, publishes their time
+  /// series and adds one line to the waterfall.
+  class NpsGazeboRosSideScanSonar : public SensorPlugin
+  {
+    /// \brief Constructor
+    public: NpsGazeboRosSideScanSonar();
+
+    /// \brief Destructor
+    public: ~NpsGazeboRosSideScanSonar();
+
+    /// \brief Load the plugin
+    /// \param take in SDF root element
+    public: virtual void Load(sensors::SensorPtr _parent,
+                              sdf::ElementPtr _sdf);
+
+    /// \brief One side of the sonar
+    private: struct Side
+    {
+      std::string name;
+      sensors::DepthCameraSensorPtr sensor;
+      rendering::DepthCameraPtr camera;
+      event::ConnectionPtr connection;
+      /// \brief Single beam tables, the camera width is the beam's
+      /// azimuthRaysPerBeam
+      NpsGazeboSonar::SonarTablesPtr tables;
+      /// \brief Latest range image and its measurement time [s], guarded
+      /// by frameMutex
+      cv::Mat range;
+      double time = -1.0;
+    };
+
+    /// \brief Resolve the starboard camera once every sensor is loaded
+    private: bool SetupStarboard();
+
+    /// \brief Acquire the single beam tables of a side's camera
+    private: void AcquireTables(Side &_side);
+
+    /// \brief Store a side's frame and start the ping once the latest
+    /// frames of every side were measured within syncWindow
+    private: void OnDepthFrame(Side *_side, const float *_image);
+
+    /// \brief Compute one ping and publish its time series and waterfall
+    private: void ComputePing(std::vector<cv::Mat> _ranges,
+                              common::Time _update_time);
+
+    /// \brief Engine frame of one side
+    private: void MakeFrame(const Side &_side, const cv::Mat &_range,
+                            uint64_t _seed,
+                            NpsGazeboSonar::SonarFrame &_frame);
+
+    /// \brief Port first, starboard second when configured
+    private: std::vector<std::unique_ptr<Side>> sides;
+    private: std::string starboardName;
+    private: bool starboardReady;
+    private: std::mutex frameMutex;
+    /// \brief Largest difference of the measurement times of the sides
+    /// of one ping [s], half an update period unless set
+    private: double syncWindow;
+
+    // Sonar properties, see NpsGazeboRosImageSonar
+    private: double sonarFreq;
+    private: double bandwidth;
+    private: double soundSpeed;
+    private: double maxDistance;
+    private: double minDistance;
+    private: double sourceLevel;
+    private: double mu;
+    private: int raySkips;
+    private: int nFreq;
+    private: std::vector<float> attenuationTable;
+    private: NpsGazeboSonar::SonarPrecision precision;
+    /// \brief Transmit x window and matched filter of each bin, empty for
+    /// the flat spectrum. Both sides share the window.
+    private: std::vector<NpsGazeboSonar::Complex> waveformTransmit;
+    private: std::vector<NpsGazeboSonar::Complex> matchedFilter;
+    /// \brief Time varying gain and compression of the ping and the
+    /// waterfall, null when <tvg> is off
+    private: std::unique_ptr<NpsGazeboSonar::SonarGainStage> gainStage;
+    /// \brief Amplitude at full level, 0 for each ping's peak
+    private: float gainCeiling;
+
+    /// \brief Waterfall of the last pings, only touched by ping tasks
+    private: std::unique_ptr<NpsGazeboSonar::SonarWaterfall> waterfall;
+    private: float waterfallGain;
+
+    /// \brief Ping computation on the shared sonar executor
+    private: std::unique_ptr<NpsGazeboSonar::SonarTaskGroup> taskGroup;
+    private: int droppedPings;
+    private: bool debugFlag;
+
+    private: std::string frame_name_;
+    private: std::unique_ptr<ros::NodeHandle> rosnode_;
+    /// \brief Time series of both sides of each ping
+    private: ros::Publisher ping_pub_;
+    /// \brief Waterfall image after each ping
+    private: ros::Publisher waterfall_pub_;
+  };
+}
+#endif
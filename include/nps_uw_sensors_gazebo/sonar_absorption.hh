@@ -0,0 +1,69 @@
+/*
+ * Copyright 2020 Naval Postgraduate School
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+
+#ifndef SONAR_ABSORPTION_HH
+#define SONAR_ABSORPTION_HH
+
+#include <string>
+#include <vector>
+
+namespace NpsGazeboSonar
+{
+  /// \brief Seawater absorption models
+  enum class AbsorptionModel
+  {
+    /// \brief Same absorption for every frequency
+    CONSTANT,
+    /// \brief Francois & Garrison (1982), boric acid, magnesium sulphate
+    /// and pure water relaxation terms
+    FRANCOIS_GARRISON
+  };
+
+  /// \brief Water column properties used by the absorption models
+  struct WaterProperties
+  {
+    /// \brief Temperature [deg C]
+    double temperature = 10.0;
+    /// \brief Salinity [ppt]
+    double salinity = 35.0;
+    /// \brief Depth [m]
+    double depth = 10.0;
+    double pH = 8.0;
+  };
+
+  /// \brief Parse an SDF model name, "constant" or "francois_garrison"
+  /// \return False if the name is unknown
+  bool ParseAbsorptionModel(const std::string &_name,
+                            AbsorptionModel &_model);
+
+  /// \brief Francois-Garrison absorption
+  /// \param[in] _frequency Frequency [Hz]
+  /// \return Absorption [dB/m]
+  double FrancoisGarrisonAbsorption(double _frequency,
+                                    const WaterProperties &_water);
+
+  /// \brief Amplitude attenuation of every frequency bin of the echo
+  /// spectrum, bin f being at _sonarFreq + _deltaF*(f + 1 - nFreq/2)
+  /// \param[in] _constAbsorption Absorption of the CONSTANT model [dB/m]
+  /// \return Attenuation per bin [Np/m] (nFreq)
+  std::vector<float> AttenuationTable(AbsorptionModel _model,
+                                      double _constAbsorption,
+                                      const WaterProperties &_water,
+                                      double _sonarFreq, double _deltaF,
+                                      int _nFreq);
+}  // namespace NpsGazeboSonar
+#endif
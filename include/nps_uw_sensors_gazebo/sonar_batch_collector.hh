@@ -0,0 +1,88 @@
+/*
+ * Copyright 2020 Naval Postgraduate School
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+
+#ifndef SONAR_BATCH_COLLECTOR_HH
+#define SONAR_BATCH_COLLECTOR_HH
+
+#include <nps_uw_sensors_gazebo/sonar_calculation_cuda.cuh>
+
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <vector>
+
+namespace NpsGazeboSonar
+{
+  /// \brief Called with the result of a submitted frame
+  typedef std::function<void(SonarResult)> SonarBatchDone;
+
+  /// \brief Gathers the frames that sonars hand to the executor for the
+  /// same simulation time and computes them with one batched engine call.
+  /// Nothing waits: a frame is announced when it is handed off, and the
+  /// thread that submits or withdraws the last announced frame of a stamp
+  /// runs the batch and every frame's continuation. Inactive sonars and
+  /// sonars without a frame at that stamp never hold a batch back.
+  class SonarBatchCollector
+  {
+    /// \brief Access the process-wide collector
+    public: static SonarBatchCollector &Instance();
+
+    /// \brief Expect a frame stamped _stamp, called on the rendering thread
+    /// before the frame is handed to the executor
+    public: void Announce(double _stamp);
+
+    /// \brief Drop an announced frame that will not be submitted
+    public: void Withdraw(double _stamp);
+
+    /// \brief Add an announced frame to its batch and return. _done runs
+    /// with the frame's result, on this thread if the batch is complete
+    /// or on the thread completing it later.
+    /// \param[in] _frame Input images and configuration
+    /// \param[in] _stamp Simulation time of the frame [s]
+    public: void Submit(const SonarFrame &_frame, double _stamp,
+                        SonarBatchDone _done);
+
+    /// \brief Number of batched engine calls and frames computed by them
+    public: void Stats(uint64_t &_batches, uint64_t &_frames) const;
+
+    private: SonarBatchCollector();
+
+    private: struct Batch
+    {
+      /// \brief Announced frames not yet submitted or withdrawn
+      int outstanding = 0;
+      std::vector<SonarFrame> frames;
+      std::vector<SonarBatchDone> done;
+    };
+
+    /// \brief Take the batch of _stamp out of the pending set if nothing
+    /// is outstanding, called with the lock held
+    /// \return False if the batch is still collecting
+    private: bool Complete(double _stamp, Batch &_batch);
+
+    /// \brief Run a completed batch on the calling thread, called without
+    /// the lock
+    private: void Run(Batch &_batch);
+
+    private: mutable std::mutex mutex;
+    private: std::map<double, Batch> pending;
+    private: uint64_t batches;
+    private: uint64_t frames;
+  };
+}  // namespace NpsGazeboSonar
+#endif
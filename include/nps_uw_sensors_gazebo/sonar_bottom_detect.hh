@@ -0,0 +1,79 @@
+/*
+ * Copyright 2020 Naval Postgraduate School
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+
+#ifndef SONAR_BOTTOM_DETECT_HH
+#define SONAR_BOTTOM_DETECT_HH
+
+#include <string>
+
+namespace NpsGazeboSonar
+{
+  /// \brief Which part of a beam's strongest echo gives its range
+  enum class ReturnMode
+  {
+    /// \brief First crossing of a fraction of the peak before the peak,
+    /// the nearest point of an extended target such as the bottom
+    LEADING_EDGE,
+    /// \brief Maximum of the echo
+    PEAK
+  };
+
+  /// \brief Parse "leading_edge" or "peak"
+  /// \return False for any other name, _mode is left unchanged
+  bool ParseReturnMode(const std::string &_name, ReturnMode &_mode);
+
+  /// \brief Range of one beam's return
+  struct SonarReturn
+  {
+    int beam;
+    /// \brief Interpolated range [m]
+    float range;
+    /// \brief Peak amplitude of the echo
+    float intensity;
+  };
+
+  /// \brief Extracts one return per beam from its amplitude along range,
+  /// with sub-bin interpolation: a parabola through the peak and its
+  /// neighbours, or a linear crossing of the leading edge threshold.
+  class SonarBottomDetector
+  {
+    /// \brief Constructor
+    /// \param[in] _threshold Leading edge level as a fraction of the peak
+    /// \param[in] _minIntensity Beams whose peak is at most this
+    /// amplitude have no return
+    /// \param[in] _minRange Bins closer than this [m] are ignored
+    public: SonarBottomDetector(ReturnMode _mode, double _threshold,
+                                double _minIntensity, double _minRange);
+
+    /// \brief Find the return of one beam
+    /// \param[in] _amplitude Echo amplitude of each range bin (_nBins)
+    /// \param[in] _rangeResolution Range step between bins [m], bin 0 is
+    /// at range 0
+    /// \param[out] _return Return of the beam, left unchanged without one
+    /// \return False if the beam has no return
+    public: bool Detect(int _beam, const float *_amplitude, int _nBins,
+                        float _rangeResolution, SonarReturn &_return) const;
+
+    public: ReturnMode Mode() const;
+
+    private: ReturnMode mode;
+    private: float threshold;
+    private: float minIntensity;
+    private: float minRange;
+  };
+}  // namespace NpsGazeboSonar
+#endif
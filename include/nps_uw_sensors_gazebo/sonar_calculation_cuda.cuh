@@ -25,11 +25,16 @@
 #include <stdio.h>
 #include <iostream>
 #include <complex>
+#include <memory>
 #include <valarray>
+#include <vector>
 
 #include <opencv2/core.hpp>
 #include <opencv2/core/core.hpp>
 
+#include <nps_uw_sensors_gazebo/sonar_precision.cuh>
+#include <nps_uw_sensors_gazebo/sonar_presets.cuh>
+
 namespace NpsGazeboSonar
 {
 
@@ -40,30 +45,210 @@ namespace NpsGazeboSonar
   /// \brief CUDA Device Check Function Wrapper
   void check_cuda_init_wrapper(void);
 
+  /// \brief Bent-ray corrections of the sensor's depth (see
+  /// SonarRefractionTable), indexed by the depression angle and length of
+  /// the straight line to each pixel
+  struct SonarRefraction
+  {
+    /// \brief Bent path length - straight distance [m] and sound speed x
+    /// travel time - straight distance [m], nElevations x nDistances
+    /// elevation major. Null path keeps straight rays.
+    const float *path = nullptr;
+    const float *delay = nullptr;
+    int nElevations = 0;
+    int nDistances = 0;
+    /// \brief Depression angles of the first and last rows [rad] and the
+    /// distance of the last column [m], the first is at 0
+    double minElevation = 0.0;
+    double maxElevation = 0.0;
+    double maxDistance = 0.0;
+    /// \brief Downward tilt of the camera axis [rad], added to the
+    /// elevation of each pixel
+    double declination = 0.0;
+  };
+
+  /// \brief Per-sensor parameters of one sonar calculation
+  struct SonarCalculationConfig
+  {
+    double hPixelSize;
+    double vPixelSize;
+    double hFOV;
+    double vFOV;
+    double beam_azimuthAngleWidth;
+    double beam_elevationAngleWidth;
+    double ray_azimuthAngleWidth;
+    double ray_elevationAngleWidth;
+    double soundSpeed;
+    /// \brief Rays outside [minDistance, maxDistance] are not synthesized
+    double minDistance;
+    double maxDistance;
+    double sourceLevel;
+    int nBeams;
+    int nRays;
+    int raySkips;
+    /// \brief Sample weight of each image row (nRays), or null to sample
+    /// every raySkips-th row. Rows with weight 0 are skipped, a sampled row
+    /// stands in for weight x raySkips rows. At most one row of each
+    /// raySkips stratum may be sampled.
+    const float *rowWeight;
+    double sonarFreq;
+    double bandwidth;
+    int nFreq;
+    double mu;
+    /// \brief Square root of the reflectivity of each material ID
+    /// (nMaterials), used when the frame has a material image
+    const float *reflectivity = nullptr;
+    int nMaterials = 0;
+    /// \brief Amplitude attenuation of each frequency bin [Np/m] (nFreq)
+    const float *attenuation;
+    /// \brief Shared tables (see SonarTableCache), window is nFreq and
+    /// beamCorrector is nBeams x nBeams row major
+    const float *window;
+    const float *beamCorrector;
+    float beamCorrectorSum;
+    /// \brief Transmit spectrum x window of each bin (nFreq), shaping the
+    /// echo spectrum (see WaveformWeights), null applies the window alone
+    const Complex *transmit = nullptr;
+    /// \brief Matched filter of each bin (nFreq) applied to the echo
+    /// spectrum after the transmit spectrum, null for no pulse compression
+    const Complex *matchedFilter = nullptr;
+    bool debugFlag;
+    /// \brief Seed of the fixed random phase of each ray of views without
+    /// a random image, which keeps their sum incoherent. Incremental
+    /// sonars take it when the accumulation restarts.
+    unsigned int phaseSeed = 0;
+    /// \brief Arithmetic of the per-ray model and echo synthesis
+    SonarPrecision precision = SonarPrecision::SINGLE;
+    /// \brief Run the synthesis kernels specialized for a shipped beam
+    /// layout when the frame matches one (see SonarPreset), false always
+    /// runs the generic kernels
+    bool presets = true;
+    /// \brief Add a second bounce estimate: each ray is reflected
+    /// specularly about its normal and marched in screen space for a
+    /// secondary hit, whose delayed echo is added to the ray's beam
+    bool multipath = false;
+    /// \brief March budget of each reflected ray [steps], the steps
+    /// cover maxDistance
+    int multipathSteps = 32;
+    /// \brief Thickness of the surface behind each pixel as a fraction of
+    /// its depth, a reflected ray deeper behind it passes behind it
+    double multipathThickness = 0.05;
+    /// \brief Amplitude factor of the specular reflection
+    double multipathLoss = 0.5;
+    /// \brief Report the first hard return of each beam (see
+    /// SonarResult::firstReturn)
+    bool firstReturns = false;
+    /// \brief Sound speed profile refraction of the direct rays, the
+    /// second bounce stays straight
+    SonarRefraction refraction;
+  };
+
+  /// \brief Images of one depth camera and the map of its columns onto
+  /// the sonar beams
+  struct SonarView
+  {
+    cv::Mat depth_image;
+    cv::Mat normal_image;
+    /// \brief Per-ray complex Gaussian noise (CV_32FC2), empty for noise
+    /// free rays
+    cv::Mat rand_image;
+    /// \brief Material ID of each pixel (CV_8UC1), empty for constant
+    /// reflectivity
+    cv::Mat material_image;
+    /// \brief Horizontal field of view of this camera [rad]
+    double hFOV;
+    /// \brief Beam of each image column (width), -1 for columns outside
+    /// the sonar fan
+    const int *columnBeam;
+    /// \brief Slot of each column among the columns of its beam (width)
+    const int *columnSlot;
+    /// \brief Azimuth beam pattern weight of each column relative to the
+    /// center of its beam (width)
+    const float *columnPattern;
+    /// \brief Maximum number of columns of this view in one beam
+    int nSlots;
+    /// \brief Incremental mode: changed flag of each tile (row major,
+    /// SonarFrame::tileSize square), see SonarTileTracker
+    std::vector<unsigned char> changedTiles;
+  };
+
+  /// \brief Device side state of an incremental sonar: the accumulated
+  /// noise free spectrum and the images it was computed from
+  struct SonarIncrementalState;
+
+  /// \brief Create the state of one incremental sonar, freed with the
+  /// last pointer
+  std::shared_ptr<SonarIncrementalState> create_incremental_state();
+
+  /// \brief One sensor's input views and configuration. Several views
+  /// are stitched into one beam set.
+  struct SonarFrame
+  {
+    std::vector<SonarView> views;
+    SonarCalculationConfig config;
+
+    /// \brief Incremental mode state, null recomputes every ray. Only the
+    /// changed tiles are recomputed: their previous contribution is
+    /// subtracted from the accumulated spectrum and the new one added.
+    /// Rays have no noise but a fixed random phase (see
+    /// SonarCalculationConfig::phaseSeed), the caller applies speckle to
+    /// the time samples of the result.
+    std::shared_ptr<SonarIncrementalState> incremental;
+    /// \brief Tile edge [px]
+    int tileSize = 32;
+    /// \brief Recompute every ray and restart the accumulation
+    bool fullRefresh = true;
+    /// \brief Evaluate and sum the rays of beam x row tiles in shared
+    /// memory instead of going through a frame sized ray buffer
+    bool tiled = false;
+    /// \brief Count the device memory traffic of the primary rays into
+    /// SonarResult::rayBytes, costs an atomic per ray
+    bool countRayBytes = false;
+  };
+
+  /// \brief Beam spectra of one frame and its ray occupancy
+  struct SonarResult
+  {
+    CArray2D beams;
+    /// \brief Rays with a return inside the range window
+    int validRays = 0;
+    /// \brief Rays evaluated after ray skipping
+    int totalRays = 0;
+    /// \brief Device memory traffic of the primary rays between
+    /// evaluation and the beam spectra [bytes]: buffer fills and the loads
+    /// and stores of the kernels, counted as they run. Zero unless
+    /// SonarFrame::countRayBytes is set.
+    unsigned long long rayBytes = 0;
+    /// \brief Preset whose specialized kernels ran, null for the generic
+    /// kernels
+    const SonarPreset *preset = nullptr;
+    /// \brief Reflected rays that found a secondary hit, zero without
+    /// multipath
+    int multipathRays = 0;
+    /// \brief Screen-space march steps taken by all reflected rays
+    unsigned long long multipathSteps = 0;
+    /// \brief Device time of the multipath march, compaction and
+    /// synthesis summed over the views [ms]
+    float multipathTime = 0.0f;
+    /// \brief Range of the closest sampled ray of each beam over all
+    /// views [m] (nBeams), maxDistance for beams without a return. Empty
+    /// unless SonarCalculationConfig::firstReturns is set.
+    std::vector<float> firstReturn;
+
+    /// \brief Fraction of rays that contributed to the echo
+    double Occupancy() const
+    { return totalRays > 0 ? static_cast<double>(validRays) / totalRays : 0.0; }
+  };
+
   /// \brief Sonar Claculation Function Wrapper
-  CArray2D sonar_calculation_wrapper(const cv::Mat &depth_image,
-                                     const cv::Mat &normal_image,
-                                     const cv::Mat &rand_image,
-                                     double _hPixelSize,
-                                     double _vPixelSize,
-                                     double _hFOV,
-                                     double _vFOV,
-                                     double _beam_azimuthAngleWidth,
-                                     double _beam_elevationAngleWidth,
-                                     double _ray_azimuthAngleWidth,
-                                     double _ray_elevationAngleWidth,
-                                     double _soundSpeed,
-                                     double _maxDistance,
-                                     double _sourceLevel,
-                                     int _nBeams, int _nRays,
-                                     int _raySkips,
-                                     double _sonarFreq,
-                                     double _bandwidth,
-                                     int _nFreq,
-                                     double _mu,
-                                     double _attenuation,
-                                     float *_window,
-                                     float **_beamCorrector,
-                                     float _beamCorrectorSum,
-                                     bool _debugFlag);
-} // namespace NpsGazeboSonar
\ No newline at end of file
+  SonarResult sonar_calculation_wrapper(const SonarFrame &_frame);
+
+  /// \brief Batched Sonar Claculation Function Wrapper. The kernels of
+  /// every frame are queued on the calling thread's streams one frame
+  /// after the other, the beam spectra of the frames sharing the same
+  /// nFreq go through one batched FFT, and the host waits once for the
+  /// whole batch before reading the results back.
+  /// \return One result per frame, in input order
+  std::vector<SonarResult> sonar_calculation_batch_wrapper(
+                                const std::vector<SonarFrame> &_frames);
+} // namespace NpsGazeboSonar
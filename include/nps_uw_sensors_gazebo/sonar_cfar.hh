@@ -0,0 +1,95 @@
+/*
+ * Copyright 2020 Naval Postgraduate School
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+
+#ifndef SONAR_CFAR_HH
+#define SONAR_CFAR_HH
+
+#include <string>
+#include <vector>
+
+namespace NpsGazeboSonar
+{
+  /// \brief Noise estimate of the constant false alarm rate detector
+  enum class CfarMethod
+  {
+    /// \brief Mean of the training cells
+    CELL_AVERAGING,
+    /// \brief k-th smallest training cell, robust to nearby targets
+    ORDERED_STATISTIC
+  };
+
+  /// \brief Parse "ca" or "os"
+  /// \return False for any other name, _method is left unchanged
+  bool ParseCfarMethod(const std::string &_name, CfarMethod &_method);
+
+  /// \brief One target detected in a beam
+  struct SonarDetection
+  {
+    int beam;
+    int bin;
+    /// \brief Range of the bin [m]
+    float range;
+    /// \brief Echo amplitude, the value of the raw sonar image
+    float intensity;
+    /// \brief Power over the local noise estimate [dB]
+    float snr;
+  };
+
+  /// \brief Square law CFAR detector along the range bins of a beam.
+  /// Each bin is compared with a scaled noise estimate from the training
+  /// cells on both sides, skipping the guard cells next to it. At the
+  /// ends of the beam the window is truncated and the scale recomputed
+  /// for the cells left, so the false alarm rate holds everywhere. Runs
+  /// of consecutive bins above threshold report their peak only.
+  class SonarCfar
+  {
+    /// \brief Constructor
+    /// \param[in] _trainingCells Training cells on each side of a bin
+    /// \param[in] _guardCells Guard cells on each side of a bin
+    /// \param[in] _pfa Probability of false alarm per bin in Rayleigh
+    /// distributed noise
+    /// \param[in] _rank Ordered statistic, as a fraction of the training
+    /// cells (ORDERED_STATISTIC only)
+    public: SonarCfar(CfarMethod _method, int _trainingCells,
+                      int _guardCells, double _pfa, double _rank = 0.75);
+
+    /// \brief Detect the targets of one beam
+    /// \param[in] _beam Beam index stored in the detections
+    /// \param[in] _power Power of each range bin (_nBins)
+    /// \param[in] _ranges Range of each bin [m] (_nBins)
+    /// \param[out] _detections Detections are appended in range order
+    public: void Detect(int _beam, const float *_power, int _nBins,
+                        const float *_ranges,
+                        std::vector<SonarDetection> &_detections) const;
+
+    /// \brief Threshold over noise estimate for a window of _cells
+    /// training cells
+    public: double Scale(int _cells) const;
+
+    public: CfarMethod Method() const;
+
+    private: CfarMethod method;
+    private: int trainingCells;
+    private: int guardCells;
+    private: double rank;
+    /// \brief Scale of each window size, 0 to 2 x trainingCells cells.
+    /// CELL_AVERAGING scales the sum of the cells, ORDERED_STATISTIC the
+    /// k-th smallest one.
+    private: std::vector<double> scale;
+  };
+}  // namespace NpsGazeboSonar
+#endif
@@ -0,0 +1,75 @@
+/*
+ * Copyright 2020 Naval Postgraduate School
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+
+#ifndef SONAR_ECHOGRAM_HH
+#define SONAR_ECHOGRAM_HH
+
+#include <opencv2/core.hpp>
+#include <vector>
+
+namespace NpsGazeboSonar
+{
+  /// \brief Echogram of a single beam sonar: echo intensity over range,
+  /// one column per ping. The image is a fixed size sweep, each ping
+  /// writes its column at the cursor and blanks the next one as the gap
+  /// between the newest and the oldest ping. Nothing is allocated after
+  /// construction.
+  class SonarEchogram
+  {
+    /// \brief Constructor
+    /// \param[in] _bins Range bins, the image height
+    /// \param[in] _pings Pings kept, the image width
+    /// \param[in] _minRange Start of the first bin [m]
+    /// \param[in] _maxRange End of the last bin [m]
+    /// \param[in] _buffer Row major _bins x _pings image to draw into,
+    /// e.g. the data of a preallocated image message. Null allocates one.
+    public: SonarEchogram(int _bins, int _pings, double _minRange,
+                          double _maxRange, unsigned char *_buffer = nullptr);
+
+    /// \brief Start accumulating a new ping
+    public: void Begin();
+
+    /// \brief Add one return to the ping being accumulated, returns out
+    /// of range are ignored
+    public: void AddReturn(double _range, float _weight);
+
+    /// \brief Write the accumulated ping into the image
+    /// \param[in] _gain Gray level per unit of echo intensity
+    /// \return Column written
+    public: int Commit(float _gain);
+
+    /// \brief Echo intensity of each bin of the last ping, valid until
+    /// the next Begin
+    public: const std::vector<float> &Series() const;
+
+    /// \brief Center range of a bin [m]
+    public: double BinRange(int _bin) const;
+
+    /// \brief Echogram image (CV_8UC1, bins x pings)
+    public: const cv::Mat &Image() const;
+
+    /// \brief Column the next ping is written to
+    public: int Cursor() const;
+
+    private: double minRange;
+    private: double binSize;
+    private: std::vector<float> series;
+    private: cv::Mat image;
+    private: int cursor;
+  };
+}  // namespace NpsGazeboSonar
+#endif
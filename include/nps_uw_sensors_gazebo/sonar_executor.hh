@@ -0,0 +1,142 @@
+/*
+ * Copyright 2020 Naval Postgraduate School
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+
+#ifndef SONAR_EXECUTOR_HH
+#define SONAR_EXECUTOR_HH
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace NpsGazeboSonar
+{
+  typedef std::function<void()> SonarTask;
+
+  class SonarExecutor;
+
+  /// \brief Per-sensor submission handle. Tasks submitted from outside
+  /// the executor are queued per group and groups are serviced round
+  /// robin by priority, so one busy sonar cannot starve the others.
+  class SonarTaskGroup
+  {
+    /// \brief Constructor
+    /// \param[in] _priority Groups with higher priority are serviced first
+    public: explicit SonarTaskGroup(int _priority = 0);
+
+    /// \brief Destructor, waits for outstanding tasks
+    public: ~SonarTaskGroup();
+
+    /// \brief Queue a task on the shared executor
+    public: void Run(SonarTask _task);
+
+    /// \brief Split [0, _n) into tiles of _tile items, run them in
+    /// parallel and wait for all of them
+    public: void ParallelFor(int _n, int _tile,
+                             const std::function<void(int, int)> &_body);
+
+    /// \brief Block until every task of this group has finished. The
+    /// calling thread executes queued tasks while it waits. Must not be
+    /// called from a task of the same group; use ParallelFor there.
+    public: void Wait();
+
+    /// \brief Number of submitted tasks that have not finished
+    public: int Pending() const;
+
+    public: int Priority() const;
+
+    private: friend class SonarExecutor;
+    private: const int priority;
+    private: std::atomic<int> pending;
+    private: std::mutex doneMutex;
+    private: std::condition_variable doneCondition;
+
+    /// \brief Tasks submitted from non-worker threads, guarded by the
+    /// executor's queue mutex
+    private: std::deque<SonarTask> queue;
+  };
+
+  /// \brief Process-wide work-stealing thread pool shared by all sonar
+  /// plugin instances
+  class SonarExecutor
+  {
+    /// \brief Access the process-wide executor
+    public: static SonarExecutor &Instance();
+
+    /// \brief Set pool size (0 uses all hardware threads) and core
+    /// pinning. Only effective before the first task is submitted.
+    /// \return False if the pool is already running
+    public: bool Configure(int _threads, bool _pinCores);
+
+    /// \brief Number of worker threads
+    public: int Threads() const;
+
+    private: SonarExecutor();
+    private: ~SonarExecutor();
+
+    private: struct Item
+    {
+      SonarTask task;
+      SonarTaskGroup *group;
+    };
+
+    /// \brief Deque owned by one worker. The owner pushes and pops at
+    /// the back, thieves take from the front.
+    private: struct Worker
+    {
+      std::mutex mutex;
+      std::deque<Item> tasks;
+    };
+
+    private: void Start();
+    private: void Submit(SonarTaskGroup *_group, SonarTask _task);
+    private: void Register(SonarTaskGroup *_group);
+    private: void Unregister(SonarTaskGroup *_group);
+    private: void WorkerLoop(int _index);
+
+    /// \brief Find and run one task: own deque, then group queues, then
+    /// steal from other workers. A non-null _only restricts the search to
+    /// that group so a waiting thread only helps with its own work.
+    /// \return False if no task was available
+    private: bool RunOne(int _index, SonarTaskGroup *_only);
+    private: bool PopGroupTask(SonarTaskGroup *_only, Item &_item);
+    private: bool PopLocal(int _index, SonarTaskGroup *_only, Item &_item);
+    private: bool Steal(int _index, SonarTaskGroup *_only, Item &_item);
+    private: static void Finish(SonarTaskGroup *_group);
+
+    private: friend class SonarTaskGroup;
+
+    private: int nThreads;
+    private: bool pinCores;
+    private: bool running;
+    private: std::atomic<bool> stop;
+    private: std::vector<std::thread> threads;
+    private: std::vector<std::unique_ptr<Worker>> workers;
+
+    /// \brief Registered groups and their external queues
+    private: std::mutex queueMutex;
+    private: std::condition_variable queueCondition;
+    private: std::vector<SonarTaskGroup *> groups;
+    private: size_t nextGroup;
+    private: std::atomic<int> queued;
+  };
+}  // namespace NpsGazeboSonar
+#endif
@@ -0,0 +1,89 @@
+/*
+ * Copyright 2020 Naval Postgraduate School
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+
+#ifndef SONAR_GAIN_HH
+#define SONAR_GAIN_HH
+
+#include <string>
+#include <vector>
+
+namespace NpsGazeboSonar
+{
+  /// \brief Mapping of compensated echo amplitude to display level
+  enum class CompressionMode
+  {
+    /// \brief Proportional to amplitude, clipped at the ceiling
+    LINEAR,
+    /// \brief Proportional to dB over the dynamic range below the ceiling
+    LOG
+  };
+
+  /// \brief Parse an SDF compression name, "linear" or "log"
+  /// \return False if the name is unknown
+  bool ParseCompressionMode(const std::string &_name,
+                            CompressionMode &_mode);
+
+  /// \brief Time varying gain and compression settings
+  struct SonarGainConfig
+  {
+    /// \brief n of the n log10(R) spreading term [dB], 0 for none
+    double spreading = 40.0;
+    /// \brief One way amplitude absorption [Np/m], 0 for none
+    double absorption = 0.0;
+    /// \brief Closer bins get the gain of this range [m]
+    double minRange = 0.0;
+    CompressionMode mode = CompressionMode::LOG;
+    /// \brief Span of LOG below the ceiling [dB]
+    double dynamicRange = 60.0;
+  };
+
+  /// \brief Post-FFT time varying gain and dynamic range compression.
+  /// The gain of each range bin, n log10(R) spreading plus 2 alpha R
+  /// absorption [dB], is precomputed, so a frame is one multiply per bin
+  /// and one compression per bin, with the gain curve broadcast over the
+  /// beams.
+  class SonarGainStage
+  {
+    /// \brief Constructor
+    /// \param[in] _ranges Range of each bin [m]
+    public: SonarGainStage(const SonarGainConfig &_config,
+                           const std::vector<float> &_ranges);
+
+    /// \brief Largest compensated amplitude of a block of beams, the
+    /// automatic ceiling of a frame is the largest over its blocks
+    /// \param[in] _amplitude Echo amplitude, beam major (_nBeams x bins)
+    public: float Peak(const float *_amplitude, int _nBeams) const;
+
+    /// \brief Display levels [0, 255] of a block of beams
+    /// \param[in] _amplitude Echo amplitude, beam major (_nBeams x bins)
+    /// \param[in] _ceiling Compensated amplitude shown at full level
+    /// \param[out] _level Display level, same layout as _amplitude, may
+    /// be _amplitude itself
+    public: void Apply(const float *_amplitude, int _nBeams, float _ceiling,
+                       float *_level) const;
+
+    /// \brief Gain curve, amplitude factor of each bin
+    public: const std::vector<float> &Gain() const;
+
+    public: CompressionMode Mode() const;
+
+    private: std::vector<float> gain;
+    private: CompressionMode mode;
+    private: float dynamicRange;
+  };
+}  // namespace NpsGazeboSonar
+#endif
@@ -0,0 +1,108 @@
+/*
+ * Copyright 2020 Naval Postgraduate School
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+
+#ifndef SONAR_MATERIAL_MAP_HH
+#define SONAR_MATERIAL_MAP_HH
+
+#include <gazebo/rendering/ogre_gazebo.h>
+#include <gazebo/rendering/RenderTypes.hh>
+
+#include <opencv2/core.hpp>
+
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace NpsGazeboSonar
+{
+  /// \brief Process-wide table mapping sonar material IDs to surface
+  /// reflectivity. ID 0 is reserved for surfaces without a material and
+  /// takes the reflectivity of the sonar rendering them.
+  class SonarMaterialTable
+  {
+    /// \brief Largest material ID, IDs are rendered into an 8 bit mask
+    public: static const int MAX_ID = 255;
+
+    /// \brief Access the process-wide table
+    public: static SonarMaterialTable &Instance();
+
+    /// \brief Assign a material ID to a model name or an Ogre material
+    /// name. Adding an existing target updates its reflectivity.
+    /// \param[in] _target Model name or visual material name
+    /// \param[in] _mu Surface reflectivity
+    /// \return Material ID, 0 if the table is full
+    public: int Add(const std::string &_target, double _mu);
+
+    /// \brief Material ID of a rendered surface, models take precedence
+    /// over visual materials
+    /// \return Material ID, 0 if neither is in the table
+    public: int Lookup(const std::string &_modelName,
+                       const std::string &_materialName) const;
+
+    /// \brief Square root of the reflectivity of every ID, as used by the
+    /// scattering model (MAX_ID + 1 entries)
+    /// \param[in] _defaultMu Reflectivity of ID 0
+    public: void SqrtReflectivity(double _defaultMu,
+                                  std::vector<float> &_table) const;
+
+    /// \brief Incremented whenever a target is added or updated
+    public: uint64_t Revision() const;
+
+    private: SonarMaterialTable();
+
+    private: mutable std::mutex mutex;
+    private: std::map<std::string, int> ids;
+    private: std::vector<float> sqrtMu;
+    private: uint64_t revision;
+  };
+
+  /// \brief Renders the material ID of every pixel of a camera into an
+  /// 8 bit mask, aligned with the camera's depth image. Entities are
+  /// resolved to IDs the first time they are rendered, so models spawned
+  /// later are picked up without rebuilding anything.
+  class SonarMaterialPass : public Ogre::MaterialManager::Listener
+  {
+    /// \brief Constructor, must be called from the rendering thread
+    public: explicit SonarMaterialPass(gazebo::rendering::CameraPtr _camera);
+
+    public: virtual ~SonarMaterialPass();
+
+    /// \brief Render the mask, must be called from the rendering thread
+    /// \param[out] _ids Material ID image (CV_8UC1)
+    public: void Render(cv::Mat &_ids);
+
+    // Documentation inherited
+    public: virtual Ogre::Technique *handleSchemeNotFound(
+                unsigned short _schemeIndex, const Ogre::String &_schemeName,
+                Ogre::Material *_originalMaterial, unsigned short _lodIndex,
+                const Ogre::Renderable *_rend);
+
+    private: gazebo::rendering::CameraPtr camera;
+    private: Ogre::TexturePtr texture;
+    private: Ogre::RenderTexture *renderTexture;
+    private: Ogre::Technique *plainColor;
+    private: cv::Mat rgb;
+
+    /// \brief Material IDs of rendered entities, keyed by visual and
+    /// material name, valid for table revision tableRevision
+    private: std::map<std::string, int> entityIds;
+    private: uint64_t tableRevision;
+  };
+}  // namespace NpsGazeboSonar
+#endif
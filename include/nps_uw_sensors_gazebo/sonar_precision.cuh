@@ -0,0 +1,236 @@
+/*
+ * Copyright 2020 Naval Postgraduate School
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+
+#ifndef SONAR_PRECISION_CUH
+#define SONAR_PRECISION_CUH
+
+#include "cuda_runtime.h"
+#include <thrust/complex.h>
+
+#include <math.h>
+#include <string>
+
+namespace NpsGazeboSonar
+{
+  /// \brief Arithmetic of the per-ray sonar model. DOUBLE is the
+  /// reference, SINGLE uses float library functions and FAST polynomial
+  /// approximations of bounded error (see SonarMath<FAST>).
+  enum class SonarPrecision
+  {
+    DOUBLE,
+    SINGLE,
+    FAST
+  };
+
+  /// \brief Parse "double", "single" or "fast"
+  /// \return False for any other name, _precision is left unchanged
+  inline bool ParsePrecision(const std::string &_name,
+                             SonarPrecision &_precision)
+  {
+    if (_name == "double")
+      _precision = SonarPrecision::DOUBLE;
+    else if (_name == "single")
+      _precision = SonarPrecision::SINGLE;
+    else if (_name == "fast")
+      _precision = SonarPrecision::FAST;
+    else
+      return false;
+    return true;
+  }
+
+  /// \brief Name of a precision tier
+  inline const char *PrecisionName(SonarPrecision _precision)
+  {
+    switch (_precision)
+    {
+      case SonarPrecision::DOUBLE: return "double";
+      case SonarPrecision::SINGLE: return "single";
+      default: return "fast";
+    }
+  }
+
+  /// \brief Math functions of the sonar model at one precision tier,
+  /// selected at compile time by specialization. Arguments and results
+  /// are float, the tier decides how they are evaluated.
+  template <SonarPrecision P>
+  struct SonarMath;
+
+  /// \brief Reference tier, everything evaluated in double
+  template <>
+  struct SonarMath<SonarPrecision::DOUBLE>
+  {
+    __host__ __device__ static inline float Sinc(float _t)
+    {
+      const double t = _t;
+      return (fabs(t) < 1E-8) ? 1.0 : sin(t) / t;
+    }
+
+    __host__ __device__ static inline void Sincos(float _x, float &_sin,
+                                                  float &_cos)
+    {
+      _sin = sin(static_cast<double>(_x));
+      _cos = cos(static_cast<double>(_x));
+    }
+
+    __host__ __device__ static inline float Acos(float _x)
+    {
+      return acos(static_cast<double>(_x));
+    }
+
+    __host__ __device__ static inline float Exp(float _x)
+    {
+      return exp(static_cast<double>(_x));
+    }
+
+    __host__ __device__ static inline float Atan2(float _y, float _x)
+    {
+      return atan2(static_cast<double>(_y), static_cast<double>(_x));
+    }
+
+    /// \brief exp(_distance * _k), the product formed in double
+    __host__ __device__ static inline thrust::complex<float> Phasor(
+        float _distance, thrust::complex<float> _k)
+    {
+      const double magnitude =
+          exp(static_cast<double>(_distance) * _k.real());
+      const double phase = static_cast<double>(_distance) * _k.imag();
+      return thrust::complex<float>(magnitude * cos(phase),
+                                    magnitude * sin(phase));
+    }
+  };
+
+  /// \brief Float library functions
+  template <>
+  struct SonarMath<SonarPrecision::SINGLE>
+  {
+    __host__ __device__ static inline float Sinc(float _t)
+    {
+      return (fabsf(_t) < 1E-8f) ? 1.0f : sinf(_t) / _t;
+    }
+
+    __host__ __device__ static inline void Sincos(float _x, float &_sin,
+                                                  float &_cos)
+    {
+      _sin = sinf(_x);
+      _cos = cosf(_x);
+    }
+
+    __host__ __device__ static inline float Acos(float _x)
+    {
+      return acosf(_x);
+    }
+
+    __host__ __device__ static inline float Exp(float _x)
+    {
+      return expf(_x);
+    }
+
+    __host__ __device__ static inline float Atan2(float _y, float _x)
+    {
+      return atan2f(_y, _x);
+    }
+
+    __host__ __device__ static inline thrust::complex<float> Phasor(
+        float _distance, thrust::complex<float> _k)
+    {
+      float s, c;
+      Sincos(_distance * _k.imag(), s, c);
+      const float magnitude = Exp(_distance * _k.real());
+      return thrust::complex<float>(magnitude * c, magnitude * s);
+    }
+  };
+
+  /// \brief Polynomial approximations with bounded error: Sincos 2e-7
+  /// absolute for |x| < 4e5, Acos 5e-7 absolute, Exp 3e-7 relative on
+  /// [-87, 88], Sinc 2e-7 absolute. Atan2 is the float library one.
+  template <>
+  struct SonarMath<SonarPrecision::FAST>
+  {
+    __host__ __device__ static inline void Sincos(float _x, float &_sin,
+                                                  float &_cos)
+    {
+      // Cody-Waite reduction to [-pi, pi] with 2 pi split in three
+      // parts, the first two of 8 bits each, so that both products are
+      // exact up to 2^16 turns. Echo phases reach 2 k d, several
+      // thousand radians at long ranges.
+      const float turns = rintf(_x * 1.59154937e-1f);
+      const float x = ((_x - turns * 6.28125f) - turns * 1.93786621e-3f)
+                      - turns * -2.55903137e-6f;
+      // Quadrant and remainder, pi/2 split in three parts
+      const float quadrant = rintf(x * 0.636619772f);
+      const float r = ((x - quadrant * 1.5703125f)
+                       - quadrant * 4.83751297e-4f)
+                      - quadrant * 7.54978995e-8f;
+      const float r2 = r * r;
+      const float s = r + r * r2 * (-1.66666667e-1f + r2 * (8.33333333e-3f
+                      + r2 * (-1.98412698e-4f + r2 * 2.75573192e-6f)));
+      const float c = 1.0f + r2 * (-0.5f + r2 * (4.16666667e-2f
+                      + r2 * (-1.38888889e-3f + r2 * 2.48015873e-5f)));
+      const int q = static_cast<int>(quadrant) & 3;
+      _sin = (q == 0) ? s : (q == 1) ? c : (q == 2) ? -s : -c;
+      _cos = (q == 0) ? c : (q == 1) ? -s : (q == 2) ? -c : s;
+    }
+
+    __host__ __device__ static inline float Sinc(float _t)
+    {
+      if (fabsf(_t) < 1E-4f)
+        return 1.0f - _t * _t * 1.66666667e-1f;
+      float s, c;
+      Sincos(_t, s, c);
+      return s / _t;
+    }
+
+    __host__ __device__ static inline float Acos(float _x)
+    {
+      // Abramowitz and Stegun 4.4.46 on [0, 1], mirrored for x < 0
+      const float x = fminf(fabsf(_x), 1.0f);
+      const float p = 1.5707963050f + x * (-0.2145988016f
+                      + x * (0.0889789874f + x * (-0.0501743046f
+                      + x * (0.0308918810f + x * (-0.0170881256f
+                      + x * (0.0066700901f + x * -0.0012624911f))))));
+      const float result = sqrtf(1.0f - x) * p;
+      return _x < 0.0f ? 3.14159265f - result : result;
+    }
+
+    __host__ __device__ static inline float Exp(float _x)
+    {
+      // 2^n * exp(r) with |r| <= ln(2)/2, ln(2) split in two parts
+      const float x = fminf(fmaxf(_x, -87.0f), 88.0f);
+      const float n = rintf(x * 1.44269504f);
+      const float r = (x - n * 0.693359375f) + n * 2.12194440e-4f;
+      const float p = 1.0f + r * (1.0f + r * (0.5f + r * (1.66666667e-1f
+                      + r * (4.16666667e-2f + r * (8.33333333e-3f
+                      + r * 1.38888889e-3f)))));
+      return ldexpf(p, static_cast<int>(n));
+    }
+
+    __host__ __device__ static inline float Atan2(float _y, float _x)
+    {
+      return atan2f(_y, _x);
+    }
+
+    __host__ __device__ static inline thrust::complex<float> Phasor(
+        float _distance, thrust::complex<float> _k)
+    {
+      float s, c;
+      Sincos(_distance * _k.imag(), s, c);
+      const float magnitude = Exp(_distance * _k.real());
+      return thrust::complex<float>(magnitude * c, magnitude * s);
+    }
+  };
+}  // namespace NpsGazeboSonar
+#endif
@@ -0,0 +1,87 @@
+/*
+ * Copyright 2020 Naval Postgraduate School
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+
+#ifndef SONAR_PRESETS_CUH
+#define SONAR_PRESETS_CUH
+
+#include "cuda_runtime.h"
+
+namespace NpsGazeboSonar
+{
+  /// \brief Beam layout of a shipped sonar model. The engine has echo
+  /// synthesis kernels specialized at compile time for every layout in
+  /// SONAR_PRESETS (see kernels_for in sonar_calculation_cuda.cu). The
+  /// number of frequency bins follows from the configured range and
+  /// bandwidth, so only its parity is fixed, both parities are
+  /// instantiated.
+  struct SonarPreset
+  {
+    const char *model;
+    int nBeams;
+    /// \brief Rendered columns per beam (azimuthRaysPerBeam)
+    int columnsPerBeam;
+    /// \brief Frequency bins each synthesis thread keeps in registers,
+    /// every ray is loaded once for all of them
+    int binsPerThread;
+  };
+
+  /// \brief Layouts of the models in models/, from their camera width.
+  /// blueview_p900 has 399 bins (10 m, 29.9 kHz), four per thread still
+  /// give 4 x 512 synthesis blocks. seabat_f50 has half the beams and
+  /// keeps two per thread so its grid still fills the device.
+  static const SonarPreset SONAR_PRESETS[] = {
+    {"blueview_p900", 512, 1, 4},
+    {"blueview_m450", 512, 1, 4},
+    {"seabat_f50", 256, 1, 2}
+  };
+
+  /// \brief Find the shipped preset of a beam layout
+  /// \return The first matching preset, null for a custom layout
+  inline const SonarPreset *FindPreset(int _nBeams, int _columnsPerBeam)
+  {
+    for (const SonarPreset &preset : SONAR_PRESETS)
+    {
+      if (preset.nBeams == _nBeams && preset.columnsPerBeam == _columnsPerBeam)
+        return &preset;
+    }
+    return nullptr;
+  }
+
+  /// \brief Problem shape known to the synthesis kernels at compile time.
+  /// A FREQ_PARITY of 0 (even) or 1 (odd) and a positive COLUMNS replace
+  /// the runtime value, -1 and 0 keep it. BINS is the number of frequency
+  /// bins per thread.
+  template <int FREQ_PARITY, int COLUMNS, int BINS>
+  struct SonarShape
+  {
+    static const int bins = BINS;
+
+    __host__ __device__ static inline bool EvenFreq(int _nFreq)
+    {
+      return FREQ_PARITY >= 0 ? FREQ_PARITY == 0 : _nFreq % 2 == 0;
+    }
+
+    __host__ __device__ static inline int Columns(int _nColumns)
+    {
+      return COLUMNS > 0 ? COLUMNS : _nColumns;
+    }
+  };
+
+  /// \brief Every dimension taken at runtime, one bin per thread
+  typedef SonarShape<-1, 0, 1> GenericShape;
+}  // namespace NpsGazeboSonar
+#endif
@@ -0,0 +1,78 @@
+/*
+ * Copyright 2020 Naval Postgraduate School
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+
+#ifndef SONAR_RAY_LOD_HH
+#define SONAR_RAY_LOD_HH
+
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include <opencv2/core.hpp>
+
+namespace NpsGazeboSonar
+{
+  /// \brief Elevation row sampling. The rows are split into segments of
+  /// raySkips rows, or with range dependent level of detail: rows whose
+  /// nearest return lies within the near range keep segments of raySkips
+  /// rows, rows at level L segments of 2^L x raySkips rows, and rows
+  /// without any return the coarsest level. Rows on a grazing surface,
+  /// whose range changes by more than a range bin over a segment, are
+  /// only coarsened as far as that stays within one bin. One row of each
+  /// segment is sampled, the first one or a jittered one (stratified
+  /// sampling), and weighted by the elevation angle of the segment in
+  /// units of one stratum.
+  class SonarRayLOD
+  {
+    /// \brief Constructor
+    /// \param[in] _maxLevel Coarsest level, rows 2^_maxLevel strata apart.
+    /// 0 keeps segments of raySkips rows regardless of range.
+    /// \param[in] _nearRange Range up to which rows keep full detail [m],
+    /// each doubling of the range beyond it adds one level
+    /// \param[in] _rangeResolution Range bin size [m]
+    /// \param[in] _focalLength Focal length of the camera rows [px]
+    /// \param[in] _jitter Sample a random row of each segment
+    public: SonarRayLOD(int _nRays, int _raySkips, int _maxLevel,
+                        double _nearRange, double _rangeResolution,
+                        double _focalLength, bool _jitter = false);
+
+    /// \brief Row weights of one frame, see
+    /// SonarCalculationConfig::rowWeight
+    /// \param[in] _seed Frame seed, the jittered rows are a function of it
+    /// \param[out] _rowWeight Weight of every row (nRays)
+    public: void Sample(uint64_t _seed, std::vector<float> &_rowWeight) const;
+
+    /// \brief Number of rows with a non-zero weight
+    public: int SampledRows() const;
+
+    /// \brief Choose the rows of the next frame from the range images
+    /// (CV_32FC1, nRays rows, 0 for no return) of this frame's views
+    public: void Update(const std::vector<cv::Mat> &_ranges);
+
+    private: int nRays;
+    private: int raySkips;
+    private: int maxLevel;
+    private: double nearRange;
+    private: double rangeResolution;
+    private: bool jitter;
+    /// \brief Elevation angle of every row edge (nRays + 1) [rad]
+    private: std::vector<double> rowEdge;
+    /// \brief First row and number of rows of each segment
+    private: std::vector<std::pair<int, int>> segments;
+  };
+}  // namespace NpsGazeboSonar
+#endif
@@ -0,0 +1,136 @@
+/*
+ * Copyright 2020 Naval Postgraduate School
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+
+#ifndef SONAR_REFRACTION_HH
+#define SONAR_REFRACTION_HH
+
+#include <cstddef>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace NpsGazeboSonar
+{
+  /// \brief Sound speed of the water column, linear between the samples
+  /// and constant beyond them
+  struct SoundSpeedProfile
+  {
+    /// \brief Depth of each sample below the sea surface [m], ascending
+    std::vector<double> depth;
+    /// \brief Sound speed of each sample [m/s]
+    std::vector<double> speed;
+
+    /// \brief Sound speed at a depth [m/s]
+    double Speed(double _depth) const;
+
+    bool operator<(const SoundSpeedProfile &_other) const;
+    bool operator!=(const SoundSpeedProfile &_other) const;
+  };
+
+  /// \brief Profile of depth, speed pairs in any depth order
+  /// \return False for an odd or empty list or a speed <= 0
+  bool MakeSoundSpeedProfile(const std::vector<double> &_pairs,
+                             SoundSpeedProfile &_profile);
+
+  /// \brief Parse "depth speed" pairs separated by spaces
+  /// \return False if the list is malformed or empty
+  bool ParseSoundSpeedProfile(const std::string &_list,
+                              SoundSpeedProfile &_profile);
+
+  /// \brief Read a profile file, one "depth speed" pair per line, lines
+  /// starting with # are comments
+  /// \return False if the file cannot be read or holds no samples
+  bool LoadSoundSpeedProfile(const std::string &_file,
+                             SoundSpeedProfile &_profile);
+
+  /// \brief Profile and grid that fully determine a refraction table
+  struct SonarRefractionKey
+  {
+    SoundSpeedProfile profile;
+    /// \brief Constant sound speed of the range and wave number [m/s]
+    double soundSpeed;
+    double maxDistance;
+    /// \brief Depression angles covered by the table [rad], positive
+    /// down
+    double minElevation = -1.4;
+    double maxElevation = 1.4;
+    int nDepths = 16;
+    int nElevations = 64;
+    int nDistances = 64;
+
+    bool operator<(const SonarRefractionKey &_other) const;
+  };
+
+  /// \brief Bent-ray corrections precomputed by tracing a fan of rays
+  /// through the profile from a grid of sensor depths. Each entry is
+  /// indexed by the depression angle and length of the straight line to a
+  /// point, as rendered by the depth camera, and holds the extra length
+  /// of the bent ray reaching it and its extra travel time as a range at
+  /// the constant sound speed. The echo model applies both through an
+  /// interpolated lookup instead of tracing rays per pixel.
+  class SonarRefractionTable
+  {
+    /// \brief Trace the rays of every sensor depth of the grid
+    public: explicit SonarRefractionTable(const SonarRefractionKey &_key);
+
+    /// \brief Corrections of one sensor depth, interpolated between the
+    /// two nearest depths of the grid
+    /// \param[out] _path Bent path length - straight distance [m]
+    /// \param[out] _delay Soundspeed x travel time - straight distance
+    /// [m], both nElevations x nDistances, elevation major
+    public: void Slice(double _depth, std::vector<float> &_path,
+                       std::vector<float> &_delay) const;
+
+    public: const SonarRefractionKey &Key() const;
+
+    /// \brief Heap memory held by the table [bytes]
+    public: size_t Bytes() const;
+
+    /// \brief Trace the fan of one sensor depth into its slice
+    private: void Trace(int _slice);
+
+    private: SonarRefractionKey key;
+    private: std::vector<double> depths;
+    /// \brief nDepths x nElevations x nDistances
+    private: std::vector<float> path;
+    private: std::vector<float> delay;
+  };
+
+  typedef std::shared_ptr<const SonarRefractionTable> SonarRefractionPtr;
+
+  /// \brief Process-wide registry of refraction tables. A table is traced
+  /// once per profile and grid, and again only when a sonar asks for a
+  /// changed profile.
+  class SonarRefractionCache
+  {
+    /// \brief Access the process-wide registry
+    public: static SonarRefractionCache &Instance();
+
+    /// \brief Get the table of a profile, tracing it if no other sonar
+    /// currently holds it
+    public: SonarRefractionPtr Acquire(const SonarRefractionKey &_key);
+
+    private: SonarRefractionCache() = default;
+
+    private: std::mutex mutex;
+    private: std::map<SonarRefractionKey,
+                      std::weak_ptr<const SonarRefractionTable>> entries;
+  };
+}  // namespace NpsGazeboSonar
+#endif
@@ -0,0 +1,70 @@
+/*
+ * Copyright 2020 Naval Postgraduate School
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+
+#ifndef SONAR_RESULT_CACHE_HH
+#define SONAR_RESULT_CACHE_HH
+
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+#include <nps_uw_sensors_gazebo/sonar_calculation_cuda.cuh>
+
+namespace NpsGazeboSonar
+{
+  /// \brief Everything the noise free beam spectra of a sonar depend on
+  struct SonarCacheKey
+  {
+    /// \brief Hash of the quantized sensor world pose
+    uint64_t pose = 0;
+    /// \brief Hash of the quantized poses of the models in the FOV
+    uint64_t scene = 0;
+    /// \brief Hash of the sensor configuration and material table
+    uint64_t config = 0;
+    /// \brief False when the key could not be computed, never a hit
+    bool valid = false;
+
+    bool operator==(const SonarCacheKey &_other) const;
+  };
+
+  /// \brief Incremental FNV-1a hash of values quantized to _resolution
+  uint64_t HashQuantized(const std::vector<double> &_values,
+                         double _resolution,
+                         uint64_t _hash = 14695981039346656037ULL);
+
+  /// \brief Noise free beam spectra of a sonar's previous frame, reused
+  /// while neither the sensor nor anything it sees has moved
+  class SonarResultCache
+  {
+    /// \brief Get the stored spectra if they were computed for _key
+    /// \return True on a hit
+    public: bool Lookup(const SonarCacheKey &_key, CArray2D &_beams);
+
+    /// \brief Replace the stored spectra
+    public: void Store(const SonarCacheKey &_key, const CArray2D &_beams);
+
+    public: uint64_t Hits() const;
+    public: uint64_t Misses() const;
+
+    private: mutable std::mutex mutex;
+    private: SonarCacheKey key;
+    private: CArray2D beams;
+    private: uint64_t hits = 0;
+    private: uint64_t misses = 0;
+  };
+}  // namespace NpsGazeboSonar
+#endif
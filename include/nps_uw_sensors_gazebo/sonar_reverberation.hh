@@ -0,0 +1,118 @@
+/*
+ * Copyright 2020 Naval Postgraduate School
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+
+#ifndef SONAR_REVERBERATION_HH
+#define SONAR_REVERBERATION_HH
+
+#include <complex>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace NpsGazeboSonar
+{
+  /// \brief Volume scattering strength from a depth down to the next
+  /// layer
+  struct SonarScatteringLayer
+  {
+    /// \brief Top of the layer, below the sea surface [m]
+    double depth;
+    /// \brief Volume scattering strength Sv [dB re 1/m]
+    double strength;
+  };
+
+  /// \brief Parse a layer list, "depth strength" pairs separated by
+  /// spaces, into layers sorted by depth
+  /// \return False if the list is malformed
+  bool ParseScatteringLayers(const std::string &_list,
+                             std::vector<SonarScatteringLayer> &_layers);
+
+  /// \brief Water column reverberation settings
+  struct SonarReverberationConfig
+  {
+    /// \brief Volume scattering strength Sv above the first layer, and
+    /// everywhere without layers [dB re 1/m]
+    double strength = -80.0;
+    std::vector<SonarScatteringLayer> layers;
+    /// \brief Source level [dB re 1 muPa]
+    double sourceLevel = 220.0;
+    /// \brief One way amplitude absorption [Np/m]
+    double absorption = 0.0;
+    /// \brief Vertical beam width [rad]
+    double elevationWidth = 0.0;
+    /// \brief Closer bins have no reverberation [m]
+    double minRange = 0.0;
+    /// \brief Output amplitude of a unit ray amplitude spread over one
+    /// range cell (FFT gain, bin width and beam correction)
+    double scale = 1.0;
+    /// \brief Range cells of the coarse grid, interpolated to the bins
+    int rangeCells = 64;
+  };
+
+  /// \brief Volume reverberation of the water column, added per beam and
+  /// range bin after the FFT. The mean square amplitude of a range cell
+  /// follows the sonar equation for a volume of beam solid angle x cell
+  /// length: SL - 20 log10(R) - 2 alpha R + Sv + 10 log10(psi dR). It is
+  /// evaluated on a coarse range grid, once per depth change when
+  /// layered, and scaled per beam by its width, so a frame is one
+  /// complex Gaussian draw per bin in front of each beam's first hard
+  /// return, which shadows the water behind it.
+  class SonarReverberation
+  {
+    /// \brief Constructor
+    /// \param[in] _ranges Range of each bin [m]
+    /// \param[in] _beamWidths Azimuth width of each beam [rad]
+    public: SonarReverberation(const SonarReverberationConfig &_config,
+                               const std::vector<float> &_ranges,
+                               const std::vector<float> &_beamWidths);
+
+    /// \brief Follow the sensor through the layers, the grid is only
+    /// rebuilt when layered and the depth or tilt moved
+    /// \param[in] _depth Sensor depth below the sea surface [m]
+    /// \param[in] _declination Downward tilt of the beam axis [rad]
+    /// \return True if the grid was rebuilt
+    public: bool Update(double _depth, double _declination);
+
+    /// \brief Add reverberation to one beam's echo
+    /// \param[in,out] _echo Complex echo of each range bin
+    /// \param[in] _firstReturn Range of the beam's first hard return [m],
+    /// bins at or beyond it are shadowed
+    public: void Apply(int _beam, std::complex<float> *_echo,
+                       float _firstReturn,
+                       std::default_random_engine &_generator) const;
+
+    /// \brief RMS amplitude of each bin of a beam without shadowing
+    public: float Level(int _beam, int _bin) const;
+
+    /// \brief Scattering strength at a depth [dB re 1/m]
+    private: double Strength(double _depth) const;
+
+    /// \brief Evaluate the coarse grid
+    private: void Build();
+
+    private: SonarReverberationConfig config;
+    private: std::vector<float> ranges;
+    /// \brief Square root of each beam's width
+    private: std::vector<float> beamFactor;
+    /// \brief RMS amplitude of each bin for a beam of unit width,
+    /// interpolated from the coarse cells
+    private: std::vector<float> profile;
+    private: double depth;
+    private: double declination;
+  };
+}  // namespace NpsGazeboSonar
+#endif
@@ -0,0 +1,71 @@
+/*
+ * Copyright 2020 Naval Postgraduate School
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+
+#ifndef SONAR_STITCHING_HH
+#define SONAR_STITCHING_HH
+
+#include <vector>
+
+#include <opencv2/core.hpp>
+
+namespace NpsGazeboSonar
+{
+  /// \brief Geometry of one depth camera of a stitched fan
+  struct SonarCameraGeometry
+  {
+    /// \brief Image width [px]
+    int width;
+    /// \brief Horizontal field of view [rad]
+    double hFOV;
+    /// \brief Yaw relative to the sonar frame [rad], positive to the left
+    double yaw;
+  };
+
+  /// \brief Precomputed map of one camera's image columns onto the beams
+  /// of the stitched fan (see SonarView)
+  struct SonarColumnMap
+  {
+    /// \brief Beam of each column, -1 outside the fan or where another
+    /// camera looks closer to its optical axis (width)
+    std::vector<int> beam;
+    /// \brief Slot of each column among this camera's columns of the
+    /// same beam (width)
+    std::vector<int> slot;
+    /// \brief Azimuth beam pattern weight relative to the beam center
+    /// (width)
+    std::vector<float> pattern;
+    /// \brief Maximum number of columns of this camera in one beam
+    int nSlots = 0;
+  };
+
+  /// \brief Horizontal field of view of the fan covered by all cameras,
+  /// symmetric about the sonar frame [rad]
+  double StitchedFOV(const std::vector<SonarCameraGeometry> &_cameras);
+
+  /// \brief Column to beam maps of every camera for _nBeams beams spread
+  /// uniformly over _fov. Where cameras overlap, each azimuth is taken
+  /// from the camera whose optical axis is closest to it.
+  std::vector<SonarColumnMap> BuildColumnMaps(
+                      const std::vector<SonarCameraGeometry> &_cameras,
+                      int _nBeams, double _fov);
+
+  /// \brief Convert a z-depth image into a range image, depths up to
+  /// _cutoff give a range of 0 (no return)
+  void DepthToRange(const float *_depth, int _width, int _height,
+                    double _hFOV, double _cutoff, cv::Mat &_range);
+}  // namespace NpsGazeboSonar
+#endif
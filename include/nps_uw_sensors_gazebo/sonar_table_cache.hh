@@ -0,0 +1,123 @@
+/*
+ * Copyright 2020 Naval Postgraduate School
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+
+#ifndef SONAR_TABLE_CACHE_HH
+#define SONAR_TABLE_CACHE_HH
+
+#include <cstddef>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace NpsGazeboSonar
+{
+  /// \brief Sensor configuration that fully determines the precomputed
+  /// sonar tables. Two sonars with equal keys share one set of tables.
+  struct SonarTableKey
+  {
+    int nBeams;
+    int nFreq;
+    /// \brief Rendered columns per beam, the camera is nBeams x this wide
+    int azimuthRaysPerBeam;
+    double hFOV;
+    double bandwidth;
+    double soundSpeed;
+    /// \brief Output beam azimuths [rad] (nBeams, ascending). Empty keeps
+    /// the pinhole azimuths of the rendered columns.
+    std::vector<float> beamAngles;
+    /// \brief Rendered beams are spaced uniformly over hFOV instead of
+    /// following one camera's pinhole geometry (stitched cameras)
+    bool renderedUniform = false;
+
+    bool operator<(const SonarTableKey &_other) const;
+  };
+
+  /// \brief Immutable tables precomputed once per sensor configuration
+  struct SonarTables
+  {
+    SonarTableKey key;
+
+    /// \brief Range of each time sample [m] (nFreq)
+    std::vector<float> rangeVector;
+
+    /// \brief Normalized Hamming window (nFreq)
+    std::vector<float> window;
+
+    /// \brief Beam culling corrector, row major (nBeams x nBeams).
+    /// Maps rendered beams to output beams, so any beam angle resampling
+    /// is folded in.
+    std::vector<float> beamCorrector;
+    float beamCorrectorSum;
+
+    /// \brief Azimuth of each rendered beam center [rad] (nBeams)
+    std::vector<float> renderedAngles;
+
+    /// \brief Scan conversion map: azimuth of each output beam and the
+    /// begin/end bearings of each beam's fan sector [rad] (nBeams)
+    std::vector<float> azimuthAngles;
+    std::vector<float> bearingBegin;
+    std::vector<float> bearingEnd;
+
+    /// \brief Azimuth beam pattern weight of each rendered column
+    /// relative to the center of its beam (nBeams x azimuthRaysPerBeam)
+    std::vector<float> azimuthBeamPattern;
+
+    /// \brief Beam and slot of each rendered column of a single camera
+    /// (nBeams x azimuthRaysPerBeam), see SonarView
+    std::vector<int> columnBeam;
+    std::vector<int> columnSlot;
+
+    /// \brief Heap memory held by the tables [bytes]
+    size_t Bytes() const;
+  };
+
+  typedef std::shared_ptr<const SonarTables> SonarTablesPtr;
+
+  /// \brief Process-wide registry of reference counted sonar tables.
+  /// Tables are built on first use and freed when the last sonar
+  /// holding them releases its pointer.
+  class SonarTableCache
+  {
+    /// \brief Access the process-wide registry
+    public: static SonarTableCache &Instance();
+
+    /// \brief Get the tables for a configuration, building them if no
+    /// other sonar currently holds them
+    public: SonarTablesPtr Acquire(const SonarTableKey &_key);
+
+    /// \brief Memory avoided by sharing instead of per-sonar copies
+    public: size_t BytesSaved() const;
+
+    /// \brief Memory currently held by all live tables
+    public: size_t BytesInUse() const;
+
+    /// \brief Number of sonars currently holding tables
+    public: int Users() const;
+
+    private: SonarTableCache() = default;
+
+    /// \brief Compute all tables for a configuration
+    private: static std::shared_ptr<SonarTables> Build(
+                                  const SonarTableKey &_key);
+
+    private: mutable std::mutex mutex;
+    private: std::map<SonarTableKey, std::weak_ptr<const SonarTables>>
+                                  entries;
+  };
+}  // namespace NpsGazeboSonar
+#endif
@@ -0,0 +1,63 @@
+/*
+ * Copyright 2020 Naval Postgraduate School
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+
+#ifndef SONAR_TILE_TRACKER_HH
+#define SONAR_TILE_TRACKER_HH
+
+#include <cstdint>
+#include <vector>
+
+#include <nps_uw_sensors_gazebo/sonar_calculation_cuda.cuh>
+
+namespace NpsGazeboSonar
+{
+  /// \brief Change detection for incremental sonar updates. Every view is
+  /// split into square tiles whose depth, normal and material pixels are
+  /// hashed each frame; tiles whose hash differs from the previous frame
+  /// are flagged in SonarView::changedTiles.
+  class SonarTileTracker
+  {
+    /// \brief Constructor
+    /// \param[in] _tileSize Tile edge [px]
+    /// \param[in] _refreshInterval Frames between full recomputations,
+    /// bounding the accumulated rounding drift
+    public: SonarTileTracker(int _tileSize, int _refreshInterval);
+
+    /// \brief Flag the changed tiles of this frame's views
+    /// \return True if the frame must be fully recomputed: first frame,
+    /// changed view geometry, Invalidate() or refresh interval reached
+    public: bool Update(std::vector<SonarView> &_views);
+
+    /// \brief Force a full recomputation with the next frame
+    public: void Invalidate();
+
+    /// \brief Tile edge [px]
+    public: int TileSize() const;
+
+    /// \brief Fraction of tiles recomputed by the last update
+    public: double ChangedFraction() const;
+
+    private: int tileSize;
+    private: int refreshInterval;
+    private: int framesSinceRefresh;
+    private: bool invalid;
+    private: double changedFraction;
+    /// \brief Tile hashes of each view (tiles per view)
+    private: std::vector<std::vector<uint64_t>> hashes;
+  };
+}  // namespace NpsGazeboSonar
+#endif
@@ -0,0 +1,39 @@
+/*
+ * Copyright 2020 Naval Postgraduate School
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+
+#ifndef SONAR_TILING_HH
+#define SONAR_TILING_HH
+
+#include <cstddef>
+
+#include <opencv2/core.hpp>
+
+namespace NpsGazeboSonar
+{
+  /// \brief Rows of a band whose depth, normal, noise and filter
+  /// intermediates fit in _cacheBytes of cache, at least one
+  int BandRows(int _cols, size_t _cacheBytes);
+
+  /// \brief Compute rows [_begin, _end) of the normal image (CV_32FC3,
+  /// allocated by the caller) from a depth image (CV_32FC1). Only the
+  /// band and a few rows around it are touched, so bands can run in
+  /// parallel and their intermediates stay in cache. Gives the same
+  /// normals as the full frame computation.
+  void ComputeNormalBand(const cv::Mat &_depth, int _begin, int _end,
+                         double _focalLength, cv::Mat &_normal);
+}  // namespace NpsGazeboSonar
+#endif
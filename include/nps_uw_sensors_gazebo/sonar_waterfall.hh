@@ -0,0 +1,63 @@
+/*
+ * Copyright 2020 Naval Postgraduate School
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+
+#ifndef SONAR_WATERFALL_HH
+#define SONAR_WATERFALL_HH
+
+#include <opencv2/core.hpp>
+
+namespace NpsGazeboSonar
+{
+  /// \brief Side-scan waterfall kept as a ring buffer of ping lines. A
+  /// ping writes one line over the oldest one, nothing else is touched.
+  /// The ring is stored twice, one copy below the other, and every line
+  /// is written to both, so the image is always the contiguous rows
+  /// starting at the head and is never copied.
+  class SonarWaterfall
+  {
+    /// \brief Constructor
+    /// \param[in] _lines Pings kept, the image height
+    /// \param[in] _binsPerSide Range bins of each side, the image is
+    /// twice as wide
+    public: SonarWaterfall(int _lines, int _binsPerSide);
+
+    /// \brief Add the newest ping. Port is mirrored onto the left half,
+    /// far range at the edge, starboard fills the right half.
+    /// \param[in] _port Echo amplitude of each port bin, null for none
+    /// \param[in] _starboard Echo amplitude of each starboard bin, null
+    /// for none
+    /// \param[in] _gain Gray level per unit of amplitude
+    public: void Push(const float *_port, const float *_starboard,
+                      float _gain);
+
+    /// \brief Waterfall image (CV_8UC1), newest ping on the top row. A
+    /// view of the ring, valid until the next Push.
+    public: cv::Mat Image() const;
+
+    /// \brief Pings pushed so far, at most the image height
+    public: int Lines() const;
+
+    private: int binsPerSide;
+    private: int lines;
+    /// \brief Two copies of the ring (2 x lines rows)
+    private: cv::Mat ring;
+    /// \brief Row of the newest line
+    private: int head;
+    private: int count;
+  };
+}  // namespace NpsGazeboSonar
+#endif
@@ -0,0 +1,96 @@
+/*
+ * Copyright 2020 Naval Postgraduate School
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+
+#ifndef SONAR_WAVEFORM_HH
+#define SONAR_WAVEFORM_HH
+
+#include <complex>
+#include <string>
+#include <vector>
+
+namespace NpsGazeboSonar
+{
+  /// \brief Transmit waveforms
+  enum class WaveformType
+  {
+    /// \brief Flat spectrum over the bandwidth, the original model
+    FLAT,
+    /// \brief Rectangular pulse at the sonar frequency
+    CW,
+    /// \brief Linear frequency modulated chirp centered on the sonar
+    /// frequency
+    LFM,
+    /// \brief Transmit spectrum read from a file
+    FILE
+  };
+
+  /// \brief Transmit waveform of a sonar
+  struct SonarWaveform
+  {
+    WaveformType type = WaveformType::FLAT;
+    /// \brief Pulse length of CW and LFM [s]
+    double pulseLength = 1e-3;
+    /// \brief Swept bandwidth of LFM [Hz], 0 sweeps the sonar bandwidth
+    double chirpBandwidth = 0.0;
+    /// \brief Spectrum of FILE, one "frequency[Hz] real imag" line per
+    /// sample in ascending frequency, '#' starts a comment
+    std::string spectrumFile;
+  };
+
+  /// \brief Outcome of building a waveform's spectrum
+  enum class WaveformStatus
+  {
+    OK,
+    /// \brief The spectrum file cannot be opened
+    FILE_NOT_FOUND,
+    /// \brief The spectrum file has no "frequency real imag" line
+    NO_SAMPLES,
+    /// \brief The spectrum file frequencies are not ascending
+    UNSORTED,
+    /// \brief Nothing is transmitted within the sonar bandwidth
+    OUT_OF_BAND
+  };
+
+  /// \brief Parse an SDF waveform name, "flat", "cw", "lfm" or "file"
+  /// \return False if the name is unknown
+  bool ParseWaveformType(const std::string &_name, WaveformType &_type);
+
+  /// \brief Readable reason of a status, for the plugins' warnings
+  std::string WaveformStatusText(WaveformStatus _status);
+
+  /// \brief Transmit spectrum of every frequency bin, bin f being at
+  /// _sonarFreq + _deltaF*(f + 1 - nFreq/2) as in AttenuationTable
+  WaveformStatus TransmitSpectrum(const SonarWaveform &_waveform,
+                                  double _sonarFreq, double _deltaF,
+                                  int _nFreq,
+                                  std::vector<std::complex<float>> &_spectrum);
+
+  /// \brief Per-bin tables of pulse compression. The echo spectrum of the
+  /// scene is multiplied by _transmit (transmit spectrum x window), which
+  /// keeps the phase of the transmitted pulse, and the resulting echo by
+  /// _matchedFilter (conjugate replica normalized to the peak of the
+  /// compressed spectrum).
+  /// \param[in] _window Window of each bin (nFreq)
+  /// \return Status, both tables are empty unless OK
+  WaveformStatus WaveformWeights(
+                       const SonarWaveform &_waveform,
+                       const std::vector<float> &_window,
+                       double _sonarFreq, double _deltaF,
+                       std::vector<std::complex<float>> &_transmit,
+                       std::vector<std::complex<float>> &_matchedFilter);
+}  // namespace NpsGazeboSonar
+#endif
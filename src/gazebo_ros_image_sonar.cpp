@@ -24,6 +24,9 @@
 #include <sensor_msgs/point_cloud2_iterator.h>
 
 #include <nps_uw_sensors_gazebo/sonar_calculation_cuda.cuh>
+#include <nps_uw_sensors_gazebo/sonar_batch_collector.hh>
+#include <nps_uw_sensors_gazebo/sonar_absorption.hh>
+#include <nps_uw_sensors_gazebo/sonar_tiling.hh>
 
 #include <opencv2/core/core.hpp>
 #include <boost/thread/thread.hpp>
@@ -33,9 +36,14 @@
 #include <gazebo/sensors/Sensor.hh>
 #include <sdf/sdf.hh>
 #include <gazebo/sensors/SensorTypes.hh>
+#include <gazebo/sensors/SensorManager.hh>
+#include <gazebo/sensors/DepthCameraSensor.hh>
 
 #include <algorithm>
+#include <cmath>
 #include <string>
+#include <thread>
+#include <utility>
 #include <vector>
 #include <limits>
 
@@ -58,20 +66,53 @@ NpsGazeboRosImageSonar::NpsGazeboRosImageSonar() :
   // for csv write logs
   this->writeCounter = 0;
   this->writeNumber = 1;
+
+  this->droppedFrames = 0;
+  this->cameraHFOV = 0.0;
+  this->cameraVFOV = 0.0;
+  this->frameInFlight = false;
+  this->batchSensors = false;
+  this->stitchWindow = 0.05;
+  this->stitchReady = true;
+  this->framePending = false;
+  this->sonarHFOV = 0.0;
+  this->materialRevision = 0;
+  this->tiledProcessing = false;
+  this->tileCacheBytes = 256 * 1024;
+  this->precision = NpsGazeboSonar::SonarPrecision::SINGLE;
+  this->multipath = false;
+  this->multipathSteps = 32;
+  this->multipathThickness = 0.05;
+  this->multipathLoss = 0.5;
+  this->volumeReverb = false;
+  this->refractionDepth = NAN;
+  this->refractionDeclination = NAN;
+  this->profileRevision = 0;
 }
 
 
 // Destructor
 NpsGazeboRosImageSonar::~NpsGazeboRosImageSonar()
 {
+  // Finish any sonar frame still running on the executor. A batched
+  // frame completes on the thread of the last sonar of its batch.
+  this->taskGroup.reset();
+  while (this->frameInFlight)
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+  for (auto &camera : this->stitchCameras)
+    camera->connection.reset();
   this->newDepthFrameConnection.reset();
   this->newImageFrameConnection.reset();
   this->newRGBPointCloudConnection.reset();
-  this->newSonarImageConnection.reset();
 
+  this->materialPass.reset();
   this->parentSensor.reset();
   this->depthCamera.reset();
 
+  // Tables are freed once the last sonar using them unloads
+  this->tables.reset();
+
   // CSV log write stream close
   writeLog.close();
 }
@@ -95,6 +136,8 @@ void NpsGazeboRosImageSonar::Load(sensors::SensorPtr _parent,
   this->height = this->depthCamera->ImageHeight();
   this->depth = this->depthCamera->ImageDepth();
   this->format = this->depthCamera->ImageFormat();
+  this->cameraHFOV = this->depthCamera->HFOV().Radian();
+  this->cameraVFOV = this->depthCamera->VFOV().Radian();
 
   this->newDepthFrameConnection =
     this->depthCamera->ConnectNewDepthFrame(
@@ -110,13 +153,6 @@ void NpsGazeboRosImageSonar::Load(sensors::SensorPtr _parent,
                   std::placeholders::_3, std::placeholders::_4,
                   std::placeholders::_5));
 
-  this->newSonarImageConnection =
-    this->depthCamera->ConnectNewDepthFrame(
-        std::bind(&NpsGazeboRosImageSonar::OnNewDepthFrame,
-                  this, std::placeholders::_1, std::placeholders::_2,
-                  std::placeholders::_3, std::placeholders::_4,
-                  std::placeholders::_5));
-
   this->parentSensor->SetActive(true);
 
   // Make sure the ROS node for Gazebo has already been initialized
@@ -179,6 +215,41 @@ void NpsGazeboRosImageSonar::Load(sensors::SensorPtr _parent,
   else
     this->sonar_image_topic_name_ =
       _sdf->GetElement("sonarImageTopicName")->Get<std::string>();
+  if (!_sdf->HasElement("sonarOccupancyTopicName"))
+    this->sonar_occupancy_topic_name_ = "sonar_occupancy";
+  else
+    this->sonar_occupancy_topic_name_ =
+      _sdf->GetElement("sonarOccupancyTopicName")->Get<std::string>();
+  if (!_sdf->HasElement("sonarCacheTopicName"))
+    this->sonar_cache_topic_name_ = "sonar_cache";
+  else
+    this->sonar_cache_topic_name_ =
+      _sdf->GetElement("sonarCacheTopicName")->Get<std::string>();
+  if (!_sdf->HasElement("sonarDroppedTopicName"))
+    this->sonar_dropped_topic_name_ = "sonar_dropped_frames";
+  else
+    this->sonar_dropped_topic_name_ =
+      _sdf->GetElement("sonarDroppedTopicName")->Get<std::string>();
+  if (!_sdf->HasElement("sonarMultipathTopicName"))
+    this->sonar_multipath_topic_name_ = "sonar_multipath";
+  else
+    this->sonar_multipath_topic_name_ =
+      _sdf->GetElement("sonarMultipathTopicName")->Get<std::string>();
+  if (!_sdf->HasElement("sonarDetectionsTopicName"))
+    this->sonar_detections_topic_name_ = "sonar_detections";
+  else
+    this->sonar_detections_topic_name_ =
+      _sdf->GetElement("sonarDetectionsTopicName")->Get<std::string>();
+  if (!_sdf->HasElement("sonarReturnsTopicName"))
+    this->sonar_returns_topic_name_ = "sonar_returns";
+  else
+    this->sonar_returns_topic_name_ =
+      _sdf->GetElement("sonarReturnsTopicName")->Get<std::string>();
+  if (!_sdf->HasElement("sonarAltitudeTopicName"))
+    this->sonar_altitude_topic_name_ = "sonar_altitude";
+  else
+    this->sonar_altitude_topic_name_ =
+      _sdf->GetElement("sonarAltitudeTopicName")->Get<std::string>();
 
 
   if (!_sdf->HasElement("clip"))
@@ -239,37 +310,358 @@ void NpsGazeboRosImageSonar::Load(sensors::SensorPtr _parent,
   if (this->raySkips == 0) this->raySkips = 1;
 
   // --- Calculate common sonar parameters ---- //
-  // if (this->constMu)
-  this->mu = 1e-3;
-  // else
-  //   // nothing yet
-
-  // Transmission path properties (typical model used here)
-  // More sophisticated model by Francois-Garrison model is available
-  this->absorption = 0.0354;  // [dB/m]
-  this->attenuation = this->absorption*log(10)/20.0;
+  // Reflectivity of surfaces without a material
+  if (!_sdf->HasElement("reflectivity"))
+    this->mu = 1e-3;
+  else
+    this->mu =
+      _sdf->GetElement("reflectivity")->Get<double>();
+  // Per-surface reflectivity, each <material> maps a model name or a
+  // visual material name to a reflectivity in the process-wide table
+  if (!this->constMu && _sdf->HasElement("materials"))
+  {
+    NpsGazeboSonar::SonarMaterialTable &materialTable =
+        NpsGazeboSonar::SonarMaterialTable::Instance();
+    sdf::ElementPtr material =
+        _sdf->GetElement("materials")->GetElement("material");
+    for (; material; material = material->GetNextElement("material"))
+    {
+      const std::string target = material->Get<std::string>("target");
+      const double reflectivity = material->Get<double>("reflectivity");
+      if (materialTable.Add(target, reflectivity) == 0)
+        ROS_WARN_STREAM("Sonar material table full, ignoring " << target);
+    }
+  }
 
-  // Range vector
+  // Number of frequency (time) samples
   const float max_T = this->maxDistance*2.0/this->soundSpeed;
   float delta_f = 1.0/max_T;
-  const float delta_t = 1.0/this->bandwidth;
   this->nFreq = ceil(this->bandwidth/delta_f);
   delta_f = this->bandwidth/this->nFreq;
-  const int nTime = nFreq;
-  this->rangeVector = new float[nTime];
-  for (int i = 0; i < nTime; i++)
+
+  // Transmission path properties
+  // "constant" applies <absorption> [dB/m] to every frequency,
+  // "francois_garrison" evaluates the Francois-Garrison model per bin
+  NpsGazeboSonar::AbsorptionModel absorptionModel =
+      NpsGazeboSonar::AbsorptionModel::CONSTANT;
+  if (_sdf->HasElement("absorptionModel"))
+  {
+    std::string modelName =
+      _sdf->GetElement("absorptionModel")->Get<std::string>();
+    if (!NpsGazeboSonar::ParseAbsorptionModel(modelName, absorptionModel))
+      ROS_WARN_STREAM("Unknown absorptionModel '" << modelName
+                      << "', using constant absorption");
+  }
+  if (!_sdf->HasElement("absorption"))
+    this->absorption = 0.0354;  // [dB/m]
+  else
+    this->absorption =
+      _sdf->GetElement("absorption")->Get<double>();
+  NpsGazeboSonar::WaterProperties water;
+  if (_sdf->HasElement("waterTemperature"))
+    water.temperature = _sdf->GetElement("waterTemperature")->Get<double>();
+  if (_sdf->HasElement("waterSalinity"))
+    water.salinity = _sdf->GetElement("waterSalinity")->Get<double>();
+  if (_sdf->HasElement("waterDepth"))
+    water.depth = _sdf->GetElement("waterDepth")->Get<double>();
+  if (_sdf->HasElement("waterPH"))
+    water.pH = _sdf->GetElement("waterPH")->Get<double>();
+  // Bins are spaced as in the echo synthesis (1/max_T)
+  this->attenuationTable = NpsGazeboSonar::AttenuationTable(
+      absorptionModel, this->absorption, water,
+      this->sonarFreq, 1.0/max_T, this->nFreq);
+
+  // Transmit waveform, pulse compressed by its matched filter. "flat"
+  // keeps the flat spectrum over the bandwidth.
+  if (_sdf->HasElement("waveform"))
+  {
+    std::string waveformName =
+      _sdf->GetElement("waveform")->Get<std::string>();
+    if (!NpsGazeboSonar::ParseWaveformType(waveformName, this->waveform.type))
+      ROS_WARN_STREAM("Unknown waveform '" << waveformName
+                      << "', using a flat spectrum");
+  }
+  if (_sdf->HasElement("pulseLength"))
+    this->waveform.pulseLength =
+      _sdf->GetElement("pulseLength")->Get<double>();
+  if (_sdf->HasElement("chirpBandwidth"))
+    this->waveform.chirpBandwidth =
+      _sdf->GetElement("chirpBandwidth")->Get<double>();
+  if (_sdf->HasElement("spectrumFile"))
+    this->waveform.spectrumFile =
+      _sdf->GetElement("spectrumFile")->Get<std::string>();
+
+  // Time varying gain and compression of the published intensities:
+  // n log10(R) spreading plus the two way absorption at the sonar
+  // frequency, then "log" or "linear" mapping below <ceilingLevel> [dB],
+  // the frame's peak when unset
+  if (!_sdf->HasElement("tvg"))
+    this->tvg = false;
+  else
+    this->tvg = _sdf->GetElement("tvg")->Get<bool>();
+  if (_sdf->HasElement("tvgSpreading"))
+    this->gainConfig.spreading =
+      _sdf->GetElement("tvgSpreading")->Get<double>();
+  bool tvgAbsorption = true;
+  if (_sdf->HasElement("tvgAbsorption"))
+    tvgAbsorption = _sdf->GetElement("tvgAbsorption")->Get<bool>();
+  if (tvgAbsorption)
+    this->gainConfig.absorption = this->attenuationTable[this->nFreq / 2];
+  this->gainConfig.minRange = this->point_cloud_cutoff_;
+  if (_sdf->HasElement("compression"))
+  {
+    std::string compression =
+      _sdf->GetElement("compression")->Get<std::string>();
+    if (!NpsGazeboSonar::ParseCompressionMode(compression,
+                                              this->gainConfig.mode))
+      ROS_WARN_STREAM("Unknown compression '" << compression
+                      << "', using log");
+  }
+  if (_sdf->HasElement("dynamicRange"))
+    this->gainConfig.dynamicRange =
+      _sdf->GetElement("dynamicRange")->Get<double>();
+  this->gainCeiling = 0.0;
+  if (_sdf->HasElement("ceilingLevel"))
+    this->gainCeiling =
+      pow(10.0, _sdf->GetElement("ceilingLevel")->Get<double>() / 20.0);
+
+  // Volume reverberation of the water column in front of each beam's
+  // first hard return: <volumeScattering> Sv [dB re 1/m], optionally
+  // layered with <scatteringLayers> "depth Sv" pairs, depth below the
+  // sea surface at world z = 0
+  if (_sdf->HasElement("reverberation"))
+    this->volumeReverb = _sdf->GetElement("reverberation")->Get<bool>();
+  if (_sdf->HasElement("volumeScattering"))
+    this->reverbConfig.strength =
+      _sdf->GetElement("volumeScattering")->Get<double>();
+  if (_sdf->HasElement("scatteringLayers") &&
+      !NpsGazeboSonar::ParseScatteringLayers(
+          _sdf->GetElement("scatteringLayers")->Get<std::string>(),
+          this->reverbConfig.layers))
+    ROS_WARN_STREAM("scatteringLayers needs depth and strength pairs, "
+                    "using a uniform water column");
+  if (_sdf->HasElement("reverberationCells"))
+    this->reverbConfig.rangeCells =
+      _sdf->GetElement("reverberationCells")->Get<int>();
+  this->reverbConfig.sourceLevel = this->sourceLevel;
+  this->reverbConfig.absorption = this->attenuationTable[this->nFreq / 2];
+  this->reverbConfig.minRange = this->point_cloud_cutoff_;
+
+  // Sound speed profile refraction: <soundSpeedProfile> "depth speed"
+  // pairs or <soundSpeedProfileFile>, depth below the sea surface at
+  // world z = 0. Bent-ray corrections are traced once per profile into a
+  // table shared with other sonars; a profile published on
+  // <soundSpeedTopicName> replaces it at runtime.
+  NpsGazeboSonar::SonarRefractionKey refractionKey;
+  bool refraction = false;
+  if (_sdf->HasElement("soundSpeedProfile"))
+  {
+    refraction = NpsGazeboSonar::ParseSoundSpeedProfile(
+        _sdf->GetElement("soundSpeedProfile")->Get<std::string>(),
+        refractionKey.profile);
+    if (!refraction)
+      ROS_WARN_STREAM("soundSpeedProfile needs depth and speed pairs, "
+                      "using straight rays");
+  }
+  else if (_sdf->HasElement("soundSpeedProfileFile"))
   {
-    this->rangeVector[i] = delta_t*i*this->soundSpeed/2.0;
+    const std::string file =
+        _sdf->GetElement("soundSpeedProfileFile")->Get<std::string>();
+    refraction =
+        NpsGazeboSonar::LoadSoundSpeedProfile(file, refractionKey.profile);
+    if (!refraction)
+      ROS_WARN_STREAM("Cannot read sound speed profile '" << file
+                      << "', using straight rays");
+  }
+  if (!_sdf->HasElement("soundSpeedTopicName"))
+    this->sound_speed_topic_name_ = "sound_speed_profile";
+  else
+    this->sound_speed_topic_name_ =
+      _sdf->GetElement("soundSpeedTopicName")->Get<std::string>();
+  if (refraction)
+  {
+    refractionKey.soundSpeed = this->soundSpeed;
+    refractionKey.maxDistance = this->maxDistance;
+    if (_sdf->HasElement("refractionDepths"))
+      refractionKey.nDepths =
+        _sdf->GetElement("refractionDepths")->Get<int>();
+    if (_sdf->HasElement("refractionElevations"))
+      refractionKey.nElevations =
+        _sdf->GetElement("refractionElevations")->Get<int>();
+    if (_sdf->HasElement("refractionDistances"))
+      refractionKey.nDistances =
+        _sdf->GetElement("refractionDistances")->Get<int>();
+    this->refractionTable =
+        NpsGazeboSonar::SonarRefractionCache::Instance().Acquire(
+            refractionKey);
   }
 
   // FOV, Number of beams, number of rays are defined at model.sdf
-  // Currently, this->width equals # of beams, and this->height equals # of rays
-  // Each beam consists of (elevation,azimuth)=(this->height,1) rays
-  // Beam patterns
-  this->nBeams = this->width;
+  // The camera renders azimuthRaysPerBeam columns per beam, so
+  // this->width equals # of beams x azimuthRaysPerBeam, and this->height
+  // equals # of rays. Each beam consists of
+  // (elevation,azimuth)=(this->height,azimuthRaysPerBeam) rays
+  if (!_sdf->HasElement("azimuthRaysPerBeam"))
+    this->ray_nAzimuthRays = 1;
+  else
+    this->ray_nAzimuthRays =
+      _sdf->GetElement("azimuthRaysPerBeam")->Get<int>();
+  if (this->ray_nAzimuthRays < 1 ||
+      this->width % this->ray_nAzimuthRays != 0)
+  {
+    ROS_WARN_STREAM("Image width " << this->width
+        << " is not a multiple of azimuthRaysPerBeam "
+        << this->ray_nAzimuthRays << ", using one ray per beam");
+    this->ray_nAzimuthRays = 1;
+  }
+  this->nBeams = this->width / this->ray_nAzimuthRays;
   this->nRays = this->height;
   this->ray_nElevationRays = this->height;
-  this->ray_nAzimuthRays = 1;
+
+  // Range dependent level of detail: rows are sampled every raySkips rows
+  // near the sonar and up to 2^lodMaxLevel times coarser far away, chosen
+  // from the previous frame's ranges
+  bool rayLOD = false;
+  if (_sdf->HasElement("rayLOD"))
+    rayLOD = _sdf->GetElement("rayLOD")->Get<bool>();
+  // Row of each stratum: "fixed" takes the first row, "stratified" a
+  // jittered row drawn from the frame seed
+  std::string raySampling = "fixed";
+  if (_sdf->HasElement("raySampling"))
+    raySampling = _sdf->GetElement("raySampling")->Get<std::string>();
+  if (raySampling != "fixed" && raySampling != "stratified")
+  {
+    ROS_WARN_STREAM("Unknown raySampling '" << raySampling
+                    << "', using fixed ray skips");
+    raySampling = "fixed";
+  }
+  // Incremental updates for static scenes: depth tiles are hashed and
+  // only changed tiles recomputed, with a full refresh every
+  // incrementalRefresh frames
+  bool incremental = false;
+  if (_sdf->HasElement("incremental"))
+    incremental = _sdf->GetElement("incremental")->Get<bool>();
+  if (incremental)
+  {
+    int tileSize = 32;
+    int refresh = 100;
+    if (_sdf->HasElement("incrementalTileSize"))
+      tileSize = _sdf->GetElement("incrementalTileSize")->Get<int>();
+    if (_sdf->HasElement("incrementalRefresh"))
+      refresh = _sdf->GetElement("incrementalRefresh")->Get<int>();
+    this->tileTracker.reset(
+        new NpsGazeboSonar::SonarTileTracker(tileSize, refresh));
+    this->incrementalState = NpsGazeboSonar::create_incremental_state();
+    if (rayLOD || raySampling != "fixed")
+    {
+      // The sampled rows must not move between frames
+      ROS_WARN_STREAM("incremental updates use fixed ray skips, ignoring "
+                      "rayLOD and raySampling");
+      rayLOD = false;
+      raySampling = "fixed";
+    }
+  }
+  if (rayLOD || raySampling == "stratified")
+  {
+    double lodNearRange = this->maxDistance / 8.0;
+    int lodMaxLevel = 3;
+    if (_sdf->HasElement("lodNearRange"))
+      lodNearRange = _sdf->GetElement("lodNearRange")->Get<double>();
+    if (_sdf->HasElement("lodMaxLevel"))
+      lodMaxLevel = _sdf->GetElement("lodMaxLevel")->Get<int>();
+    // Rows are pinhole rows of the camera's default focal length
+    this->rayLOD.reset(new NpsGazeboSonar::SonarRayLOD(
+        this->nRays, this->raySkips, rayLOD ? lodMaxLevel : 0, lodNearRange,
+        this->soundSpeed / this->bandwidth,
+        this->width / (2.0 * tan(this->cameraHFOV / 2.0)),
+        raySampling == "stratified"));
+  }
+
+  // Reuse the noise free spectra while neither the sensor nor the models
+  // in its FOV move, only the speckle is drawn anew
+  if (_sdf->HasElement("resultCache") &&
+      _sdf->GetElement("resultCache")->Get<bool>())
+    this->resultCache.reset(new NpsGazeboSonar::SonarResultCache());
+
+  // Normals, noise and echo synthesis in cache sized tiles instead of
+  // full frame passes, for high resolution cameras
+  if (_sdf->HasElement("tiledProcessing"))
+    this->tiledProcessing = _sdf->GetElement("tiledProcessing")->Get<bool>();
+  if (_sdf->HasElement("tileCacheBytes"))
+    this->tileCacheBytes = _sdf->GetElement("tileCacheBytes")->Get<int>();
+
+  // Arithmetic of the sonar model: "double" reference, "single" float
+  // functions or "fast" polynomial approximations
+  if (_sdf->HasElement("precision"))
+  {
+    const std::string precision =
+        _sdf->GetElement("precision")->Get<std::string>();
+    if (!NpsGazeboSonar::ParsePrecision(precision, this->precision))
+      ROS_WARN_STREAM("Unknown precision '" << precision
+                      << "', using single");
+  }
+
+  // Screen-space second bounce: specular reflection of every ray marched
+  // through the depth image for at most multipathSteps steps
+  if (_sdf->HasElement("multipath"))
+    this->multipath = _sdf->GetElement("multipath")->Get<bool>();
+  if (_sdf->HasElement("multipathSteps"))
+    this->multipathSteps =
+        std::max(1, _sdf->GetElement("multipathSteps")->Get<int>());
+  if (_sdf->HasElement("multipathThickness"))
+    this->multipathThickness = std::max(0.0,
+        _sdf->GetElement("multipathThickness")->Get<double>());
+  if (_sdf->HasElement("multipathLoss"))
+    this->multipathLoss = _sdf->GetElement("multipathLoss")->Get<double>();
+
+  // Constant false alarm rate detection along range: "ca" cell
+  // averaging, "os" ordered statistic or "none"
+  if (_sdf->HasElement("cfarMethod") &&
+      _sdf->GetElement("cfarMethod")->Get<std::string>() != "none")
+  {
+    const std::string name =
+        _sdf->GetElement("cfarMethod")->Get<std::string>();
+    NpsGazeboSonar::CfarMethod method =
+        NpsGazeboSonar::CfarMethod::CELL_AVERAGING;
+    if (!NpsGazeboSonar::ParseCfarMethod(name, method))
+      ROS_WARN_STREAM("Unknown CFAR method '" << name
+                      << "', using cell averaging");
+    int trainingCells = 16;
+    int guardCells = 2;
+    double pfa = 1e-3;
+    double rank = 0.75;
+    if (_sdf->HasElement("cfarTrainingCells"))
+      trainingCells = _sdf->GetElement("cfarTrainingCells")->Get<int>();
+    if (_sdf->HasElement("cfarGuardCells"))
+      guardCells = _sdf->GetElement("cfarGuardCells")->Get<int>();
+    if (_sdf->HasElement("cfarPfa"))
+      pfa = _sdf->GetElement("cfarPfa")->Get<double>();
+    if (_sdf->HasElement("cfarRank"))
+      rank = _sdf->GetElement("cfarRank")->Get<double>();
+    this->cfar.reset(new NpsGazeboSonar::SonarCfar(
+        method, trainingCells, guardCells, pfa, rank));
+  }
+
+  // Per beam returns: "leading_edge" or "peak" of the strongest echo,
+  // or "none"
+  if (_sdf->HasElement("bottomDetection") &&
+      _sdf->GetElement("bottomDetection")->Get<std::string>() != "none")
+  {
+    const std::string name =
+        _sdf->GetElement("bottomDetection")->Get<std::string>();
+    NpsGazeboSonar::ReturnMode mode = NpsGazeboSonar::ReturnMode::LEADING_EDGE;
+    if (!NpsGazeboSonar::ParseReturnMode(name, mode))
+      ROS_WARN_STREAM("Unknown bottom detection '" << name
+                      << "', using leading_edge");
+    double threshold = 0.5;
+    double minIntensity = 0.0;
+    if (_sdf->HasElement("bottomThreshold"))
+      threshold = _sdf->GetElement("bottomThreshold")->Get<double>();
+    if (_sdf->HasElement("bottomMinIntensity"))
+      minIntensity = _sdf->GetElement("bottomMinIntensity")->Get<double>();
+    this->bottomDetector.reset(new NpsGazeboSonar::SonarBottomDetector(
+        mode, threshold, minIntensity, this->point_cloud_cutoff_));
+  }
 
   // Print sonar calculation settings
   ROS_INFO_STREAM("");
@@ -279,12 +671,58 @@ void NpsGazeboRosImageSonar::Load(sensors::SensorPtr _parent,
   ROS_INFO_STREAM("Maximum view range  [m] = " << this->maxDistance);
   ROS_INFO_STREAM("Distance resolution [m] = " <<
                     this->soundSpeed*(1.0/(this->nFreq*delta_f)));
-  ROS_INFO_STREAM("# of Beams = " << this->nBeams);
   ROS_INFO_STREAM("# of Rays / Beam (Elevation, Azimuth) = ("
       << ray_nElevationRays << ", " << ray_nAzimuthRays << ")");
   ROS_INFO_STREAM("Calculation skips (Elevation) = "
-      << this->raySkips);
+      << this->raySkips << (rayLOD ? " (range level of detail)" : "")
+      << (raySampling == "stratified" ? " (stratified)" : ""));
+  if (this->resultCache)
+    ROS_INFO_STREAM("Result cache enabled (static scenes)");
+  ROS_INFO_STREAM("Precision = "
+      << NpsGazeboSonar::PrecisionName(this->precision));
+  if (this->refractionTable)
+    ROS_INFO_STREAM("Refraction = "
+        << this->refractionTable->Key().profile.depth.size()
+        << " sample sound speed profile, "
+        << this->refractionTable->Bytes() << " bytes of bent-ray tables");
+  if (this->volumeReverb)
+    ROS_INFO_STREAM("Volume reverberation = " << this->reverbConfig.strength
+        << " dB" << (this->reverbConfig.layers.empty() ? "" : ", layered"));
+  if (this->multipath)
+    ROS_INFO_STREAM("Multipath = second bounce, " << this->multipathSteps
+                    << " march steps, thickness "
+                    << this->multipathThickness << " x depth, loss "
+                    << this->multipathLoss);
+  if (this->cfar)
+    ROS_INFO_STREAM("CFAR detection = "
+        << (this->cfar->Method() ==
+            NpsGazeboSonar::CfarMethod::CELL_AVERAGING ? "ca" : "os"));
+  if (this->bottomDetector)
+    ROS_INFO_STREAM("Bottom detection = "
+        << (this->bottomDetector->Mode() ==
+            NpsGazeboSonar::ReturnMode::PEAK ? "peak" : "leading_edge"));
+  if (this->waveform.type == NpsGazeboSonar::WaveformType::CW)
+    ROS_INFO_STREAM("Waveform = cw, " << this->waveform.pulseLength
+                    << " s pulse, matched filter");
+  else if (this->waveform.type == NpsGazeboSonar::WaveformType::LFM)
+    ROS_INFO_STREAM("Waveform = lfm, " << this->waveform.pulseLength
+                    << " s chirp, matched filter");
+  else if (this->waveform.type == NpsGazeboSonar::WaveformType::FILE)
+    ROS_INFO_STREAM("Waveform = " << this->waveform.spectrumFile
+                    << ", matched filter");
+  if (this->tvg)
+    ROS_INFO_STREAM("TVG = " << this->gainConfig.spreading << " log R + "
+        << 2.0 * this->gainConfig.absorption * 20.0 / log(10.0)
+        << " dB/m R, "
+        << (this->gainConfig.mode == NpsGazeboSonar::CompressionMode::LOG ?
+            "log" : "linear") << " compression");
+  if (this->tiledProcessing)
+    ROS_INFO_STREAM("Tiled processing, " << this->tileCacheBytes
+                    << " bytes per host tile");
   ROS_INFO_STREAM("# of Time data / Beam = " << this->nFreq);
+  ROS_INFO_STREAM("Attenuation [Np/m] (first, last bin) = ("
+      << this->attenuationTable.front() << ", "
+      << this->attenuationTable.back() << ")");
   ROS_INFO_STREAM("==================================================");
   ROS_INFO_STREAM("");
 
@@ -318,23 +756,65 @@ void NpsGazeboRosImageSonar::Load(sensors::SensorPtr _parent,
     this->debugFlag =
       _sdf->GetElement("debugFlag")->Get<bool>();
 
-  // -- Pre calculations for sonar -- //
-  // Hamming window
-  this->window = new float[this->nFreq];
-  float windowSum = 0;
-  for (size_t f = 0; f < this->nFreq; f++)
+  // Shared executor for all sonars in this process. Pool size and core
+  // pinning are set by the first sonar to load.
+  int executorThreads = 0;
+  bool executorPinCores = false;
+  int executorPriority = 0;
+  if (_sdf->HasElement("executorThreads"))
+    executorThreads = _sdf->GetElement("executorThreads")->Get<int>();
+  if (_sdf->HasElement("executorPinCores"))
+    executorPinCores = _sdf->GetElement("executorPinCores")->Get<bool>();
+  if (_sdf->HasElement("executorPriority"))
+    executorPriority = _sdf->GetElement("executorPriority")->Get<int>();
+  NpsGazeboSonar::SonarExecutor &executor =
+      NpsGazeboSonar::SonarExecutor::Instance();
+  if (!executor.Configure(executorThreads, executorPinCores) &&
+      (_sdf->HasElement("executorThreads") ||
+       _sdf->HasElement("executorPinCores")))
+    ROS_WARN_STREAM("Sonar executor already running with "
+        << executor.Threads() << " threads, ignoring executor settings");
+  this->taskGroup.reset(new NpsGazeboSonar::SonarTaskGroup(executorPriority));
+  ROS_INFO_STREAM("Sonar executor threads = " << executor.Threads()
+      << ", priority = " << executorPriority);
+
+  // Batch engine calls with other sonars rendering the same sim time
+  if (_sdf->HasElement("batchSensors"))
+    this->batchSensors = _sdf->GetElement("batchSensors")->Get<bool>();
+
+  // Extra depth cameras stitched into one fan with this one, resolved
+  // with the first frame once every sensor is loaded. Their frames match
+  // this one's within half an update period unless stitchWindow is set.
+  this->stitchWindow = 0.05;
+  if (_sdf->HasElement("stitchWindow"))
+    this->stitchWindow = _sdf->GetElement("stitchWindow")->Get<double>();
+  else if (this->parentSensor->UpdateRate() > 0.0)
+    this->stitchWindow = 0.5 / this->parentSensor->UpdateRate();
+  if (_sdf->HasElement("stitchCameras"))
   {
-    this->window[f] = 0.54 - 0.46 * cos(2.0*M_PI*(f+1)/this->nFreq);
-    windowSum += pow(this->window[f], 2.0);
+    sdf::ElementPtr camera =
+        _sdf->GetElement("stitchCameras")->GetElement("camera");
+    while (camera)
+    {
+      this->stitchNames.push_back(camera->Get<std::string>());
+      camera = camera->GetNextElement("camera");
+    }
   }
-  for (size_t f = 0; f < this->nFreq; f++)
-    this->window[f] = this->window[f]/sqrt(windowSum);
+  this->stitchReady = this->stitchNames.empty();
+  // The beams of a stitched fan are known once its cameras are resolved
+  if (!this->stitchReady)
+    this->nBeams = 0;
 
-  // Sonar corrector preallocation
-  this->beamCorrector = new float*[nBeams];
-  for (int i = 0; i < nBeams; i++)
-      this->beamCorrector[i] = new float[nBeams];
-  this->beamCorrectorSum = 0.0;
+  // -- Pre calculations for sonar -- //
+  // Output beam geometry: "pinhole" keeps the camera column azimuths,
+  // "uniform" spreads the beams evenly over the HFOV, otherwise a list
+  // of nBeams vendor beam angles [deg] in ascending order
+  this->beamAnglesSpec = "pinhole";
+  if (_sdf->HasElement("beamAngles"))
+    this->beamAnglesSpec = _sdf->GetElement("beamAngles")->Get<std::string>();
+  this->sonarHFOV = this->cameraHFOV;
+  if (this->stitchReady)
+    this->AcquireTables(this->sonarHFOV, false);
 
   load_connection_ =
     GazeboRosCameraUtils::OnLoad(
@@ -343,6 +823,99 @@ void NpsGazeboRosImageSonar::Load(sensors::SensorPtr _parent,
 }
 
 
+/////////////////////////////////////////////////
+void NpsGazeboRosImageSonar::AcquireTables(double _hFOV, bool _stitched)
+{
+  // Range vector, Hamming window, beam corrector and scan conversion map
+  // are shared between all sonars with the same configuration
+  NpsGazeboSonar::SonarTableKey tableKey;
+  tableKey.nBeams = this->nBeams;
+  tableKey.nFreq = this->nFreq;
+  tableKey.azimuthRaysPerBeam = this->ray_nAzimuthRays;
+  tableKey.hFOV = _hFOV;
+  tableKey.bandwidth = this->bandwidth;
+  tableKey.soundSpeed = this->soundSpeed;
+  tableKey.renderedUniform = _stitched;
+  if (this->beamAnglesSpec == "uniform")
+  {
+    for (int beam = 0; beam < this->nBeams; beam++)
+      tableKey.beamAngles.push_back(-tableKey.hFOV/2.0
+          + (beam + 0.5) * tableKey.hFOV / this->nBeams);
+  }
+  else if (this->beamAnglesSpec != "pinhole")
+  {
+    std::istringstream angles(this->beamAnglesSpec);
+    double angle;
+    while (angles >> angle)
+      tableKey.beamAngles.push_back(angle * M_PI / 180.0);
+    if (static_cast<int>(tableKey.beamAngles.size()) != this->nBeams ||
+        !std::is_sorted(tableKey.beamAngles.begin(),
+                        tableKey.beamAngles.end()))
+    {
+      ROS_WARN_STREAM("beamAngles needs " << this->nBeams
+          << " ascending angles, using pinhole beam angles");
+      tableKey.beamAngles.clear();
+    }
+  }
+  NpsGazeboSonar::SonarTableCache &tableCache =
+      NpsGazeboSonar::SonarTableCache::Instance();
+  this->tables = tableCache.Acquire(tableKey);
+  ROS_INFO_STREAM("# of Beams = " << this->nBeams);
+  // Stitched frames always run the generic kernels
+  const NpsGazeboSonar::SonarPreset *preset =
+      NpsGazeboSonar::FindPreset(this->nBeams, this->ray_nAzimuthRays);
+  if (preset && !_stitched)
+    ROS_INFO_STREAM("Specialized kernels = " << preset->model
+                    << " beam layout, " << preset->binsPerThread
+                    << " bins per thread");
+
+  // Transmit x window and matched filter, computed once so pulse
+  // compression is two multiplies per bin in the engine
+  this->waveformTransmit.clear();
+  this->matchedFilter.clear();
+  if (this->waveform.type != NpsGazeboSonar::WaveformType::FLAT)
+  {
+    const NpsGazeboSonar::WaveformStatus status =
+      NpsGazeboSonar::WaveformWeights(this->waveform, this->tables->window,
+          this->sonarFreq, this->soundSpeed / (2.0 * this->maxDistance),
+          this->waveformTransmit, this->matchedFilter);
+    if (status != NpsGazeboSonar::WaveformStatus::OK)
+      ROS_WARN_STREAM("Waveform: "
+                      << NpsGazeboSonar::WaveformStatusText(status)
+                      << (this->waveform.type ==
+                          NpsGazeboSonar::WaveformType::FILE ?
+                          " ('" + this->waveform.spectrumFile + "')" : "")
+                      << ", using a flat spectrum");
+  }
+
+  // Gain curve over the range bins of these tables
+  if (this->tvg)
+    this->gainStage.reset(new NpsGazeboSonar::SonarGainStage(
+        this->gainConfig, this->tables->rangeVector));
+
+  // Reverberation grid over the range bins and fan sectors of these
+  // tables. A diffuse cell spreads over the FFT output, whose bins gain
+  // sqrt(nFreq) in power average, scaled like the direct echo.
+  if (this->volumeReverb)
+  {
+    std::vector<float> beamWidths(this->nBeams);
+    for (int beam = 0; beam < this->nBeams; beam++)
+      beamWidths[beam] =
+          this->tables->bearingEnd[beam] - this->tables->bearingBegin[beam];
+    this->reverbConfig.elevationWidth = this->cameraVFOV;
+    this->reverbConfig.scale = sqrt(static_cast<double>(this->nFreq))
+        * this->soundSpeed / (2.0 * this->maxDistance)
+        / this->tables->beamCorrectorSum;
+    this->reverberation.reset(new NpsGazeboSonar::SonarReverberation(
+        this->reverbConfig, this->tables->rangeVector, beamWidths));
+    this->beamFirstReturn.clear();
+  }
+  ROS_INFO_STREAM("Shared sonar tables: " << tableCache.Users()
+      << " sonar(s), " << tableCache.BytesInUse() << " bytes in use, "
+      << tableCache.BytesSaved() << " bytes saved");
+}
+
+
 void NpsGazeboRosImageSonar::Advertise()
 {
   ros::AdvertiseOptions depth_image_ao =
@@ -398,6 +971,45 @@ void NpsGazeboRosImageSonar::Advertise()
   this->sonar_image_pub_ =
       this->rosnode_->advertise<sensor_msgs::Image>
       ("sonar_image", 10);
+
+  this->sonar_occupancy_pub_ =
+      this->rosnode_->advertise<std_msgs::Float64>
+      (this->sonar_occupancy_topic_name_, 10);
+
+  this->sonar_cache_pub_ =
+      this->rosnode_->advertise<std_msgs::UInt64MultiArray>
+      (this->sonar_cache_topic_name_, 10);
+
+  this->sonar_dropped_pub_ =
+      this->rosnode_->advertise<std_msgs::UInt64>
+      (this->sonar_dropped_topic_name_, 10);
+
+  if (this->refractionTable)
+  {
+    ros::SubscribeOptions sound_speed_so =
+      ros::SubscribeOptions::create<std_msgs::Float64MultiArray>(
+        this->sound_speed_topic_name_, 1,
+        boost::bind(&NpsGazeboRosImageSonar::OnSoundSpeedProfile, this, _1),
+        ros::VoidPtr(), &this->camera_queue_);
+    this->sound_speed_sub_ = this->rosnode_->subscribe(sound_speed_so);
+  }
+
+  if (this->multipath)
+    this->sonar_multipath_pub_ =
+        this->rosnode_->advertise<std_msgs::Float64MultiArray>
+        (this->sonar_multipath_topic_name_, 10);
+
+  this->sonar_detections_pub_ =
+      this->rosnode_->advertise<sensor_msgs::PointCloud2>
+      (this->sonar_detections_topic_name_, 10);
+
+  this->sonar_returns_pub_ =
+      this->rosnode_->advertise<sensor_msgs::PointCloud2>
+      (this->sonar_returns_topic_name_, 10);
+
+  this->sonar_altitude_pub_ =
+      this->rosnode_->advertise<std_msgs::Float64>
+      (this->sonar_altitude_topic_name_, 10);
 }
 
 
@@ -482,6 +1094,14 @@ void NpsGazeboRosImageSonar::OnNewDepthFrame(const float *_image,
   if (!this->initialized_ || this->height_ <=0 || this->width_ <=0)
     return;
 
+  // Stitched cameras are resolved once every sensor has been loaded
+  if (!this->stitchReady)
+  {
+    this->stitchReady = this->SetupStitching();
+    if (!this->stitchReady)
+      return;
+  }
+
   this->depth_sensor_update_time_ = this->parentSensor->LastMeasurementTime();
 
   if (this->parentSensor->IsActive())
@@ -499,9 +1119,53 @@ void NpsGazeboRosImageSonar::OnNewDepthFrame(const float *_image,
       // for use in sonar computation (published in function if needed)
       this->ComputePointCloud(_image);
 
-      // Generate sonar image data if topics have subscribers
+      // Generate sonar image data if topics have subscribers.
+      // The computation is handed to the shared executor so that several
+      // sonars run in parallel instead of on the rendering thread.
       if (this->depth_image_connect_count_ > 0)
-        this->ComputeSonarImage(_image);
+      {
+        if (this->frameInFlight)
+        {
+          this->DropFrame("previous frame still in flight");
+        }
+        else
+        {
+          // The task only reads its own copy of the frame's inputs
+          FrameInput frame;
+          frame.depth_image = this->point_cloud_image_.clone();
+          if (!this->constMu)
+          {
+            // Rendered here, aligned with the depth image of this frame
+            if (!this->materialPass)
+              this->materialPass.reset(
+                  new NpsGazeboSonar::SonarMaterialPass(this->depthCamera));
+            this->materialPass->Render(frame.material_image);
+          }
+          frame.update_time = this->depth_sensor_update_time_;
+          if (this->resultCache)
+            frame.cacheKey = this->CacheKey();
+          const ignition::math::Pose3d pose = this->depthCamera->WorldPose();
+          const ignition::math::Vector3d axis =
+              pose.Rot().RotateVector(ignition::math::Vector3d::UnitX);
+          frame.rotation = pose.Rot();
+          frame.depth = -pose.Pos().Z();
+          frame.declination =
+              -asin(std::min(std::max(axis.Z(), -1.0), 1.0));
+          if (this->stitchCameras.empty())
+          {
+            this->DispatchFrame(frame);
+          }
+          else
+          {
+            // Wait here, on the rendering thread, for the other cameras
+            if (this->framePending)
+              this->DropFrame("stitched cameras fell behind");
+            this->pendingFrame = frame;
+            this->framePending = true;
+            this->DispatchStitched();
+          }
+        }
+      }
     }
   }
   else
@@ -545,69 +1209,653 @@ void NpsGazeboRosImageSonar::OnNewImageFrame(const unsigned char *_image,
   }
 }
 
-// Most of the plugin work happens here
-void NpsGazeboRosImageSonar::ComputeSonarImage(const float *_src)
+/////////////////////////////////////////////////
+void NpsGazeboRosImageSonar::DispatchFrame(const FrameInput &_frame)
 {
-  this->lock_.lock();
-  cv::Mat depth_image = this->point_cloud_image_;
-  cv::Mat normal_image = this->ComputeNormalImage(depth_image);
-  double vFOV = this->parentSensor->DepthCamera()->VFOV().Radian();
-  double hFOV = this->parentSensor->DepthCamera()->HFOV().Radian();
+  this->frameInFlight = true;
+  if (this->batchSensors)
+    NpsGazeboSonar::SonarBatchCollector::Instance().Announce(
+        _frame.update_time.Double());
+  this->taskGroup->Run([this, _frame]()
+    {
+      this->ComputeSonarImage(_frame);
+    });
+}
+
+/////////////////////////////////////////////////
+void NpsGazeboRosImageSonar::DispatchStitched()
+{
+  if (!this->framePending)
+    return;
+
+  // The frame of each camera closest to this one's measurement time
+  const double time = this->pendingFrame.update_time.Double();
+  std::vector<std::deque<std::pair<double, std::pair<cv::Mat, cv::Mat>>>
+              ::iterator> matches;
+  for (auto &camera : this->stitchCameras)
+  {
+    auto match = camera->frames.end();
+    bool later = false;
+    for (auto it = camera->frames.begin(); it != camera->frames.end(); ++it)
+    {
+      const double offset = fabs(it->first - time);
+      if (offset <= this->stitchWindow &&
+          (match == camera->frames.end() ||
+           offset < fabs(match->first - time)))
+        match = it;
+      later = later || it->first > time + this->stitchWindow;
+    }
+    if (match == camera->frames.end())
+    {
+      // Frames arrive in order, a later one means this one never will
+      if (later)
+      {
+        this->framePending = false;
+        this->pendingFrame = FrameInput();
+        this->DropFrame("no frame of '" + camera->name + "'");
+      }
+      return;
+    }
+    matches.push_back(match);
+  }
+
+  FrameInput frame = this->pendingFrame;
+  for (size_t c = 0; c < this->stitchCameras.size(); c++)
+  {
+    frame.stitched.push_back(matches[c]->second);
+    this->stitchCameras[c]->frames.erase(
+        this->stitchCameras[c]->frames.begin(), matches[c] + 1);
+  }
+  this->framePending = false;
+  this->pendingFrame = FrameInput();
+  this->DispatchFrame(frame);
+}
+
+/////////////////////////////////////////////////
+void NpsGazeboRosImageSonar::DropFrame(const std::string &_reason)
+{
+  std_msgs::UInt64 dropped_msg;
+  dropped_msg.data = ++this->droppedFrames;
+  this->sonar_dropped_pub_.publish(dropped_msg);
+  ROS_WARN_STREAM_THROTTLE(5.0, "Sonar frame dropped (" << _reason
+                           << "), " << dropped_msg.data << " so far");
+}
+
+/////////////////////////////////////////////////
+bool NpsGazeboRosImageSonar::SetupStitching()
+{
+  // This camera is the center of the fan, the others are placed by their
+  // yaw relative to it on the same link
+  std::vector<NpsGazeboSonar::SonarCameraGeometry> geometry;
+  geometry.push_back({static_cast<int>(this->width),
+                      this->cameraHFOV, 0.0});
+  const double primaryYaw = this->parentSensor->Pose().Rot().Yaw();
+  std::vector<std::unique_ptr<StitchCamera>> cameras;
+  for (const std::string &name : this->stitchNames)
+  {
+    sensors::DepthCameraSensorPtr sensor =
+        std::dynamic_pointer_cast<sensors::DepthCameraSensor>(
+            sensors::get_sensor(name));
+    if (!sensor || !sensor->DepthCamera())
+    {
+      ROS_WARN_STREAM_THROTTLE(5.0, "Waiting for stitched depth camera '"
+                               << name << "'");
+      return false;
+    }
+    rendering::DepthCameraPtr camera = sensor->DepthCamera();
+    if (camera->ImageHeight() != this->height)
+    {
+      ROS_WARN_STREAM("Stitched camera '" << name << "' is "
+          << camera->ImageHeight() << " rows high instead of "
+          << this->height << ", ignoring it");
+      continue;
+    }
+    const double yaw = sensor->Pose().Rot().Yaw() - primaryYaw;
+    geometry.push_back({static_cast<int>(camera->ImageWidth()),
+                        camera->HFOV().Radian(),
+                        atan2(sin(yaw), cos(yaw))});
+    cameras.emplace_back(new StitchCamera());
+    cameras.back()->name = name;
+    cameras.back()->sensor = sensor;
+    cameras.back()->hFOV = camera->HFOV().Radian();
+    cameras.back()->focalLength = camera->ImageWidth()
+        / (2.0 * tan(cameras.back()->hFOV / 2.0));
+  }
+
+  // Beams keep the width of azimuthRaysPerBeam columns of this camera
+  const double fov = NpsGazeboSonar::StitchedFOV(geometry);
+  const double beamWidth = this->ray_nAzimuthRays * geometry[0].hFOV
+                           / this->width;
+  this->nBeams = std::max(1, static_cast<int>(round(fov / beamWidth)));
+  std::vector<NpsGazeboSonar::SonarColumnMap> maps =
+      NpsGazeboSonar::BuildColumnMaps(geometry, this->nBeams, fov);
+  this->primaryColumns = maps[0];
+  for (size_t c = 0; c < cameras.size(); c++)
+  {
+    StitchCamera *camera = cameras[c].get();
+    camera->columns = maps[c + 1];
+    camera->connection = camera->sensor->DepthCamera()->ConnectNewDepthFrame(
+        [this, camera](const float *_image, unsigned int, unsigned int,
+                       unsigned int, const std::string &)
+        {
+          this->OnStitchDepthFrame(camera, _image);
+        });
+    camera->sensor->SetActive(true);
+  }
+  this->stitchCameras = std::move(cameras);
+
+  this->sonarHFOV = fov;
+  this->AcquireTables(fov, true);
+  ROS_INFO_STREAM("Stitched " << this->stitchCameras.size() + 1
+      << " depth cameras into " << this->nBeams << " beams over "
+      << fov * 180.0 / M_PI << " deg");
+  return true;
+}
+
+
+/////////////////////////////////////////////////
+void NpsGazeboRosImageSonar::OnStitchDepthFrame(StitchCamera *_camera,
+                                                const float *_image)
+{
+  rendering::DepthCameraPtr camera = _camera->sensor->DepthCamera();
+  const double time = _camera->sensor->LastMeasurementTime().Double();
+  cv::Mat range;
+  NpsGazeboSonar::DepthToRange(_image, camera->ImageWidth(),
+                               camera->ImageHeight(),
+                               camera->HFOV().Radian(),
+                               this->point_cloud_cutoff_, range);
+  cv::Mat material;
+  if (!this->constMu)
+  {
+    if (!_camera->materialPass)
+      _camera->materialPass.reset(
+          new NpsGazeboSonar::SonarMaterialPass(camera));
+    _camera->materialPass->Render(material);
+  }
+
+  _camera->frames.emplace_back(time, std::make_pair(range, material));
+  while (_camera->frames.size() > 4)
+    _camera->frames.pop_front();
+  this->DispatchStitched();
+}
+
+/////////////////////////////////////////////////
+NpsGazeboSonar::SonarCacheKey NpsGazeboRosImageSonar::CacheKey()
+{
+  NpsGazeboSonar::SonarCacheKey key;
+  physics::WorldPtr world =
+      physics::get_world(this->parentSensor->WorldName());
+  if (!world)
+    return key;
+
+  const ignition::math::Pose3d pose = this->depthCamera->WorldPose();
+  key.pose = NpsGazeboSonar::HashQuantized(
+      {pose.Pos().X(), pose.Pos().Y(), pose.Pos().Z()}, 1e-3);
+  key.pose = NpsGazeboSonar::HashQuantized(
+      {pose.Rot().W(), pose.Rot().X(), pose.Rot().Y(), pose.Rot().Z()},
+      1e-4, key.pose);
+
+  // Models whose bounding sphere reaches into the fan (camera frame is
+  // x forward, y left, z up)
+  const double halfH = this->sonarHFOV / 2.0;
+  const double halfV = this->cameraVFOV / 2.0;
+  const physics::Model_V models = world->Models();
+  key.scene = NpsGazeboSonar::HashQuantized(
+      {static_cast<double>(models.size())}, 1.0);
+  for (const physics::ModelPtr &model : models)
+  {
+    const ignition::math::Box box = model->BoundingBox();
+    const double radius = box.Size().Length() / 2.0;
+    const ignition::math::Vector3d local =
+        pose.Rot().RotateVectorReverse(box.Center() - pose.Pos());
+    const double distance = local.Length();
+    if (distance - radius > this->maxDistance)
+      continue;
+    if (distance > radius)
+    {
+      const double spread = asin(radius / distance);
+      if (fabs(atan2(local.Y(), local.X())) - spread > halfH ||
+          fabs(atan2(local.Z(), std::hypot(local.X(), local.Y())))
+            - spread > halfV)
+        continue;
+    }
+    for (const physics::LinkPtr &link : model->GetLinks())
+    {
+      const ignition::math::Pose3d linkPose = link->WorldPose();
+      key.scene = NpsGazeboSonar::HashQuantized(
+          {static_cast<double>(link->GetId()), linkPose.Pos().X(),
+           linkPose.Pos().Y(), linkPose.Pos().Z()}, 1e-3, key.scene);
+      key.scene = NpsGazeboSonar::HashQuantized(
+          {linkPose.Rot().W(), linkPose.Rot().X(), linkPose.Rot().Y(),
+           linkPose.Rot().Z()}, 1e-4, key.scene);
+    }
+  }
+
+  key.config = NpsGazeboSonar::HashQuantized(
+      {static_cast<double>(this->nBeams), static_cast<double>(this->nFreq),
+       static_cast<double>(this->raySkips), this->mu, this->maxDistance,
+       static_cast<double>(
+           NpsGazeboSonar::SonarMaterialTable::Instance().Revision()),
+       static_cast<double>(this->profileRevision)}, 1e-9);
+  key.valid = true;
+  return key;
+}
+
+/////////////////////////////////////////////////
+void NpsGazeboRosImageSonar::OnSoundSpeedProfile(
+    const std_msgs::Float64MultiArrayConstPtr &_msg)
+{
+  std::unique_ptr<NpsGazeboSonar::SoundSpeedProfile> profile(
+      new NpsGazeboSonar::SoundSpeedProfile());
+  if (!NpsGazeboSonar::MakeSoundSpeedProfile(_msg->data, *profile))
+  {
+    ROS_WARN_STREAM("Sound speed profile on " << this->sound_speed_topic_name_
+                    << " needs depth and speed pairs, ignored");
+    return;
+  }
+  std::lock_guard<std::mutex> guard(this->profileMutex);
+  this->pendingProfile = std::move(profile);
+  this->profileRevision++;
+}
+
+/////////////////////////////////////////////////
+bool NpsGazeboRosImageSonar::UpdateRefraction(double _depth,
+                                              double _declination)
+{
+  // A changed profile swaps the table, traced only if no other sonar
+  // holds it already
+  std::unique_ptr<NpsGazeboSonar::SoundSpeedProfile> profile;
+  {
+    std::lock_guard<std::mutex> guard(this->profileMutex);
+    profile = std::move(this->pendingProfile);
+  }
+  if (profile && *profile != this->refractionTable->Key().profile)
+  {
+    NpsGazeboSonar::SonarRefractionKey key = this->refractionTable->Key();
+    key.profile = *profile;
+    this->refractionTable =
+        NpsGazeboSonar::SonarRefractionCache::Instance().Acquire(key);
+    this->refractionDepth = NAN;
+    if (this->debugFlag)
+      ROS_INFO_STREAM("Sound speed profile changed, "
+                      << key.profile.depth.size() << " samples");
+  }
+
+  // Slice of the sensor's depth, interpolated again when it moved by a
+  // fraction of the distance step or tilted
+  const NpsGazeboSonar::SonarRefractionKey &key = this->refractionTable->Key();
+  const double tolerance = 0.1 * key.maxDistance / (key.nDistances - 1);
+  if (!std::isnan(this->refractionDepth) &&
+      fabs(_depth - this->refractionDepth) <= tolerance &&
+      fabs(_declination - this->refractionDeclination) <= 1e-3)
+    return false;
+  this->refractionTable->Slice(_depth, this->refractionPath,
+                               this->refractionDelay);
+  this->refractionDepth = _depth;
+  this->refractionDeclination = _declination;
+  return true;
+}
+
+/////////////////////////////////////////////////
+void NpsGazeboRosImageSonar::ComputeBeams(const FrameInput &_frame)
+{
+  double vFOV = this->cameraVFOV;
+  double hFOV = this->sonarHFOV;
   double vPixelSize = vFOV / this->height;
-  double hPixelSize = hFOV / this->width;
+  double hPixelSize = this->cameraHFOV / this->width;
+  double hBeamSize = hFOV / this->nBeams;
+
+  // One view per camera, this one first, each with its own intrinsics
+  std::vector<NpsGazeboSonar::SonarView> views(1 + this->stitchCameras.size());
+  std::vector<double> focalLengths(views.size(), this->focal_length_);
+  views[0].depth_image = _frame.depth_image;
+  views[0].material_image = _frame.material_image;
+  views[0].hFOV = this->cameraHFOV;
+  if (this->stitchNames.empty())
+  {
+    views[0].columnBeam = this->tables->columnBeam.data();
+    views[0].columnSlot = this->tables->columnSlot.data();
+    views[0].columnPattern = this->tables->azimuthBeamPattern.data();
+    views[0].nSlots = this->ray_nAzimuthRays;
+  }
+  else
+  {
+    views[0].columnBeam = this->primaryColumns.beam.data();
+    views[0].columnSlot = this->primaryColumns.slot.data();
+    views[0].columnPattern = this->primaryColumns.pattern.data();
+    views[0].nSlots = this->primaryColumns.nSlots;
 
-  // rand number generator
-  cv::Mat rand_image = cv::Mat(depth_image.rows, depth_image.cols, CV_32FC2);
-  uint64 randN = static_cast<uint64>(std::rand());
-  cv::theRNG().state = randN;
-  cv::RNG rng = cv::theRNG();
-  rng.fill(rand_image, cv::RNG::NORMAL, 0.f, 1.f);
+    // Frames of the other cameras matched on the rendering thread
+    for (size_t c = 0; c < this->stitchCameras.size(); c++)
+    {
+      StitchCamera &camera = *this->stitchCameras[c];
+      NpsGazeboSonar::SonarView &view = views[c + 1];
+      view.depth_image = _frame.stitched[c].first;
+      view.material_image = _frame.stitched[c].second;
+      view.hFOV = camera.hFOV;
+      view.columnBeam = camera.columns.beam.data();
+      view.columnSlot = camera.columns.slot.data();
+      view.columnPattern = camera.columns.pattern.data();
+      view.nSlots = camera.columns.nSlots;
+      focalLengths[c + 1] = camera.focalLength;
+    }
+  }
 
-  if (this->beamCorrectorSum == 0)
-    ComputeCorrector();
+  // Normal image and random image stages of every view run in parallel
+  // (incremental and cached sonars apply speckle to the time samples of
+  // the result instead of drawing a random image)
+  uint64 randN = static_cast<uint64>(std::rand());
+  const bool rayNoise = !this->tileTracker && !this->resultCache;
+  if (this->tiledProcessing)
+  {
+    // Row bands of every view sized to stay in cache from the depth read
+    // to the normal and noise writes: view, first and last row
+    std::vector<cv::Vec3i> bands;
+    for (int v = 0; v < static_cast<int>(views.size()); v++)
+    {
+      NpsGazeboSonar::SonarView &view = views[v];
+      const int rows = view.depth_image.rows;
+      const int cols = view.depth_image.cols;
+      view.normal_image = cv::Mat(rows, cols, CV_32FC3);
+      if (rayNoise)
+        view.rand_image = cv::Mat(rows, cols, CV_32FC2);
+      const int bandRows =
+          NpsGazeboSonar::BandRows(cols, this->tileCacheBytes);
+      for (int first = 0; first < rows; first += bandRows)
+        bands.push_back(cv::Vec3i(v, first, std::min(first + bandRows, rows)));
+    }
+    this->taskGroup->ParallelFor(static_cast<int>(bands.size()), 1,
+      [&](int begin, int end)
+      {
+        for (int b = begin; b < end; b++)
+        {
+          NpsGazeboSonar::SonarView &view = views[bands[b][0]];
+          NpsGazeboSonar::ComputeNormalBand(view.depth_image, bands[b][1],
+              bands[b][2], focalLengths[bands[b][0]], view.normal_image);
+          if (rayNoise)
+          {
+            cv::Mat rand_band =
+                view.rand_image.rowRange(bands[b][1], bands[b][2]);
+            cv::RNG rng(randN + b);
+            rng.fill(rand_band, cv::RNG::NORMAL, 0.f, 1.f);
+          }
+        }
+      });
+  }
+  else
+  {
+    this->taskGroup->ParallelFor(2 * static_cast<int>(views.size()), 1,
+      [&](int stage, int)
+      {
+        NpsGazeboSonar::SonarView &view = views[stage / 2];
+        if (stage % 2 == 0)
+        {
+          view.normal_image = this->ComputeNormalImage(view.depth_image,
+                                                       focalLengths[stage / 2]);
+        }
+        else if (rayNoise)
+        {
+          // rand number generator
+          view.rand_image = cv::Mat(view.depth_image.rows,
+                                    view.depth_image.cols, CV_32FC2);
+          cv::RNG rng(randN + stage / 2);
+          rng.fill(view.rand_image, cv::RNG::NORMAL, 0.f, 1.f);
+        }
+      });
+  }
+  cv::Mat normal_image = views[0].normal_image;
 
   // For calc time measure
   auto start = std::chrono::high_resolution_clock::now();
   // ------------------------------------------------//
   // --------      Sonar calculations       -------- //
   // ------------------------------------------------//
-  CArray2D P_Beams = NpsGazeboSonar::sonar_calculation_wrapper(
-                  depth_image,   // cv::Mat& depth_image
-                  normal_image,  // cv::Mat& normal_image
-                  rand_image,    // cv::Mat& rand_image
-                  hPixelSize,    // hPixelSize
-                  vPixelSize,    // vPixelSize
-                  hFOV,          // hFOV
-                  vFOV,          // VFOV
-                  hPixelSize,    // _beam_azimuthAngleWidth
-                  vPixelSize,    // _beam_elevationAngleWidth
-                  hPixelSize,    // _ray_azimuthAngleWidth
-                  vPixelSize*(raySkips),  // _ray_elevationAngleWidth
-                  this->soundSpeed,    // _soundSpeed
-                  this->maxDistance,   // _maxDistance
-                  this->sourceLevel,   // _sourceLevel
-                  this->nBeams,        // _nBeams
-                  this->nRays,         // _nRays
-                  this->raySkips,      // _raySkips
-                  this->sonarFreq,     // _sonarFreq
-                  this->bandwidth,     // _bandwidth
-                  this->nFreq,         // _nFreq
-                  this->mu,            // _mu
-                  this->attenuation,   // _attenuation
-                  this->window,        // _window
-                  this->beamCorrector,      // _beamCorrector
-                  this->beamCorrectorSum,   // _beamCorrectorSum
-                  this->debugFlag);
+  NpsGazeboSonar::SonarFrame frame;
+  frame.views = views;
+  NpsGazeboSonar::SonarCalculationConfig &config = frame.config;
+  config.hPixelSize = hPixelSize;
+  config.vPixelSize = vPixelSize;
+  config.hFOV = hFOV;
+  config.vFOV = vFOV;
+  config.beam_azimuthAngleWidth = hBeamSize;
+  config.beam_elevationAngleWidth = vPixelSize;
+  config.ray_azimuthAngleWidth = hPixelSize;
+  config.ray_elevationAngleWidth = vPixelSize*(raySkips);
+  config.soundSpeed = this->soundSpeed;
+  config.minDistance = this->point_cloud_cutoff_;
+  config.maxDistance = this->maxDistance;
+  config.sourceLevel = this->sourceLevel;
+  config.nBeams = this->nBeams;
+  config.nRays = this->nRays;
+  config.raySkips = this->raySkips;
+  // Rows chosen from the previous frame's ranges and the frame seed
+  std::vector<float> rowWeight;
+  config.rowWeight = nullptr;
+  if (this->rayLOD)
+  {
+    this->rayLOD->Sample(randN, rowWeight);
+    config.rowWeight = rowWeight.data();
+  }
+  config.sonarFreq = this->sonarFreq;
+  config.bandwidth = this->bandwidth;
+  config.nFreq = this->nFreq;
+  config.mu = this->mu;
+  config.debugFlag = this->debugFlag;
+  config.phaseSeed = static_cast<unsigned int>(randN);
+  config.precision = this->precision;
+  config.reflectivity = nullptr;
+  config.nMaterials = 0;
+  if (!_frame.material_image.empty())
+  {
+    // Copied per frame (256 floats) so spawns never race the engine
+    NpsGazeboSonar::SonarMaterialTable::Instance().SqrtReflectivity(
+        this->mu, this->reflectivityTable);
+    config.reflectivity = this->reflectivityTable.data();
+    config.nMaterials = this->reflectivityTable.size();
+  }
+  config.attenuation = this->attenuationTable.data();
+  config.window = this->tables->window.data();
+  config.beamCorrector = this->tables->beamCorrector.data();
+  config.beamCorrectorSum = this->tables->beamCorrectorSum;
+  config.transmit = this->waveformTransmit.empty() ?
+      nullptr : this->waveformTransmit.data();
+  config.matchedFilter = this->matchedFilter.empty() ?
+      nullptr : this->matchedFilter.data();
+  bool refracted = false;
+  if (this->refractionTable)
+  {
+    refracted = this->UpdateRefraction(_frame.depth, _frame.declination);
+    const NpsGazeboSonar::SonarRefractionKey &key =
+        this->refractionTable->Key();
+    config.refraction.path = this->refractionPath.data();
+    config.refraction.delay = this->refractionDelay.data();
+    config.refraction.nElevations = key.nElevations;
+    config.refraction.nDistances = key.nDistances;
+    config.refraction.minElevation = key.minElevation;
+    config.refraction.maxElevation = key.maxElevation;
+    config.refraction.maxDistance = key.maxDistance;
+    config.refraction.declination = this->refractionDeclination;
+  }
+  config.multipath = this->multipath;
+  config.multipathSteps = this->multipathSteps;
+  config.multipathThickness = this->multipathThickness;
+  config.multipathLoss = this->multipathLoss;
+  config.firstReturns = this->reverberation != nullptr;
+
+  // Incremental update: only tiles that changed since the last frame are
+  // recomputed, speckle is drawn per sample when the frame is published
+  if (this->tileTracker)
+  {
+    // Previous rays of unchanged tiles were bent differently
+    if (refracted)
+      this->tileTracker->Invalidate();
+    if (!_frame.material_image.empty())
+    {
+      const uint64_t revision =
+          NpsGazeboSonar::SonarMaterialTable::Instance().Revision();
+      if (revision != this->materialRevision)
+      {
+        this->materialRevision = revision;
+        this->tileTracker->Invalidate();
+      }
+    }
+    frame.incremental = this->incrementalState;
+    frame.tileSize = this->tileTracker->TileSize();
+    frame.fullRefresh = this->tileTracker->Update(frame.views);
+    if (this->debugFlag)
+      ROS_INFO_STREAM("Sonar tiles recomputed: "
+                      << this->tileTracker->ChangedFraction()
+                      << (frame.fullRefresh ? " (full refresh)" : ""));
+  }
+
+  frame.tiled = this->tiledProcessing;
+  frame.countRayBytes = this->debugFlag;
+
+  // The frame is finished here, or by the thread that completes its batch
+  std::vector<cv::Mat> ranges;
+  for (const NpsGazeboSonar::SonarView &view : views)
+    ranges.push_back(view.depth_image);
+  auto done = [this, _frame, normal_image, ranges, start](
+                  NpsGazeboSonar::SonarResult _result)
+    {
+      this->OnBeams(_frame, normal_image, ranges, start, _result);
+    };
+  if (this->batchSensors)
+    NpsGazeboSonar::SonarBatchCollector::Instance().Submit(
+        frame, _frame.update_time.Double(), done);
+  else
+    done(NpsGazeboSonar::sonar_calculation_wrapper(frame));
+}
+
+
+/////////////////////////////////////////////////
+void NpsGazeboRosImageSonar::OnBeams(const FrameInput &_frame,
+    cv::Mat _normal_image, const std::vector<cv::Mat> &_ranges,
+    std::chrono::high_resolution_clock::time_point _start,
+    NpsGazeboSonar::SonarResult &_result)
+{
+  // Level of detail of the next frame from this frame's ranges
+  if (this->rayLOD)
+    this->rayLOD->Update(_ranges);
+
+  // Fraction of rays with a return inside the range window
+  std_msgs::Float64 occupancy_msg;
+  occupancy_msg.data = _result.Occupancy();
+  this->sonar_occupancy_pub_.publish(occupancy_msg);
+
+  // Added cost of the second bounce: secondary hits, march steps and
+  // device time [ms]
+  if (this->multipath)
+  {
+    std_msgs::Float64MultiArray multipath_msg;
+    multipath_msg.data.push_back(_result.multipathRays);
+    multipath_msg.data.push_back(
+        static_cast<double>(_result.multipathSteps));
+    multipath_msg.data.push_back(_result.multipathTime);
+    this->sonar_multipath_pub_.publish(multipath_msg);
+  }
 
   // For calc time measure
   auto stop = std::chrono::high_resolution_clock::now();
   auto duration = std::chrono::duration_cast<
-                  std::chrono::microseconds>(stop - start);
+                  std::chrono::microseconds>(stop - _start);
   if (debugFlag)
   {
     ROS_INFO_STREAM("GPU Sonar Frame Calc Time " <<
                     duration.count()/10000 << "/100 [s]\n");
+    ROS_INFO_STREAM("Sonar ray occupancy " << _result.validRays << "/"
+                    << _result.totalRays << " (" << _result.Occupancy()
+                    << ")");
+    ROS_INFO_STREAM("Sonar ray traffic [MB] " << _result.rayBytes / 1e6
+                    << (this->tiledProcessing ? " (tiled)" : ""));
+    if (this->multipath)
+      ROS_INFO_STREAM("Sonar multipath " << _result.multipathRays
+                      << " secondary hits, " << _result.multipathSteps
+                      << " march steps, " << _result.multipathTime << " ms");
+  }
+
+  // Kept across cached frames, the scene has not moved
+  if (!_result.firstReturn.empty())
+    this->beamFirstReturn = std::move(_result.firstReturn);
+
+  if (this->resultCache)
+  {
+    this->resultCache->Store(_frame.cacheKey, _result.beams);
+    this->cachedNormalImage = _normal_image;
+  }
+  this->PublishSonarImage(_frame, _result.beams, _normal_image, false);
+}
+
+
+// Most of the plugin work happens here
+// Runs on the executor with the frame's own copy of its inputs. Plugin
+// state written here and up to PublishSonarImage (caches, level of detail,
+// logs) is only touched by this sonar's single in-flight frame, and
+// messages are local, so the camera lock is not held during the
+// computation.
+void NpsGazeboRosImageSonar::ComputeSonarImage(const FrameInput &_frame)
+{
+  // Noise free spectra of the previous frame while nothing has moved
+  CArray2D beams;
+  if (this->resultCache && this->resultCache->Lookup(_frame.cacheKey, beams))
+  {
+    if (this->batchSensors)
+      NpsGazeboSonar::SonarBatchCollector::Instance().Withdraw(
+          _frame.update_time.Double());
+    this->PublishSonarImage(_frame, beams, this->cachedNormalImage, true);
+    return;
+  }
+
+  this->ComputeBeams(_frame);
+}
+
+
+/////////////////////////////////////////////////
+void NpsGazeboRosImageSonar::PublishSonarImage(const FrameInput &_frame,
+                                               CArray2D &beams,
+                                               cv::Mat normal_image,
+                                               bool cached)
+{
+  const common::Time &update_time = _frame.update_time;
+  double hBeamSize = this->sonarHFOV / this->nBeams;
+  cv::Mat depth_image = _frame.depth_image;
+
+  // Incremental and cached results are noise free (rays at fixed random
+  // phases, the power of the noisy rays), fresh speckle on every time
+  // sample of the beams
+  if (this->resultCache || this->tileTracker)
+  {
+    cv::RNG rng(static_cast<uint64>(std::rand()));
+    const float scale = 1.0 / sqrt(2.0);
+    for (size_t beam = 0; beam < beams.size(); beam++)
+      for (size_t f = 0; f < beams[beam].size(); f++)
+        beams[beam][f] *= Complex(rng.gaussian(1.0) * scale,
+                                  rng.gaussian(1.0) * scale);
+  }
+
+  if (this->resultCache)
+  {
+    std_msgs::UInt64MultiArray cache_msg;
+    cache_msg.data.push_back(this->resultCache->Hits());
+    cache_msg.data.push_back(this->resultCache->Misses());
+    this->sonar_cache_pub_.publish(cache_msg);
+    if (this->debugFlag)
+      ROS_INFO_STREAM("Sonar result cache " << (cached ? "hit" : "miss")
+          << ", hits " << cache_msg.data[0] << ", misses "
+          << cache_msg.data[1]);
   }
+  // Water column reverberation, drawn fresh every frame and shadowed by
+  // each beam's first hard return
+  if (this->reverberation)
+  {
+    this->reverberation->Update(_frame.depth, _frame.declination);
+    for (size_t beam = 0; beam < beams.size(); beam++)
+      this->reverberation->Apply(beam, &beams[beam][0],
+          beam < this->beamFirstReturn.size() ?
+              this->beamFirstReturn[beam] : this->maxDistance,
+          this->generator);
+  }
+  const CArray2D &P_Beams = beams;
 
   // CSV log write stream
   // Each cols corresponds to each beams
@@ -617,7 +1865,7 @@ void NpsGazeboRosImageSonar::ComputeSonarImage(const float *_src)
     if (this->writeCounter == 1
         ||this->writeCounter % this->writeInterval == 0)
     {
-      double time = this->parentSensor_->LastMeasurementTime().Double();
+      double time = update_time.Double();
       std::stringstream filename;
       filename << "/tmp/SonarRawData_" << std::setw(6) <<  std::setfill('0')
                << this->writeNumber << ".csv";
@@ -630,7 +1878,7 @@ void NpsGazeboRosImageSonar::ComputeSonarImage(const float *_src)
       for (size_t i = 0; i < P_Beams[0].size(); i++)
       {
         // writing range vector at first column
-        writeLog << this->rangeVector[i];
+        writeLog << this->tables->rangeVector[i];
         for (size_t b = 0; b < nBeams; b ++)
         {
           if (P_Beams[b][i].imag() > 0)
@@ -649,51 +1897,95 @@ void NpsGazeboRosImageSonar::ComputeSonarImage(const float *_src)
   }
 
   // Sonar image ROS msg
-  this->sonar_image_raw_msg_.header.frame_id
+  acoustic_msgs::SonarImage sonar_image_raw_msg;
+  sonar_image_raw_msg.header.frame_id
         = this->frame_name_.c_str();
-  this->sonar_image_raw_msg_.header.stamp.sec
-        = this->depth_sensor_update_time_.sec;
-  this->sonar_image_raw_msg_.header.stamp.nsec
-        = this->depth_sensor_update_time_.nsec;
-  this->sonar_image_raw_msg_.frequency = this->sonarFreq;
-  this->sonar_image_raw_msg_.sound_speed = this->soundSpeed;
-  this->sonar_image_raw_msg_.azimuth_beamwidth = hPixelSize;
-  this->sonar_image_raw_msg_.elevation_beamwidth = hPixelSize*this->nRays;
-  std::vector<float> azimuth_angles;
-  double fl = static_cast<double>(width) / (2.0 * tan(hFOV/2.0));
-  for (size_t beam = 0; beam < nBeams; beam ++)
-    azimuth_angles.push_back(atan2(static_cast<double>(beam) -
-                    0.5 * static_cast<double>(width-1), fl));
-  this->sonar_image_raw_msg_.azimuth_angles = azimuth_angles;
+  sonar_image_raw_msg.header.stamp.sec
+        = update_time.sec;
+  sonar_image_raw_msg.header.stamp.nsec
+        = update_time.nsec;
+  sonar_image_raw_msg.frequency = this->sonarFreq;
+  sonar_image_raw_msg.sound_speed = this->soundSpeed;
+  sonar_image_raw_msg.azimuth_beamwidth = hBeamSize;
+  // Every beam spans the vertical field of view of the camera
+  sonar_image_raw_msg.elevation_beamwidth = this->cameraVFOV;
+  const std::vector<float> &azimuth_angles = this->tables->azimuthAngles;
+  sonar_image_raw_msg.azimuth_angles = azimuth_angles;
   // std::vector<float> elevation_angles;
   // elevation_angles.push_back(vFOV / 2.0);  // 1D in elevation
-  // this->sonar_image_raw_msg_.elevation_angles = elevation_angles;
-  std::vector<float> ranges;
-  for (size_t i = 0; i < P_Beams[0].size(); i ++)
-    ranges.push_back(rangeVector[i]);
-  this->sonar_image_raw_msg_.ranges = ranges;
+  // sonar_image_raw_msg.elevation_angles = elevation_angles;
+  const std::vector<float> &ranges = this->tables->rangeVector;
+  sonar_image_raw_msg.ranges = ranges;
+
+  // sonar_image_raw_msg.is_bigendian = false;
+  sonar_image_raw_msg.data_size = 1;  // sizeof(float) * nFreq * nBeams;
+  // Echo amplitudes, computed in beam tiles. The bottom detector reads
+  // each beam's amplitudes and the gain stage finds its peak in the same
+  // pass.
+  const int tile = 32;
+  std::vector<float> amplitudes(nBeams * nFreq);
+  std::vector<float> tilePeaks((nBeams + tile - 1) / tile, 0.0f);
+  std::vector<NpsGazeboSonar::SonarReturn> returns(nBeams);
+  std::vector<unsigned char> hasReturn(nBeams, 0);
+  const float rangeResolution = ranges.size() > 1 ? ranges[1] - ranges[0] : 0;
+  this->taskGroup->ParallelFor(nBeams, tile, [&](int begin, int end)
+    {
+      for (int beam = begin; beam < end; beam ++)
+      {
+        float *amplitude = &amplitudes[beam * nFreq];
+        for (int f = 0; f < nFreq; f ++)
+          amplitude[f] = abs(P_Beams[beam][f]);
+        if (this->bottomDetector)
+          hasReturn[beam] = this->bottomDetector->Detect(beam,
+              amplitude, nFreq, rangeResolution, returns[beam]);
+      }
+      if (this->gainStage)
+        tilePeaks[begin / tile] = this->gainStage->Peak(
+            &amplitudes[begin * nFreq], end - begin);
+    });
+
+  // Raw message intensities and plot data: the amplitude itself, or its
+  // time varying gain compensated and compressed level
+  std::vector<float> levels;
+  const float *level = amplitudes.data();
+  float ceiling = this->gainCeiling;
+  if (this->gainStage)
+  {
+    if (ceiling <= 0.0f)
+      ceiling = *std::max_element(tilePeaks.begin(), tilePeaks.end());
+    levels.resize(nBeams * nFreq);
+    level = levels.data();
+  }
+  std::vector<uchar> intensities(nFreq * nBeams);
+  std::vector<int> Intensity(nBeams * nFreq);
+  this->taskGroup->ParallelFor(nBeams, tile, [&](int begin, int end)
+    {
+      if (this->gainStage)
+        this->gainStage->Apply(&amplitudes[begin * nFreq], end - begin,
+                               ceiling, &levels[begin * nFreq]);
+      for (int beam = begin; beam < end; beam ++)
+      {
+        for (int f = 0; f < nFreq; f ++)
+        {
+          const int value = static_cast<int>(level[beam * nFreq + f]);
+          Intensity[beam * nFreq + f] = value;
+          intensities[f * nBeams + beam] = static_cast<uchar>(value);
+        }
+      }
+    });
+  sonar_image_raw_msg.intensities = intensities;
 
-  // this->sonar_image_raw_msg_.is_bigendian = false;
-  this->sonar_image_raw_msg_.data_size = 1;  // sizeof(float) * nFreq * nBeams;
-  std::vector<uchar> intensities;
-  for (size_t f = 0; f < nFreq; f ++)
-    for (size_t beam = 0; beam < nBeams; beam ++)
-      intensities.push_back(
-          static_cast<uchar>(static_cast<int>(abs(P_Beams[beam][f]))));
-  this->sonar_image_raw_msg_.intensities = intensities;
+  this->sonar_image_raw_pub_.publish(sonar_image_raw_msg);
 
-  this->sonar_image_raw_pub_.publish(this->sonar_image_raw_msg_);
+  if (this->bottomDetector)
+    this->PublishReturns(returns, hasReturn, _frame);
 
+  if (this->cfar)
+    this->PublishDetections(P_Beams, update_time);
 
   // Construct visual sonar image for rqt plot in sensor::image msg format
   cv_bridge::CvImage img_bridge;
 
-  // Calculate and allocate plot data
-  int Intensity[nBeams][nFreq];
-  for (size_t beam = 0; beam < nBeams; beam ++)
-    for (size_t f = 0; f < nFreq; f ++)
-        Intensity[beam][f] = static_cast<int>(abs(P_Beams[beam][f]));
-
   // Generate image of 16UC1
   cv::Mat Intensity_image = cv::Mat::zeros(cv::Size(nBeams, nFreq), CV_16UC1);
 
@@ -705,39 +1997,6 @@ void NpsGazeboRosImageSonar::ComputeSonarImage(const float *_src)
                          Intensity_image.size().height);
   const float binThickness = 2 * ceil(radius / nEffectiveRanges);
 
-  struct BearingEntry
-  {
-    float begin, center, end;
-    BearingEntry(float b, float c, float e)
-      : begin(b), center(c), end(e)
-        {;}
-  };
-
-  std::vector<BearingEntry> angles;
-  angles.reserve(nBeams);
-
-  for ( int b = 0; b < nBeams; ++b )
-  {
-    const float center = azimuth_angles[b];
-    float begin = 0.0, end = 0.0;
-    if (b == 0)
-    {
-      end = (azimuth_angles[b + 1] + center) / 2.0;
-      begin = 2 * center - end;
-    }
-    else if (b == nBeams - 1)
-    {
-      begin = angles[b - 1].end;
-      end = 2 * center - begin;
-    }
-    else
-    {
-      begin = angles[b - 1].end;
-      end = (azimuth_angles[b + 1] + center) / 2.0;
-    }
-    angles.push_back(BearingEntry(begin, center, end));
-  }
-
   const float ThetaShift = 1.5*M_PI;
   for ( int r = 0; r < ranges.size(); ++r )
   {
@@ -745,68 +2004,223 @@ void NpsGazeboRosImageSonar::ComputeSonarImage(const float *_src)
     for ( int b = 0; b < nBeams; ++b )
     {
       const float range = ranges[r];
-      const int intensity = Intensity[b][r];
-      const float begin = angles[b].begin + ThetaShift,
-                  end = angles[b].end + ThetaShift;
+      const int intensity = Intensity[b * nFreq + r];
+      const float begin = this->tables->bearingBegin[b] + ThetaShift,
+                  end = this->tables->bearingEnd[b] + ThetaShift;
       const float rad = static_cast<float>(radius) * range/rangeMax;
       // Assume angles are in image frame x-right, y-down
+      // Compressed levels span 0-255, spread them over 16 bits
       cv::ellipse(Intensity_image, origin, cv::Size(rad, rad), 0,
                   begin * 180/M_PI, end * 180/M_PI,
-                  intensity*256/5*this->plotScaler,
+                  this->gainStage ? intensity*256 :
+                                    intensity*256/5*this->plotScaler,
                   binThickness);
     }
   }
 
   // Publish final sonar image
-  this->sonar_image_msg_.header.frame_id
+  sensor_msgs::Image sonar_image_msg;
+  sonar_image_msg.header.frame_id
         = this->frame_name_;
-  this->sonar_image_msg_.header.stamp.sec
-        = this->depth_sensor_update_time_.sec;
-  this->sonar_image_msg_.header.stamp.nsec
-        = this->depth_sensor_update_time_.nsec;
-  img_bridge = cv_bridge::CvImage(this->sonar_image_msg_.header,
+  sonar_image_msg.header.stamp.sec
+        = update_time.sec;
+  sonar_image_msg.header.stamp.nsec
+        = update_time.nsec;
+  img_bridge = cv_bridge::CvImage(sonar_image_msg.header,
                                   sensor_msgs::image_encodings::MONO16,
                                   Intensity_image);
   // from cv_bridge to sensor_msgs::Image
-  img_bridge.toImageMsg(this->sonar_image_msg_);
+  img_bridge.toImageMsg(sonar_image_msg);
 
-  this->sonar_image_pub_.publish(this->sonar_image_msg_);
+  this->sonar_image_pub_.publish(sonar_image_msg);
 
   // ---------------------------------------- End of sonar calculation
 
 
   // Still publishing the depth and normal image (just because)
   // Depth image
-  this->depth_image_msg_.header.frame_id
+  sensor_msgs::Image depth_image_msg;
+  depth_image_msg.header.frame_id
         = this->frame_name_;
-  this->depth_image_msg_.header.stamp.sec
-        = this->depth_sensor_update_time_.sec;
-  this->depth_image_msg_.header.stamp.nsec
-        = this->depth_sensor_update_time_.nsec;
-  img_bridge = cv_bridge::CvImage(this->depth_image_msg_.header,
+  depth_image_msg.header.stamp.sec
+        = update_time.sec;
+  depth_image_msg.header.stamp.nsec
+        = update_time.nsec;
+  img_bridge = cv_bridge::CvImage(depth_image_msg.header,
                                   sensor_msgs::image_encodings::TYPE_32FC1,
                                   depth_image);
   // from cv_bridge to sensor_msgs::Image
-  img_bridge.toImageMsg(this->depth_image_msg_);
-  this->depth_image_pub_.publish(this->depth_image_msg_);
+  img_bridge.toImageMsg(depth_image_msg);
+  this->depth_image_pub_.publish(depth_image_msg);
 
   // Normal image
-  this->normal_image_msg_.header.frame_id
+  sensor_msgs::Image normal_image_msg;
+  normal_image_msg.header.frame_id
         = this->frame_name_;
-  this->normal_image_msg_.header.stamp.sec
-        = this->depth_sensor_update_time_.sec;
-  this->normal_image_msg_.header.stamp.nsec
-        = this->depth_sensor_update_time_.nsec;
+  normal_image_msg.header.stamp.sec
+        = update_time.sec;
+  normal_image_msg.header.stamp.nsec
+        = update_time.nsec;
   cv::Mat normal_image8;
   normal_image.convertTo(normal_image8, CV_8UC3, 255.0);
-  img_bridge = cv_bridge::CvImage(this->normal_image_msg_.header,
+  img_bridge = cv_bridge::CvImage(normal_image_msg.header,
                                   sensor_msgs::image_encodings::RGB8,
                                   normal_image8);
-  img_bridge.toImageMsg(this->normal_image_msg_);
+  img_bridge.toImageMsg(normal_image_msg);
   // from cv_bridge to sensor_msgs::Image
-  this->normal_image_pub_.publish(this->normal_image_msg_);
+  this->normal_image_pub_.publish(normal_image_msg);
 
-  this->lock_.unlock();
+  // The next frame of this sonar may start
+  this->frameInFlight = false;
+}
+
+
+void NpsGazeboRosImageSonar::PublishDetections(const CArray2D &_beams,
+                                               common::Time _update_time)
+{
+  // Beams are detected in tiles, each tile appends to its own list
+  const int tile = 32;
+  const int nTiles = (nBeams + tile - 1) / tile;
+  std::vector<std::vector<NpsGazeboSonar::SonarDetection>> tileDetections(
+      nTiles);
+  this->taskGroup->ParallelFor(nBeams, tile, [&](int begin, int end)
+    {
+      std::vector<float> power(nFreq);
+      std::vector<NpsGazeboSonar::SonarDetection> &detections =
+          tileDetections[begin / tile];
+      for (int beam = begin; beam < end; beam++)
+      {
+        for (int f = 0; f < nFreq; f++)
+          power[f] = std::norm(_beams[beam][f]);
+        this->cfar->Detect(beam, power.data(), nFreq,
+                           this->tables->rangeVector.data(), detections);
+      }
+    });
+
+  size_t nDetections = 0;
+  for (const auto &detections : tileDetections)
+    nDetections += detections.size();
+
+  sensor_msgs::PointCloud2 detections_msg;
+  detections_msg.header.frame_id = this->frame_name_;
+  detections_msg.header.stamp.sec = _update_time.sec;
+  detections_msg.header.stamp.nsec = _update_time.nsec;
+  detections_msg.height = 1;
+  detections_msg.is_dense = true;
+  sensor_msgs::PointCloud2Modifier modifier(detections_msg);
+  modifier.setPointCloud2Fields(7,
+      "x", 1, sensor_msgs::PointField::FLOAT32,
+      "y", 1, sensor_msgs::PointField::FLOAT32,
+      "z", 1, sensor_msgs::PointField::FLOAT32,
+      "beam", 1, sensor_msgs::PointField::FLOAT32,
+      "range", 1, sensor_msgs::PointField::FLOAT32,
+      "intensity", 1, sensor_msgs::PointField::FLOAT32,
+      "snr", 1, sensor_msgs::PointField::FLOAT32);
+  modifier.resize(nDetections);
+
+  sensor_msgs::PointCloud2Iterator<float> iter_x(detections_msg, "x");
+  sensor_msgs::PointCloud2Iterator<float> iter_y(detections_msg, "y");
+  sensor_msgs::PointCloud2Iterator<float> iter_z(detections_msg, "z");
+  sensor_msgs::PointCloud2Iterator<float> iter_beam(detections_msg, "beam");
+  sensor_msgs::PointCloud2Iterator<float> iter_range(detections_msg, "range");
+  sensor_msgs::PointCloud2Iterator<float> iter_intensity(detections_msg,
+                                                         "intensity");
+  sensor_msgs::PointCloud2Iterator<float> iter_snr(detections_msg, "snr");
+  for (const auto &detections : tileDetections)
+  {
+    for (const NpsGazeboSonar::SonarDetection &detection : detections)
+    {
+      // Optical frame, z forward and x right, in the plane of the fan
+      const float azimuth = this->tables->azimuthAngles[detection.beam];
+      *iter_x = detection.range * sin(azimuth);
+      *iter_y = 0.0;
+      *iter_z = detection.range * cos(azimuth);
+      *iter_beam = detection.beam;
+      *iter_range = detection.range;
+      *iter_intensity = detection.intensity;
+      *iter_snr = detection.snr;
+      ++iter_x; ++iter_y; ++iter_z; ++iter_beam; ++iter_range;
+      ++iter_intensity; ++iter_snr;
+    }
+  }
+  this->sonar_detections_pub_.publish(detections_msg);
+
+  if (this->debugFlag)
+    ROS_INFO_STREAM("CFAR detections " << nDetections << " of "
+                    << nBeams * nFreq << " bins");
+}
+
+
+void NpsGazeboRosImageSonar::PublishReturns(
+    const std::vector<NpsGazeboSonar::SonarReturn> &_returns,
+    const std::vector<unsigned char> &_hasReturn,
+    const FrameInput &_frame)
+{
+  const size_t nReturns =
+      std::count(_hasReturn.begin(), _hasReturn.end(), 1);
+
+  sensor_msgs::PointCloud2 returns_msg;
+  returns_msg.header.frame_id = this->frame_name_;
+  returns_msg.header.stamp.sec = _frame.update_time.sec;
+  returns_msg.header.stamp.nsec = _frame.update_time.nsec;
+  returns_msg.height = 1;
+  returns_msg.is_dense = true;
+  sensor_msgs::PointCloud2Modifier modifier(returns_msg);
+  modifier.setPointCloud2Fields(6,
+      "x", 1, sensor_msgs::PointField::FLOAT32,
+      "y", 1, sensor_msgs::PointField::FLOAT32,
+      "z", 1, sensor_msgs::PointField::FLOAT32,
+      "beam", 1, sensor_msgs::PointField::FLOAT32,
+      "range", 1, sensor_msgs::PointField::FLOAT32,
+      "intensity", 1, sensor_msgs::PointField::FLOAT32);
+  modifier.resize(nReturns);
+
+  sensor_msgs::PointCloud2Iterator<float> iter_x(returns_msg, "x");
+  sensor_msgs::PointCloud2Iterator<float> iter_y(returns_msg, "y");
+  sensor_msgs::PointCloud2Iterator<float> iter_z(returns_msg, "z");
+  sensor_msgs::PointCloud2Iterator<float> iter_beam(returns_msg, "beam");
+  sensor_msgs::PointCloud2Iterator<float> iter_range(returns_msg, "range");
+  sensor_msgs::PointCloud2Iterator<float> iter_intensity(returns_msg,
+                                                         "intensity");
+
+  // The beam pointing closest to nadir gives the altitude
+  double altitude = std::numeric_limits<double>::quiet_NaN();
+  double nadirCosine = 0.0;
+  for (int beam = 0; beam < nBeams; beam++)
+  {
+    if (!_hasReturn[beam])
+      continue;
+    const NpsGazeboSonar::SonarReturn &ret = _returns[beam];
+    // Optical frame, z forward and x right, in the plane of the fan
+    const float azimuth = this->tables->azimuthAngles[beam];
+    *iter_x = ret.range * sin(azimuth);
+    *iter_y = 0.0;
+    *iter_z = ret.range * cos(azimuth);
+    *iter_beam = beam;
+    *iter_range = ret.range;
+    *iter_intensity = ret.intensity;
+    ++iter_x; ++iter_y; ++iter_z; ++iter_beam; ++iter_range;
+    ++iter_intensity;
+
+    // Beam direction in the world, camera frame x forward and y left
+    const ignition::math::Vector3d direction =
+        _frame.rotation.RotateVector(
+            ignition::math::Vector3d(cos(azimuth), -sin(azimuth), 0.0));
+    if (-direction.Z() > nadirCosine)
+    {
+      nadirCosine = -direction.Z();
+      altitude = ret.range * nadirCosine;
+    }
+  }
+  this->sonar_returns_pub_.publish(returns_msg);
+
+  // Only beams pointing below the horizon measure an altitude
+  if (nadirCosine > 0.0)
+  {
+    std_msgs::Float64 altitude_msg;
+    altitude_msg.data = altitude;
+    this->sonar_altitude_pub_.publish(altitude_msg);
+  }
 }
 
 
@@ -941,31 +2355,8 @@ double NpsGazeboRosImageSonar::ComputeIncidence(double azimuth,
 }
 
 /////////////////////////////////////////////////
-// Precalculation of corrector sonar calculation
-void NpsGazeboRosImageSonar::ComputeCorrector()
-{
-  double hFOV = this->parentSensor->DepthCamera()->HFOV().Radian();
-  double hPixelSize = hFOV / this->width;
-  // Beam culling correction precalculation
-  for (size_t beam = 0; beam < nBeams; beam ++)
-  {
-    float beam_azimuthAngle = -(hFOV/2.0) + beam * hPixelSize + hPixelSize/2.0;
-    for (size_t beam_other = 0; beam_other < nBeams; beam_other ++)
-    {
-      float beam_azimuthAngle_other
-              = -(hFOV/2.0) + beam_other * hPixelSize + hPixelSize/2.0;
-      float azimuthBeamPattern =
-        unnormalized_sinc(M_PI * 0.884 / hPixelSize
-        * sin(beam_azimuthAngle-beam_azimuthAngle_other));
-      this->beamCorrector[beam][beam_other] = azimuthBeamPattern;
-      this->beamCorrectorSum += pow(azimuthBeamPattern, 2);
-    }
-  }
-  this->beamCorrectorSum = sqrt(this->beamCorrectorSum);
-}
-
-/////////////////////////////////////////////////
-cv::Mat NpsGazeboRosImageSonar::ComputeNormalImage(cv::Mat& depth)
+cv::Mat NpsGazeboRosImageSonar::ComputeNormalImage(cv::Mat& depth,
+                                                   double focalLength)
 {
   // filters
   cv::Mat_<float> f1 = (cv::Mat_<float>(3, 3) << 1,  2,  1,
@@ -998,20 +2389,23 @@ cv::Mat NpsGazeboRosImageSonar::ComputeNormalImage(cv::Mat& depth)
   // (-dzx*fy, -dzy*fx, fx*fy)
   images.at(0) = n1;    // for green channel
   images.at(1) = n2;    // for red channel
-  images.at(2) = 1.0/this->focal_length_*depth;  // for blue channel
+  images.at(2) = 1.0/focalLength*depth;  // for blue channel
 
   cv::Mat normal_image;
   cv::merge(images, normal_image);
 
-  for (int i = 0; i < normal_image.rows; ++i)
-  {
-    for (int j = 0; j < normal_image.cols; ++j)
+  // Normalize in row tiles on the shared executor
+  this->taskGroup->ParallelFor(normal_image.rows, 16, [&](int begin, int end)
     {
-      cv::Vec3f& n = normal_image.at<cv::Vec3f>(i, j);
-      n = cv::normalize(n);
-      float& d = depth.at<float>(i, j);
-    }
-  }
+      for (int i = begin; i < end; ++i)
+      {
+        for (int j = 0; j < normal_image.cols; ++j)
+        {
+          cv::Vec3f& n = normal_image.at<cv::Vec3f>(i, j);
+          n = cv::normalize(n);
+        }
+      }
+    });
   return normal_image;
 }
 
@@ -28,6 +28,7 @@
 #include <boost/bind.hpp>
 
 #include <algorithm>
+#include <cstring>
 #include <limits>
 #include <string>
 
@@ -53,6 +54,7 @@ GazeboRosDepthCamera::GazeboRosDepthCamera()
   this->point_cloud_cutoff_ = 0.4;
   this->sonar_point_cloud_connect_count_ = 0;
   this->last_depth_image_camera_info_update_time_ = common::Time(0);
+  this->echogram_gain_ = 255.0;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -66,7 +68,6 @@ GazeboRosDepthCamera::~GazeboRosDepthCamera()
 void GazeboRosDepthCamera::Load(sensors::SensorPtr _parent,
                                 sdf::ElementPtr _sdf)
 {
-  std::cout << "nps_gazebo_ros_depth_camera_sonar_single_beam";
   DepthCameraPlugin::Load(_parent, _sdf);
 
   // Make sure the ROS node for Gazebo has already been initialized
@@ -125,6 +126,70 @@ void GazeboRosDepthCamera::Load(sensors::SensorPtr _parent,
     this->point_cloud_cutoff_ =
       _sdf->GetElement("pointCloudCutoff")->Get<double>();
 
+  // Optional echogram, fraction of the pixels returning from each range bin
+  bool echogram = false;
+  if (_sdf->HasElement("echogram"))
+    echogram = _sdf->GetElement("echogram")->Get<bool>();
+  if (echogram)
+  {
+    int bins = 200;
+    if (_sdf->HasElement("echogramBins"))
+      bins = std::max(_sdf->GetElement("echogramBins")->Get<int>(), 1);
+    int pings = 400;
+    if (_sdf->HasElement("echogramPings"))
+      pings = std::max(_sdf->GetElement("echogramPings")->Get<int>(), 2);
+    if (_sdf->HasElement("echogramGain"))
+      this->echogram_gain_ = _sdf->GetElement("echogramGain")->Get<double>();
+    double max_range = this->depthCamera->FarClip();
+    if (_sdf->HasElement("echogramMaxRange"))
+      max_range = _sdf->GetElement("echogramMaxRange")->Get<double>();
+    if (!_sdf->HasElement("echogramTopicName"))
+      this->echogram_topic_name_ = "echogram";
+    else
+      this->echogram_topic_name_ =
+        _sdf->GetElement("echogramTopicName")->Get<std::string>();
+    if (!_sdf->HasElement("pingTopicName"))
+      this->ping_topic_name_ = "ping";
+    else
+      this->ping_topic_name_ =
+        _sdf->GetElement("pingTopicName")->Get<std::string>();
+
+    // Both messages are sized once, pings only overwrite their contents
+    this->echogram_msg_.encoding = sensor_msgs::image_encodings::MONO8;
+    this->echogram_msg_.height = bins;
+    this->echogram_msg_.width = pings;
+    this->echogram_msg_.step = pings;
+    this->echogram_msg_.is_bigendian = 0;
+    this->echogram_msg_.data.resize(bins * pings);
+    this->echogram_.reset(new NpsGazeboSonar::SonarEchogram(
+        bins, pings, this->point_cloud_cutoff_, max_range,
+        this->echogram_msg_.data.data()));
+
+    const double hfov = this->depthCamera->HFOV().Radian();
+    this->ping_msg_.azimuth_beamwidth = hfov;
+    this->ping_msg_.elevation_beamwidth = this->depthCamera->VFOV().Radian();
+    this->ping_msg_.azimuth_angles.assign(1, 0.0);
+    this->ping_msg_.data_size = 1;
+    this->ping_msg_.ranges.resize(bins);
+    for (int bin = 0; bin < bins; bin++)
+      this->ping_msg_.ranges[bin] = this->echogram_->BinRange(bin);
+    this->ping_msg_.intensities.resize(bins);
+
+    // Same pinhole geometry as the point cloud
+    const double fl =
+      static_cast<double>(this->width) / (2.0 * tan(hfov / 2.0));
+    this->range_scale_.resize(this->width * this->height);
+    for (unsigned int j = 0; j < this->height; j++)
+    {
+      const double y = (j - 0.5 * (this->height - 1.0)) / fl;
+      for (unsigned int i = 0; i < this->width; i++)
+      {
+        const double x = (i - 0.5 * (this->width - 1.0)) / fl;
+        this->range_scale_[j * this->width + i] = sqrt(1.0 + x * x + y * y);
+      }
+    }
+  }
+
   load_connection_ = GazeboRosCameraUtils::OnLoad(boost::bind(
                        &GazeboRosDepthCamera::Advertise, this));
   GazeboRosCameraUtils::Load(_parent, _sdf);
@@ -164,6 +229,16 @@ void GazeboRosDepthCamera::Advertise()
         ros::VoidPtr(), &this->camera_queue_);
   this->depth_image_camera_info_pub_ =
     this->rosnode_->advertise(depth_image_camera_info_ao);
+
+  if (this->echogram_)
+  {
+    this->echogram_pub_ =
+      this->rosnode_->advertise<sensor_msgs::Image>(
+        this->echogram_topic_name_, 1);
+    this->ping_pub_ =
+      this->rosnode_->advertise<acoustic_msgs::SonarImage>(
+        this->ping_topic_name_, 1);
+  }
 }
 
 
@@ -189,7 +264,6 @@ void GazeboRosDepthCamera::PointCloudDisconnect()
 // Increment count
 void GazeboRosDepthCamera::DepthImageConnect()
 {
-std::cout << "DepthImageConnect\n";
   this->depth_image_connect_count_++;
   this->parentSensor->SetActive(true);
 }
@@ -197,7 +271,6 @@ std::cout << "DepthImageConnect\n";
 // Decrement count
 void GazeboRosDepthCamera::DepthImageDisconnect()
 {
-std::cout << "DepthImageDisconnect\n";
   this->depth_image_connect_count_--;
 }
 
@@ -205,7 +278,6 @@ std::cout << "DepthImageDisconnect\n";
 // Increment count
 void GazeboRosDepthCamera::NormalsImageConnect()
 {
-std::cout << "NormalsImageConnect\n";
   this->normals_image_connect_count_++;
   this->parentSensor->SetActive(true);
 }
@@ -213,7 +285,6 @@ std::cout << "NormalsImageConnect\n";
 // Decrement count
 void GazeboRosDepthCamera::NormalsImageDisconnect()
 {
-std::cout << "NormalsImageDisconnect\n";
   this->normals_image_connect_count_--;
 }
 
@@ -236,7 +307,6 @@ void GazeboRosDepthCamera::OnNewDepthFrame(const float *_image,
     unsigned int _width, unsigned int _height, unsigned int _depth,
     const std::string &_format)
 {
-std::cout << "OnNewDepthFrame\n";
   if (!this->initialized_ || this->height_ <=0 || this->width_ <=0)
     return;
 
@@ -250,10 +320,12 @@ std::cout << "OnNewDepthFrame\n";
 
   if (this->parentSensor->IsActive())
   {
+    // the echogram needs every ping, not only those with subscribers
     if (this->point_cloud_connect_count_ <= 0 &&
         this->depth_image_connect_count_ <= 0 &&
         this->normals_image_connect_count_ <= 0 &&
-        (*this->image_connect_count_) <= 0)
+        (*this->image_connect_count_) <= 0 &&
+        !this->echogram_)
     {
       this->parentSensor->SetActive(false);
     }
@@ -264,13 +336,17 @@ std::cout << "OnNewDepthFrame\n";
 
       if (this->depth_image_connect_count_ > 0)
         this->FillDepthImage(_image);
+
+      if (this->echogram_)
+        this->FillEchogram(_image);
     }
   }
   else
   {
     if (this->point_cloud_connect_count_ > 0 ||
         this->depth_image_connect_count_ <= 0 ||  // zz why?
-        this->normals_image_connect_count_ <= 0)
+        this->normals_image_connect_count_ <= 0 ||
+        this->echogram_)
       // do this first so there's chance for sensor to run 1
       // frame after activate
       this->parentSensor->SetActive(true);
@@ -283,7 +359,6 @@ void GazeboRosDepthCamera::OnNewRGBPointCloud(const float *_pcd,
     unsigned int _width, unsigned int _height, unsigned int _depth,
     const std::string &_format)
 {
-std::cout << "OnNewRGBPointCloud\n";
   if (!this->initialized_ || this->height_ <=0 || this->width_ <=0)
     return;
 
@@ -338,15 +413,6 @@ std::cout << "OnNewRGBPointCloud\n";
           *iter_y = _pcd[4 * index + 1];
           *iter_z = _pcd[4 * index + 2];
           *iter_rgb = _pcd[4 * index + 3];
-          if (i == _width /2 && j == _height / 2)
-          {
-            uint32_t rgb = *reinterpret_cast<int*>(&(*iter_rgb));
-            uint8_t r = (rgb >> 16) & 0x0000ff;
-            uint8_t g = (rgb >> 8)  & 0x0000ff;
-            uint8_t b = (rgb)       & 0x0000ff;
-            std::cerr << static_cast<int>(r) << " " << static_cast<int>(g)
-                      << " " << static_cast<int>(b) << std::endl;
-          }
         }
       }
 
@@ -362,7 +428,6 @@ void GazeboRosDepthCamera::OnNewImageFrame(const unsigned char *_image,
     unsigned int _width, unsigned int _height, unsigned int _depth,
     const std::string &_format)
 {
-std::cout << "OnNewImageFrame\n";
   if (!this->initialized_ || this->height_ <=0 || this->width_ <=0)
     return;
 
@@ -466,8 +531,6 @@ bool GazeboRosDepthCamera::FillDepthImageHelper(
   int index = 0;
 
   // convert depth to image
-  std::cout << "FillDepthImageHelper rows: " << rows_arg
-            << " cols: " << cols_arg << std::endl;
   for (uint32_t j = 0; j < rows_arg; j++)
   {
     for (uint32_t i = 0; i < cols_arg; i++)
@@ -586,6 +649,41 @@ bool GazeboRosDepthCamera::FillPointCloudHelper(
   return true;
 }
 
+////////////////////////////////////////////////////////////////////////////////
+// Put echogram data to the interface
+void GazeboRosDepthCamera::FillEchogram(const float *_src)
+{
+  this->lock_.lock();
+
+  // Echo intensity of a bin is the fraction of the pixels returning from it
+  const int pixels = this->width * this->height;
+  const float weight = pixels > 0 ? 1.0 / pixels : 0.0;
+  this->echogram_->Begin();
+  for (int index = 0; index < pixels; index++)
+  {
+    if (_src[index] > this->point_cloud_cutoff_)
+      this->echogram_->AddReturn(_src[index] * this->range_scale_[index],
+                                 weight);
+  }
+  this->echogram_->Commit(this->echogram_gain_);
+
+  const std::vector<float> &series = this->echogram_->Series();
+  for (size_t bin = 0; bin < series.size(); bin++)
+    this->ping_msg_.intensities[bin] =
+      cv::saturate_cast<uint8_t>(series[bin] * this->echogram_gain_);
+
+  this->ping_msg_.header.frame_id   = this->frame_name_;
+  this->ping_msg_.header.stamp.sec  = this->depth_sensor_update_time_.sec;
+  this->ping_msg_.header.stamp.nsec = this->depth_sensor_update_time_.nsec;
+  this->echogram_msg_.header = this->ping_msg_.header;
+  if (this->ping_pub_.getNumSubscribers() > 0)
+    this->ping_pub_.publish(this->ping_msg_);
+  if (this->echogram_pub_.getNumSubscribers() > 0)
+    this->echogram_pub_.publish(this->echogram_msg_);
+
+  this->lock_.unlock();
+}
+
 // ************************************************************************
 // normals
 // ************************************************************************
@@ -596,7 +694,6 @@ void GazeboRosDepthCamera::OnNewNormalsFrame(const float *_normals_image,
     unsigned int _width, unsigned int _height, unsigned int _normals,
     const std::string &_format)
 {
-std::cout << "OnNewNormalsFrame\n";
   if (!this->initialized_ || this->height_ <=0 || this->width_ <=0)
     return;
 
@@ -28,7 +28,7 @@
  */
 
 
-#include "nps_uw_sensors_gazebo/nps_gazebo_ros_gpu_sonar_single_beam.h"
+#include "nps_uw_sensors_gazebo/nps_gazebo_ros_gpu_sonar_single_beam.hh"
 
 #include <assert.h>
 
@@ -36,9 +36,12 @@
 #include <tf/transform_listener.h>
 
 #include <gazebo_plugins/gazebo_ros_utils.h>
+#include <sensor_msgs/image_encodings.h>
 
 #include <sdf/sdf.hh>
 
+#include <boost/algorithm/string.hpp>
+
 #include <algorithm>
 #include <string>
 
@@ -60,6 +63,7 @@ GZ_REGISTER_SENSOR_PLUGIN(NpsGazeboRosGpuSingleBeamSonar)
 NpsGazeboRosGpuSingleBeamSonar::NpsGazeboRosGpuSingleBeamSonar()
 {
   this->seed = 0;
+  this->echogram_gain_ = 255.0;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -67,8 +71,10 @@ NpsGazeboRosGpuSingleBeamSonar::NpsGazeboRosGpuSingleBeamSonar()
 NpsGazeboRosGpuSingleBeamSonar::~NpsGazeboRosGpuSingleBeamSonar()
 {
   ROS_DEBUG_STREAM_NAMED("gpu_laser_sonar", "Shutting down GPU Laser");
-  this->rosnode_->shutdown();
-  delete this->rosnode_;
+  if (this->deferred_load_thread_.joinable())
+    this->deferred_load_thread_.join();
+  if (this->rosnode_)
+    this->rosnode_->shutdown();
   ROS_DEBUG_STREAM_NAMED("gpu_laser_sonar", "Unloaded");
 }
 
@@ -77,15 +83,13 @@ NpsGazeboRosGpuSingleBeamSonar::~NpsGazeboRosGpuSingleBeamSonar()
 void NpsGazeboRosGpuSingleBeamSonar::Load(
               sensors::SensorPtr _parent, sdf::ElementPtr _sdf)
 {
-std::cout << "NpsGazeboRosGpuSingleBeamSonar Load\n";
-
+  // save pointers
+  this->sdf = _sdf;
   // load plugin
   GpuRayPlugin::Load(_parent, this->sdf);
   // Get the world name.
-  std::string worldName = _parent->WorldName();
-  this->world_ = physics::get_world(worldName);
-  // save pointers
-  this->sdf = _sdf;
+  this->world_name_ = _parent->WorldName();
+  this->world_ = physics::get_world(this->world_name_);
 
   GAZEBO_SENSORS_USING_DYNAMIC_POINTER_CAST;
   this->parent_ray_sensor_ =
@@ -93,8 +97,8 @@ std::cout << "NpsGazeboRosGpuSingleBeamSonar Load\n";
 
   if (!this->parent_ray_sensor_)
   {
-    gzthrow("NpsGazeboRosGpuSingleBeamSonar controller");
-    gzthrow("requires a Ray Sensor as its parent");
+    gzthrow("NpsGazeboRosGpuSingleBeamSonar controller requires a Ray Sensor "
+            "as its parent");
   }
 
   this->robot_namespace_ =  GetRobotNamespace(_parent, _sdf, "Laser");
@@ -102,7 +106,7 @@ std::cout << "NpsGazeboRosGpuSingleBeamSonar Load\n";
   if (!this->sdf->HasElement("frameName"))
   {
     ROS_INFO_NAMED("gpu_laser_sonar", "NpsGazeboRosGpuSingleBeamSonar"
-     << " plugin missing <frameName>, defaults to /world");
+     " plugin missing <frameName>, defaults to /world");
     this->frame_name_ = "/world";
   }
   else
@@ -111,7 +115,7 @@ std::cout << "NpsGazeboRosGpuSingleBeamSonar Load\n";
   if (!this->sdf->HasElement("topicName"))
   {
     ROS_INFO_NAMED("gpu_laser_sonar", "NpsGazeboRosGpuSingleBeamSonar"
-     << " plugin missing <topicName>, defaults to /world");
+     " plugin missing <topicName>, defaults to /world");
     this->topic_name_ = "/world";
   }
   else
@@ -119,11 +123,59 @@ std::cout << "NpsGazeboRosGpuSingleBeamSonar Load\n";
 
   this->laser_connect_count_ = 0;
 
+  // Optional echogram, fraction of the rays returning from each range bin
+  bool echogram = false;
+  if (this->sdf->HasElement("echogram"))
+    echogram = this->sdf->Get<bool>("echogram");
+  if (echogram)
+  {
+    int bins = 200;
+    if (this->sdf->HasElement("echogramBins"))
+      bins = std::max(this->sdf->Get<int>("echogramBins"), 1);
+    int pings = 400;
+    if (this->sdf->HasElement("echogramPings"))
+      pings = std::max(this->sdf->Get<int>("echogramPings"), 2);
+    if (this->sdf->HasElement("echogramGain"))
+      this->echogram_gain_ = this->sdf->Get<double>("echogramGain");
+    this->echogram_topic_name_ = "echogram";
+    if (this->sdf->HasElement("echogramTopicName"))
+      this->echogram_topic_name_ =
+        this->sdf->Get<std::string>("echogramTopicName");
+    this->ping_topic_name_ = "ping";
+    if (this->sdf->HasElement("pingTopicName"))
+      this->ping_topic_name_ = this->sdf->Get<std::string>("pingTopicName");
+
+    // Both messages are sized once, pings only overwrite their contents
+    this->echogram_msg_.encoding = sensor_msgs::image_encodings::MONO8;
+    this->echogram_msg_.height = bins;
+    this->echogram_msg_.width = pings;
+    this->echogram_msg_.step = pings;
+    this->echogram_msg_.is_bigendian = 0;
+    this->echogram_msg_.data.resize(bins * pings);
+    this->echogram_.reset(new NpsGazeboSonar::SonarEchogram(
+        bins, pings, this->parent_ray_sensor_->RangeMin(),
+        this->parent_ray_sensor_->RangeMax(),
+        this->echogram_msg_.data.data()));
+
+    this->ping_msg_.azimuth_beamwidth =
+      (this->parent_ray_sensor_->AngleMax() -
+       this->parent_ray_sensor_->AngleMin()).Radian();
+    this->ping_msg_.elevation_beamwidth =
+      (this->parent_ray_sensor_->VerticalAngleMax() -
+       this->parent_ray_sensor_->VerticalAngleMin()).Radian();
+    this->ping_msg_.azimuth_angles.assign(1, 0.0);
+    this->ping_msg_.data_size = 1;
+    this->ping_msg_.ranges.resize(bins);
+    for (int bin = 0; bin < bins; bin++)
+      this->ping_msg_.ranges[bin] = this->echogram_->BinRange(bin);
+    this->ping_msg_.intensities.resize(bins);
+  }
+
 
   // Make sure the ROS node for Gazebo has already been initialized
   if (!ros::isInitialized())
   {
-    ROS_FATAL_STREAM_NAMED("gpu_laser_sonar", "A ROS node for Gazebo"
+    ROS_FATAL_STREAM_NAMED("gpu_laser_sonar", "A ROS node for Gazebo "
       << "has not been initialized, unable to load plugin. "
       << "Load the Gazebo system plugin 'libgazebo_ros_api_plugin.so'"
       << " in the gazebo_ros package)");
@@ -131,7 +183,7 @@ std::cout << "NpsGazeboRosGpuSingleBeamSonar Load\n";
   }
 
   ROS_INFO_NAMED("gpu_laser_sonar", "Starting "
-    << "NpsGazeboRosGpuSingleBeamSonar Plugin (ns = %s)",
+    "NpsGazeboRosGpuSingleBeamSonar Plugin (ns = %s)",
     this->robot_namespace_.c_str() );
   // ros callback queue for processing subscription
   this->deferred_load_thread_ = boost::thread(
@@ -148,7 +200,7 @@ void NpsGazeboRosGpuSingleBeamSonar::LoadThread()
 
   this->pmq.startServiceThread();
 
-  this->rosnode_ = new ros::NodeHandle(this->robot_namespace_);
+  this->rosnode_.reset(new ros::NodeHandle(this->robot_namespace_));
 
   this->tf_prefix_ = tf::getPrefixParam(*this->rosnode_);
   if ( this->tf_prefix_.empty() ) {
@@ -156,7 +208,7 @@ void NpsGazeboRosGpuSingleBeamSonar::LoadThread()
       boost::trim_right_if(this->tf_prefix_, boost::is_any_of("/"));
   }
   ROS_INFO_NAMED("gpu_laser_sonar", "GPU Laser Plugin (ns = %s)"
-             << " <tf_prefix_>, set to \"%s\"",
+             " <tf_prefix_>, set to \"%s\"",
              this->robot_namespace_.c_str(), this->tf_prefix_.c_str());
 
   // resolve tf prefix
@@ -174,6 +226,16 @@ void NpsGazeboRosGpuSingleBeamSonar::LoadThread()
     this->pub_queue_ = this->pmq.addPub<sensor_msgs::LaserScan>();
   }
 
+  if (this->echogram_)
+  {
+    this->echogram_pub_ = this->rosnode_->advertise<sensor_msgs::Image>(
+      this->echogram_topic_name_, 1);
+    this->ping_pub_ = this->rosnode_->advertise<acoustic_msgs::SonarImage>(
+      this->ping_topic_name_, 1);
+    // the echogram needs every ping, not only those with laser subscribers
+    this->LaserConnect();
+  }
+
   // Initialize the controller
 
   // sensor generation off by default
@@ -255,12 +317,14 @@ void NpsGazeboRosGpuSingleBeamSonar::OnScan(ConstLaserScanStampedPtr &_msg)
   laser_msg.ranges.resize(0);
   laser_msg.intensities.resize(0);
 
+  if (this->echogram_)
+    this->PublishEchogram(_msg);
+
   // calculate range and intensity from Gazebo array
   float angle = laser_msg.angle_min;
   float intensity = 0.0;
   float range = laser_msg.range_max - laser_msg.range_min;
   auto range_it = _msg->scan().ranges().begin();
-  auto intensity_it = _msg->scan().intensities().begin();
   while (range_it != _msg->scan().ranges().end())
   {
     // sum of f(intensity, angle)
@@ -270,7 +334,6 @@ void NpsGazeboRosGpuSingleBeamSonar::OnScan(ConstLaserScanStampedPtr &_msg)
 
     // next
     ++range_it;
-    ++intensity_it;
   }
 
   // store calculated range and intensity
@@ -280,5 +343,32 @@ void NpsGazeboRosGpuSingleBeamSonar::OnScan(ConstLaserScanStampedPtr &_msg)
   // publish
   this->pub_queue_->push(laser_msg, this->pub_);
 }
-}
 
+////////////////////////////////////////////////////////////////////////////////
+// Add the scan to the echogram and publish it
+void NpsGazeboRosGpuSingleBeamSonar::PublishEchogram(
+                                  ConstLaserScanStampedPtr &_msg)
+{
+  // Echo intensity of a bin is the fraction of the rays returning from it
+  const int nRays = _msg->scan().ranges_size();
+  const float weight = nRays > 0 ? 1.0 / nRays : 0.0;
+  this->echogram_->Begin();
+  for (const double range : _msg->scan().ranges())
+    this->echogram_->AddReturn(range, weight);
+  this->echogram_->Commit(this->echogram_gain_);
+
+  const std::vector<float> &series = this->echogram_->Series();
+  for (size_t bin = 0; bin < series.size(); bin++)
+    this->ping_msg_.intensities[bin] =
+      cv::saturate_cast<uint8_t>(series[bin] * this->echogram_gain_);
+
+  this->ping_msg_.header.stamp =
+    ros::Time(_msg->time().sec(), _msg->time().nsec());
+  this->ping_msg_.header.frame_id = this->frame_name_;
+  this->echogram_msg_.header = this->ping_msg_.header;
+  if (this->ping_pub_.getNumSubscribers() > 0)
+    this->ping_pub_.publish(this->ping_msg_);
+  if (this->echogram_pub_.getNumSubscribers() > 0)
+    this->echogram_pub_.publish(this->echogram_msg_);
+}
+}
@@ -0,0 +1,554 @@
+/*
+ * Copyright 2020 Naval Postgraduate School
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+
+#include <nps_uw_sensors_gazebo/nps_gazebo_ros_side_scan_sonar.hh>
+
+#include <sensor_msgs/image_encodings.h>
+#include <cv_bridge/cv_bridge.h>
+
+#include <nps_uw_sensors_gazebo/sonar_absorption.hh>
+#include <nps_uw_sensors_gazebo/sonar_stitching.hh>
+#include <nps_uw_sensors_gazebo/sonar_tiling.hh>
+
+#include <gazebo/sensors/Sensor.hh>
+#include <gazebo/sensors/SensorManager.hh>
+#include <gazebo/sensors/DepthCameraSensor.hh>
+
+#include <math.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+namespace gazebo
+{
+// Register this plugin with the simulator
+GZ_REGISTER_SENSOR_PLUGIN(NpsGazeboRosSideScanSonar)
+
+
+// Constructor
+NpsGazeboRosSideScanSonar::NpsGazeboRosSideScanSonar() :
+  SensorPlugin()
+{
+  this->starboardReady = true;
+  this->syncWindow = 0.05;
+  this->nFreq = 0;
+  this->waterfallGain = 1.0;
+  this->gainCeiling = 0.0;
+  this->droppedPings = 0;
+  this->debugFlag = false;
+  this->precision = NpsGazeboSonar::SonarPrecision::SINGLE;
+}
+
+
+// Destructor
+NpsGazeboRosSideScanSonar::~NpsGazeboRosSideScanSonar()
+{
+  // Finish any ping still running on the executor
+  this->taskGroup.reset();
+  for (auto &side : this->sides)
+  {
+    side->connection.reset();
+    side->tables.reset();
+  }
+  if (this->rosnode_)
+    this->rosnode_->shutdown();
+}
+
+
+// Load the controller
+void NpsGazeboRosSideScanSonar::Load(sensors::SensorPtr _parent,
+                                     sdf::ElementPtr _sdf)
+{
+  this->sides.emplace_back(new Side());
+  Side *port = this->sides[0].get();
+  port->sensor =
+    std::dynamic_pointer_cast<sensors::DepthCameraSensor>(_parent);
+  if (!port->sensor)
+  {
+    gzerr << "NpsGazeboRosSideScanSonar not attached to a depthCamera "
+          << "sensor\n";
+    return;
+  }
+  port->name = port->sensor->Name();
+  port->camera = port->sensor->DepthCamera();
+
+  // Make sure the ROS node for Gazebo has already been initialized
+  if (!ros::isInitialized())
+  {
+    ROS_FATAL_STREAM_NAMED("side_scan_sonar", "A ROS node for Gazebo "
+        << "has not been initialized, unable to load plugin. "
+        << "Load the Gazebo system plugin 'libgazebo_ros_api_plugin.so'"
+        << " in the gazebo_ros package)");
+    return;
+  }
+
+  std::string robotNamespace = "";
+  if (_sdf->HasElement("robotNamespace"))
+    robotNamespace = _sdf->GetElement("robotNamespace")->Get<std::string>();
+  std::string sonarName = "side_scan_sonar";
+  if (_sdf->HasElement("sonarName"))
+    sonarName = _sdf->GetElement("sonarName")->Get<std::string>();
+  if (!_sdf->HasElement("frameName"))
+    this->frame_name_ = "side_scan_sonar_link";
+  else
+    this->frame_name_ = _sdf->GetElement("frameName")->Get<std::string>();
+
+  // Read sonar properties from model.sdf, defaults of a 400 kHz survey
+  // side-scan
+  if (!_sdf->HasElement("sonarFreq"))
+    this->sonarFreq = 400e3;
+  else
+    this->sonarFreq = _sdf->GetElement("sonarFreq")->Get<double>();
+  if (!_sdf->HasElement("bandwidth"))
+    this->bandwidth = 20e3;
+  else
+    this->bandwidth = _sdf->GetElement("bandwidth")->Get<double>();
+  if (!_sdf->HasElement("soundSpeed"))
+    this->soundSpeed = 1500;
+  else
+    this->soundSpeed = _sdf->GetElement("soundSpeed")->Get<double>();
+  if (!_sdf->HasElement("maxDistance"))
+    this->maxDistance = 75;
+  else
+    this->maxDistance = _sdf->GetElement("maxDistance")->Get<double>();
+  if (!_sdf->HasElement("minDistance"))
+    this->minDistance = 0.4;
+  else
+    this->minDistance = _sdf->GetElement("minDistance")->Get<double>();
+  if (!_sdf->HasElement("sourceLevel"))
+    this->sourceLevel = 220;
+  else
+    this->sourceLevel = _sdf->GetElement("sourceLevel")->Get<double>();
+  if (!_sdf->HasElement("reflectivity"))
+    this->mu = 1e-3;
+  else
+    this->mu = _sdf->GetElement("reflectivity")->Get<double>();
+  if (!_sdf->HasElement("raySkips"))
+    this->raySkips = 1;
+  else
+    this->raySkips = _sdf->GetElement("raySkips")->Get<int>();
+  if (this->raySkips <= 0) this->raySkips = 1;
+  if (_sdf->HasElement("precision"))
+  {
+    const std::string precision =
+        _sdf->GetElement("precision")->Get<std::string>();
+    if (!NpsGazeboSonar::ParsePrecision(precision, this->precision))
+      ROS_WARN_STREAM("Unknown precision '" << precision
+                      << "', using single");
+  }
+  if (_sdf->HasElement("debugFlag"))
+    this->debugFlag = _sdf->GetElement("debugFlag")->Get<bool>();
+
+  // Number of frequency (time) samples, as in the image sonar
+  const float max_T = this->maxDistance*2.0/this->soundSpeed;
+  this->nFreq = ceil(this->bandwidth*max_T);
+
+  // Transmission path properties
+  NpsGazeboSonar::AbsorptionModel absorptionModel =
+      NpsGazeboSonar::AbsorptionModel::CONSTANT;
+  if (_sdf->HasElement("absorptionModel"))
+  {
+    std::string modelName =
+      _sdf->GetElement("absorptionModel")->Get<std::string>();
+    if (!NpsGazeboSonar::ParseAbsorptionModel(modelName, absorptionModel))
+      ROS_WARN_STREAM("Unknown absorptionModel '" << modelName
+                      << "', using constant absorption");
+  }
+  double absorption = 0.0354;  // [dB/m]
+  if (_sdf->HasElement("absorption"))
+    absorption = _sdf->GetElement("absorption")->Get<double>();
+  NpsGazeboSonar::WaterProperties water;
+  if (_sdf->HasElement("waterTemperature"))
+    water.temperature = _sdf->GetElement("waterTemperature")->Get<double>();
+  if (_sdf->HasElement("waterSalinity"))
+    water.salinity = _sdf->GetElement("waterSalinity")->Get<double>();
+  if (_sdf->HasElement("waterDepth"))
+    water.depth = _sdf->GetElement("waterDepth")->Get<double>();
+  if (_sdf->HasElement("waterPH"))
+    water.pH = _sdf->GetElement("waterPH")->Get<double>();
+  this->attenuationTable = NpsGazeboSonar::AttenuationTable(
+      absorptionModel, absorption, water,
+      this->sonarFreq, 1.0/max_T, this->nFreq);
+
+  // Transmit waveform, see NpsGazeboRosImageSonar
+  NpsGazeboSonar::SonarWaveform waveform;
+  if (_sdf->HasElement("waveform"))
+  {
+    std::string waveformName =
+      _sdf->GetElement("waveform")->Get<std::string>();
+    if (!NpsGazeboSonar::ParseWaveformType(waveformName, waveform.type))
+      ROS_WARN_STREAM("Unknown waveform '" << waveformName
+                      << "', using a flat spectrum");
+  }
+  if (_sdf->HasElement("pulseLength"))
+    waveform.pulseLength = _sdf->GetElement("pulseLength")->Get<double>();
+  if (_sdf->HasElement("chirpBandwidth"))
+    waveform.chirpBandwidth =
+      _sdf->GetElement("chirpBandwidth")->Get<double>();
+  if (_sdf->HasElement("spectrumFile"))
+    waveform.spectrumFile =
+      _sdf->GetElement("spectrumFile")->Get<std::string>();
+
+  // Time varying gain and compression, see NpsGazeboRosImageSonar
+  bool tvg = false;
+  if (_sdf->HasElement("tvg"))
+    tvg = _sdf->GetElement("tvg")->Get<bool>();
+  NpsGazeboSonar::SonarGainConfig gainConfig;
+  if (_sdf->HasElement("tvgSpreading"))
+    gainConfig.spreading = _sdf->GetElement("tvgSpreading")->Get<double>();
+  bool tvgAbsorption = true;
+  if (_sdf->HasElement("tvgAbsorption"))
+    tvgAbsorption = _sdf->GetElement("tvgAbsorption")->Get<bool>();
+  if (tvgAbsorption)
+    gainConfig.absorption = this->attenuationTable[this->nFreq / 2];
+  gainConfig.minRange = this->minDistance;
+  if (_sdf->HasElement("compression"))
+  {
+    std::string compression =
+      _sdf->GetElement("compression")->Get<std::string>();
+    if (!NpsGazeboSonar::ParseCompressionMode(compression, gainConfig.mode))
+      ROS_WARN_STREAM("Unknown compression '" << compression
+                      << "', using log");
+  }
+  if (_sdf->HasElement("dynamicRange"))
+    gainConfig.dynamicRange =
+      _sdf->GetElement("dynamicRange")->Get<double>();
+  if (_sdf->HasElement("ceilingLevel"))
+    this->gainCeiling =
+      pow(10.0, _sdf->GetElement("ceilingLevel")->Get<double>() / 20.0);
+
+  // Waterfall of the last pings, port on the left
+  int waterfallLines = 500;
+  if (_sdf->HasElement("waterfallLines"))
+    waterfallLines = _sdf->GetElement("waterfallLines")->Get<int>();
+  if (_sdf->HasElement("waterfallGain"))
+    this->waterfallGain = _sdf->GetElement("waterfallGain")->Get<double>();
+  this->waterfall.reset(
+      new NpsGazeboSonar::SonarWaterfall(waterfallLines, this->nFreq));
+
+  int executorPriority = 0;
+  if (_sdf->HasElement("executorPriority"))
+    executorPriority = _sdf->GetElement("executorPriority")->Get<int>();
+  this->taskGroup.reset(new NpsGazeboSonar::SonarTaskGroup(executorPriority));
+
+  // The starboard camera is resolved with the first frame, once every
+  // sensor has been loaded
+  if (_sdf->HasElement("starboardCamera"))
+    this->starboardName =
+        _sdf->GetElement("starboardCamera")->Get<std::string>();
+  this->starboardReady = this->starboardName.empty();
+  if (_sdf->HasElement("syncWindow"))
+    this->syncWindow = _sdf->GetElement("syncWindow")->Get<double>();
+  else if (port->sensor->UpdateRate() > 0.0)
+    this->syncWindow = 0.5 / port->sensor->UpdateRate();
+
+  this->AcquireTables(*port);
+  if (waveform.type != NpsGazeboSonar::WaveformType::FLAT)
+  {
+    const NpsGazeboSonar::WaveformStatus status =
+      NpsGazeboSonar::WaveformWeights(waveform, port->tables->window,
+          this->sonarFreq, 1.0/max_T,
+          this->waveformTransmit, this->matchedFilter);
+    if (status != NpsGazeboSonar::WaveformStatus::OK)
+      ROS_WARN_STREAM("Waveform: "
+                      << NpsGazeboSonar::WaveformStatusText(status)
+                      << (waveform.type ==
+                          NpsGazeboSonar::WaveformType::FILE ?
+                          " ('" + waveform.spectrumFile + "')" : "")
+                      << ", using a flat spectrum");
+  }
+  if (tvg)
+    this->gainStage.reset(new NpsGazeboSonar::SonarGainStage(
+        gainConfig, port->tables->rangeVector));
+  port->connection = port->camera->ConnectNewDepthFrame(
+      [this, port](const float *_image, unsigned int, unsigned int,
+                   unsigned int, const std::string &)
+      {
+        this->OnDepthFrame(port, _image);
+      });
+  port->sensor->SetActive(true);
+
+  std::string pingTopicName = "ping";
+  if (_sdf->HasElement("pingTopicName"))
+    pingTopicName = _sdf->GetElement("pingTopicName")->Get<std::string>();
+  std::string waterfallTopicName = "waterfall";
+  if (_sdf->HasElement("waterfallTopicName"))
+    waterfallTopicName =
+        _sdf->GetElement("waterfallTopicName")->Get<std::string>();
+  this->rosnode_.reset(
+      new ros::NodeHandle(robotNamespace + "/" + sonarName));
+  this->ping_pub_ =
+      this->rosnode_->advertise<acoustic_msgs::SonarImage>(pingTopicName, 10);
+  this->waterfall_pub_ =
+      this->rosnode_->advertise<sensor_msgs::Image>(waterfallTopicName, 10);
+
+  // Print sonar calculation settings
+  ROS_INFO_STREAM("");
+  ROS_INFO_STREAM("==================================================");
+  ROS_INFO_STREAM("==========   SIDE-SCAN SONAR LOADED   ============");
+  ROS_INFO_STREAM("==================================================");
+  ROS_INFO_STREAM("Maximum range [m] = " << this->maxDistance);
+  ROS_INFO_STREAM("# of Time data / Side = " << this->nFreq);
+  ROS_INFO_STREAM("Port camera = " << port->name << ", starboard camera = "
+      << (this->starboardName.empty() ? "none" : this->starboardName));
+  ROS_INFO_STREAM("Waterfall lines = " << waterfallLines);
+  ROS_INFO_STREAM("==================================================");
+  ROS_INFO_STREAM("");
+}
+
+
+/////////////////////////////////////////////////
+void NpsGazeboRosSideScanSonar::AcquireTables(Side &_side)
+{
+  // One beam per side, every column of the camera lies in it
+  NpsGazeboSonar::SonarTableKey tableKey;
+  tableKey.nBeams = 1;
+  tableKey.nFreq = this->nFreq;
+  tableKey.azimuthRaysPerBeam = _side.camera->ImageWidth();
+  tableKey.hFOV = _side.camera->HFOV().Radian();
+  tableKey.bandwidth = this->bandwidth;
+  tableKey.soundSpeed = this->soundSpeed;
+  _side.tables = NpsGazeboSonar::SonarTableCache::Instance().Acquire(tableKey);
+}
+
+
+/////////////////////////////////////////////////
+bool NpsGazeboRosSideScanSonar::SetupStarboard()
+{
+  sensors::DepthCameraSensorPtr sensor =
+      std::dynamic_pointer_cast<sensors::DepthCameraSensor>(
+          sensors::get_sensor(this->starboardName));
+  if (!sensor || !sensor->DepthCamera())
+  {
+    ROS_WARN_STREAM_THROTTLE(5.0, "Waiting for starboard depth camera '"
+                             << this->starboardName << "'");
+    return false;
+  }
+
+  std::unique_ptr<Side> starboard(new Side());
+  starboard->name = this->starboardName;
+  starboard->sensor = sensor;
+  starboard->camera = sensor->DepthCamera();
+  this->AcquireTables(*starboard);
+  Side *side = starboard.get();
+  {
+    std::lock_guard<std::mutex> guard(this->frameMutex);
+    this->sides.push_back(std::move(starboard));
+  }
+  side->connection = side->camera->ConnectNewDepthFrame(
+      [this, side](const float *_image, unsigned int, unsigned int,
+                   unsigned int, const std::string &)
+      {
+        this->OnDepthFrame(side, _image);
+      });
+  side->sensor->SetActive(true);
+  return true;
+}
+
+
+/////////////////////////////////////////////////
+void NpsGazeboRosSideScanSonar::OnDepthFrame(Side *_side,
+                                             const float *_image)
+{
+  if (!this->starboardReady)
+  {
+    this->starboardReady = this->SetupStarboard();
+    if (!this->starboardReady)
+      return;
+  }
+
+  rendering::DepthCameraPtr camera = _side->camera;
+  cv::Mat range;
+  NpsGazeboSonar::DepthToRange(_image, camera->ImageWidth(),
+                               camera->ImageHeight(),
+                               camera->HFOV().Radian(),
+                               this->minDistance, range);
+  const common::Time time = _side->sensor->LastMeasurementTime();
+
+  // A ping needs the latest frame of every side, measured close enough
+  // to this one to be the same ping
+  std::vector<cv::Mat> ranges;
+  {
+    std::lock_guard<std::mutex> guard(this->frameMutex);
+    _side->range = range;
+    _side->time = time.Double();
+    for (const auto &side : this->sides)
+    {
+      if (side->time < 0.0 ||
+          fabs(side->time - _side->time) > this->syncWindow)
+        return;
+    }
+    for (auto &side : this->sides)
+    {
+      ranges.push_back(side->range);
+      side->time = -1.0;
+    }
+  }
+
+  if (this->taskGroup->Pending() > 0)
+  {
+    // previous ping still in flight
+    this->droppedPings++;
+    if (this->debugFlag)
+      ROS_INFO_STREAM("Side-scan pings dropped: " << this->droppedPings);
+    return;
+  }
+  this->taskGroup->Run([this, ranges, time]()
+    {
+      this->ComputePing(ranges, time);
+    });
+}
+
+
+/////////////////////////////////////////////////
+void NpsGazeboRosSideScanSonar::MakeFrame(const Side &_side,
+                                          const cv::Mat &_range,
+                                          uint64_t _seed,
+                                          NpsGazeboSonar::SonarFrame &_frame)
+{
+  const int rows = _range.rows;
+  const int cols = _range.cols;
+  const double hFOV = _side.camera->HFOV().Radian();
+  const double vFOV = _side.camera->VFOV().Radian();
+  const double focalLength = cols / (2.0 * tan(hFOV / 2.0));
+
+  NpsGazeboSonar::SonarView view;
+  view.depth_image = _range;
+  view.normal_image = cv::Mat(rows, cols, CV_32FC3);
+  NpsGazeboSonar::ComputeNormalBand(_range, 0, rows, focalLength,
+                                    view.normal_image);
+  view.rand_image = cv::Mat(rows, cols, CV_32FC2);
+  cv::RNG rng(_seed);
+  rng.fill(view.rand_image, cv::RNG::NORMAL, 0.f, 1.f);
+  view.hFOV = hFOV;
+  view.columnBeam = _side.tables->columnBeam.data();
+  view.columnSlot = _side.tables->columnSlot.data();
+  view.columnPattern = _side.tables->azimuthBeamPattern.data();
+  view.nSlots = cols;
+  _frame.views.assign(1, view);
+
+  // The whole camera is one beam: the rows sample its vertical fan and
+  // the columns its along track width
+  NpsGazeboSonar::SonarCalculationConfig &config = _frame.config;
+  config.hPixelSize = hFOV / cols;
+  config.vPixelSize = vFOV / rows;
+  config.hFOV = hFOV;
+  config.vFOV = vFOV;
+  config.beam_azimuthAngleWidth = hFOV;
+  config.beam_elevationAngleWidth = vFOV / rows;
+  config.ray_azimuthAngleWidth = hFOV / cols;
+  config.ray_elevationAngleWidth = vFOV / rows * this->raySkips;
+  config.soundSpeed = this->soundSpeed;
+  config.minDistance = this->minDistance;
+  config.maxDistance = this->maxDistance;
+  config.sourceLevel = this->sourceLevel;
+  config.nBeams = 1;
+  config.nRays = rows;
+  config.raySkips = this->raySkips;
+  config.rowWeight = nullptr;
+  config.sonarFreq = this->sonarFreq;
+  config.bandwidth = this->bandwidth;
+  config.nFreq = this->nFreq;
+  config.mu = this->mu;
+  config.reflectivity = nullptr;
+  config.nMaterials = 0;
+  config.attenuation = this->attenuationTable.data();
+  config.window = _side.tables->window.data();
+  config.beamCorrector = _side.tables->beamCorrector.data();
+  config.beamCorrectorSum = _side.tables->beamCorrectorSum;
+  config.transmit = this->waveformTransmit.empty() ?
+      nullptr : this->waveformTransmit.data();
+  config.matchedFilter = this->matchedFilter.empty() ?
+      nullptr : this->matchedFilter.data();
+  config.debugFlag = this->debugFlag;
+  config.precision = this->precision;
+}
+
+
+/////////////////////////////////////////////////
+void NpsGazeboRosSideScanSonar::ComputePing(std::vector<cv::Mat> _ranges,
+                                            common::Time _update_time)
+{
+  auto start = std::chrono::high_resolution_clock::now();
+
+  // Both sides in one engine call and one batched FFT
+  const uint64_t seed = static_cast<uint64_t>(std::rand());
+  std::vector<NpsGazeboSonar::SonarFrame> frames(_ranges.size());
+  for (size_t s = 0; s < _ranges.size(); s++)
+    this->MakeFrame(*this->sides[s], _ranges[s], seed + s, frames[s]);
+  std::vector<NpsGazeboSonar::SonarResult> results =
+      NpsGazeboSonar::sonar_calculation_batch_wrapper(frames);
+
+  // Echo amplitude of each side, port first, then the time varying gain
+  // compensated and compressed level when enabled
+  const int nSides = static_cast<int>(results.size());
+  std::vector<float> amplitude(nSides * this->nFreq);
+  for (int s = 0; s < nSides; s++)
+    for (int f = 0; f < this->nFreq; f++)
+      amplitude[s * this->nFreq + f] = std::abs(results[s].beams[0][f]);
+  if (this->gainStage)
+  {
+    float ceiling = this->gainCeiling;
+    if (ceiling <= 0.0f)
+      ceiling = this->gainStage->Peak(amplitude.data(), nSides);
+    this->gainStage->Apply(amplitude.data(), nSides, ceiling,
+                           amplitude.data());
+  }
+
+  // Time series of the ping, one beam per side looking abeam
+  acoustic_msgs::SonarImage ping_msg;
+  ping_msg.header.frame_id = this->frame_name_;
+  ping_msg.header.stamp.sec = _update_time.sec;
+  ping_msg.header.stamp.nsec = _update_time.nsec;
+  ping_msg.frequency = this->sonarFreq;
+  ping_msg.sound_speed = this->soundSpeed;
+  ping_msg.azimuth_beamwidth = this->sides[0]->camera->HFOV().Radian();
+  ping_msg.elevation_beamwidth = this->sides[0]->camera->VFOV().Radian();
+  ping_msg.azimuth_angles.push_back(M_PI / 2.0);
+  if (nSides > 1)
+    ping_msg.azimuth_angles.push_back(-M_PI / 2.0);
+  ping_msg.ranges = this->sides[0]->tables->rangeVector;
+  ping_msg.data_size = 1;
+  ping_msg.intensities.resize(this->nFreq * nSides);
+  for (int f = 0; f < this->nFreq; f++)
+    for (int s = 0; s < nSides; s++)
+      ping_msg.intensities[f * nSides + s] =
+          cv::saturate_cast<uchar>(amplitude[s * this->nFreq + f]);
+  this->ping_pub_.publish(ping_msg);
+
+  // One new waterfall line, the image is copied once into the message
+  this->waterfall->Push(amplitude.data(),
+                        nSides > 1 ? &amplitude[this->nFreq] : nullptr,
+                        this->waterfallGain);
+  sensor_msgs::Image waterfall_msg;
+  waterfall_msg.header = ping_msg.header;
+  cv_bridge::CvImage(waterfall_msg.header,
+                     sensor_msgs::image_encodings::MONO8,
+                     this->waterfall->Image()).toImageMsg(waterfall_msg);
+  this->waterfall_pub_.publish(waterfall_msg);
+
+  if (this->debugFlag)
+  {
+    auto stop = std::chrono::high_resolution_clock::now();
+    ROS_INFO_STREAM("Side-scan ping computed in "
+        << std::chrono::duration<double, std::milli>(stop - start).count()
+        << " ms");
+  }
+}
+}
@@ -0,0 +1,101 @@
+/*
+ * Copyright 2020 Naval Postgraduate School
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+
+#include <nps_uw_sensors_gazebo/sonar_absorption.hh>
+
+#include <math.h>
+
+namespace NpsGazeboSonar
+{
+/////////////////////////////////////////////////
+bool ParseAbsorptionModel(const std::string &_name, AbsorptionModel &_model)
+{
+  if (_name == "constant")
+    _model = AbsorptionModel::CONSTANT;
+  else if (_name == "francois_garrison")
+    _model = AbsorptionModel::FRANCOIS_GARRISON;
+  else
+    return false;
+  return true;
+}
+
+/////////////////////////////////////////////////
+double FrancoisGarrisonAbsorption(double _frequency,
+                                  const WaterProperties &_water)
+{
+  // Model is in kHz and dB/km
+  const double f = fabs(_frequency) / 1000.0;
+  const double T = _water.temperature;
+  const double S = _water.salinity;
+  const double D = _water.depth;
+  const double theta = 273.0 + T;
+  const double c = 1412.0 + 3.21 * T + 1.19 * S + 0.0167 * D;
+
+  // Boric acid
+  const double A1 = 8.86 / c * pow(10.0, 0.78 * _water.pH - 5.0);
+  const double P1 = 1.0;
+  const double f1 = 2.8 * sqrt(S / 35.0) * pow(10.0, 4.0 - 1245.0 / theta);
+
+  // Magnesium sulphate
+  const double A2 = 21.44 * S / c * (1.0 + 0.025 * T);
+  const double P2 = 1.0 - 1.37e-4 * D + 6.2e-9 * D * D;
+  const double f2 = 8.17 * pow(10.0, 8.0 - 1990.0 / theta)
+                    / (1.0 + 0.0018 * (S - 35.0));
+
+  // Pure water
+  double A3;
+  if (T <= 20.0)
+    A3 = 4.937e-4 - 2.59e-5 * T + 9.11e-7 * T * T - 1.50e-8 * T * T * T;
+  else
+    A3 = 3.964e-4 - 1.146e-5 * T + 1.45e-7 * T * T - 6.5e-10 * T * T * T;
+  const double P3 = 1.0 - 3.83e-5 * D + 4.9e-10 * D * D;
+
+  const double f_2 = f * f;
+  const double alpha = A1 * P1 * f1 * f_2 / (f_2 + f1 * f1)
+                     + A2 * P2 * f2 * f_2 / (f_2 + f2 * f2)
+                     + A3 * P3 * f_2;
+  return alpha / 1000.0;
+}
+
+/////////////////////////////////////////////////
+std::vector<float> AttenuationTable(AbsorptionModel _model,
+                                    double _constAbsorption,
+                                    const WaterProperties &_water,
+                                    double _sonarFreq, double _deltaF,
+                                    int _nFreq)
+{
+  // dB/m of pressure to Np/m of amplitude
+  const double dbToNeper = log(10.0) / 20.0;
+  std::vector<float> table(_nFreq);
+  for (int f = 0; f < _nFreq; f++)
+  {
+    double absorption = _constAbsorption;
+    if (_model == AbsorptionModel::FRANCOIS_GARRISON)
+    {
+      // same bin frequencies as the echo synthesis
+      double offset;
+      if (_nFreq % 2 == 0)
+        offset = _deltaF * (-_nFreq / 2.0 + f + 1.0);
+      else
+        offset = _deltaF * (-(_nFreq - 1) / 2.0 + f + 1.0);
+      absorption = FrancoisGarrisonAbsorption(_sonarFreq + offset, _water);
+    }
+    table[f] = absorption * dbToNeper;
+  }
+  return table;
+}
+}  // namespace NpsGazeboSonar
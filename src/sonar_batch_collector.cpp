@@ -0,0 +1,113 @@
+/*
+ * Copyright 2020 Naval Postgraduate School
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+
+#include <nps_uw_sensors_gazebo/sonar_batch_collector.hh>
+
+#include <algorithm>
+#include <utility>
+
+namespace NpsGazeboSonar
+{
+/////////////////////////////////////////////////
+SonarBatchCollector &SonarBatchCollector::Instance()
+{
+  static SonarBatchCollector instance;
+  return instance;
+}
+
+/////////////////////////////////////////////////
+SonarBatchCollector::SonarBatchCollector()
+  : batches(0), frames(0)
+{
+}
+
+/////////////////////////////////////////////////
+void SonarBatchCollector::Announce(double _stamp)
+{
+  std::lock_guard<std::mutex> guard(this->mutex);
+  this->pending[_stamp].outstanding++;
+}
+
+/////////////////////////////////////////////////
+void SonarBatchCollector::Withdraw(double _stamp)
+{
+  Batch batch;
+  {
+    std::lock_guard<std::mutex> guard(this->mutex);
+    auto found = this->pending.find(_stamp);
+    if (found == this->pending.end())
+      return;
+    found->second.outstanding--;
+    if (!this->Complete(_stamp, batch))
+      return;
+  }
+  this->Run(batch);
+}
+
+/////////////////////////////////////////////////
+void SonarBatchCollector::Submit(const SonarFrame &_frame, double _stamp,
+                                 SonarBatchDone _done)
+{
+  Batch batch;
+  {
+    std::lock_guard<std::mutex> guard(this->mutex);
+    Batch &slot = this->pending[_stamp];
+    slot.outstanding = std::max(slot.outstanding - 1, 0);
+    slot.frames.push_back(_frame);
+    slot.done.push_back(std::move(_done));
+    if (!this->Complete(_stamp, batch))
+      return;
+  }
+  this->Run(batch);
+}
+
+/////////////////////////////////////////////////
+void SonarBatchCollector::Stats(uint64_t &_batches,
+                                uint64_t &_frames) const
+{
+  std::lock_guard<std::mutex> guard(this->mutex);
+  _batches = this->batches;
+  _frames = this->frames;
+}
+
+/////////////////////////////////////////////////
+bool SonarBatchCollector::Complete(double _stamp, Batch &_batch)
+{
+  auto found = this->pending.find(_stamp);
+  if (found == this->pending.end() || found->second.outstanding > 0)
+    return false;
+  _batch = std::move(found->second);
+  this->pending.erase(found);
+  if (!_batch.frames.empty())
+  {
+    this->batches++;
+    this->frames += _batch.frames.size();
+  }
+  return true;
+}
+
+/////////////////////////////////////////////////
+void SonarBatchCollector::Run(Batch &_batch)
+{
+  if (_batch.frames.empty())
+    return;
+  std::vector<SonarResult> results =
+      sonar_calculation_batch_wrapper(_batch.frames);
+  for (size_t i = 0; i < _batch.done.size(); i++)
+    _batch.done[i](std::move(results[i]));
+}
+}  // namespace NpsGazeboSonar
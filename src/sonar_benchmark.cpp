@@ -0,0 +1,448 @@
+/*
+ * Copyright 2020 Naval Postgraduate School
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+
+// Offline benchmark of the sonar engine on a synthetic seabed scene.
+// Usage: nps_sonar_benchmark [nBeams] [nRays] [iterations]
+
+#include <nps_uw_sensors_gazebo/sonar_calculation_cuda.cuh>
+#include <nps_uw_sensors_gazebo/sonar_table_cache.hh>
+#include <nps_uw_sensors_gazebo/sonar_absorption.hh>
+#include <nps_uw_sensors_gazebo/sonar_ray_lod.hh>
+
+#include <math.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <vector>
+
+namespace
+{
+// P900 like configuration
+const double SONAR_FREQ = 900e3;
+const double BANDWIDTH = 29.9e3;
+const double SOUND_SPEED = 1500.0;
+const double MAX_DISTANCE = 10.0;
+const double HFOV = 90.0 * M_PI / 180.0;
+const double VFOV = 20.0 * M_PI / 180.0;
+// Longest range of the math function checks [m], the default maxDistance
+// of the plugin
+const double PHASE_DISTANCE = 60.0;
+
+/// \brief Seabed seen from 2 m above, tilted down by half the VFOV and
+/// sloping up across the fan
+void SyntheticScene(int _width, int _height, uint64_t _seed,
+                    cv::Mat &_depth, cv::Mat &_normal, cv::Mat &_rand)
+{
+  _depth = cv::Mat(_height, _width, CV_32FC1);
+  _normal = cv::Mat(_height, _width, CV_32FC3);
+  _rand = cv::Mat(_height, _width, CV_32FC2);
+  const double fl = _width / (2.0 * tan(HFOV / 2.0));
+  for (int row = 0; row < _height; row++)
+  {
+    const double elevation = atan2(row - 0.5 * (_height - 1), fl)
+                             + VFOV / 2.0;
+    for (int col = 0; col < _width; col++)
+    {
+      const double altitude = 2.0 - 0.5 * col / _width;
+      _depth.at<float>(row, col) =
+          elevation > 0.0 ? altitude / sin(elevation) : 0.0;
+      _normal.at<cv::Vec3f>(row, col) = cv::Vec3f(0.0, -1.0, 0.0);
+    }
+  }
+  cv::RNG rng(_seed);
+  rng.fill(_rand, cv::RNG::NORMAL, 0.f, 1.f);
+}
+
+/// \brief Single camera frame with k columns per beam
+void MakeFrame(int _nBeams, int _k, int _nRays, int _raySkips, int _nFreq,
+               uint64_t _seed, const NpsGazeboSonar::SonarTablesPtr &_tables,
+               const std::vector<float> &_attenuation,
+               NpsGazeboSonar::SonarFrame &_frame)
+{
+  const int width = _nBeams * _k;
+  NpsGazeboSonar::SonarView view;
+  SyntheticScene(width, _nRays, _seed, view.depth_image, view.normal_image,
+                 view.rand_image);
+  view.hFOV = HFOV;
+  view.columnBeam = _tables->columnBeam.data();
+  view.columnSlot = _tables->columnSlot.data();
+  view.columnPattern = _tables->azimuthBeamPattern.data();
+  view.nSlots = _k;
+  _frame.views.assign(1, view);
+
+  NpsGazeboSonar::SonarCalculationConfig &config = _frame.config;
+  config.hPixelSize = HFOV / width;
+  config.vPixelSize = VFOV / _nRays;
+  config.hFOV = HFOV;
+  config.vFOV = VFOV;
+  config.beam_azimuthAngleWidth = HFOV / _nBeams;
+  config.beam_elevationAngleWidth = VFOV / _nRays;
+  config.ray_azimuthAngleWidth = HFOV / width;
+  config.ray_elevationAngleWidth = VFOV / _nRays * _raySkips;
+  config.soundSpeed = SOUND_SPEED;
+  config.minDistance = 0.0;
+  config.maxDistance = MAX_DISTANCE;
+  config.sourceLevel = 220;
+  config.nBeams = _nBeams;
+  config.nRays = _nRays;
+  config.raySkips = _raySkips;
+  config.rowWeight = nullptr;
+  config.sonarFreq = SONAR_FREQ;
+  config.bandwidth = BANDWIDTH;
+  config.nFreq = _nFreq;
+  config.mu = 1e-3;
+  config.reflectivity = nullptr;
+  config.nMaterials = 0;
+  config.attenuation = _attenuation.data();
+  config.window = _tables->window.data();
+  config.beamCorrector = _tables->beamCorrector.data();
+  config.beamCorrectorSum = _tables->beamCorrectorSum;
+  config.debugFlag = false;
+}
+
+/// \brief Maximum error of the math functions of tier P against the
+/// double library functions over their ranges in the sonar model, and the
+/// host time to evaluate all of them [ns per sample]. Sincos covers the
+/// echo phases 2 k d up to the band edge at PHASE_DISTANCE.
+template <NpsGazeboSonar::SonarPrecision P>
+void FunctionErrors(double &_sinc, double &_sincos, double &_acos,
+                    double &_exp, double &_ns)
+{
+  typedef NpsGazeboSonar::SonarMath<P> Math;
+  const int n = 1000000;
+  const double maxPhase =
+      2.0 * (2.0 * M_PI * BANDWIDTH / 2.0 / SOUND_SPEED) * PHASE_DISTANCE;
+  // Arguments of each function at sample _i
+  auto arguments = [n, maxPhase](int _i, float &_t, float &_x, float &_c,
+                                 float &_e)
+  {
+    const double u = static_cast<double>(_i) / (n - 1);
+    _t = -50.0 + 100.0 * u;
+    _x = maxPhase * (2.0 * u - 1.0);
+    _c = -1.0 + 2.0 * u;
+    _e = -20.0 + 25.0 * u;
+  };
+
+  float t, x, c, e, sine, cosine;
+  float sink = 0.0f;
+  auto start = std::chrono::high_resolution_clock::now();
+  for (int i = 0; i < n; i++)
+  {
+    arguments(i, t, x, c, e);
+    Math::Sincos(x, sine, cosine);
+    sink += Math::Sinc(t) + sine + cosine + Math::Acos(c) + Math::Exp(e);
+  }
+  auto stop = std::chrono::high_resolution_clock::now();
+  _ns = std::chrono::duration<double, std::nano>(stop - start).count() / n;
+  if (sink == 1234.5f)
+    printf(" ");
+
+  _sinc = _sincos = _acos = _exp = 0.0;
+  for (int i = 0; i < n; i++)
+  {
+    arguments(i, t, x, c, e);
+    Math::Sincos(x, sine, cosine);
+    const double td = t;
+    _sinc = std::max(_sinc, fabs(Math::Sinc(t)
+                                 - (fabs(td) < 1E-8 ? 1.0 : sin(td) / td)));
+    _sincos = std::max(_sincos, std::max(fabs(sine - sin(double(x))),
+                                         fabs(cosine - cos(double(x)))));
+    _acos = std::max(_acos, fabs(Math::Acos(c) - acos(double(c))));
+    _exp = std::max(_exp, fabs(Math::Exp(e) / exp(double(e)) - 1.0));
+  }
+}
+
+/// \brief Add the beam intensities |P|^2 of a result to _sum
+void AccumulateIntensity(const NpsGazeboSonar::SonarResult &_result,
+                         std::vector<double> &_sum)
+{
+  size_t index = 0;
+  for (size_t beam = 0; beam < _result.beams.size(); beam++)
+    for (size_t f = 0; f < _result.beams[beam].size(); f++, index++)
+      _sum[index] += std::norm(_result.beams[beam][f]);
+}
+}  // namespace
+
+int main(int argc, char **argv)
+{
+  const int nBeams = argc > 1 ? atoi(argv[1]) : 256;
+  const int nRays = argc > 2 ? atoi(argv[2]) : 128;
+  const int iterations = argc > 3 ? atoi(argv[3]) : 20;
+
+  NpsGazeboSonar::check_cuda_init_wrapper();
+
+  const double max_T = MAX_DISTANCE * 2.0 / SOUND_SPEED;
+  const int nFreq = ceil(BANDWIDTH * max_T);
+  std::vector<float> attenuation = NpsGazeboSonar::AttenuationTable(
+      NpsGazeboSonar::AbsorptionModel::CONSTANT, 0.0354,
+      NpsGazeboSonar::WaterProperties(), SONAR_FREQ, 1.0 / max_T, nFreq);
+
+  auto tablesFor = [&](int k)
+  {
+    NpsGazeboSonar::SonarTableKey key;
+    key.nBeams = nBeams;
+    key.nFreq = nFreq;
+    key.azimuthRaysPerBeam = k;
+    key.hFOV = HFOV;
+    key.bandwidth = BANDWIDTH;
+    key.soundSpeed = SOUND_SPEED;
+    return NpsGazeboSonar::SonarTableCache::Instance().Acquire(key);
+  };
+
+  printf("nBeams %d, nRays %d, nFreq %d, %d iterations\n",
+         nBeams, nRays, nFreq, iterations);
+
+  // Azimuth supersampling cost
+  printf("%4s %8s %12s %10s\n", "k", "width", "ms/frame", "vs k=1");
+  double baseline = 0.0;
+  for (int k = 1; k <= 8; k++)
+  {
+    NpsGazeboSonar::SonarTablesPtr tables = tablesFor(k);
+    NpsGazeboSonar::SonarFrame frame;
+    MakeFrame(nBeams, k, nRays, 1, nFreq, 42, tables, attenuation, frame);
+
+    // warm up, plan creation and first allocations
+    NpsGazeboSonar::sonar_calculation_wrapper(frame);
+
+    auto start = std::chrono::high_resolution_clock::now();
+    for (int i = 0; i < iterations; i++)
+      NpsGazeboSonar::sonar_calculation_wrapper(frame);
+    auto stop = std::chrono::high_resolution_clock::now();
+    const double ms = std::chrono::duration<double, std::milli>(
+                      stop - start).count() / iterations;
+    if (k == 1)
+      baseline = ms;
+    printf("%4d %8d %12.3f %10.2f\n", k, nBeams * k, ms, ms / baseline);
+  }
+
+  // Elevation sampling error vs cost: fixed rows every raySkips rows and
+  // one jittered row per segment of raySkips rows, against every row
+  // (raySkips 1). The mean intensity image over the iterations
+  // (independent speckle, the same seeds for every mode) is compared, the
+  // error is the RMS difference relative to the RMS of the reference.
+  NpsGazeboSonar::SonarTablesPtr tables = tablesFor(1);
+  const double focalLength = nBeams / (2.0 * tan(HFOV / 2.0));
+  auto meanIntensity = [&](int _raySkips, bool _stratified, double &_ms)
+  {
+    std::vector<double> sum(nBeams * nFreq, 0.0);
+    NpsGazeboSonar::SonarRayLOD sampler(nRays, _raySkips, 0, MAX_DISTANCE,
+                                        SOUND_SPEED / BANDWIDTH, focalLength,
+                                        true);
+    std::vector<float> rowWeight;
+    _ms = 0.0;
+    for (int i = 0; i < iterations; i++)
+    {
+      NpsGazeboSonar::SonarFrame frame;
+      MakeFrame(nBeams, 1, nRays, _raySkips, nFreq, 1000 + i, tables,
+                attenuation, frame);
+      if (_stratified)
+      {
+        sampler.Sample(i, rowWeight);
+        frame.config.rowWeight = rowWeight.data();
+      }
+      auto start = std::chrono::high_resolution_clock::now();
+      AccumulateIntensity(NpsGazeboSonar::sonar_calculation_wrapper(frame),
+                          sum);
+      auto stop = std::chrono::high_resolution_clock::now();
+      _ms += std::chrono::duration<double, std::milli>(stop - start).count();
+    }
+    _ms /= iterations;
+    for (double &value : sum)
+      value /= iterations;
+    return sum;
+  };
+
+  double fullMs;
+  const std::vector<double> reference = meanIntensity(1, false, fullMs);
+  double referenceSquares = 0.0;
+  for (double value : reference)
+    referenceSquares += value * value;
+
+  printf("\n%8s %12s %12s %10s %10s\n", "raySkips", "sampling",
+         "ms/frame", "vs full", "rel. RMS");
+  for (int raySkips = 2; raySkips <= 8; raySkips *= 2)
+  {
+    for (int stratified = 0; stratified < 2; stratified++)
+    {
+      double ms;
+      const std::vector<double> mean =
+          meanIntensity(raySkips, stratified, ms);
+      double squares = 0.0;
+      for (size_t index = 0; index < mean.size(); index++)
+        squares += pow(mean[index] - reference[index], 2);
+      printf("%8d %12s %12.3f %10.2f %10.4f\n", raySkips,
+             stratified ? "stratified" : "fixed", ms, ms / fullMs,
+             referenceSquares > 0.0 ? sqrt(squares / referenceSquares) : 0.0);
+    }
+  }
+
+  // Tiled processing at a high render resolution (at least 1024 columns):
+  // echo synthesis of shared memory tiles vs the ray buffer. The device
+  // traffic of the rays is counted by the engine on a separate run, so
+  // the atomics of the count stay out of the timing.
+  const int kTiled = std::max(1, (1024 + nBeams - 1) / nBeams);
+  NpsGazeboSonar::SonarTablesPtr tiledTables = tablesFor(kTiled);
+  NpsGazeboSonar::SonarFrame tiledFrame;
+  MakeFrame(nBeams, kTiled, nRays, 1, nFreq, 7, tiledTables, attenuation,
+            tiledFrame);
+  printf("\n%8s %8s %12s %14s\n", "width", "tiled", "ms/frame",
+         "ray MB/frame");
+  std::vector<double> tiledSum[2];
+  for (int tiled = 0; tiled < 2; tiled++)
+  {
+    tiledFrame.tiled = tiled;
+    tiledFrame.countRayBytes = true;
+    const NpsGazeboSonar::SonarResult counted =
+        NpsGazeboSonar::sonar_calculation_wrapper(tiledFrame);
+    tiledSum[tiled].assign(nBeams * nFreq, 0.0);
+    AccumulateIntensity(counted, tiledSum[tiled]);
+
+    tiledFrame.countRayBytes = false;
+    auto start = std::chrono::high_resolution_clock::now();
+    for (int i = 0; i < iterations; i++)
+      NpsGazeboSonar::sonar_calculation_wrapper(tiledFrame);
+    auto stop = std::chrono::high_resolution_clock::now();
+    const double ms = std::chrono::duration<double, std::milli>(
+                      stop - start).count() / iterations;
+    printf("%8d %8s %12.3f %14.2f\n", nBeams * kTiled,
+           tiled ? "yes" : "no", ms, counted.rayBytes / 1e6);
+  }
+
+  // Both paths sum the same rays, only in a different order
+  double difference = 0.0, norm = 0.0;
+  for (size_t index = 0; index < tiledSum[0].size(); index++)
+  {
+    difference += pow(tiledSum[1][index] - tiledSum[0][index], 2);
+    norm += pow(tiledSum[0][index], 2);
+  }
+  printf("tiled vs untiled rel. difference %.2e\n",
+         norm > 0.0 ? sqrt(difference / norm) : 0.0);
+
+  // Precision tiers: maximum error of each approximation against the
+  // double functions and their host time, and engine time and intensity
+  // error against the double tier on the same frame
+  const NpsGazeboSonar::SonarPrecision tiers[] = {
+      NpsGazeboSonar::SonarPrecision::DOUBLE,
+      NpsGazeboSonar::SonarPrecision::SINGLE,
+      NpsGazeboSonar::SonarPrecision::FAST};
+  NpsGazeboSonar::SonarFrame tierFrame;
+  MakeFrame(nBeams, 1, nRays, 1, nFreq, 11, tables, attenuation, tierFrame);
+  std::vector<double> referenceIntensity;
+  double doubleMs = 0.0;
+  printf("\n%8s %10s %10s %10s %10s %12s %12s %10s %10s\n", "tier",
+         "sinc", "sincos", "acos", "exp (rel)", "host ns/eval", "ms/frame",
+         "speedup", "rel. error");
+  for (NpsGazeboSonar::SonarPrecision tier : tiers)
+  {
+    double sinc, sincos, acos, exp, ns;
+    if (tier == NpsGazeboSonar::SonarPrecision::DOUBLE)
+      FunctionErrors<NpsGazeboSonar::SonarPrecision::DOUBLE>(
+          sinc, sincos, acos, exp, ns);
+    else if (tier == NpsGazeboSonar::SonarPrecision::SINGLE)
+      FunctionErrors<NpsGazeboSonar::SonarPrecision::SINGLE>(
+          sinc, sincos, acos, exp, ns);
+    else
+      FunctionErrors<NpsGazeboSonar::SonarPrecision::FAST>(
+          sinc, sincos, acos, exp, ns);
+
+    tierFrame.config.precision = tier;
+    NpsGazeboSonar::sonar_calculation_wrapper(tierFrame);
+    std::vector<double> intensity(nBeams * nFreq, 0.0);
+    auto start = std::chrono::high_resolution_clock::now();
+    for (int i = 0; i < iterations; i++)
+    {
+      NpsGazeboSonar::SonarResult result =
+          NpsGazeboSonar::sonar_calculation_wrapper(tierFrame);
+      if (i == 0)
+        AccumulateIntensity(result, intensity);
+    }
+    auto stop = std::chrono::high_resolution_clock::now();
+    const double ms = std::chrono::duration<double, std::milli>(
+                      stop - start).count() / iterations;
+    if (tier == NpsGazeboSonar::SonarPrecision::DOUBLE)
+    {
+      referenceIntensity = intensity;
+      doubleMs = ms;
+    }
+    double error = 0.0, peak = 0.0;
+    for (size_t index = 0; index < intensity.size(); index++)
+    {
+      error = std::max(error,
+                       fabs(intensity[index] - referenceIntensity[index]));
+      peak = std::max(peak, referenceIntensity[index]);
+    }
+    printf("%8s %10.2e %10.2e %10.2e %10.2e %12.2f %12.3f %10.2f %10.2e\n",
+           NpsGazeboSonar::PrecisionName(tier), sinc, sincos, acos, exp, ns,
+           ms, doubleMs / ms, peak > 0.0 ? error / peak : 0.0);
+  }
+
+  // Shipped presets: synthesis kernels specialized for the model's beam
+  // layout vs the generic kernels, with the ray buffer and with tiles, at
+  // the blueview_p900 range and bandwidth. The error is the largest
+  // intensity difference relative to the peak.
+  printf("\n%14s %8s %8s %6s %8s %12s %12s %10s %10s\n", "preset",
+         "nBeams", "nFreq", "bins", "tiled", "generic ms", "preset ms",
+         "speedup", "rel. error");
+  for (const NpsGazeboSonar::SonarPreset &preset :
+       NpsGazeboSonar::SONAR_PRESETS)
+  {
+    NpsGazeboSonar::SonarTableKey key;
+    key.nBeams = preset.nBeams;
+    key.nFreq = nFreq;
+    key.azimuthRaysPerBeam = preset.columnsPerBeam;
+    key.hFOV = HFOV;
+    key.bandwidth = BANDWIDTH;
+    key.soundSpeed = SOUND_SPEED;
+    NpsGazeboSonar::SonarTablesPtr presetTables =
+        NpsGazeboSonar::SonarTableCache::Instance().Acquire(key);
+    NpsGazeboSonar::SonarFrame presetFrame;
+    MakeFrame(preset.nBeams, preset.columnsPerBeam, nRays, 1, nFreq, 13,
+              presetTables, attenuation, presetFrame);
+    for (int tiled = 0; tiled < 2; tiled++)
+    {
+      presetFrame.tiled = tiled;
+      double ms[2];
+      std::vector<double> intensity[2];
+      for (int specialized = 0; specialized < 2; specialized++)
+      {
+        presetFrame.config.presets = specialized;
+        intensity[specialized].assign(preset.nBeams * nFreq, 0.0);
+        AccumulateIntensity(
+            NpsGazeboSonar::sonar_calculation_wrapper(presetFrame),
+            intensity[specialized]);
+        auto start = std::chrono::high_resolution_clock::now();
+        for (int i = 0; i < iterations; i++)
+          NpsGazeboSonar::sonar_calculation_wrapper(presetFrame);
+        auto stop = std::chrono::high_resolution_clock::now();
+        ms[specialized] = std::chrono::duration<double, std::milli>(
+                          stop - start).count() / iterations;
+      }
+      double error = 0.0, peak = 0.0;
+      for (size_t index = 0; index < intensity[0].size(); index++)
+      {
+        error = std::max(error,
+                         fabs(intensity[1][index] - intensity[0][index]));
+        peak = std::max(peak, intensity[0][index]);
+      }
+      printf("%14s %8d %8d %6d %8s %12.3f %12.3f %10.2f %10.2e\n",
+             preset.model, preset.nBeams, nFreq, preset.binsPerThread,
+             tiled ? "yes" : "no", ms[0], ms[1], ms[0] / ms[1],
+             peak > 0.0 ? error / peak : 0.0);
+    }
+  }
+  return 0;
+}
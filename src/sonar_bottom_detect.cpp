@@ -0,0 +1,114 @@
+/*
+ * Copyright 2020 Naval Postgraduate School
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+
+#include <nps_uw_sensors_gazebo/sonar_bottom_detect.hh>
+
+#include <math.h>
+#include <algorithm>
+
+namespace NpsGazeboSonar
+{
+/////////////////////////////////////////////////
+bool ParseReturnMode(const std::string &_name, ReturnMode &_mode)
+{
+  if (_name == "leading_edge")
+    _mode = ReturnMode::LEADING_EDGE;
+  else if (_name == "peak")
+    _mode = ReturnMode::PEAK;
+  else
+    return false;
+  return true;
+}
+
+/////////////////////////////////////////////////
+SonarBottomDetector::SonarBottomDetector(ReturnMode _mode, double _threshold,
+                                         double _minIntensity,
+                                         double _minRange)
+  : mode(_mode),
+    threshold(std::min(std::max(_threshold, 0.0), 1.0)),
+    minIntensity(std::max(_minIntensity, 0.0)),
+    minRange(std::max(_minRange, 0.0))
+{
+}
+
+/////////////////////////////////////////////////
+bool SonarBottomDetector::Detect(int _beam, const float *_amplitude,
+                                 int _nBins, float _rangeResolution,
+                                 SonarReturn &_return) const
+{
+  if (_nBins <= 0 || !(_rangeResolution > 0.0f))
+    return false;
+  const int first = std::min(
+      static_cast<int>(ceil(this->minRange / _rangeResolution)), _nBins);
+
+  // Peak of the beam, the single pass over its bins
+  int peak = -1;
+  float peakValue = this->minIntensity;
+  for (int bin = first; bin < _nBins; bin++)
+  {
+    if (_amplitude[bin] > peakValue)
+    {
+      peakValue = _amplitude[bin];
+      peak = bin;
+    }
+  }
+  if (peak < 0)
+    return false;
+
+  float position = peak;
+  if (this->mode == ReturnMode::PEAK)
+  {
+    // Vertex of the parabola through the peak and its neighbours
+    if (peak > first && peak < _nBins - 1)
+    {
+      const float left = _amplitude[peak - 1];
+      const float right = _amplitude[peak + 1];
+      const float curvature = left - 2.0f * peakValue + right;
+      if (curvature < 0.0f)
+        position += 0.5f * (left - right) / curvature;
+    }
+  }
+  else
+  {
+    // Walk back from the peak to the last bin below the level, the
+    // crossing is interpolated between it and the next bin
+    const float level = this->threshold * peakValue;
+    int bin = peak;
+    while (bin > first && _amplitude[bin - 1] >= level)
+      bin--;
+    position = bin;
+    if (bin > first)
+    {
+      const float below = _amplitude[bin - 1];
+      const float above = _amplitude[bin];
+      if (above > below)
+        position = bin - 1 + (level - below) / (above - below);
+    }
+  }
+
+  _return.beam = _beam;
+  _return.range = position * _rangeResolution;
+  _return.intensity = peakValue;
+  return true;
+}
+
+/////////////////////////////////////////////////
+ReturnMode SonarBottomDetector::Mode() const
+{
+  return this->mode;
+}
+}  // namespace NpsGazeboSonar
@@ -16,6 +16,7 @@
 */
 
 #include <nps_uw_sensors_gazebo/sonar_calculation_cuda.cuh>
+#include <nps_uw_sensors_gazebo/sonar_precision.cuh>
 
 // #include <math.h>
 #include <assert.h>
@@ -34,10 +35,21 @@
 #include <cufftw.h>
 #include <thrust/device_vector.h>
 #include <list>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <utility>
+#include <vector>
 
 #include <chrono>
 
 #define BLOCK_SIZE 32
+// Threads of a tiled synthesis block, also the rays it keeps in shared memory
+#define TILE_RAYS 256
+// Bisections of a multipath march step that went behind a surface
+#define MULTIPATH_REFINE 4
 
 static inline void _safe_cuda_call(cudaError err, const char *msg,
                                    const char *file_name, const int line_number)
@@ -57,12 +69,17 @@ static inline void _safe_cuda_call(cudaError err, const char *msg,
 // Incident Angle Calculation Function
 // incidence angle is target's normal angle accounting for the ray's azimuth
 // and elevation
+template <NpsGazeboSonar::SonarPrecision P>
 __device__ float compute_incidence(float azimuth, float elevation, float *normal)
 {
+  typedef NpsGazeboSonar::SonarMath<P> Math;
   // ray normal from camera azimuth and elevation
-  float camera_x = cosf(-azimuth) * cosf(elevation);
-  float camera_y = sinf(-azimuth) * cosf(elevation);
-  float camera_z = sinf(elevation);
+  float sin_azimuth, cos_azimuth, sin_elevation, cos_elevation;
+  Math::Sincos(-azimuth, sin_azimuth, cos_azimuth);
+  Math::Sincos(elevation, sin_elevation, cos_elevation);
+  float camera_x = cos_azimuth * cos_elevation;
+  float camera_y = sin_azimuth * cos_elevation;
+  float camera_z = sin_elevation;
   float ray_normal[3] = {camera_x, camera_y, camera_z};
 
   // target normal with axes compensated to camera axes
@@ -78,79 +95,267 @@ __device__ float compute_incidence(float azimuth, float elevation, float *normal
 
   //   printf("TEST    %f \n", dot_product);
 
-  return M_PI - acosf(dot_product);
+  return static_cast<float>(M_PI) - Math::Acos(dot_product);
 }
 
 ///////////////////////////////////////////////////////////////////////////
-__device__ __host__ float unnormalized_sinc(float t)
+// Sums the spectra of nViews camera views, stored back to back, into the
+// first one
+__global__ void spectrum_merge(thrust::complex<float> *P_Beams_F,
+                               int nViews, int N)
 {
-  if (abs(t) < 1E-8)
-    return 1.0;
-  else
-    return sin(t) / t;
+  const int index = blockIdx.x * blockDim.x + threadIdx.x;
+  if (index < N)
+  {
+    thrust::complex<float> sum = P_Beams_F[index];
+    for (int view = 1; view < nViews; view++)
+      sum += P_Beams_F[view * N + index];
+    P_Beams_F[index] = sum;
+  }
 }
 
 ///////////////////////////////////////////////////////////////////////////
-template <typename T>
-__global__ void column_sums_reduce(const T *__restrict__ in, T *__restrict__ out, size_t width, size_t height)
+// Incremental mode: adds the change P to the accumulated spectrum S (or
+// restarts it) and replaces P by the accumulated spectrum. A fresh
+// spectrum recomputed every frame (multipath) is added to the output but
+// never accumulated.
+__global__ void spectrum_accumulate(thrust::complex<float> *P_Beams_F,
+                                    thrust::complex<float> *accumulated,
+                                    const thrust::complex<float> *fresh,
+                                    int N, bool restart)
 {
+  const int index = blockIdx.x * blockDim.x + threadIdx.x;
+  if (index < N)
+  {
+    thrust::complex<float> sum = P_Beams_F[index];
+    if (!restart)
+      sum += accumulated[index];
+    accumulated[index] = sum;
+    if (fresh)
+      sum += fresh[index];
+    P_Beams_F[index] = sum;
+  }
+}
 
-  __shared__ T sdata[BLOCK_SIZE][BLOCK_SIZE + 1];
-  size_t idx = threadIdx.x + blockDim.x * blockIdx.x;
-  size_t width_stride = gridDim.x * blockDim.x;
-  size_t full_width = (width & (~((unsigned long long)(BLOCK_SIZE - 1)))) + ((width & (BLOCK_SIZE - 1)) ? BLOCK_SIZE : 0); // round up to next block
-  for (size_t w = idx; w < full_width; w += width_stride)
-  { // grid-stride loop across matrix width
-    sdata[threadIdx.y][threadIdx.x] = 0;
-    size_t in_ptr = w + threadIdx.y * width;
-    for (size_t h = threadIdx.y; h < height; h += BLOCK_SIZE)
-    { // block-stride loop across matrix height
-      sdata[threadIdx.y][threadIdx.x] += (w < width) ? in[in_ptr] : 0;
-      in_ptr += width * BLOCK_SIZE;
-    }
-    __syncthreads();
-    T my_val = sdata[threadIdx.x][threadIdx.y];
-    for (int i = warpSize >> 1; i > 0; i >>= 1) // warp-wise parallel sum reduction
-      my_val += __shfl_xor_sync(0xFFFFFFFFU, my_val, i);
-    __syncthreads();
-    if (threadIdx.x == 0)
-      sdata[0][threadIdx.y] = my_val;
-    __syncthreads();
-    if ((threadIdx.y == 0) && ((w) < width))
-      out[w] = sdata[0][threadIdx.x];
+///////////////////////////////////////////////////////////////////////////
+// Beam culling correction and windowing in one pass
+// P_Beams_Cor[beam][f] = window[f] / beamCorrectorSum
+//                        * sum_other beamCorrector[beam][other] * P[other][f]
+// With a transmit waveform, transmit[f] (transmit x window) takes the
+// place of window[f] and the echo is then compressed by matchedFilter[f]
+__global__ void beam_correction_window(const thrust::complex<float> *P_Beams_F,
+                                       thrust::complex<float> *P_Beams_Cor,
+                                       const float *beamCorrector,
+                                       const float *window,
+                                       const thrust::complex<float> *transmit,
+                                       const thrust::complex<float> *matchedFilter,
+                                       float beamCorrectorSum,
+                                       int nBeams, int nFreq)
+{
+  const int f = blockIdx.x * blockDim.x + threadIdx.x;
+  const int beam = blockIdx.y;
+  if (f < nFreq && beam < nBeams)
+  {
+    thrust::complex<float> sum(0.0f, 0.0f);
+    for (int beam_other = 0; beam_other < nBeams; beam_other++)
+      sum += beamCorrector[beam * nBeams + beam_other]
+             * P_Beams_F[beam_other * nFreq + f];
+    thrust::complex<float> echo;
+    if (transmit)
+      echo = sum * (transmit[f] / beamCorrectorSum);
+    else
+      echo = sum * (window[f] / beamCorrectorSum);
+    if (matchedFilter)
+      echo *= matchedFilter[f];
+    P_Beams_Cor[beam * nFreq + f] = echo;
   }
 }
 
-__global__ void gpu_matrix_mult(float *a, float *b, float *c, int m, int n, int k)
+///////////////////////////////////////////////////////////////////////////
+// Ray returned to a beam, stored in per-beam segments of nRaysPerBeam
+// (column slots per beam x nRaysSkipped) entries. A negative or NaN
+// distance marks a ray without a return.
+struct SonarRay
+{
+  float distance;
+  thrust::complex<float> amplitude;
+};
+
+///////////////////////////////////////////////////////////////////////////
+// Device side refraction table of a frame, bilinear over the depression
+// angle and straight distance of a ray. A null path keeps straight rays.
+struct RefractionLookup
 {
-  int row = blockIdx.y * blockDim.y + threadIdx.y;
-  int col = blockIdx.x * blockDim.x + threadIdx.x;
-  float sum = 0;
-  if (col < k && row < m)
+  const float *path;
+  const float *delay;
+  int nElevations;
+  int nDistances;
+  float minElevation;
+  float elevationStep;
+  float distanceStep;
+  float declination;
+
+  // Replaces the straight distance by the bent path length and the range
+  // of the travel time
+  __device__ void Apply(float elevation, float distance,
+                        float &bentPath, float &bentRange) const
   {
-    for (int i = 0; i < n; i++)
-    {
-      sum += a[row * n + i] * b[i * k + col];
-    }
-    c[row * k + col] = sum;
+    bentPath = distance;
+    bentRange = distance;
+    if (!path)
+      return;
+    const float e = fminf(fmaxf((elevation + declination - minElevation)
+                                / elevationStep, 0.0f), nElevations - 1.0f);
+    const float d = fminf(fmaxf(distance / distanceStep, 0.0f),
+                          nDistances - 1.0f);
+    const int e0 = min(static_cast<int>(e), nElevations - 2);
+    const int d0 = min(static_cast<int>(d), nDistances - 2);
+    const float te = e - e0;
+    const float td = d - d0;
+    const int i00 = e0 * nDistances + d0;
+    const int i10 = i00 + nDistances;
+    bentPath += (path[i00] * (1.0f - td) + path[i00 + 1] * td) * (1.0f - te)
+                + (path[i10] * (1.0f - td) + path[i10 + 1] * td) * te;
+    bentRange += (delay[i00] * (1.0f - td) + delay[i00 + 1] * td) * (1.0f - te)
+                 + (delay[i10] * (1.0f - td) + delay[i10 + 1] * td) * te;
   }
+};
+
+///////////////////////////////////////////////////////////////////////////
+// Noise of a ray without a random image: a unit phasor x sqrt(2) at a
+// random phase fixed by the pixel and seed. The sum of the rays of a beam
+// stays incoherent, with the power of the Gaussian noise of a random
+// image, and the same seed gives the same phase to the same pixel, which
+// incremental updates need to remove a previous contribution.
+template <NpsGazeboSonar::SonarPrecision P>
+__device__ void ray_phase(int column, int ray, unsigned int seed,
+                          float &xi_z, float &xi_y)
+{
+  unsigned int hash = seed ^ (static_cast<unsigned int>(ray) * 0x9E3779B9u
+                              + static_cast<unsigned int>(column));
+  hash = (hash ^ (hash >> 16)) * 0x7FEB352Du;
+  hash = (hash ^ (hash >> 15)) * 0x846CA68Bu;
+  hash ^= hash >> 16;
+  const float phase = static_cast<float>(2.0 * M_PI / 16777216.0)
+                      * (hash >> 8) - static_cast<float>(M_PI);
+  NpsGazeboSonar::SonarMath<P>::Sincos(phase, xi_y, xi_z);
+  xi_z *= static_cast<float>(M_SQRT2);
+  xi_y *= static_cast<float>(M_SQRT2);
 }
 
-__global__ void gpu_diag_matrix_mult(float *Val, int *RowPtr, float *diagVals, int total_rows)
+///////////////////////////////////////////////////////////////////////////
+// Point scattering amplitude of the ray of one image pixel, evaluated at
+// precision tier P. Returns false for rays with no return (zero depth) or
+// outside the range window. With refraction the range is the travel time
+// of the bent ray and the spreading follows its path length.
+template <NpsGazeboSonar::SonarPrecision P>
+__device__ bool ray_amplitude(int column, int ray,
+                              const float *depth_image,
+                              const float *normal_image,
+                              int width, int height,
+                              int depth_image_step,
+                              int normal_image_step,
+                              const float *rand_image,
+                              int rand_image_step,
+                              unsigned int phaseSeed,
+                              const unsigned char *material_image,
+                              int material_image_step,
+                              const float *reflectivity,
+                              const float *columnPattern,
+                              float focalLength, float vFOV,
+                              float sourceTerm,
+                              const float *rowWeight,
+                              float minDistance, float maxDistance,
+                              float mu_sqrt, float area_scaler,
+                              const RefractionLookup &refraction,
+                              float &distance,
+                              thrust::complex<float> &amplitude)
 {
-  const int row = threadIdx.x + blockIdx.x * blockDim.x;
-  if (row < total_rows)
+  typedef NpsGazeboSonar::SonarMath<P> Math;
+  // Location of the image pixel
+  const int depth_index = ray * depth_image_step / sizeof(float) + column;
+  const int normal_index = ray * normal_image_step / sizeof(float) + (3 * column);
+  const int rand_index = ray * rand_image_step / sizeof(float) + (2 * column);
+  // Input parameters for ray processing
+  distance = depth_image[depth_index] * 1.0f;
+  if (!(distance > 0.0f))
+    return false;
+  float ray_elevationAngle = Math::Atan2(ray - 0.5f * (height-1),
+                                         focalLength);
+  float path;
+  refraction.Apply(ray_elevationAngle, distance, path, distance);
+  if (distance < minDistance || distance > maxDistance)
+    return false;
+  float normal[3] = {normal_image[normal_index],
+                     normal_image[normal_index + 1],
+                     normal_image[normal_index + 2]};
+  float ray_azimuthAngle = Math::Atan2(column - 0.5f * (width-1),
+                                       focalLength);
+
+  // Beam pattern
+  // azimuth pattern of this column relative to its beam center, from
+  // the precomputed column map (1 with a single column per beam)
+  float azimuthPattern = columnPattern[column];
+  float sin_elevation, cos_elevation;
+  Math::Sincos(ray_elevationAngle, sin_elevation, cos_elevation);
+  float elevationBeamPattern =
+      Math::Sinc(static_cast<float>(M_PI * 0.884) / vFOV * sin_elevation);
+  // incidence angle
+  float incidence = compute_incidence<P>(ray_azimuthAngle, ray_elevationAngle, normal);
+  float sin_incidence, cos_incidence;
+  Math::Sincos(incidence, sin_incidence, cos_incidence);
+
+  // ----- Point scattering model ------ //
+  // Gaussian noise generated using opencv RNG, a fixed random phase
+  // without a random image (speckle applied to the beamformed time
+  // samples)
+  float xi_z, xi_y;
+  if (rand_image)
   {
-    for (int i = RowPtr[row]; i < RowPtr[row + 1]; i++)
-    {
-      Val[i] = diagVals[row] * Val[i];
-    }
+    xi_z = rand_image[rand_index];
+    xi_y = rand_image[rand_index + 1];
   }
+  else
+    ray_phase<P>(column, ray, phaseSeed, xi_z, xi_y);
+
+  // Surface reflectivity, one gather from the material table
+  if (material_image)
+    mu_sqrt = reflectivity[material_image[ray * material_image_step + column]];
+
+  // Calculate amplitude
+  const float sqrt1_2 = static_cast<float>(M_SQRT1_2);
+  thrust::complex<float> randomAmps =
+      thrust::complex<float>(xi_z * sqrt1_2, xi_y * sqrt1_2);
+  thrust::complex<float> lambert_sqrt =
+      thrust::complex<float>(mu_sqrt * cos_incidence, 0.0);
+  thrust::complex<float> beamPattern =
+      thrust::complex<float>(azimuthPattern * elevationBeamPattern, 0.0);
+  // A row standing in for several rows covers their area as well, which
+  // keeps the expected echo energy unbiased
+  if (rowWeight)
+    area_scaler *= rowWeight[ray];
+  thrust::complex<float> targetArea_sqrt = thrust::complex<float>(sqrtf(path * area_scaler), 0.0);
+  // Spreading loss only, frequency dependent absorption is applied per
+  // bin during the echo synthesis
+  thrust::complex<float> propagationTerm =
+      thrust::complex<float>(1.0f / (path * path), 0.0);
+  amplitude = randomAmps * thrust::complex<float>(sourceTerm, 0.0)
+              * propagationTerm * beamPattern * lambert_sqrt * targetArea_sqrt;
+
+  return true;
 }
 
 ///////////////////////////////////////////////////////////////////////////
 // Sonar Claculation Function
-__global__ void sonar_calculation(thrust::complex<float> *P_Beams,
+// Evaluates the point scattering amplitude of every kept ray. Rays with no
+// return (zero depth), closer than minDistance or beyond maxDistance are
+// marked invalid and left out of the echo synthesis. With a tile mask only
+// rays of flagged tiles are evaluated, scaled by sign (-1 removes a
+// previous contribution), into the slots starting at slotOffset. The
+// bytes written to rays are added to rayBytes unless it is null.
+template <NpsGazeboSonar::SonarPrecision P>
+__global__ void sonar_calculation(SonarRay *rays,
+                                  unsigned long long *rayBytes,
                                   float *depth_image,
                                   float *normal_image,
                                   int width,
@@ -159,93 +364,1004 @@ __global__ void sonar_calculation(thrust::complex<float> *P_Beams,
                                   int normal_image_step,
                                   float *rand_image,
                                   int rand_image_step,
+                                  unsigned int phaseSeed,
+                                  const unsigned char *material_image,
+                                  int material_image_step,
+                                  const float *reflectivity,
+                                  const int *columnBeam,
+                                  const int *columnSlot,
+                                  const float *columnPattern,
+                                  int nSlots,
+                                  int slotOffset,
+                                  const unsigned char *tileMask,
+                                  int tileSize,
+                                  int tilesPerRow,
+                                  float sign,
                                   float hPixelSize,
                                   float vPixelSize,
-                                  float hFOV,
+                                  float focalLength,
                                   float vFOV,
                                   float beam_azimuthAngleWidth,
                                   float beam_elevationAngleWidth,
                                   float ray_azimuthAngleWidth,
                                   float ray_elevationAngleWidth,
-                                  float soundSpeed,
                                   float sourceTerm,
                                   int nBeams, int nRays,
                                   int raySkips,
-                                  float sonarFreq, float delta_f,
-                                  int nFreq, float bandwidth,
-                                  float mu_sqrt, float attenuation,
-                                  float area_scaler)
+                                  const float *rowWeight,
+                                  float minDistance, float maxDistance,
+                                  float mu_sqrt, float area_scaler,
+                                  RefractionLookup refraction)
 {
-  // 2D Index of current thread
-  const int beam = blockIdx.x * blockDim.x + threadIdx.x;
+  // 2D Index of current thread, each image column is mapped to a beam
+  // and to a slot among the columns of that beam
+  const int column = blockIdx.x * blockDim.x + threadIdx.x;
   const int ray = blockIdx.y * blockDim.y + threadIdx.y;
 
+  // Number of rays kept per beam after skipping
+  const int nRaysSkipped = (nRays + raySkips - 1) / raySkips;
+  const int nRaysPerBeam = nRaysSkipped * nSlots;
+
   //Only valid threads perform memory I/O
-  if ((beam < width) && (ray < height) && (ray % raySkips == 0))
+  // Rows are sampled from the row weight table when given (at most one
+  // row per raySkips stratum), otherwise every raySkips-th row
+  if ((column < width) && (ray < height)
+      && (rowWeight ? rowWeight[ray] > 0.0f : ray % raySkips == 0)
+      && columnBeam[column] >= 0
+      && (!tileMask || tileMask[(ray / tileSize) * tilesPerRow
+                                + column / tileSize]))
   {
-    // Location of the image pixel
-    const int depth_index = ray * depth_image_step / sizeof(float) + beam;
-    const int normal_index = ray * normal_image_step / sizeof(float) + (3 * beam);
-    const int rand_index = ray * rand_image_step / sizeof(float) + (2 * beam);
-    // Input parameters for ray processing
-    float distance = depth_image[depth_index] * 1.0f;
-    float normal[3] = {normal_image[normal_index],
-                      normal_image[normal_index + 1],
-                      normal_image[normal_index + 2]};
-    double fl = static_cast<double>(width) / (2.0 * tan(hFOV/2.0));
-    float ray_azimuthAngle = atan2(static_cast<double>(beam) -
-                      0.5 * static_cast<double>(width-1), fl);
-    float ray_elevationAngle = atan2(static_cast<double>(ray) -
-                      0.5 * static_cast<double>(height-1), fl);
-
-    // Beam pattern
-    // float azimuthBeamPattern = abs(unnormalized_sinc(M_PI * 0.884
-    // 				/ ray_azimuthAngleWidth * sin(ray_azimuthAngle)));
-    // only one column of rays for each beam at beam center
-    float azimuthBeamPattern = 1.0;
-    float elevationBeamPattern = unnormalized_sinc(M_PI * 0.884 / vFOV * sin(ray_elevationAngle));
-    // incidence angle
-    float incidence = compute_incidence(ray_azimuthAngle, ray_elevationAngle, normal);
-
-    // ----- Point scattering model ------ //
-    // Gaussian noise generated using opencv RNG
-    float xi_z = rand_image[rand_index];
-    float xi_y = rand_image[rand_index + 1];
-
-    // Calculate amplitude
-    thrust::complex<float> randomAmps = thrust::complex<float>(xi_z / sqrt(2.0), xi_y / sqrt(2.0));
-    thrust::complex<float> lambert_sqrt =
-        thrust::complex<float>(mu_sqrt * cos(incidence), 0.0);
-    thrust::complex<float> beamPattern =
-        thrust::complex<float>(azimuthBeamPattern * elevationBeamPattern, 0.0);
-    thrust::complex<float> targetArea_sqrt = thrust::complex<float>(sqrt(distance * area_scaler), 0.0);
-    thrust::complex<float> propagationTerm =
-        thrust::complex<float>(1.0 / pow(distance, 2.0) * exp(-2.0 * attenuation * distance), 0.0);
-    thrust::complex<float> amplitude = randomAmps * thrust::complex<float>(sourceTerm, 0.0)
-                                     * propagationTerm * beamPattern * lambert_sqrt * targetArea_sqrt;
-
-    // Summation of Echo returned from a signal (frequency domain)
-    for (size_t f = 0; f < nFreq; f++)
-    {
-      float freq;
-      if (nFreq % 2 == 0)
-        freq = delta_f * (-nFreq / 2.0 + f*1.0f + 1.0);
+    SonarRay &target = rays[columnBeam[column] * nRaysPerBeam
+                            + (slotOffset + columnSlot[column]) * nRaysSkipped
+                            + ray / raySkips];
+
+    float distance;
+    thrust::complex<float> amplitude;
+    if (!ray_amplitude<P>(column, ray, depth_image, normal_image, width, height,
+                       depth_image_step, normal_image_step,
+                       rand_image, rand_image_step, phaseSeed,
+                       material_image, material_image_step, reflectivity,
+                       columnPattern, focalLength, vFOV, sourceTerm, rowWeight,
+                       minDistance, maxDistance, mu_sqrt, area_scaler,
+                       refraction, distance, amplitude))
+    {
+      target.distance = -1.0f;
+      if (rayBytes)
+        atomicAdd(rayBytes, static_cast<unsigned long long>(sizeof(float)));
+      return;
+    }
+    target.distance = distance;
+    target.amplitude = amplitude * sign;
+    if (rayBytes)
+      atomicAdd(rayBytes, static_cast<unsigned long long>(sizeof(SonarRay)));
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Point origin + t * direction of a reflected ray projected on the depth
+// image: its pixel, range and the depth seen by that pixel. False when
+// the point leaves the image.
+__device__ bool march_sample(const float *origin, const float *direction,
+                             float t, const float *depth_image,
+                             int depth_image_step, int width, int height,
+                             float cx, float cy, float focalLength,
+                             int &column, int &ray, float &range, float &seen)
+{
+  const float x = origin[0] + t * direction[0];
+  const float y = origin[1] + t * direction[1];
+  const float z = origin[2] + t * direction[2];
+  if (x <= 0.0f)
+    return false;
+  // Inverse of the pixel azimuth and elevation of the kernels
+  const float horizontal = sqrtf(x * x + y * y);
+  column = __float2int_rn(cx - focalLength * y / x);
+  ray = __float2int_rn(cy + focalLength * z / horizontal);
+  if (column < 0 || column >= width || ray < 0 || ray >= height)
+    return false;
+  seen = depth_image[ray * depth_image_step / sizeof(float) + column];
+  range = sqrtf(horizontal * horizontal + z * z);
+  return true;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Multipath Calculation Function
+// Second bounce estimate of every kept ray: the ray is reflected
+// specularly about its surface normal and marched through the depth image
+// in maxSteps steps of stepLength. A step that lands behind the surface
+// seen by its pixel is bisected back to where it crossed that surface,
+// and is the secondary hit if it is then within thickness x depth of the
+// surface; deeper, the ray passes behind it and the march goes on. Its
+// echo comes back on the path sonar - hit - first surface - sonar, so it
+// is added to the first surface's beam at half the total path length.
+// Reflections leaving the image miss, screen space holds no other
+// geometry. The steps taken are added to marchSteps.
+template <NpsGazeboSonar::SonarPrecision P>
+__global__ void multipath_calculation(SonarRay *rays,
+                                      unsigned long long *marchSteps,
+                                      const float *depth_image,
+                                      const float *normal_image,
+                                      int width,
+                                      int height,
+                                      int depth_image_step,
+                                      int normal_image_step,
+                                      const float *rand_image,
+                                      int rand_image_step,
+                                      unsigned int phaseSeed,
+                                      const unsigned char *material_image,
+                                      int material_image_step,
+                                      const float *reflectivity,
+                                      const int *columnBeam,
+                                      const int *columnSlot,
+                                      const float *columnPattern,
+                                      int nSlots,
+                                      float focalLength,
+                                      float vFOV,
+                                      float sourceTerm,
+                                      int nRays,
+                                      int raySkips,
+                                      const float *rowWeight,
+                                      float minDistance, float maxDistance,
+                                      float mu_sqrt, float area_scaler,
+                                      int maxSteps, float stepLength,
+                                      float thickness,
+                                      float reflectionLoss)
+{
+  typedef NpsGazeboSonar::SonarMath<P> Math;
+  const int column = blockIdx.x * blockDim.x + threadIdx.x;
+  const int ray = blockIdx.y * blockDim.y + threadIdx.y;
+
+  const int nRaysSkipped = (nRays + raySkips - 1) / raySkips;
+  const int nRaysPerBeam = nRaysSkipped * nSlots;
+
+  if ((column >= width) || (ray >= height)
+      || !(rowWeight ? rowWeight[ray] > 0.0f : ray % raySkips == 0)
+      || columnBeam[column] < 0)
+    return;
+
+  SonarRay &target = rays[columnBeam[column] * nRaysPerBeam
+                          + columnSlot[column] * nRaysSkipped
+                          + ray / raySkips];
+  target.distance = -1.0f;
+
+  const int depth_index = ray * depth_image_step / sizeof(float) + column;
+  const int normal_index = ray * normal_image_step / sizeof(float) + (3 * column);
+  const float distance = depth_image[depth_index];
+  if (!(distance > 0.0f) || distance < minDistance || distance > maxDistance)
+    return;
+
+  // First surface point and normal, camera axes as in compute_incidence
+  const float cx = 0.5f * (width - 1);
+  const float cy = 0.5f * (height - 1);
+  const float azimuth = Math::Atan2(column - cx, focalLength);
+  const float elevation = Math::Atan2(ray - cy, focalLength);
+  float sin_azimuth, cos_azimuth, sin_elevation, cos_elevation;
+  Math::Sincos(-azimuth, sin_azimuth, cos_azimuth);
+  Math::Sincos(elevation, sin_elevation, cos_elevation);
+  const float direction[3] = {cos_azimuth * cos_elevation,
+                              sin_azimuth * cos_elevation,
+                              sin_elevation};
+  float normal[3] = {normal_image[normal_index + 2],
+                     -normal_image[normal_index],
+                     -normal_image[normal_index + 1]};
+  float length = sqrtf(normal[0] * normal[0] + normal[1] * normal[1]
+                       + normal[2] * normal[2]);
+  const float dot_first = (direction[0] * normal[0] + direction[1] * normal[1]
+                           + direction[2] * normal[2]) / fmaxf(length, 1e-6f);
+  // Back facing or degenerate normal, no specular path
+  if (!(length > 0.0f) || dot_first >= 0.0f)
+    return;
+
+  // Specular reflection direction
+  float reflected[3];
+  for (int i = 0; i < 3; i++)
+    reflected[i] = direction[i] - 2.0f * dot_first * normal[i] / length;
+
+  // Bounded screen-space march
+  const float origin[3] = {distance * direction[0],
+                           distance * direction[1],
+                           distance * direction[2]};
+  int step = 1;
+  int hit_column = -1, hit_ray = -1;
+  float hit_range = 0.0f, hit_t = 0.0f;
+  for (; step <= maxSteps; step++)
+  {
+    float t = step * stepLength;
+    int c, r;
+    float range, seen;
+    if (!march_sample(origin, reflected, t, depth_image, depth_image_step,
+                      width, height, cx, cy, focalLength, c, r, range, seen))
+      break;
+    if (!(seen > 0.0f) || range < seen)
+      continue;
+
+    // Behind the surface, bisect back to where the ray crossed it
+    float front = t - stepLength;
+    for (int i = 0; i < MULTIPATH_REFINE; i++)
+    {
+      const float mid = 0.5f * (front + t);
+      int mid_c, mid_r;
+      float mid_range, mid_seen;
+      if (march_sample(origin, reflected, mid, depth_image, depth_image_step,
+                       width, height, cx, cy, focalLength,
+                       mid_c, mid_r, mid_range, mid_seen)
+          && mid_seen > 0.0f && mid_range >= mid_seen)
+      {
+        t = mid;
+        c = mid_c;
+        r = mid_r;
+        range = mid_range;
+        seen = mid_seen;
+      }
       else
-        freq = delta_f * (-(nFreq - 1) / 2.0 + f*1.0f + 1.0);
-      float kw = 2.0 * M_PI * freq / soundSpeed; // wave vector
+      {
+        front = mid;
+      }
+    }
+    if (range - seen < thickness * seen)
+    {
+      hit_column = c;
+      hit_ray = r;
+      hit_range = seen;
+      hit_t = t;
+      break;
+    }
+  }
+  atomicAdd(marchSteps,
+            static_cast<unsigned long long>(min(step, maxSteps)));
+  if (hit_column < 0)
+    return;
+
+  // Echo delay of the whole path, folded into a two-way distance
+  const float half_path = 0.5f * (distance + hit_t + hit_range);
+  if (half_path > maxDistance)
+    return;
+
+  // Scattering of the reflected ray at the secondary hit
+  const int hit_normal_index =
+      hit_ray * normal_image_step / sizeof(float) + (3 * hit_column);
+  const float hit_normal[3] = {normal_image[hit_normal_index + 2],
+                               -normal_image[hit_normal_index],
+                               -normal_image[hit_normal_index + 1]};
+  length = sqrtf(hit_normal[0] * hit_normal[0] + hit_normal[1] * hit_normal[1]
+                 + hit_normal[2] * hit_normal[2]);
+  const float cos_hit = -(reflected[0] * hit_normal[0]
+                          + reflected[1] * hit_normal[1]
+                          + reflected[2] * hit_normal[2]) / fmaxf(length, 1e-6f);
+  if (!(cos_hit > 0.0f))
+    return;
+  float mu_hit = mu_sqrt;
+  if (material_image)
+    mu_hit = reflectivity[material_image[hit_ray * material_image_step
+                                         + hit_column]];
+
+  // Noise of the first ray, beam pattern of its direction
+  float xi_z, xi_y;
+  if (rand_image)
+  {
+    const int rand_index = ray * rand_image_step / sizeof(float) + (2 * column);
+    xi_z = rand_image[rand_index];
+    xi_y = rand_image[rand_index + 1];
+  }
+  else
+    ray_phase<P>(column, ray, phaseSeed, xi_z, xi_y);
+  const float sqrt1_2 = static_cast<float>(M_SQRT1_2);
+  const float elevationBeamPattern =
+      Math::Sinc(static_cast<float>(M_PI * 0.884) / vFOV * sin_elevation);
+  if (rowWeight)
+    area_scaler *= rowWeight[ray];
+  const float scale = sourceTerm * columnPattern[column] * elevationBeamPattern
+      * reflectionLoss * mu_hit * cos_hit * sqrtf(half_path * area_scaler)
+      / (half_path * half_path);
+
+  target.distance = half_path;
+  target.amplitude = thrust::complex<float>(xi_z * sqrt1_2 * scale,
+                                            xi_y * sqrt1_2 * scale);
+}
+
+///////////////////////////////////////////////////////////////////////////
+// First hard return of each beam: the closest sampled ray of every column
+// inside the range window. Positive floats order like their bit patterns,
+// so the minimum over the columns of a beam is an integer atomicMin.
+__global__ void beam_first_return(int *firstReturn,
+                                  const float *depth_image,
+                                  int width, int height,
+                                  int depth_image_step,
+                                  const int *columnBeam,
+                                  int raySkips,
+                                  const float *rowWeight,
+                                  float minDistance, float maxDistance)
+{
+  const int column = blockIdx.x * blockDim.x + threadIdx.x;
+  if (column >= width || columnBeam[column] < 0)
+    return;
+
+  float nearest = maxDistance;
+  for (int ray = 0; ray < height; ray++)
+  {
+    if (rowWeight ? !(rowWeight[ray] > 0.0f) : ray % raySkips != 0)
+      continue;
+    const float distance =
+        depth_image[ray * depth_image_step / sizeof(float) + column];
+    if (distance > 0.0f && distance >= minDistance && distance < nearest)
+      nearest = distance;
+  }
+  atomicMin(&firstReturn[columnBeam[column]], __float_as_int(nearest));
+}
 
+///////////////////////////////////////////////////////////////////////////
+// Stream compaction: moves the valid rays of each beam to the front of the
+// beam's segment, keeping their order, and stores the count per beam. The
+// NaN distance of slots no column was mapped to fails the test as well.
+// The bytes read and written are added to rayBytes unless it is null.
+__global__ void ray_compaction(SonarRay *rays, int *rayCounts,
+                               unsigned long long *rayBytes,
+                               int nBeams, int nRaysPerBeam)
+{
+  const int beam = blockIdx.x * blockDim.x + threadIdx.x;
+  if (beam < nBeams)
+  {
+    SonarRay *segment = rays + beam * nRaysPerBeam;
+    int count = 0;
+    for (int ray = 0; ray < nRaysPerBeam; ray++)
+    {
+      if (segment[ray].distance >= 0.0f)
+        segment[count++] = segment[ray];
+    }
+    rayCounts[beam] = count;
+    if (rayBytes)
+      atomicAdd(rayBytes, static_cast<unsigned long long>(
+          nRaysPerBeam * sizeof(float) + 2 * count * sizeof(SonarRay)
+          + sizeof(int)));
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Two-way absorption and phase per meter of frequency bin f, a ray at
+// distance d contributes exp(d * k) times its amplitude. The parity of
+// nFreq is a constant of preset shapes S.
+template <class S>
+__device__ thrust::complex<float> echo_wavenumber(int f, int nFreq,
+                                                  float delta_f,
+                                                  float soundSpeed,
+                                                  const float *attenuation)
+{
+  float freq;
+  if (S::EvenFreq(nFreq))
+    freq = delta_f * (-nFreq / 2.0 + f*1.0f + 1.0);
+  else
+    freq = delta_f * (-(nFreq - 1) / 2.0 + f*1.0f + 1.0);
+  float kw = 2.0 * M_PI * freq / soundSpeed; // wave vector
+  return thrust::complex<float>(-2.0f * attenuation[f], 2.0f * kw);
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Echo synthesis: frequency domain sum of the compacted rays of each beam
+// P_Beams_F is [beam][freq], attenuation is the precomputed absorption
+// table [Np/m] of each bin. Each thread sums up to S::bins bins,
+// blockDim.x apart, in registers, so a ray is loaded once for all of them
+// and the bins are independent chains. The grid covers
+// blockDim.x * S::bins bins per block. The rays are read once per block,
+// the block's reads and bin writes are added to rayBytes unless it is
+// null.
+template <NpsGazeboSonar::SonarPrecision P, class S>
+__global__ void echo_synthesis(const SonarRay *rays, const int *rayCounts,
+                               unsigned long long *rayBytes,
+                               const float *attenuation,
+                               thrust::complex<float> *P_Beams_F,
+                               float soundSpeed, float delta_f,
+                               int nBeams, int nRaysPerBeam, int nFreq)
+{
+  const int stride = blockDim.x;
+  const int first = blockIdx.x * stride * S::bins + threadIdx.x;
+  const int beam = blockIdx.y;
+  if (first < nFreq && beam < nBeams)
+  {
+    // Bins of this thread below nFreq, the rest is skipped
+    const int nActive = min(S::bins, (nFreq - first + stride - 1) / stride);
+    thrust::complex<float> k[S::bins];
+    thrust::complex<float> sum[S::bins];
+#pragma unroll
+    for (int bin = 0; bin < S::bins; bin++)
+    {
+      if (bin < nActive)
+        k[bin] = echo_wavenumber<S>(first + bin * stride, nFreq, delta_f,
+                                    soundSpeed, attenuation);
+      sum[bin] = thrust::complex<float>(0.0f, 0.0f);
+    }
+
+    const SonarRay *segment = rays + beam * nRaysPerBeam;
+    const int count = rayCounts[beam];
+    if (rayBytes && threadIdx.x == 0)
+    {
+      const int blockBins =
+          min(stride * S::bins, nFreq - blockIdx.x * stride * S::bins);
+      atomicAdd(rayBytes, static_cast<unsigned long long>(
+          sizeof(int) + count * sizeof(SonarRay)
+          + blockBins * sizeof(thrust::complex<float>)));
+    }
+    for (int ray = 0; ray < count; ray++)
+    {
       // Transmit spectrum, frequency domain
-      thrust::complex<float> kernel = exp(thrust::complex<float>(0.0f, 2.0f * distance * kw)) * amplitude;
-      P_Beams[beam * nFreq * (int)(nRays / raySkips) + (int)(ray / raySkips) * nFreq + f] =
-          thrust::complex<float>(kernel.real() , kernel.imag());
+      const float distance = segment[ray].distance;
+      const thrust::complex<float> amplitude = segment[ray].amplitude;
+#pragma unroll
+      for (int bin = 0; bin < S::bins; bin++)
+      {
+        if (bin < nActive)
+          sum[bin] += NpsGazeboSonar::SonarMath<P>::Phasor(distance, k[bin])
+                      * amplitude;
+      }
+    }
+#pragma unroll
+    for (int bin = 0; bin < S::bins; bin++)
+    {
+      if (bin < nActive)
+        P_Beams_F[beam * nFreq + first + bin * stride] = sum[bin];
     }
   }
 }
 
+///////////////////////////////////////////////////////////////////////////
+// Tiled processing: one block per beam and tile of tileRows image rows.
+// The rays of the tile are evaluated into shared memory and summed into
+// the beam's range bins while they are resident, so no ray buffer,
+// compaction or re-gather goes through device memory. P_Beams_F and
+// rayCounts must be zeroed, tiles add to them atomically. Preset shapes S
+// fix the columns of every beam, which turns the ray to pixel division
+// into a constant one, and read each resident ray once for S::bins bins.
+// The atomic read-modify-write of the bins by every chunk with rays is
+// added to rayBytes unless it is null.
+template <NpsGazeboSonar::SonarPrecision P, class S>
+__global__ void tiled_echo_synthesis(thrust::complex<float> *P_Beams_F,
+                                     int *rayCounts,
+                                     unsigned long long *rayBytes,
+                                     const int *beamColumnStart,
+                                     const int *beamColumns,
+                                     int tileRows,
+                                     const float *depth_image,
+                                     const float *normal_image,
+                                     int width,
+                                     int height,
+                                     int depth_image_step,
+                                     int normal_image_step,
+                                     const float *rand_image,
+                                     int rand_image_step,
+                                     unsigned int phaseSeed,
+                                     const unsigned char *material_image,
+                                     int material_image_step,
+                                     const float *reflectivity,
+                                     const float *columnPattern,
+                                     const unsigned char *tileMask,
+                                     int tileSize,
+                                     int tilesPerRow,
+                                     float sign,
+                                     float focalLength,
+                                     float vFOV,
+                                     float sourceTerm,
+                                     int raySkips,
+                                     const float *rowWeight,
+                                     float minDistance, float maxDistance,
+                                     float mu_sqrt, float area_scaler,
+                                     RefractionLookup refraction,
+                                     const float *attenuation,
+                                     float soundSpeed, float delta_f,
+                                     int nFreq)
+{
+  __shared__ float rayDistance[TILE_RAYS];
+  __shared__ float rayReal[TILE_RAYS];
+  __shared__ float rayImag[TILE_RAYS];
+  __shared__ int rayCount;
+
+  const int beam = blockIdx.x;
+  const int rowBegin = blockIdx.y * tileRows;
+  const int rowEnd = min(rowBegin + tileRows, height);
+  const int columnBegin = beamColumnStart[beam];
+  const int nColumns = S::Columns(beamColumnStart[beam + 1] - columnBegin);
+  const int nTileRays = nColumns * max(rowEnd - rowBegin, 0);
+  float *P = reinterpret_cast<float *>(P_Beams_F + beam * nFreq);
+
+  // Chunks of at most TILE_RAYS rays of the tile
+  for (int chunk = 0; chunk < nTileRays; chunk += TILE_RAYS)
+  {
+    if (threadIdx.x == 0)
+      rayCount = 0;
+    __syncthreads();
+
+    const int index = chunk + threadIdx.x;
+    if (index < nTileRays)
+    {
+      const int column = beamColumns[columnBegin + index % nColumns];
+      const int ray = rowBegin + index / nColumns;
+      float distance;
+      thrust::complex<float> amplitude;
+      if ((rowWeight ? rowWeight[ray] > 0.0f : ray % raySkips == 0)
+          && (!tileMask || tileMask[(ray / tileSize) * tilesPerRow
+                                    + column / tileSize])
+          && ray_amplitude<P>(column, ray, depth_image, normal_image,
+                           width, height, depth_image_step,
+                           normal_image_step, rand_image, rand_image_step,
+                           phaseSeed,
+                           material_image, material_image_step,
+                           reflectivity, columnPattern, focalLength, vFOV,
+                           sourceTerm, rowWeight, minDistance, maxDistance,
+                           mu_sqrt, area_scaler, refraction,
+                           distance, amplitude))
+      {
+        const int slot = atomicAdd(&rayCount, 1);
+        rayDistance[slot] = distance;
+        rayReal[slot] = sign * amplitude.real();
+        rayImag[slot] = sign * amplitude.imag();
+      }
+    }
+    __syncthreads();
+
+    const int count = rayCount;
+    if (count > 0)
+    {
+      const int stride = blockDim.x;
+      for (int first = threadIdx.x; first < nFreq; first += stride * S::bins)
+      {
+        const int nActive =
+            min(S::bins, (nFreq - first + stride - 1) / stride);
+        thrust::complex<float> k[S::bins];
+        thrust::complex<float> sum[S::bins];
+#pragma unroll
+        for (int bin = 0; bin < S::bins; bin++)
+        {
+          if (bin < nActive)
+            k[bin] = echo_wavenumber<S>(first + bin * stride, nFreq, delta_f,
+                                        soundSpeed, attenuation);
+          sum[bin] = thrust::complex<float>(0.0f, 0.0f);
+        }
+        for (int r = 0; r < count; r++)
+        {
+          const float distance = rayDistance[r];
+          const thrust::complex<float> amplitude(rayReal[r], rayImag[r]);
+#pragma unroll
+          for (int bin = 0; bin < S::bins; bin++)
+          {
+            if (bin < nActive)
+              sum[bin] += NpsGazeboSonar::SonarMath<P>::Phasor(distance,
+                                                               k[bin])
+                          * amplitude;
+          }
+        }
+#pragma unroll
+        for (int bin = 0; bin < S::bins; bin++)
+        {
+          const int f = first + bin * stride;
+          if (bin < nActive)
+          {
+            atomicAdd(&P[2 * f], sum[bin].real());
+            atomicAdd(&P[2 * f + 1], sum[bin].imag());
+          }
+        }
+      }
+      if (threadIdx.x == 0)
+      {
+        atomicAdd(&rayCounts[beam], count);
+        if (rayBytes)
+          atomicAdd(rayBytes, static_cast<unsigned long long>(
+              2 * nFreq * sizeof(thrust::complex<float>) + 2 * sizeof(int)));
+      }
+    }
+    __syncthreads();
+  }
+}
+
 ///////////////////////////////////////////////////////////////////////////
 namespace NpsGazeboSonar
 {
 
+  // Kernels of one precision tier and problem shape, instantiated for
+  // every tier and shipped preset and selected per frame
+  struct SonarKernels
+  {
+    decltype(&sonar_calculation<SonarPrecision::SINGLE>) calculation;
+    decltype(&echo_synthesis<SonarPrecision::SINGLE, GenericShape>) synthesis;
+    decltype(&tiled_echo_synthesis<SonarPrecision::SINGLE, GenericShape>) tiled;
+    decltype(&multipath_calculation<SonarPrecision::SINGLE>) multipath;
+    /// Frequency bins per synthesis thread, sizes the synthesis grid
+    int bins;
+    const SonarPreset *preset;
+  };
+
+  template <SonarPrecision P, class S>
+  static SonarKernels kernels_of(const SonarPreset *_preset)
+  {
+    return {sonar_calculation<P>, echo_synthesis<P, S>,
+            tiled_echo_synthesis<P, S>, multipath_calculation<P>, S::bins,
+            _preset};
+  }
+
+  // Both frequency parities of a preset shape
+  template <SonarPrecision P, int COLUMNS, int BINS>
+  static SonarKernels preset_kernels(int _nFreq, const SonarPreset *_preset)
+  {
+    if (_nFreq % 2 == 0)
+      return kernels_of<P, SonarShape<0, COLUMNS, BINS>>(_preset);
+    return kernels_of<P, SonarShape<1, COLUMNS, BINS>>(_preset);
+  }
+
+  // Specialized kernels of a shipped layout, generic ones otherwise. The
+  // cases cover the shapes of SONAR_PRESETS.
+  template <SonarPrecision P>
+  static SonarKernels shape_kernels(const SonarPreset *_preset, int _nFreq)
+  {
+    if (_preset && _preset->columnsPerBeam == 1)
+    {
+      switch (_preset->binsPerThread)
+      {
+        case 4: return preset_kernels<P, 1, 4>(_nFreq, _preset);
+        case 2: return preset_kernels<P, 1, 2>(_nFreq, _preset);
+        default: break;
+      }
+    }
+    return kernels_of<P, GenericShape>(nullptr);
+  }
+
+  static SonarKernels kernels_for(SonarPrecision _precision,
+                                  const SonarPreset *_preset, int _nFreq)
+  {
+    switch (_precision)
+    {
+      case SonarPrecision::DOUBLE:
+        return shape_kernels<SonarPrecision::DOUBLE>(_preset, _nFreq);
+      case SonarPrecision::FAST:
+        return shape_kernels<SonarPrecision::FAST>(_preset, _nFreq);
+      default:
+        return shape_kernels<SonarPrecision::SINGLE>(_preset, _nFreq);
+    }
+  }
+
+  // Preset of a frame: one camera whose columns all map onto the beams,
+  // the same number per beam, in a shipped layout
+  static const SonarPreset *frame_preset(const SonarFrame &_frame)
+  {
+    if (!_frame.config.presets || _frame.views.size() != 1)
+      return nullptr;
+    const SonarView &view = _frame.views[0];
+    const int width = view.depth_image.cols;
+    const int nSlots = std::max(view.nSlots, 1);
+    if (width != _frame.config.nBeams * nSlots)
+      return nullptr;
+    for (int column = 0; column < width; column++)
+    {
+      if (view.columnBeam[column] < 0)
+        return nullptr;
+    }
+    return FindPreset(_frame.config.nBeams, nSlots);
+  }
+
+  // cuFFT plans reused across calls, keyed by (transform size, batch)
+  static std::mutex fft_plan_mutex;
+  static std::map<std::pair<int, int>, cufftHandle> fft_plans;
+  static const size_t MAX_FFT_PLANS = 16;
+
+  // Get a batched 1D C2C plan, fft_plan_mutex must be held
+  static cufftHandle fft_plan(int nFreq, int batch)
+  {
+    const std::pair<int, int> key(nFreq, batch);
+    auto found = fft_plans.find(key);
+    if (found != fft_plans.end())
+      return found->second;
+
+    if (fft_plans.size() >= MAX_FFT_PLANS)
+    {
+      for (auto &plan : fft_plans)
+        cufftDestroy(plan.second);
+      fft_plans.clear();
+    }
+
+    cufftHandle handle;
+    int rank = 1;         // --- 1D FFTs
+    int n[] = {nFreq};    // --- Size of the Fourier transform
+    // --- Distance between two successive input/output elements
+    int istride = 1, ostride = 1;
+    int idist = nFreq, odist = nFreq; // --- Distance between batches
+    // --- Input/Output size with pitch (ignored for 1D transforms)
+    int inembed[] = {0};
+    int onembed[] = {0};
+    cufftPlanMany(&handle, rank, n,
+                  inembed, istride, idist,
+                  onembed, ostride, odist, CUFFT_C2C, batch);
+    fft_plans[key] = handle;
+    return handle;
+  }
+
+  // Incremental sonar state, the previous images of every view stay on
+  // the device to subtract their contribution when a tile changes
+  struct SonarIncrementalState
+  {
+    struct View
+    {
+      void *depth = nullptr;
+      void *normal = nullptr;
+      void *material = nullptr;
+      // The next frame's images, swapped with the previous ones once
+      // the frame is done
+      void *nextDepth = nullptr;
+      void *nextNormal = nullptr;
+      void *nextMaterial = nullptr;
+      int width = 0;
+      int height = 0;
+      size_t depthStep = 0;
+      size_t normalStep = 0;
+      size_t materialStep = 0;
+    };
+
+    thrust::complex<float> *d_spectrum = nullptr;
+    int nBeams = 0;
+    int nFreq = 0;
+    // Seed of the ray phases accumulated since the last restart
+    unsigned int phaseSeed = 0;
+    std::vector<View> views;
+
+    void Release()
+    {
+      for (View &view : this->views)
+      {
+        cudaFree(view.depth);
+        cudaFree(view.normal);
+        cudaFree(view.material);
+        cudaFree(view.nextDepth);
+        cudaFree(view.nextNormal);
+        cudaFree(view.nextMaterial);
+      }
+      this->views.clear();
+      cudaFree(this->d_spectrum);
+      this->d_spectrum = nullptr;
+    }
+
+    ~SonarIncrementalState()
+    {
+      this->Release();
+    }
+  };
+
+  std::shared_ptr<SonarIncrementalState> create_incremental_state()
+  {
+    return std::make_shared<SonarIncrementalState>();
+  }
+
+  // Memory reused from frame to frame by the engine calls of one thread,
+  // on the device or pinned on the host. Buffers are handed out in order
+  // and all released by Reset once the frame's work is finished. A frame
+  // that outgrows the arena gets another chunk, and the chunks are merged
+  // into one at the next Reset, so steady frames never allocate.
+  struct ScratchArena
+  {
+    struct Chunk
+    {
+      char *data = nullptr;
+      size_t size = 0;
+      size_t used = 0;
+    };
+
+    bool pinnedHost = false;
+    std::vector<Chunk> chunks;
+
+    void Allocate(Chunk &chunk)
+    {
+      if (this->pinnedHost)
+        SAFE_CALL(cudaHostAlloc((void **)&chunk.data, chunk.size,
+                                cudaHostAllocDefault),
+                  "CUDA Host Alloc Failed");
+      else
+        SAFE_CALL(cudaMalloc((void **)&chunk.data, chunk.size),
+                  "CUDA Malloc Failed");
+    }
+
+    void Release()
+    {
+      for (Chunk &chunk : this->chunks)
+      {
+        if (this->pinnedHost)
+          cudaFreeHost(chunk.data);
+        else
+          cudaFree(chunk.data);
+      }
+      this->chunks.clear();
+    }
+
+    void *Alloc(size_t bytes)
+    {
+      // Aligned for any element type and coalesced access
+      bytes = (bytes + 255) & ~static_cast<size_t>(255);
+      if (this->chunks.empty() ||
+          this->chunks.back().used + bytes > this->chunks.back().size)
+      {
+        Chunk chunk;
+        chunk.size = std::max(bytes, this->chunks.empty() ?
+            static_cast<size_t>(1 << 20) : this->chunks.back().size);
+        this->Allocate(chunk);
+        this->chunks.push_back(chunk);
+      }
+      Chunk &chunk = this->chunks.back();
+      void *data = chunk.data + chunk.used;
+      chunk.used += bytes;
+      return data;
+    }
+
+    void Reset()
+    {
+      if (this->chunks.size() > 1)
+      {
+        Chunk merged;
+        for (const Chunk &chunk : this->chunks)
+          merged.size += chunk.size;
+        this->Release();
+        this->Allocate(merged);
+        this->chunks.push_back(merged);
+      }
+      for (Chunk &chunk : this->chunks)
+        chunk.used = 0;
+    }
+
+    ~ScratchArena()
+    {
+      this->Release();
+    }
+  };
+
+  // Device copies of host tables that stay the same across frames: column
+  // maps, windows, beam correctors, attenuation and waveform tables. A
+  // table is uploaded on first use and again only when its contents
+  // change, checked with a hash of the host data. Every engine call holds
+  // the copies it queued work on until its streams are done (see
+  // EngineScratch::Table), so a copy that is replaced or evicted is freed
+  // only once no queued kernel reads it.
+  struct DeviceTable
+  {
+    void *data = nullptr;
+    size_t bytes = 0;
+    uint64_t hash = 0;
+    // Table clock of the last lookup, the oldest copy is evicted first
+    uint64_t lastUse = 0;
+
+    ~DeviceTable()
+    {
+      cudaFree(this->data);
+    }
+  };
+  typedef std::shared_ptr<DeviceTable> DeviceTablePtr;
+
+  static std::mutex device_table_mutex;
+  static std::map<const void *, DeviceTablePtr> device_tables;
+  static uint64_t device_table_clock = 0;
+  // Host tables of removed sensors are never looked up again
+  static const size_t MAX_DEVICE_TABLES = 128;
+
+  static uint64_t table_hash(const void *data, size_t bytes)
+  {
+    // FNV-1a over 64 bit words, then the remaining bytes
+    uint64_t hash = 14695981039346656037ULL;
+    const unsigned char *bytePtr = static_cast<const unsigned char *>(data);
+    size_t word = 0;
+    for (; word + sizeof(uint64_t) <= bytes; word += sizeof(uint64_t))
+    {
+      uint64_t value;
+      memcpy(&value, bytePtr + word, sizeof(uint64_t));
+      hash = (hash ^ value) * 1099511628211ULL;
+    }
+    for (; word < bytes; word++)
+      hash = (hash ^ bytePtr[word]) * 1099511628211ULL;
+    return hash;
+  }
+
+  // Device copy of a host table, the caller keeps the returned pointer
+  // until its work on the copy is finished
+  static DeviceTablePtr device_table(const void *table, size_t bytes)
+  {
+    const uint64_t hash = table_hash(table, bytes);
+    std::lock_guard<std::mutex> guard(device_table_mutex);
+    DeviceTablePtr &entry = device_tables[table];
+    if (!entry || entry->bytes != bytes || entry->hash != hash)
+    {
+      // A changed table belongs to a new host object at the same
+      // address, calls still holding the old copy free it when done
+      entry = std::make_shared<DeviceTable>();
+      SAFE_CALL(cudaMalloc(&entry->data, bytes), "CUDA Malloc Failed");
+      SAFE_CALL(cudaMemcpy(entry->data, table, bytes, cudaMemcpyHostToDevice),
+                "CUDA Memcpy Failed");
+      entry->bytes = bytes;
+      entry->hash = hash;
+    }
+    entry->lastUse = ++device_table_clock;
+    DeviceTablePtr copy = entry;
+
+    if (device_tables.size() > MAX_DEVICE_TABLES)
+    {
+      auto oldest = device_tables.begin();
+      for (auto it = device_tables.begin(); it != device_tables.end(); ++it)
+      {
+        if (it->second->lastUse < oldest->second->lastUse)
+          oldest = it;
+      }
+      device_tables.erase(oldest);
+    }
+    return copy;
+  }
+
+  // Streams, events and scratch memory of the engine calls made from one
+  // thread. The streams do not synchronize with the legacy default
+  // stream, so the views of one frame and the frames computed by other
+  // threads overlap.
+  struct EngineScratch
+  {
+    ScratchArena device;
+    ScratchArena staging;
+    std::vector<cudaStream_t> streams;
+    std::vector<cudaEvent_t> events;
+    // Table copies the current call queued work on
+    std::vector<DeviceTablePtr> tables;
+
+    EngineScratch()
+    {
+      this->staging.pinnedHost = true;
+    }
+
+    cudaStream_t Stream(size_t index)
+    {
+      while (this->streams.size() <= index)
+      {
+        cudaStream_t stream;
+        SAFE_CALL(cudaStreamCreateWithFlags(&stream, cudaStreamNonBlocking),
+                  "CUDA Stream Failed");
+        this->streams.push_back(stream);
+      }
+      return this->streams[index];
+    }
+
+    cudaEvent_t Event(size_t index)
+    {
+      while (this->events.size() <= index)
+      {
+        cudaEvent_t event;
+        SAFE_CALL(cudaEventCreateWithFlags(&event, cudaEventDisableTiming),
+                  "CUDA Event Failed");
+        this->events.push_back(event);
+      }
+      return this->events[index];
+    }
+
+    // Copy through pinned staging memory so the copy is asynchronous
+    void *Upload(const void *data, size_t bytes, cudaStream_t stream)
+    {
+      void *staged = this->staging.Alloc(bytes);
+      memcpy(staged, data, bytes);
+      void *d_data = this->device.Alloc(bytes);
+      SAFE_CALL(cudaMemcpyAsync(d_data, staged, bytes,
+                                cudaMemcpyHostToDevice, stream),
+                "CUDA Memcpy Failed");
+      return d_data;
+    }
+
+    // Device copy of a constant host table, held until Release
+    template <typename T>
+    T *Table(const T *table, size_t count)
+    {
+      this->tables.push_back(device_table(table, sizeof(T) * count));
+      return static_cast<T *>(this->tables.back()->data);
+    }
+
+    // The call's streams are done, drop its hold on the table copies
+    void ReleaseTables()
+    {
+      this->tables.clear();
+    }
+
+    ~EngineScratch()
+    {
+      for (cudaStream_t stream : this->streams)
+        cudaStreamDestroy(stream);
+      for (cudaEvent_t event : this->events)
+        cudaEventDestroy(event);
+    }
+  };
+
+  static thread_local EngineScratch engine_scratch;
+
   // CUDA Device Checker Wrapper
   void check_cuda_init_wrapper(void)
   {
@@ -260,494 +1376,894 @@ namespace NpsGazeboSonar
   }
 
   // Sonar Claculation Function Wrapper
-  CArray2D sonar_calculation_wrapper(const cv::Mat &depth_image,
-                                     const cv::Mat &normal_image,
-                                     const cv::Mat &rand_image,
-                                     double _hPixelSize,
-                                     double _vPixelSize,
-                                     double _hFOV,
-                                     double _vFOV,
-                                     double _beam_azimuthAngleWidth,
-                                     double _beam_elevationAngleWidth,
-                                     double _ray_azimuthAngleWidth,
-                                     double _ray_elevationAngleWidth,
-                                     double _soundSpeed,
-                                     double _maxDistance,
-                                     double _sourceLevel,
-                                     int _nBeams, int _nRays,
-                                     int _raySkips,
-                                     double _sonarFreq,
-                                     double _bandwidth,
-                                     int _nFreq,
-                                     double _mu,
-                                     double _attenuation,
-                                     float *window,
-                                     float **beamCorrector,
-                                     float beamCorrectorSum,
-                                     bool debugFlag)
+  SonarResult sonar_calculation_wrapper(const SonarFrame &_frame)
+  {
+    std::vector<SonarFrame> frames(1, _frame);
+    return sonar_calculation_batch_wrapper(frames)[0];
+  }
+
+  // Batched Sonar Claculation Function Wrapper
+  std::vector<SonarResult> sonar_calculation_batch_wrapper(
+                                const std::vector<SonarFrame> &_frames)
   {
+    const int nFrames = static_cast<int>(_frames.size());
+    std::vector<SonarResult> results(nFrames);
+    if (nFrames == 0)
+      return results;
+
+    bool debugFlag = false;
+    for (const SonarFrame &frame : _frames)
+      debugFlag = debugFlag || frame.config.debugFlag;
+
     auto start = std::chrono::high_resolution_clock::now();
     auto stop = std::chrono::high_resolution_clock::now();
     auto duration = std::chrono::duration_cast<std::chrono::microseconds>(stop - start);
     if (debugFlag)
       start = std::chrono::high_resolution_clock::now();
 
-    // ----  Allocation of properties parameters  ---- //
-    const float hPixelSize = (float)_hPixelSize;
-    const float vPixelSize = (float)_vPixelSize;
-    const float hFOV = (float)_hFOV;
-    const float vFOV = (float)_vFOV;
-    const float beam_elevationAngleWidth = (float)_beam_elevationAngleWidth;
-    const float beam_azimuthAngleWidth = (float)_beam_azimuthAngleWidth;
-    const float ray_elevationAngleWidth = (float)_ray_elevationAngleWidth;
-    const float ray_azimuthAngleWidth = (float)_ray_azimuthAngleWidth;
-    const float soundSpeed = (float)_soundSpeed;
-    const float maxDistance = (float)_maxDistance;
-    const float sonarFreq = (float)_sonarFreq;
-    const float bandwidth = (float)_bandwidth;
-    const float mu = (float)_mu;
-    const float attenuation = (float)_attenuation;
-    const int nBeams = _nBeams;
-    const int nRays = _nRays;
-    const int nFreq = _nFreq;
-    const int raySkips = _raySkips;
+    // The previous call of this thread has finished with its scratch
+    // memory. Stream 0 runs the work a frame's views share, each view
+    // runs on a stream of its own.
+    EngineScratch &scratch = engine_scratch;
+    scratch.device.Reset();
+    scratch.staging.Reset();
+    cudaStream_t mainStream = scratch.Stream(0);
 
     //#######################################################//
-    //###############    Sonar Calculation   ################//
+    //###############    Batch scheduling    ################//
     //#######################################################//
-    // ---------   Calculation parameters   --------- //
-    const float max_distance = maxDistance;
-    // Signal
-    const float max_T = max_distance * 2.0 / soundSpeed;
-    const float delta_f = 1.0 / max_T;
-    // Precalculation
-    const float mu_sqrt = sqrt(mu);
-    const float area_scaler = ray_azimuthAngleWidth * ray_elevationAngleWidth;
-    const float sourceLevel = (float)_sourceLevel;                     // db re 1 muPa;
-    const float pref = 1e-6;                                           // 1 micro pascal (muPa);
-    const float sourceTerm = sqrt(pow(10, (sourceLevel / 10))) * pref; // source term
-
-    // ---------   Allocate GPU memory for image   --------- //
-    //Calculate total number of bytes of input and output image
-    const int depth_image_Bytes = depth_image.step * depth_image.rows;
-    const int normal_image_Bytes = normal_image.step * normal_image.rows;
-    const int rand_image_Bytes = rand_image.step * rand_image.rows;
-
-    //Allocate device memory
-    float *d_depth_image, *d_normal_image, *d_rand_image;
-    SAFE_CALL(cudaMalloc((void **)&d_depth_image, depth_image_Bytes), "CUDA Malloc Failed");
-    SAFE_CALL(cudaMalloc((void **)&d_normal_image, normal_image_Bytes), "CUDA Malloc Failed");
-    SAFE_CALL(cudaMalloc((void **)&d_rand_image, rand_image_Bytes), "CUDA Malloc Failed");
-
-    //Copy data from OpenCV input image to device memory
-    SAFE_CALL(cudaMemcpy(
-                  d_depth_image, depth_image.ptr(), depth_image_Bytes,
-                  cudaMemcpyHostToDevice),
-              "CUDA Memcpy Failed");
-    SAFE_CALL(cudaMemcpy(
-                  d_normal_image, normal_image.ptr(), normal_image_Bytes,
-                  cudaMemcpyHostToDevice),
-              "CUDA Memcpy Failed");
-    SAFE_CALL(cudaMemcpy(
-                  d_rand_image, rand_image.ptr(), rand_image_Bytes,
-                  cudaMemcpyHostToDevice),
-              "CUDA Memcpy Failed");
-
-    //Specify a reasonable block size
-    const dim3 block(BLOCK_SIZE, BLOCK_SIZE);
-
-    //Calculate grid size to cover the whole image
-    const dim3 grid((depth_image.cols + block.x - 1) / block.x,
-                    (depth_image.rows + block.y - 1) / block.y);
-
-    // Pixcel array
-    thrust::complex<float> *P_Beams;
-    thrust::complex<float> *d_P_Beams;
-    const int P_Beams_N = nBeams * (int)(nRays / raySkips) * (nFreq + 1);
-    const int P_Beams_Bytes = sizeof(thrust::complex<float>) * P_Beams_N;
-    SAFE_CALL(cudaMallocHost((void **)&P_Beams, P_Beams_Bytes), "CUDA Malloc Failed");
-    SAFE_CALL(cudaMalloc((void **)&d_P_Beams, P_Beams_Bytes), "CUDA Malloc Failed");
-
-    //Launch the beamor conversion kernel
-    sonar_calculation<<<grid, block>>>(d_P_Beams,
-                                       d_depth_image,
-                                       d_normal_image,
-                                       normal_image.cols,
-                                       normal_image.rows,
-                                       depth_image.step,
-                                       normal_image.step,
-                                       d_rand_image,
-                                       rand_image.step,
-                                       hPixelSize,
-                                       vPixelSize,
-                                       hFOV,
-                                       vFOV,
-                                       beam_azimuthAngleWidth,
-                                       beam_elevationAngleWidth,
-                                       ray_azimuthAngleWidth,
-                                       ray_elevationAngleWidth,
-                                       soundSpeed,
-                                       sourceTerm,
-                                       nBeams, nRays,
-                                       raySkips,
-                                       sonarFreq, delta_f,
-                                       nFreq, bandwidth,
-                                       mu_sqrt, attenuation,
-                                       area_scaler);
-
-    //Synchronize to check for any kernel launch errors
-    SAFE_CALL(cudaDeviceSynchronize(), "Kernel Launch Failed");
-
-    //Copy back data from destination device meory to OpenCV output image
-    SAFE_CALL(cudaMemcpy(P_Beams, d_P_Beams, P_Beams_Bytes,
-                         cudaMemcpyDeviceToHost),
-              "CUDA Memcpy Failed");
-
-    // Free GPU memory
-    cudaFree(d_depth_image);
-    cudaFree(d_normal_image);
-    cudaFree(d_rand_image);
-    cudaFree(d_P_Beams);
-
-    // For calc time measure
-    if (debugFlag)
+    // Frames with the same number of frequency bins share one FFT batch.
+    // Their corrected spectra are written next to each other.
+    std::map<int, std::vector<int>> freqGroups;
+    for (int i = 0; i < nFrames; i++)
+      freqGroups[_frames[i].config.nFreq].push_back(i);
+
+    std::vector<thrust::complex<float> *> d_P_Beams_Cor(nFrames);
+    std::map<int, thrust::complex<float> *> d_groupSpectra;
+    for (auto &group : freqGroups)
     {
-      stop = std::chrono::high_resolution_clock::now();
-      duration = std::chrono::duration_cast<std::chrono::microseconds>(stop - start);
-      printf("GPU Sonar Computation Time %lld/100 [s]\n", static_cast<long long int>(duration.count() / 10000));
-      start = std::chrono::high_resolution_clock::now();
+      const int nFreq = group.first;
+      int totalBeams = 0;
+      for (int i : group.second)
+        totalBeams += _frames[i].config.nBeams;
+      thrust::complex<float> *d_spectra =
+          static_cast<thrust::complex<float> *>(scratch.device.Alloc(
+              sizeof(thrust::complex<float>) * nFreq * totalBeams));
+      d_groupSpectra[nFreq] = d_spectra;
+
+      int beamOffset = 0;
+      for (int i : group.second)
+      {
+        d_P_Beams_Cor[i] = d_spectra + beamOffset * nFreq;
+        beamOffset += _frames[i].config.nBeams;
+      }
     }
 
-    //########################################################//
-    //#########   Summation, Culling and windowing   #########//
-    //########################################################//
-    // Preallocate an array for return
-    CArray2D P_Beams_F(CArray(nFreq), nBeams);
-    // GPU grids and rows
-    unsigned int grid_rows, grid_cols;
-    dim3 dimBlock(BLOCK_SIZE, BLOCK_SIZE);
-
-    // GPU Ray summation using column sum
-    float *P_Ray_real, *P_Ray_imag;
-    float *d_P_Ray_real, *d_P_Ray_imag;
-    const int P_Ray_N = (int)(nRays / raySkips) * (nFreq);
-    const int P_Ray_Bytes = sizeof(float) * P_Ray_N;
-    float *P_Ray_F_real, *P_Ray_F_imag;
-    float *d_P_Ray_F_real, *d_P_Ray_F_imag;
-    const int P_Ray_F_N = (nFreq)*1;
-    const int P_Ray_F_Bytes = sizeof(float) * P_Ray_F_N;
-    cudaMallocHost((void **)&P_Ray_real, P_Ray_Bytes);
-    cudaMallocHost((void **)&P_Ray_imag, P_Ray_Bytes);
-    cudaMallocHost((void **)&P_Ray_F_real, P_Ray_F_Bytes);
-    cudaMallocHost((void **)&P_Ray_F_imag, P_Ray_F_Bytes);
-    SAFE_CALL(cudaMalloc((void **)&d_P_Ray_real, P_Ray_Bytes), "CUDA Malloc Failed");
-    SAFE_CALL(cudaMalloc((void **)&d_P_Ray_imag, P_Ray_Bytes), "CUDA Malloc Failed");
-    SAFE_CALL(cudaMalloc((void **)&d_P_Ray_F_real, P_Ray_F_Bytes), "CUDA Malloc Failed");
-    SAFE_CALL(cudaMalloc((void **)&d_P_Ray_F_imag, P_Ray_F_Bytes), "CUDA Malloc Failed");
-
-    dim3 dimGrid_Ray((nFreq + BLOCK_SIZE - 1) / BLOCK_SIZE);
-
-    for (size_t beam = 0; beam < nBeams; beam ++)
-    {
-      for (size_t ray = 0; ray < (int)(nRays / raySkips); ray++)
-      {
-        for (size_t f = 0; f < nFreq; f++)
+    // Counters of each frame, copied into pinned staging memory and read
+    // once the whole batch is done
+    struct FrameReadback
+    {
+      int *rayCounts = nullptr;
+      int *multipathCounts = nullptr;
+      float *firstReturn = nullptr;
+      unsigned long long *marchSteps = nullptr;
+      unsigned long long *rayBytes = nullptr;
+      std::vector<cudaEvent_t> multipathStart, multipathStop;
+    };
+    std::vector<FrameReadback> readback(nFrames);
+
+    //#######################################################//
+    //###############    Sonar Calculation   ################//
+    //#######################################################//
+    for (int i = 0; i < nFrames; i++)
+    {
+      const SonarFrame &frame = _frames[i];
+      const SonarCalculationConfig &config = frame.config;
+      const int nViews = static_cast<int>(frame.views.size());
+
+      // ----  Allocation of properties parameters  ---- //
+      const float vPixelSize = (float)config.vPixelSize;
+      const float vFOV = (float)config.vFOV;
+      const float beam_elevationAngleWidth = (float)config.beam_elevationAngleWidth;
+      const float beam_azimuthAngleWidth = (float)config.beam_azimuthAngleWidth;
+      const float ray_elevationAngleWidth = (float)config.ray_elevationAngleWidth;
+      const float soundSpeed = (float)config.soundSpeed;
+      const float minDistance = (float)config.minDistance;
+      const float maxDistance = (float)config.maxDistance;
+      const float mu = (float)config.mu;
+      const int nBeams = config.nBeams;
+      const int nRays = config.nRays;
+      const int nFreq = config.nFreq;
+      const int raySkips = config.raySkips;
+      const int nRaysSkipped = (nRays + raySkips - 1) / raySkips;
+      const SonarKernels kernels =
+          kernels_for(config.precision, frame_preset(frame), nFreq);
+      results[i].preset = kernels.preset;
+
+      // ---------   Calculation parameters   --------- //
+      const float max_distance = maxDistance;
+      // Signal
+      const float max_T = max_distance * 2.0 / soundSpeed;
+      const float delta_f = 1.0 / max_T;
+      // Precalculation
+      const float mu_sqrt = sqrt(mu);
+      const float sourceLevel = (float)config.sourceLevel;               // db re 1 muPa;
+      const float pref = 1e-6;                                           // 1 micro pascal (muPa);
+      const float sourceTerm = sqrt(pow(10, (sourceLevel / 10))) * pref; // source term
+
+      // Tables constant across frames stay on the device, the ones
+      // drawn per frame are copied on the frame's main stream
+      float *d_attenuation = scratch.Table(config.attenuation, nFreq);
+      float *d_reflectivity = nullptr;
+      if (config.reflectivity)
+        d_reflectivity = static_cast<float *>(scratch.Upload(
+            config.reflectivity, sizeof(float) * config.nMaterials,
+            mainStream));
+
+      // Rows sampled per column
+      float *d_rowWeight = nullptr;
+      int nSampledRows = nRaysSkipped;
+      if (config.rowWeight)
+      {
+        d_rowWeight = static_cast<float *>(scratch.Upload(
+            config.rowWeight, sizeof(float) * nRays, mainStream));
+        nSampledRows = 0;
+        for (int ray = 0; ray < nRays; ray++)
+          nSampledRows += config.rowWeight[ray] > 0.0f;
+      }
+
+      // Refraction table of the sensor's depth
+      RefractionLookup refraction = {};
+      const SonarRefraction &bending = config.refraction;
+      if (bending.path && bending.nElevations > 1 && bending.nDistances > 1)
+      {
+        const int nTable = bending.nElevations * bending.nDistances;
+        refraction.path = static_cast<float *>(scratch.Upload(
+            bending.path, sizeof(float) * nTable, mainStream));
+        refraction.delay = static_cast<float *>(scratch.Upload(
+            bending.delay, sizeof(float) * nTable, mainStream));
+        refraction.nElevations = bending.nElevations;
+        refraction.nDistances = bending.nDistances;
+        refraction.minElevation = bending.minElevation;
+        refraction.elevationStep = (bending.maxElevation - bending.minElevation)
+                                   / (bending.nElevations - 1);
+        refraction.distanceStep = bending.maxDistance / (bending.nDistances - 1);
+        refraction.declination = bending.declination;
+      }
+
+      // Each camera view accumulates its own range bins on its own stream,
+      // the views are merged into one beam set at the end. The second
+      // bounce of each view has its own spectrum after the direct ones.
+      const int P_Beams_F_N = nBeams * nFreq;
+      const bool multipath = config.multipath && config.multipathSteps > 0;
+      const int nSpectra = std::max(nViews, 1) * (multipath ? 2 : 1);
+      thrust::complex<float> *d_P_Beams_F =
+          static_cast<thrust::complex<float> *>(scratch.device.Alloc(
+              sizeof(thrust::complex<float>) * P_Beams_F_N * nSpectra));
+      if (nViews == 0)
+        SAFE_CALL(cudaMemsetAsync(d_P_Beams_F, 0,
+                  sizeof(thrust::complex<float>) * P_Beams_F_N, mainStream),
+                  "CUDA Memset Failed");
+
+      // Incremental mode restarts the accumulation when asked to or when
+      // the geometry of any view changed since the previous frame
+      SonarIncrementalState *state = frame.incremental.get();
+      bool restart = frame.fullRefresh;
+      if (state)
+      {
+        restart = restart || state->nBeams != nBeams || state->nFreq != nFreq
+                  || static_cast<int>(state->views.size()) != nViews;
+        for (int v = 0; v < nViews && !restart; v++)
         {
-          P_Ray_real[ray * nFreq + f] =
-              P_Beams[beam * nFreq * (int)(nRays / raySkips) + ray * nFreq + f].real();
-          P_Ray_imag[ray * nFreq + f] =
-              P_Beams[beam * nFreq * (int)(nRays / raySkips) + ray * nFreq + f].imag();
+          const SonarView &view = frame.views[v];
+          const SonarIncrementalState::View &previous = state->views[v];
+          restart = previous.width != view.depth_image.cols
+                    || previous.height != view.depth_image.rows
+                    || previous.depthStep != view.depth_image.step
+                    || previous.normalStep != view.normal_image.step
+                    || previous.materialStep != view.material_image.step
+                    || (previous.material != nullptr)
+                       != (!view.material_image.empty() && d_reflectivity);
+        }
+        if (restart)
+        {
+          state->Release();
+          state->nBeams = nBeams;
+          state->nFreq = nFreq;
+          state->phaseSeed = config.phaseSeed;
+          state->views.resize(nViews);
+          SAFE_CALL(cudaMalloc((void **)&state->d_spectrum,
+                    sizeof(thrust::complex<float>) * P_Beams_F_N),
+                    "CUDA Malloc Failed");
         }
       }
+      // Ray phases without a random image, kept from one restart of the
+      // accumulation to the next so previous rays subtract exactly
+      const unsigned int phaseSeed =
+          state ? state->phaseSeed : config.phaseSeed;
+      std::vector<SonarIncrementalState::View> kept(nViews);
+
+      std::vector<cudaStream_t> streams(nViews);
+      std::vector<int *> d_rayCounts(nViews);
+      results[i].totalRays = 0;
+
+      // Second bounce: secondary hits per view, march steps and device
+      // time of the whole pass
+      std::vector<int *> d_multipathCounts(nViews, nullptr);
+      std::vector<cudaEvent_t> &multipathStart = readback[i].multipathStart;
+      std::vector<cudaEvent_t> &multipathStop = readback[i].multipathStop;
+      if (multipath)
+      {
+        multipathStart.resize(nViews);
+        multipathStop.resize(nViews);
+      }
+      unsigned long long *d_marchSteps = nullptr;
 
-      SAFE_CALL(cudaMemcpy(d_P_Ray_real, P_Ray_real, P_Ray_Bytes, cudaMemcpyHostToDevice),
-                "CUDA Memcpy Failed");
-      SAFE_CALL(cudaMemcpy(d_P_Ray_imag, P_Ray_imag, P_Ray_Bytes, cudaMemcpyHostToDevice),
-                "CUDA Memcpy Failed");
+      // Device memory traffic of the primary rays: fills issued here,
+      // kernel loads and stores counted on the device
+      unsigned long long *d_rayBytes = nullptr;
+      results[i].rayBytes = 0;
+      if (frame.countRayBytes)
+      {
+        d_rayBytes = static_cast<unsigned long long *>(
+            scratch.device.Alloc(sizeof(unsigned long long)));
+        SAFE_CALL(cudaMemsetAsync(d_rayBytes, 0, sizeof(unsigned long long),
+                                  mainStream),
+                  "CUDA Memset Failed");
+      }
 
-      column_sums_reduce<<<dimGrid_Ray, dimBlock>>>(d_P_Ray_real, d_P_Ray_F_real, nFreq, (int)(nRays / raySkips));
-      column_sums_reduce<<<dimGrid_Ray, dimBlock>>>(d_P_Ray_imag, d_P_Ray_F_imag, nFreq, (int)(nRays / raySkips));
+      // Range of the first hard return of each beam, maxDistance without
+      int *d_firstReturn = nullptr;
+      if (config.firstReturns)
+      {
+        const std::vector<float> noReturn(nBeams, maxDistance);
+        d_firstReturn = static_cast<int *>(scratch.Upload(
+            noReturn.data(), sizeof(float) * nBeams, mainStream));
+      }
+      if (multipath)
+      {
+        d_marchSteps = static_cast<unsigned long long *>(
+            scratch.device.Alloc(sizeof(unsigned long long)));
+        SAFE_CALL(cudaMemsetAsync(d_marchSteps, 0, sizeof(unsigned long long),
+                                  mainStream),
+                  "CUDA Memset Failed");
+      }
+      // Views start once the shared tables and buffers are in place
+      cudaEvent_t prepared = scratch.Event(0);
+      SAFE_CALL(cudaEventRecord(prepared, mainStream), "CUDA Event Failed");
+      for (int v = 0; v < nViews; v++)
+      {
+        const SonarView &view = frame.views[v];
+        const cv::Mat &depth_image = view.depth_image;
+        const cv::Mat &normal_image = view.normal_image;
+        const cv::Mat &rand_image = view.rand_image;
+        const cv::Mat &material_image = view.material_image;
+        const int width = depth_image.cols;
+        streams[v] = scratch.Stream(1 + v);
+        SAFE_CALL(cudaStreamWaitEvent(streams[v], prepared, 0),
+                  "CUDA Event Failed");
+
+        // Ray footprint of this camera
+        const float hPixelSize = (float)(view.hFOV / width);
+        const float focalLength = width / (2.0 * tan(view.hFOV / 2.0));
+        const float ray_azimuthAngleWidth = hPixelSize;
+        const float area_scaler = ray_azimuthAngleWidth * ray_elevationAngleWidth;
+        const int nSlots = std::max(view.nSlots, 1);
+        // Incremental updates remove the previous rays of changed tiles
+        // through a second set of slots
+        const bool subtract = state && !restart;
+        const int nRaysPerBeam = nRaysSkipped * nSlots * (subtract ? 2 : 1);
+        for (int column = 0; column < width; column++)
+        {
+          if (view.columnBeam[column] >= 0)
+            results[i].totalRays += nSampledRows;
+        }
 
-      SAFE_CALL(cudaMemcpy(P_Ray_F_real, d_P_Ray_F_real, P_Ray_F_Bytes,
-                           cudaMemcpyDeviceToHost), "CUDA Memcpy Failed");
-      SAFE_CALL(cudaMemcpy(P_Ray_F_imag, d_P_Ray_F_imag, P_Ray_F_Bytes,
-                           cudaMemcpyDeviceToHost), "CUDA Memcpy Failed");
-      SAFE_CALL(cudaDeviceSynchronize(), "Kernel Launch Failed");
+        // ---------   Allocate GPU memory for image   --------- //
+        //Calculate total number of bytes of input and output image
+        const int rand_image_Bytes = rand_image.step * rand_image.rows;
 
-      for (size_t f = 0; f < nFreq; f++)
-        P_Beams_F[beam][f] = Complex(P_Ray_F_real[f], P_Ray_F_imag[f]);
-    }
+        //Copy the images to the device. Incremental sonars keep them in
+        //the state for the next frame and draw noise after accumulation.
+        auto upload_image = [&](const cv::Mat &image, void **kept) -> void *
+        {
+          const size_t bytes = image.step * image.rows;
+          if (!kept)
+            return scratch.Upload(image.ptr(), bytes, streams[v]);
+          if (!*kept)
+            SAFE_CALL(cudaMalloc(kept, bytes), "CUDA Malloc Failed");
+          void *staged = scratch.staging.Alloc(bytes);
+          memcpy(staged, image.ptr(), bytes);
+          SAFE_CALL(cudaMemcpyAsync(*kept, staged, bytes,
+                                    cudaMemcpyHostToDevice, streams[v]),
+                    "CUDA Memcpy Failed");
+          return *kept;
+        };
+        SonarIncrementalState::View *next = state ? &state->views[v] : nullptr;
+        float *d_depth_image = static_cast<float *>(upload_image(
+            depth_image, next ? &next->nextDepth : nullptr));
+        float *d_normal_image = static_cast<float *>(upload_image(
+            normal_image, next ? &next->nextNormal : nullptr));
+        float *d_rand_image = nullptr;
+        if (!state && !rand_image.empty())
+          d_rand_image = static_cast<float *>(
+              scratch.Upload(rand_image.ptr(), rand_image_Bytes, streams[v]));
+
+        // Per-pixel material IDs, constant reflectivity when absent
+        unsigned char *d_material_image = nullptr;
+        if (!material_image.empty() && d_reflectivity)
+          d_material_image = static_cast<unsigned char *>(upload_image(
+              material_image, next ? &next->nextMaterial : nullptr));
+        if (state)
+        {
+          kept[v].material = d_material_image;
+          kept[v].width = depth_image.cols;
+          kept[v].height = depth_image.rows;
+          kept[v].depthStep = depth_image.step;
+          kept[v].normalStep = normal_image.step;
+          kept[v].materialStep = material_image.step;
+        }
 
-    // free memory
-    cudaFreeHost(P_Beams);
-    cudaFreeHost(P_Ray_real);
-    cudaFreeHost(P_Ray_imag);
-    cudaFreeHost(P_Ray_F_real);
-    cudaFreeHost(P_Ray_F_imag);
-    cudaFree(d_P_Ray_real);
-    cudaFree(d_P_Ray_imag);
-    cudaFree(d_P_Ray_F_real);
-    cudaFree(d_P_Ray_F_imag);
+        // Changed tiles of an incremental update
+        const int tileSize = std::max(frame.tileSize, 1);
+        const int tilesPerRow = (width + tileSize - 1) / tileSize;
+        unsigned char *d_tileMask = nullptr;
+        if (subtract)
+          d_tileMask = static_cast<unsigned char *>(scratch.Upload(
+              view.changedTiles.data(), view.changedTiles.size(), streams[v]));
+
+        // Column to beam map of this camera, uploaded once
+        int *d_columnBeam = scratch.Table(view.columnBeam, width);
+        int *d_columnSlot = scratch.Table(view.columnSlot, width);
+        float *d_columnPattern = scratch.Table(view.columnPattern, width);
+
+        d_rayCounts[v] = static_cast<int *>(
+            scratch.device.Alloc(sizeof(int) * nBeams));
+
+        //########################################################//
+        //##################   Second bounce   ###################//
+        //########################################################//
+        // Always the whole current image: a changed tile moves the
+        // secondary hits of rays anywhere in the view, so the second
+        // bounce is not accumulated in incremental mode
+        if (multipath)
+        {
+          SAFE_CALL(cudaEventCreate(&multipathStart[v]), "CUDA Event Failed");
+          SAFE_CALL(cudaEventCreate(&multipathStop[v]), "CUDA Event Failed");
+          SAFE_CALL(cudaEventRecord(multipathStart[v], streams[v]),
+                    "CUDA Event Failed");
+
+          const int nMultipathPerBeam = nRaysSkipped * nSlots;
+          SonarRay *d_multipathRays = static_cast<SonarRay *>(
+              scratch.device.Alloc(
+                  sizeof(SonarRay) * nBeams * nMultipathPerBeam));
+          SAFE_CALL(cudaMemsetAsync(d_multipathRays, 0xFF,
+                    sizeof(SonarRay) * nBeams * nMultipathPerBeam, streams[v]),
+                    "CUDA Memset Failed");
+          d_multipathCounts[v] = static_cast<int *>(
+              scratch.device.Alloc(sizeof(int) * nBeams));
+
+          const dim3 block(BLOCK_SIZE, BLOCK_SIZE);
+          const dim3 grid((depth_image.cols + block.x - 1) / block.x,
+                          (depth_image.rows + block.y - 1) / block.y);
+          kernels.multipath<<<grid, block, 0, streams[v]>>>(
+              d_multipathRays,
+              d_marchSteps,
+              d_depth_image,
+              d_normal_image,
+              normal_image.cols,
+              normal_image.rows,
+              depth_image.step,
+              normal_image.step,
+              d_rand_image,
+              rand_image.step,
+              phaseSeed,
+              d_material_image,
+              material_image.step,
+              d_reflectivity,
+              d_columnBeam,
+              d_columnSlot,
+              d_columnPattern,
+              nSlots,
+              focalLength,
+              vFOV,
+              sourceTerm,
+              nRays,
+              raySkips,
+              d_rowWeight,
+              minDistance, maxDistance,
+              mu_sqrt, area_scaler,
+              config.multipathSteps,
+              maxDistance / config.multipathSteps,
+              (float)config.multipathThickness,
+              (float)config.multipathLoss);
+          ray_compaction<<<(nBeams + BLOCK_SIZE - 1) / BLOCK_SIZE, BLOCK_SIZE,
+                           0, streams[v]>>>(
+                          d_multipathRays, d_multipathCounts[v], nullptr,
+                          nBeams, nMultipathPerBeam);
+          const int binsPerBlock = BLOCK_SIZE * kernels.bins;
+          const dim3 dimGrid_Beam((nFreq + binsPerBlock - 1) / binsPerBlock,
+                                  nBeams);
+          kernels.synthesis<<<dimGrid_Beam, BLOCK_SIZE, 0, streams[v]>>>(
+                                      d_multipathRays, d_multipathCounts[v],
+                                      nullptr,
+                                      d_attenuation,
+                                      d_P_Beams_F + (nViews + v) * P_Beams_F_N,
+                                      soundSpeed, delta_f,
+                                      nBeams, nMultipathPerBeam, nFreq);
+          SAFE_CALL(cudaEventRecord(multipathStop[v], streams[v]),
+                    "CUDA Event Failed");
+        }
 
-    if (debugFlag)
-    {
-      stop = std::chrono::high_resolution_clock::now();
-      duration = std::chrono::duration_cast<std::chrono::microseconds>(stop - start);
-      printf("Sonar Ray Summation %lld/100 [s]\n",
-            static_cast<long long int>(duration.count() / 10000));
-      start = std::chrono::high_resolution_clock::now();
-    }
+        if (d_firstReturn)
+          beam_first_return<<<(width + BLOCK_SIZE - 1) / BLOCK_SIZE,
+                               BLOCK_SIZE, 0, streams[v]>>>(
+              d_firstReturn, d_depth_image, width, depth_image.rows,
+              depth_image.step, d_columnBeam, raySkips, d_rowWeight,
+              minDistance, maxDistance);
 
-    // -------------- Beam culling correction -----------------//
-    // beamCorrector and beamCorrectorSum is precalculated at parent cpp
-    float *P_Beams_Cor_real, *P_Beams_Cor_imag;
-    float *P_Beams_Cor_F_real, *P_Beams_Cor_F_imag;
-    float *P_Beams_Cor_real_tmp, *P_Beams_Cor_imag_tmp;
-    float *d_P_Beams_Cor_real, *d_P_Beams_Cor_imag;
-    float *d_P_Beams_Cor_F_real, *d_P_Beams_Cor_F_imag;
-    const int P_Beams_Cor_N = nBeams * nFreq;
-    const int P_Beams_Cor_Bytes = sizeof(float) * P_Beams_Cor_N;
-    cudaMallocHost((void **)&P_Beams_Cor_real, P_Beams_Cor_Bytes);
-    cudaMallocHost((void **)&P_Beams_Cor_imag, P_Beams_Cor_Bytes);
-    cudaMallocHost((void **)&P_Beams_Cor_real_tmp, P_Beams_Cor_Bytes);
-    cudaMallocHost((void **)&P_Beams_Cor_imag_tmp, P_Beams_Cor_Bytes);
-    cudaMallocHost((void **)&P_Beams_Cor_F_real, P_Beams_Cor_Bytes);
-    cudaMallocHost((void **)&P_Beams_Cor_F_imag, P_Beams_Cor_Bytes);
-    SAFE_CALL(cudaMalloc((void **)&d_P_Beams_Cor_real, P_Beams_Cor_Bytes), "CUDA Malloc Failed");
-    SAFE_CALL(cudaMalloc((void **)&d_P_Beams_Cor_imag, P_Beams_Cor_Bytes), "CUDA Malloc Failed");
-    SAFE_CALL(cudaMalloc((void **)&d_P_Beams_Cor_F_real, P_Beams_Cor_Bytes), "CUDA Malloc Failed");
-    SAFE_CALL(cudaMalloc((void **)&d_P_Beams_Cor_F_imag, P_Beams_Cor_Bytes), "CUDA Malloc Failed");
-
-    float *beamCorrector_lin, *d_beamCorrector_lin;
-    const int beamCorrector_lin_N = nBeams * nBeams;
-    const int beamCorrector_lin_Bytes = sizeof(float) * beamCorrector_lin_N;
-    cudaMallocHost((void **)&beamCorrector_lin, beamCorrector_lin_Bytes);
-    SAFE_CALL(cudaMalloc((void **)&d_beamCorrector_lin, beamCorrector_lin_Bytes), "CUDA Malloc Failed");
-
-    // (nfreq x nBeams) * (nBeams x nBeams) = (nfreq x nBeams)
-    for (size_t beam = 0; beam < nBeams; beam ++)
-    {
-      for (size_t f = 0; f < nFreq; f++)
-      {
-        P_Beams_Cor_real[f * nBeams + beam] = P_Beams_F[beam][f].real() * 1.0f;
-        P_Beams_Cor_imag[f * nBeams + beam] = P_Beams_F[beam][f].imag() * 1.0f;
-      }
-      for (size_t beam_other = 0; beam_other < nBeams; beam_other ++)
-        beamCorrector_lin[beam_other * nBeams + beam] = beamCorrector[beam][beam_other];
-    }
-
-    SAFE_CALL(cudaMemcpy(d_P_Beams_Cor_real, P_Beams_Cor_real, P_Beams_Cor_Bytes,
-                         cudaMemcpyHostToDevice),
-              "CUDA Memcpy Failed");
-    SAFE_CALL(cudaMemcpy(d_P_Beams_Cor_imag, P_Beams_Cor_imag, P_Beams_Cor_Bytes,
-                         cudaMemcpyHostToDevice),
-              "CUDA Memcpy Failed");
-    SAFE_CALL(cudaMemcpy(d_beamCorrector_lin, beamCorrector_lin, beamCorrector_lin_Bytes,
-                         cudaMemcpyHostToDevice),
-              "CUDA Memcpy Failed");
-
-    grid_rows = (nFreq + BLOCK_SIZE - 1) / BLOCK_SIZE;
-    grid_cols = (nBeams + BLOCK_SIZE - 1) / BLOCK_SIZE;
-    dim3 dimGrid_Beam(grid_cols, grid_rows);
-
-    gpu_matrix_mult<<<dimGrid_Beam, dimBlock>>>(d_P_Beams_Cor_real, d_beamCorrector_lin,
-                                                d_P_Beams_Cor_F_real, nFreq, nBeams, nBeams);
-    SAFE_CALL(cudaDeviceSynchronize(), "Kernel Launch Failed");
-
-    gpu_matrix_mult<<<dimGrid_Beam, dimBlock>>>(d_P_Beams_Cor_imag, d_beamCorrector_lin,
-                                                d_P_Beams_Cor_F_imag, nFreq, nBeams, nBeams);
-    SAFE_CALL(cudaDeviceSynchronize(), "Kernel Launch Failed");
-
-    //Copy back data from destination device meory
-    SAFE_CALL(cudaMemcpy(P_Beams_Cor_real_tmp, d_P_Beams_Cor_F_real, P_Beams_Cor_Bytes,
-                         cudaMemcpyDeviceToHost),
-              "CUDA Memcpy Failed");
-    SAFE_CALL(cudaMemcpy(P_Beams_Cor_imag_tmp, d_P_Beams_Cor_F_imag, P_Beams_Cor_Bytes,
-                         cudaMemcpyDeviceToHost),
-              "CUDA Memcpy Failed");
-    SAFE_CALL(cudaDeviceSynchronize(), "Kernel Launch Failed");
-
-    // ---------------    Windowing   ----------------- //
-    float *window_diag, *d_window;
-    const int window_N = nFreq * 1;
-    const int window_Bytes = sizeof(float) * window_N;
-    window_diag = (float *)malloc(window_Bytes);
-    SAFE_CALL(cudaMalloc((void **)&d_window, window_Bytes), "CUDA Malloc Failed");
-
-    int *diag_ptr, *d_diag_ptr;
-    const int diag_ptr_N = nBeams * 1;
-    const int diag_ptr_Bytes = sizeof(int) * diag_ptr_N;
-    diag_ptr = (int *)malloc(diag_ptr_Bytes);
-    SAFE_CALL(cudaMalloc((void **)&d_diag_ptr, diag_ptr_Bytes), "CUDA Malloc Failed");
-
-    // (nBeams x nfreq) * (1 x nFreq) = (nBeams x nFreq)
-    for (size_t beam = 0; beam < nBeams; beam ++)
-    {
-      for (size_t f = 0; f < nFreq; f++)
-      { // Transpose
-        P_Beams_Cor_real[beam * nFreq + f] = P_Beams_Cor_real_tmp[f * nBeams + beam];
-        P_Beams_Cor_imag[beam * nFreq + f] = P_Beams_Cor_imag_tmp[f * nBeams + beam];
-        window_diag[f] = window[f];
-      }
-      diag_ptr[beam] = (int)beam;
-    }
-    SAFE_CALL(cudaMemcpy(d_P_Beams_Cor_real, P_Beams_Cor_real, P_Beams_Cor_Bytes,
-                         cudaMemcpyHostToDevice),
-              "CUDA Memcpy Failed");
-    SAFE_CALL(cudaMemcpy(d_P_Beams_Cor_imag, P_Beams_Cor_imag, P_Beams_Cor_Bytes,
-                         cudaMemcpyHostToDevice),
-              "CUDA Memcpy Failed");
-    SAFE_CALL(cudaMemcpy(d_window, window_diag, window_Bytes,
-                         cudaMemcpyHostToDevice),
-              "CUDA Memcpy Failed");
-    SAFE_CALL(cudaMemcpy(d_diag_ptr, diag_ptr, diag_ptr_Bytes,
-                         cudaMemcpyHostToDevice),
-              "CUDA Memcpy Failed");
-
-    grid_rows = (nFreq + BLOCK_SIZE - 1) / BLOCK_SIZE;
-    grid_cols = (nFreq + BLOCK_SIZE - 1) / BLOCK_SIZE;
-    dim3 dimGrid_window(grid_cols, grid_rows);
-    gpu_diag_matrix_mult<<<dimGrid_window, dimBlock>>>(d_P_Beams_Cor_real, d_diag_ptr, d_window, nFreq);
-    SAFE_CALL(cudaDeviceSynchronize(), "Kernel Launch Failed");
-
-    gpu_diag_matrix_mult<<<dimGrid_window, dimBlock>>>(d_P_Beams_Cor_imag, d_diag_ptr, d_window, nFreq);
-    SAFE_CALL(cudaDeviceSynchronize(), "Kernel Launch Failed");
-
-    //Copy back data from destination device meory
-    SAFE_CALL(cudaMemcpy(P_Beams_Cor_F_real, d_P_Beams_Cor_real, P_Beams_Cor_Bytes,
-                         cudaMemcpyDeviceToHost),
-              "CUDA Memcpy Failed");
-    SAFE_CALL(cudaMemcpy(P_Beams_Cor_F_imag, d_P_Beams_Cor_imag, P_Beams_Cor_Bytes,
-                         cudaMemcpyDeviceToHost),
-              "CUDA Memcpy Failed");
-    SAFE_CALL(cudaDeviceSynchronize(), "Kernel Launch Failed");
-
-    // Return
-    for (size_t beam = 0; beam < nBeams; beam ++)
-      for (size_t f = 0; f < nFreq; f++)
-        P_Beams_F[beam][f] =
-            Complex(P_Beams_Cor_F_real[beam * nFreq + f] / beamCorrectorSum,
-                    P_Beams_Cor_F_imag[beam * nFreq + f] / beamCorrectorSum);
-
-    // Free memory
-    cudaFree(d_P_Beams_Cor_imag);
-    cudaFree(d_P_Beams_Cor_real);
-    cudaFree(d_P_Beams_Cor_F_imag);
-    cudaFree(d_P_Beams_Cor_F_real);
-    cudaFree(d_beamCorrector_lin);
-    cudaFree(d_window);
-    cudaFree(d_diag_ptr);
-    cudaFreeHost(P_Beams_Cor_real);
-    cudaFreeHost(P_Beams_Cor_imag);
-    cudaFreeHost(P_Beams_Cor_F_real);
-    cudaFreeHost(P_Beams_Cor_F_imag);
-    cudaFreeHost(P_Beams_Cor_real_tmp);
-    cudaFreeHost(P_Beams_Cor_imag_tmp);
-    cudaFreeHost(beamCorrector_lin);
-    cudaFreeHost(window_diag);
-    cudaFreeHost(diag_ptr);
+        if (frame.tiled)
+        {
+          // Columns of each beam, the width of the beam's tiles
+          std::vector<int> beamColumnStart(nBeams + 1, 0);
+          for (int column = 0; column < width; column++)
+          {
+            if (view.columnBeam[column] >= 0)
+              beamColumnStart[view.columnBeam[column] + 1]++;
+          }
+          int maxColumns = 1;
+          for (int beam = 0; beam < nBeams; beam++)
+          {
+            maxColumns = std::max(maxColumns, beamColumnStart[beam + 1]);
+            beamColumnStart[beam + 1] += beamColumnStart[beam];
+          }
+          std::vector<int> beamColumns(std::max(beamColumnStart[nBeams], 1));
+          std::vector<int> next(beamColumnStart.begin(),
+                                beamColumnStart.end() - 1);
+          for (int column = 0; column < width; column++)
+          {
+            if (view.columnBeam[column] >= 0)
+              beamColumns[next[view.columnBeam[column]]++] = column;
+          }
+          int *d_beamColumnStart = static_cast<int *>(scratch.Upload(
+              beamColumnStart.data(), sizeof(int) * (nBeams + 1), streams[v]));
+          int *d_beamColumns = static_cast<int *>(scratch.Upload(
+              beamColumns.data(), sizeof(int) * beamColumns.size(),
+              streams[v]));
+
+          // As many rows per tile as fit the block's shared memory
+          const int tileRows = std::max(1, TILE_RAYS / maxColumns);
+          const dim3 tileGrid(nBeams,
+                              (depth_image.rows + tileRows - 1) / tileRows);
+          SAFE_CALL(cudaMemsetAsync(d_P_Beams_F + v * P_Beams_F_N, 0,
+                    sizeof(thrust::complex<float>) * P_Beams_F_N, streams[v]),
+                    "CUDA Memset Failed");
+          SAFE_CALL(cudaMemsetAsync(d_rayCounts[v], 0, sizeof(int) * nBeams,
+                    streams[v]),
+                    "CUDA Memset Failed");
+          if (d_rayBytes)
+            results[i].rayBytes += sizeof(thrust::complex<float>) * P_Beams_F_N
+                                   + sizeof(int) * nBeams;
+
+          const int nPasses = subtract ? 2 : 1;
+          for (int pass = 0; pass < nPasses; pass++)
+          {
+            // Second pass removes the previous contribution of the
+            // changed tiles
+            const SonarIncrementalState::View *previous =
+                pass > 0 ? &state->views[v] : nullptr;
+            kernels.tiled<<<tileGrid, TILE_RAYS, 0, streams[v]>>>(
+                d_P_Beams_F + v * P_Beams_F_N,
+                d_rayCounts[v],
+                d_rayBytes,
+                d_beamColumnStart,
+                d_beamColumns,
+                tileRows,
+                previous ? static_cast<float *>(previous->depth)
+                         : d_depth_image,
+                previous ? static_cast<float *>(previous->normal)
+                         : d_normal_image,
+                normal_image.cols,
+                normal_image.rows,
+                depth_image.step,
+                normal_image.step,
+                previous ? nullptr : d_rand_image,
+                rand_image.step,
+                phaseSeed,
+                previous ? static_cast<unsigned char *>(previous->material)
+                         : d_material_image,
+                material_image.step,
+                d_reflectivity,
+                d_columnPattern,
+                d_tileMask,
+                tileSize,
+                tilesPerRow,
+                previous ? -1.0f : 1.0f,
+                focalLength,
+                vFOV,
+                sourceTerm,
+                raySkips,
+                d_rowWeight,
+                minDistance, maxDistance,
+                mu_sqrt, area_scaler,
+                refraction,
+                d_attenuation,
+                soundSpeed, delta_f,
+                nFreq);
+          }
+          continue;
+        }
 
-    // For calc time measure
-    if (debugFlag)
-    {
-      stop = std::chrono::high_resolution_clock::now();
-      duration = std::chrono::duration_cast<std::chrono::microseconds>(stop - start);
-      printf("GPU Window & Correction %lld/100 [s]\n",
-            static_cast<long long int>(duration.count() / 10000));
-      start = std::chrono::high_resolution_clock::now();
-    }
+        // Ray amplitudes, compacted per beam before synthesis. Slots that
+        // no column maps to keep the all-ones pattern, a NaN distance.
+        SonarRay *d_rays = static_cast<SonarRay *>(
+            scratch.device.Alloc(sizeof(SonarRay) * nBeams * nRaysPerBeam));
+        SAFE_CALL(cudaMemsetAsync(d_rays, 0xFF,
+                  sizeof(SonarRay) * nBeams * nRaysPerBeam, streams[v]),
+                  "CUDA Memset Failed");
+        if (d_rayBytes)
+          results[i].rayBytes += sizeof(SonarRay) * nBeams * nRaysPerBeam;
+
+        //Specify a reasonable block size
+        const dim3 block(BLOCK_SIZE, BLOCK_SIZE);
+
+        //Calculate grid size to cover the whole image
+        const dim3 grid((depth_image.cols + block.x - 1) / block.x,
+                        (depth_image.rows + block.y - 1) / block.y);
+
+        //Launch the beamor conversion kernel
+        kernels.calculation<<<grid, block, 0, streams[v]>>>(d_rays,
+                                           d_rayBytes,
+                                           d_depth_image,
+                                           d_normal_image,
+                                           normal_image.cols,
+                                           normal_image.rows,
+                                           depth_image.step,
+                                           normal_image.step,
+                                           d_rand_image,
+                                           rand_image.step,
+                                           phaseSeed,
+                                           d_material_image,
+                                           material_image.step,
+                                           d_reflectivity,
+                                           d_columnBeam,
+                                           d_columnSlot,
+                                           d_columnPattern,
+                                           nSlots * (subtract ? 2 : 1),
+                                           0,
+                                           d_tileMask,
+                                           tileSize,
+                                           tilesPerRow,
+                                           1.0f,
+                                           hPixelSize,
+                                           vPixelSize,
+                                           focalLength,
+                                           vFOV,
+                                           beam_azimuthAngleWidth,
+                                           beam_elevationAngleWidth,
+                                           ray_azimuthAngleWidth,
+                                           ray_elevationAngleWidth,
+                                           sourceTerm,
+                                           nBeams, nRays,
+                                           raySkips,
+                                           d_rowWeight,
+                                           minDistance, maxDistance,
+                                           mu_sqrt, area_scaler,
+                                           refraction);
+
+        // Previous contribution of the changed tiles, subtracted
+        if (subtract)
+        {
+          const SonarIncrementalState::View &previous = state->views[v];
+          kernels.calculation<<<grid, block, 0, streams[v]>>>(d_rays,
+                                           d_rayBytes,
+                                           static_cast<float *>(previous.depth),
+                                           static_cast<float *>(previous.normal),
+                                           normal_image.cols,
+                                           normal_image.rows,
+                                           depth_image.step,
+                                           normal_image.step,
+                                           nullptr,
+                                           0,
+                                           phaseSeed,
+                                           static_cast<unsigned char *>(
+                                               previous.material),
+                                           material_image.step,
+                                           d_reflectivity,
+                                           d_columnBeam,
+                                           d_columnSlot,
+                                           d_columnPattern,
+                                           nSlots * 2,
+                                           nSlots,
+                                           d_tileMask,
+                                           tileSize,
+                                           tilesPerRow,
+                                           -1.0f,
+                                           hPixelSize,
+                                           vPixelSize,
+                                           focalLength,
+                                           vFOV,
+                                           beam_azimuthAngleWidth,
+                                           beam_elevationAngleWidth,
+                                           ray_azimuthAngleWidth,
+                                           ray_elevationAngleWidth,
+                                           sourceTerm,
+                                           nBeams, nRays,
+                                           raySkips,
+                                           d_rowWeight,
+                                           minDistance, maxDistance,
+                                           mu_sqrt, area_scaler,
+                                           refraction);
+        }
 
-    //#################################################//
-    //###################   FFT   #####################//
-    //#################################################//
-    SAFE_CALL(cudaDeviceSynchronize(), "Kernel Launch Failed");
-    const int DATASIZE = nFreq;
-    const int BATCH = nBeams;
-    // --- Host side input data allocation and initialization
-    cufftComplex *hostInputData = (cufftComplex *)malloc(
-        DATASIZE * BATCH * sizeof(cufftComplex));
-    for (int beam = 0; beam < BATCH; beam++)
-    {
-      for (int f = 0; f < DATASIZE; f++)
-      {
-        if (f < nFreq)
-          hostInputData[beam * DATASIZE + f] =
-              make_cuComplex(P_Beams_F[beam][f].real() * 1.0f,
-                             P_Beams_F[beam][f].imag() * 1.0f);
-        else
-          hostInputData[beam * DATASIZE + f] =
-              (make_cuComplex(0.f, 0.f)); // zero padding
+        //########################################################//
+        //###############   Compaction, synthesis   ##############//
+        //########################################################//
+        ray_compaction<<<(nBeams + BLOCK_SIZE - 1) / BLOCK_SIZE, BLOCK_SIZE,
+                         0, streams[v]>>>(
+                        d_rays, d_rayCounts[v], d_rayBytes,
+                        nBeams, nRaysPerBeam);
+
+        // Echo synthesis only visits rays with a return
+        const int binsPerBlock = BLOCK_SIZE * kernels.bins;
+        const dim3 dimGrid_Beam((nFreq + binsPerBlock - 1) / binsPerBlock,
+                                nBeams);
+        kernels.synthesis<<<dimGrid_Beam, BLOCK_SIZE, 0, streams[v]>>>(
+                                           d_rays, d_rayCounts[v],
+                                           d_rayBytes,
+                                           d_attenuation,
+                                           d_P_Beams_F + v * P_Beams_F_N,
+                                           soundSpeed, delta_f,
+                                           nBeams, nRaysPerBeam, nFreq);
       }
-    }
-
-    // --- Device side input data allocation and initialization
-    cufftComplex *deviceInputData;
-    SAFE_CALL(cudaMalloc((void **)&deviceInputData,
-                         DATASIZE * BATCH * sizeof(cufftComplex)),
-                         "FFT CUDA Malloc Failed");
-    SAFE_CALL(cudaMemcpy(deviceInputData, hostInputData,
-                         DATASIZE * BATCH * sizeof(cufftComplex),
-                         cudaMemcpyHostToDevice),
-                         "FFT CUDA Memcopy Failed");
-
-    // --- Host side output data allocation
-    cufftComplex *hostOutputData =
-        (cufftComplex *)malloc(DATASIZE * BATCH * sizeof(cufftComplex));
 
-    // --- Device side output data allocation
-    cufftComplex *deviceOutputData;
-    cudaMalloc((void **)&deviceOutputData,
-               DATASIZE * BATCH * sizeof(cufftComplex));
-
-    // --- Batched 1D FFTs
-    cufftHandle handle;
-    int rank = 1;         // --- 1D FFTs
-    int n[] = {DATASIZE}; // --- Size of the Fourier transform
-    // --- Distance between two successive input/output elements
-    int istride = 1, ostride = 1;
-    int idist = DATASIZE, odist = DATASIZE; // --- Distance between batches
-    // --- Input/Output size with pitch (ignored for 1D transforms)
-    int inembed[] = {0};
-    int onembed[] = {0};
-    int batch = BATCH; // --- Number of batched executions
-    cufftPlanMany(&handle, rank, n,
-                  inembed, istride, idist,
-                  onembed, ostride, odist, CUFFT_C2C, batch);
-
-    cufftExecC2C(handle, deviceInputData, deviceOutputData, CUFFT_FORWARD);
+      // The merge waits for every view's stream
+      for (int v = 0; v < nViews; v++)
+      {
+        cudaEvent_t viewDone = scratch.Event(1 + v);
+        SAFE_CALL(cudaEventRecord(viewDone, streams[v]), "CUDA Event Failed");
+        SAFE_CALL(cudaStreamWaitEvent(mainStream, viewDone, 0),
+                  "CUDA Event Failed");
+      }
 
-    // --- Device->Host copy of the results
-    SAFE_CALL(cudaMemcpy(hostOutputData, deviceOutputData,
-                         DATASIZE * BATCH * sizeof(cufftComplex),
-                         cudaMemcpyDeviceToHost),
-                         "FFT CUDA Memcopy Failed");
+      // Merge the range bins of all views into the first one. The second
+      // bounce spectra are merged along in one go, or kept apart to skip
+      // the accumulation of an incremental sonar.
+      thrust::complex<float> *d_multipathSpectrum = nullptr;
+      if (multipath && state && nViews > 0)
+      {
+        d_multipathSpectrum = d_P_Beams_F + nViews * P_Beams_F_N;
+        if (nViews > 1)
+          spectrum_merge<<<(P_Beams_F_N + BLOCK_SIZE - 1) / BLOCK_SIZE, BLOCK_SIZE,
+                           0, mainStream>>>(
+                           d_multipathSpectrum, nViews, P_Beams_F_N);
+      }
+      const int nMerged = d_multipathSpectrum ? nViews : nViews * (multipath ? 2 : 1);
+      if (nMerged > 1)
+        spectrum_merge<<<(P_Beams_F_N + BLOCK_SIZE - 1) / BLOCK_SIZE, BLOCK_SIZE,
+                         0, mainStream>>>(
+                         d_P_Beams_F, nMerged, P_Beams_F_N);
+
+      // Incremental mode: accumulate the change, the result stays noise
+      // free and the caller adds speckle to the time samples
+      if (state)
+      {
+        spectrum_accumulate<<<(P_Beams_F_N + BLOCK_SIZE - 1) / BLOCK_SIZE, BLOCK_SIZE,
+                              0, mainStream>>>(
+                         d_P_Beams_F, state->d_spectrum, d_multipathSpectrum,
+                         P_Beams_F_N, restart);
+      }
 
-    cufftDestroy(handle);
-    cudaFree(deviceOutputData);
-    cudaFree(deviceInputData);
-    free(hostInputData);
-    free(hostOutputData);
+      //########################################################//
+      //#########   Culling correction and windowing   #########//
+      //########################################################//
+      // Written straight into this frame's slot of the FFT batch
+      const dim3 dimGrid_Beam((nFreq + BLOCK_SIZE - 1) / BLOCK_SIZE, nBeams);
+      float *d_beamCorrector = scratch.Table(config.beamCorrector,
+                                            nBeams * nBeams);
+      float *d_window = scratch.Table(config.window, nFreq);
+      // std::complex and thrust::complex share the (re, im) layout
+      thrust::complex<float> *d_transmit = nullptr;
+      if (config.transmit)
+        d_transmit = reinterpret_cast<thrust::complex<float> *>(scratch.Table(
+            reinterpret_cast<const float *>(config.transmit), 2 * nFreq));
+      thrust::complex<float> *d_matchedFilter = nullptr;
+      if (config.matchedFilter)
+        d_matchedFilter =
+          reinterpret_cast<thrust::complex<float> *>(scratch.Table(
+            reinterpret_cast<const float *>(config.matchedFilter),
+            2 * nFreq));
+      beam_correction_window<<<dimGrid_Beam, BLOCK_SIZE, 0, mainStream>>>(
+                                                           d_P_Beams_F,
+                                                           d_P_Beams_Cor[i],
+                                                           d_beamCorrector,
+                                                           d_window,
+                                                           d_transmit,
+                                                           d_matchedFilter,
+                                                           config.beamCorrectorSum,
+                                                           nBeams, nFreq);
+
+      // Ray counts, first returns and march steps of this frame, copied
+      // on the main stream behind the frame's work
+      FrameReadback &counters = readback[i];
+      counters.rayCounts = static_cast<int *>(
+          scratch.staging.Alloc(sizeof(int) * nBeams * nViews));
+      counters.multipathCounts = static_cast<int *>(
+          scratch.staging.Alloc(sizeof(int) * nBeams * nViews));
+      memset(counters.multipathCounts, 0, sizeof(int) * nBeams * nViews);
+      for (int v = 0; v < nViews; v++)
+      {
+        SAFE_CALL(cudaMemcpyAsync(counters.rayCounts + v * nBeams,
+                                  d_rayCounts[v], sizeof(int) * nBeams,
+                                  cudaMemcpyDeviceToHost, mainStream),
+                  "CUDA Memcpy Failed");
+        if (d_multipathCounts[v])
+          SAFE_CALL(cudaMemcpyAsync(counters.multipathCounts + v * nBeams,
+                                    d_multipathCounts[v],
+                                    sizeof(int) * nBeams,
+                                    cudaMemcpyDeviceToHost, mainStream),
+                    "CUDA Memcpy Failed");
+      }
+      if (d_firstReturn)
+      {
+        counters.firstReturn = static_cast<float *>(
+            scratch.staging.Alloc(sizeof(float) * nBeams));
+        SAFE_CALL(cudaMemcpyAsync(counters.firstReturn, d_firstReturn,
+                                  sizeof(float) * nBeams,
+                                  cudaMemcpyDeviceToHost, mainStream),
+                  "CUDA Memcpy Failed");
+      }
+      if (d_marchSteps)
+      {
+        counters.marchSteps = static_cast<unsigned long long *>(
+            scratch.staging.Alloc(sizeof(unsigned long long)));
+        SAFE_CALL(cudaMemcpyAsync(counters.marchSteps, d_marchSteps,
+                                  sizeof(unsigned long long),
+                                  cudaMemcpyDeviceToHost, mainStream),
+                  "CUDA Memcpy Failed");
+      }
+      if (d_rayBytes)
+      {
+        counters.rayBytes = static_cast<unsigned long long *>(
+            scratch.staging.Alloc(sizeof(unsigned long long)));
+        SAFE_CALL(cudaMemcpyAsync(counters.rayBytes, d_rayBytes,
+                                  sizeof(unsigned long long),
+                                  cudaMemcpyDeviceToHost, mainStream),
+                  "CUDA Memcpy Failed");
+      }
 
+      // Incremental sonars keep this frame's images for the next one
+      if (state)
+      {
+        for (int v = 0; v < nViews; v++)
+        {
+          SonarIncrementalState::View &view = state->views[v];
+          std::swap(view.depth, view.nextDepth);
+          std::swap(view.normal, view.nextNormal);
+          if (kept[v].material)
+            std::swap(view.material, view.nextMaterial);
+          view.width = kept[v].width;
+          view.height = kept[v].height;
+          view.depthStep = kept[v].depthStep;
+          view.normalStep = kept[v].normalStep;
+          view.materialStep = kept[v].materialStep;
+        }
+      }
+    }
 
-    for (int beam = 0; beam < BATCH; beam++)
+    //#################################################//
+    //###################   FFT   #####################//
+    //#################################################//
+    // The transforms queue behind every frame on the main stream, the
+    // spectra come back into pinned staging memory
+    std::map<int, cufftComplex *> hostSpectra;
+    for (auto &group : freqGroups)
     {
-      for (int f = 0; f < nFreq; f++)
+      const int DATASIZE = group.first;
+      int BATCH = 0;
+      for (int i : group.second)
+        BATCH += _frames[i].config.nBeams;
+      cufftComplex *deviceData =
+          reinterpret_cast<cufftComplex *>(d_groupSpectra[DATASIZE]);
+
+      // --- One batched in-place 1D FFT for every beam of every frame
       {
-        P_Beams_F[beam][f] =
-            Complex(hostOutputData[beam * DATASIZE + f].x * delta_f,
-                    hostOutputData[beam * DATASIZE + f].y * delta_f);
+        std::lock_guard<std::mutex> guard(fft_plan_mutex);
+        cufftHandle handle = fft_plan(DATASIZE, BATCH);
+        cufftSetStream(handle, mainStream);
+        cufftExecC2C(handle, deviceData, deviceData, CUFFT_FORWARD);
       }
+
+      // --- Device->Host copy of the results
+      cufftComplex *hostOutputData = static_cast<cufftComplex *>(
+          scratch.staging.Alloc(DATASIZE * BATCH * sizeof(cufftComplex)));
+      SAFE_CALL(cudaMemcpyAsync(hostOutputData, deviceData,
+                                DATASIZE * BATCH * sizeof(cufftComplex),
+                                cudaMemcpyDeviceToHost, mainStream),
+                "FFT CUDA Memcopy Failed");
+      hostSpectra[DATASIZE] = hostOutputData;
     }
 
+    // The only wait of the batch, every view stream joined the main one
+    SAFE_CALL(cudaStreamSynchronize(mainStream), "Kernel Launch Failed");
+    scratch.ReleaseTables();
+
     // For calc time measure
     if (debugFlag)
     {
       stop = std::chrono::high_resolution_clock::now();
       duration = std::chrono::duration_cast<std::chrono::microseconds>(stop - start);
-      printf("GPU FFT Calc Time %lld/100 [s]\n",
-            static_cast<long long int>(duration.count() / 10000));
+      printf("GPU Sonar Computation Time (%d frames, %d FFT batches) "
+             "%lld/100 [s]\n", nFrames, static_cast<int>(freqGroups.size()),
+             static_cast<long long int>(duration.count() / 10000));
+    }
+
+    for (int i = 0; i < nFrames; i++)
+    {
+      const SonarCalculationConfig &config = _frames[i].config;
+      const int nBeams = config.nBeams;
+      const int nViews = static_cast<int>(_frames[i].views.size());
+      FrameReadback &counters = readback[i];
+
+      results[i].multipathTime = 0.0f;
+      for (size_t v = 0; v < counters.multipathStart.size(); v++)
+      {
+        float elapsed = 0.0f;
+        cudaEventElapsedTime(&elapsed, counters.multipathStart[v],
+                             counters.multipathStop[v]);
+        results[i].multipathTime += elapsed;
+        cudaEventDestroy(counters.multipathStart[v]);
+        cudaEventDestroy(counters.multipathStop[v]);
+      }
+      if (counters.firstReturn)
+        results[i].firstReturn.assign(counters.firstReturn,
+                                      counters.firstReturn + nBeams);
+      if (counters.marchSteps)
+        results[i].multipathSteps = *counters.marchSteps;
+      if (counters.rayBytes)
+        results[i].rayBytes += *counters.rayBytes;
+
+      // Occupancy of this frame
+      results[i].validRays = 0;
+      results[i].multipathRays = 0;
+      for (int v = 0; v < nViews; v++)
+      {
+        int viewRays = 0;
+        for (int beam = 0; beam < nBeams; beam++)
+          viewRays += counters.rayCounts[v * nBeams + beam];
+        results[i].validRays += viewRays;
+
+        // Second bounce hits of the view
+        for (int beam = 0; beam < nBeams; beam++)
+          results[i].multipathRays +=
+              counters.multipathCounts[v * nBeams + beam];
+      }
+    }
+
+    for (auto &group : freqGroups)
+    {
+      const int DATASIZE = group.first;
+      const cufftComplex *hostOutputData = hostSpectra[DATASIZE];
+      int beamOffset = 0;
+      for (int i : group.second)
+      {
+        const SonarCalculationConfig &config = _frames[i].config;
+        const float delta_f =
+            1.0 / (config.maxDistance * 2.0 / config.soundSpeed);
+        CArray2D P_Beams_F(CArray(DATASIZE), config.nBeams);
+        for (int beam = 0; beam < config.nBeams; beam++)
+        {
+          const cufftComplex *spectrum =
+              &hostOutputData[(beamOffset + beam) * DATASIZE];
+          for (int f = 0; f < DATASIZE; f++)
+            P_Beams_F[beam][f] = Complex(spectrum[f].x * delta_f,
+                                         spectrum[f].y * delta_f);
+        }
+        beamOffset += config.nBeams;
+        results[i].beams = P_Beams_F;
+      }
     }
 
-    return P_Beams_F;
+    return results;
   }
 } // namespace NpsGazeboSonar
@@ -0,0 +1,188 @@
+/*
+ * Copyright 2020 Naval Postgraduate School
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+
+#include <nps_uw_sensors_gazebo/sonar_cfar.hh>
+
+#include <math.h>
+#include <algorithm>
+
+namespace NpsGazeboSonar
+{
+/////////////////////////////////////////////////
+bool ParseCfarMethod(const std::string &_name, CfarMethod &_method)
+{
+  if (_name == "ca")
+    _method = CfarMethod::CELL_AVERAGING;
+  else if (_name == "os")
+    _method = CfarMethod::ORDERED_STATISTIC;
+  else
+    return false;
+  return true;
+}
+
+/////////////////////////////////////////////////
+// Rank of the ordered statistic among _cells training cells, 1 based
+static int OrderedRank(double _rank, int _cells)
+{
+  return std::min(std::max(static_cast<int>(round(_rank * _cells)), 1),
+                  _cells);
+}
+
+/////////////////////////////////////////////////
+// False alarm probability of the k-th of _cells exponential cells scaled
+// by _alpha
+static double OrderedPfa(int _k, int _cells, double _alpha)
+{
+  double pfa = 1.0;
+  for (int i = 0; i < _k; i++)
+    pfa *= (_cells - i) / (_cells - i + _alpha);
+  return pfa;
+}
+
+/////////////////////////////////////////////////
+SonarCfar::SonarCfar(CfarMethod _method, int _trainingCells,
+                     int _guardCells, double _pfa, double _rank)
+  : method(_method), trainingCells(std::max(_trainingCells, 1)),
+    guardCells(std::max(_guardCells, 0)),
+    rank(std::min(std::max(_rank, 0.0), 1.0))
+{
+  const double pfa = std::min(std::max(_pfa, 1e-12), 1.0);
+  this->scale.assign(2 * this->trainingCells + 1, 0.0);
+  for (int cells = 1; cells <= 2 * this->trainingCells; cells++)
+  {
+    if (this->method == CfarMethod::CELL_AVERAGING)
+    {
+      // Pfa = (1 + alpha/N)^-N for the mean of N cells, here applied to
+      // their sum
+      this->scale[cells] = pow(pfa, -1.0 / cells) - 1.0;
+      continue;
+    }
+
+    // No closed form, Pfa decreases monotonically with alpha
+    const int k = OrderedRank(this->rank, cells);
+    double low = 0.0, high = 1.0;
+    while (OrderedPfa(k, cells, high) > pfa && high < 1e12)
+      high *= 2.0;
+    for (int i = 0; i < 100; i++)
+    {
+      const double mid = 0.5 * (low + high);
+      if (OrderedPfa(k, cells, mid) > pfa)
+        low = mid;
+      else
+        high = mid;
+    }
+    this->scale[cells] = high;
+  }
+}
+
+/////////////////////////////////////////////////
+void SonarCfar::Detect(int _beam, const float *_power, int _nBins,
+                       const float *_ranges,
+                       std::vector<SonarDetection> &_detections) const
+{
+  if (_nBins <= 0)
+    return;
+  const int outer = this->guardCells + this->trainingCells;
+  const bool averaging = this->method == CfarMethod::CELL_AVERAGING;
+
+  // Training cells of the current bin, kept up to date as the window
+  // slides: a running sum (CELL_AVERAGING) or the cells in ascending
+  // order (ORDERED_STATISTIC). Both ends of both halves only move
+  // forward, one cell per bin.
+  double sum = 0.0;
+  std::vector<float> sorted;
+  sorted.reserve(2 * this->trainingCells);
+  auto add = [&](int _cell)
+  {
+    if (averaging)
+      sum += _power[_cell];
+    else
+      sorted.insert(std::upper_bound(sorted.begin(), sorted.end(),
+                                     _power[_cell]), _power[_cell]);
+  };
+  auto remove = [&](int _cell)
+  {
+    if (averaging)
+      sum -= _power[_cell];
+    else
+      sorted.erase(std::lower_bound(sorted.begin(), sorted.end(),
+                                    _power[_cell]));
+  };
+  int lagBegin = 0, lagEnd = 0, leadBegin = 0, leadEnd = 0;
+
+  // Peak of the current run of bins above threshold
+  SonarDetection peak;
+  bool inRun = false;
+  for (int bin = 0; bin < _nBins; bin++)
+  {
+    for (; leadEnd < std::min(bin + outer + 1, _nBins); leadEnd++)
+      add(leadEnd);
+    for (; leadBegin < std::min(bin + this->guardCells + 1, _nBins);
+         leadBegin++)
+      remove(leadBegin);
+    for (; lagEnd < std::max(bin - this->guardCells, 0); lagEnd++)
+      add(lagEnd);
+    for (; lagBegin < std::max(bin - outer, 0); lagBegin++)
+      remove(lagBegin);
+    const int cells = (lagEnd - lagBegin) + (leadEnd - leadBegin);
+
+    double threshold = 0.0, noise = 0.0;
+    if (cells > 0 && averaging)
+    {
+      // Rounding of the running sum must not make it negative
+      sum = std::max(sum, 0.0);
+      noise = sum / cells;
+      threshold = this->scale[cells] * sum;
+    }
+    else if (cells > 0)
+    {
+      noise = sorted[OrderedRank(this->rank, cells) - 1];
+      threshold = this->scale[cells] * noise;
+    }
+
+    const float power = _power[bin];
+    const bool detected = cells > 0 && power > threshold && power > 0.0f;
+    if (detected && (!inRun || power > peak.intensity * peak.intensity))
+    {
+      peak.beam = _beam;
+      peak.bin = bin;
+      peak.range = _ranges[bin];
+      peak.intensity = sqrt(power);
+      peak.snr = noise > 0.0 ? 10.0 * log10(power / noise) : INFINITY;
+    }
+    if (inRun && !detected)
+      _detections.push_back(peak);
+    inRun = detected;
+  }
+  if (inRun)
+    _detections.push_back(peak);
+}
+
+/////////////////////////////////////////////////
+double SonarCfar::Scale(int _cells) const
+{
+  if (_cells <= 0 || _cells >= static_cast<int>(this->scale.size()))
+    return 0.0;
+  return this->scale[_cells];
+}
+
+/////////////////////////////////////////////////
+CfarMethod SonarCfar::Method() const
+{
+  return this->method;
+}
+}  // namespace NpsGazeboSonar
@@ -0,0 +1,95 @@
+/*
+ * Copyright 2020 Naval Postgraduate School
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+
+#include <nps_uw_sensors_gazebo/sonar_echogram.hh>
+
+#include <algorithm>
+
+namespace NpsGazeboSonar
+{
+/////////////////////////////////////////////////
+SonarEchogram::SonarEchogram(int _bins, int _pings, double _minRange,
+                             double _maxRange, unsigned char *_buffer)
+  : minRange(_minRange), cursor(0)
+{
+  _bins = std::max(_bins, 1);
+  _pings = std::max(_pings, 2);
+  this->binSize = std::max(_maxRange - _minRange, 1e-6) / _bins;
+  this->series.assign(_bins, 0.0f);
+  if (_buffer)
+    this->image = cv::Mat(_bins, _pings, CV_8UC1, _buffer);
+  else
+    this->image = cv::Mat(_bins, _pings, CV_8UC1);
+  this->image.setTo(0);
+}
+
+/////////////////////////////////////////////////
+void SonarEchogram::Begin()
+{
+  std::fill(this->series.begin(), this->series.end(), 0.0f);
+}
+
+/////////////////////////////////////////////////
+void SonarEchogram::AddReturn(double _range, float _weight)
+{
+  const double bin = (_range - this->minRange) / this->binSize;
+  if (bin < 0.0 || bin >= this->series.size())
+    return;
+  this->series[static_cast<int>(bin)] += _weight;
+}
+
+/////////////////////////////////////////////////
+int SonarEchogram::Commit(float _gain)
+{
+  // Only the new column and the gap after it change, column access is
+  // strided but touches bins x 2 bytes per ping
+  const int column = this->cursor;
+  const int gap = (column + 1) % this->image.cols;
+  for (int bin = 0; bin < this->image.rows; bin++)
+  {
+    uchar *row = this->image.ptr<uchar>(bin);
+    row[column] = cv::saturate_cast<uchar>(this->series[bin] * _gain);
+    row[gap] = 0;
+  }
+  this->cursor = gap;
+  return column;
+}
+
+/////////////////////////////////////////////////
+const std::vector<float> &SonarEchogram::Series() const
+{
+  return this->series;
+}
+
+/////////////////////////////////////////////////
+double SonarEchogram::BinRange(int _bin) const
+{
+  return this->minRange + (_bin + 0.5) * this->binSize;
+}
+
+/////////////////////////////////////////////////
+const cv::Mat &SonarEchogram::Image() const
+{
+  return this->image;
+}
+
+/////////////////////////////////////////////////
+int SonarEchogram::Cursor() const
+{
+  return this->cursor;
+}
+}  // namespace NpsGazeboSonar
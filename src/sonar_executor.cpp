@@ -0,0 +1,340 @@
+/*
+ * Copyright 2020 Naval Postgraduate School
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+
+#include <nps_uw_sensors_gazebo/sonar_executor.hh>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include <algorithm>
+#include <chrono>
+#include <utility>
+
+namespace NpsGazeboSonar
+{
+// Index of the executor worker running on this thread, -1 otherwise
+static thread_local int workerIndex = -1;
+
+/////////////////////////////////////////////////
+SonarTaskGroup::SonarTaskGroup(int _priority)
+  : priority(_priority), pending(0)
+{
+  SonarExecutor::Instance().Register(this);
+}
+
+/////////////////////////////////////////////////
+SonarTaskGroup::~SonarTaskGroup()
+{
+  this->Wait();
+  SonarExecutor::Instance().Unregister(this);
+}
+
+/////////////////////////////////////////////////
+void SonarTaskGroup::Run(SonarTask _task)
+{
+  this->pending++;
+  SonarExecutor::Instance().Submit(this, std::move(_task));
+}
+
+/////////////////////////////////////////////////
+void SonarTaskGroup::ParallelFor(int _n, int _tile,
+                                 const std::function<void(int, int)> &_body)
+{
+  if (_n <= 0)
+    return;
+  _tile = std::max(_tile, 1);
+
+  // Tiles are counted separately from the group's pending tasks so this
+  // can be called from inside a task of the same group
+  std::atomic<int> remaining(0);
+  int begin = 0;
+  for (; begin + _tile < _n; begin += _tile)
+  {
+    const int end = begin + _tile;
+    remaining++;
+    this->Run([&_body, &remaining, begin, end]()
+    {
+      _body(begin, end);
+      remaining--;
+    });
+  }
+  // Run the last tile on the calling thread instead of idling
+  _body(begin, _n);
+
+  SonarExecutor &executor = SonarExecutor::Instance();
+  while (remaining > 0)
+  {
+    if (!executor.RunOne(workerIndex, this))
+      std::this_thread::yield();
+  }
+}
+
+/////////////////////////////////////////////////
+void SonarTaskGroup::Wait()
+{
+  SonarExecutor &executor = SonarExecutor::Instance();
+  while (this->pending > 0)
+  {
+    if (!executor.RunOne(workerIndex, this))
+    {
+      std::unique_lock<std::mutex> lock(this->doneMutex);
+      this->doneCondition.wait_for(lock, std::chrono::microseconds(200),
+                                   [this]() { return this->pending <= 0; });
+    }
+  }
+}
+
+/////////////////////////////////////////////////
+int SonarTaskGroup::Pending() const
+{
+  return this->pending;
+}
+
+/////////////////////////////////////////////////
+int SonarTaskGroup::Priority() const
+{
+  return this->priority;
+}
+
+/////////////////////////////////////////////////
+SonarExecutor &SonarExecutor::Instance()
+{
+  static SonarExecutor instance;
+  return instance;
+}
+
+/////////////////////////////////////////////////
+SonarExecutor::SonarExecutor()
+  : pinCores(false), running(false), stop(false), nextGroup(0), queued(0)
+{
+  this->nThreads =
+      std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+}
+
+/////////////////////////////////////////////////
+SonarExecutor::~SonarExecutor()
+{
+  this->stop = true;
+  this->queueCondition.notify_all();
+  for (auto &thread : this->threads)
+    thread.join();
+}
+
+/////////////////////////////////////////////////
+bool SonarExecutor::Configure(int _threads, bool _pinCores)
+{
+  std::lock_guard<std::mutex> guard(this->queueMutex);
+  if (this->running)
+    return false;
+  if (_threads > 0)
+    this->nThreads = _threads;
+  else
+    this->nThreads =
+        std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+  this->pinCores = _pinCores;
+  return true;
+}
+
+/////////////////////////////////////////////////
+int SonarExecutor::Threads() const
+{
+  return this->nThreads;
+}
+
+/////////////////////////////////////////////////
+void SonarExecutor::Start()
+{
+  // called with queueMutex held
+  if (this->running)
+    return;
+  this->running = true;
+
+  const int hardware =
+      std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+  for (int i = 0; i < this->nThreads; i++)
+    this->workers.emplace_back(new Worker());
+  for (int i = 0; i < this->nThreads; i++)
+  {
+    this->threads.emplace_back(&SonarExecutor::WorkerLoop, this, i);
+#ifdef __linux__
+    if (this->pinCores)
+    {
+      cpu_set_t cpuset;
+      CPU_ZERO(&cpuset);
+      CPU_SET(i % hardware, &cpuset);
+      pthread_setaffinity_np(this->threads.back().native_handle(),
+                             sizeof(cpu_set_t), &cpuset);
+    }
+#endif
+  }
+}
+
+/////////////////////////////////////////////////
+void SonarExecutor::Register(SonarTaskGroup *_group)
+{
+  std::lock_guard<std::mutex> guard(this->queueMutex);
+  this->groups.push_back(_group);
+}
+
+/////////////////////////////////////////////////
+void SonarExecutor::Unregister(SonarTaskGroup *_group)
+{
+  std::lock_guard<std::mutex> guard(this->queueMutex);
+  this->groups.erase(
+      std::remove(this->groups.begin(), this->groups.end(), _group),
+      this->groups.end());
+}
+
+/////////////////////////////////////////////////
+void SonarExecutor::Submit(SonarTaskGroup *_group, SonarTask _task)
+{
+  this->queued++;
+  if (workerIndex >= 0)
+  {
+    // Spawned from a running task: keep it local, others may steal it
+    Worker &worker = *this->workers[workerIndex];
+    std::lock_guard<std::mutex> guard(worker.mutex);
+    worker.tasks.push_back(Item{std::move(_task), _group});
+  }
+  else
+  {
+    std::lock_guard<std::mutex> guard(this->queueMutex);
+    this->Start();
+    _group->queue.push_back(std::move(_task));
+  }
+  this->queueCondition.notify_one();
+}
+
+/////////////////////////////////////////////////
+bool SonarExecutor::PopGroupTask(SonarTaskGroup *_only, Item &_item)
+{
+  std::lock_guard<std::mutex> guard(this->queueMutex);
+  if (_only)
+  {
+    if (_only->queue.empty())
+      return false;
+    _item.task = std::move(_only->queue.front());
+    _item.group = _only;
+    _only->queue.pop_front();
+    return true;
+  }
+
+  // Highest priority first, round robin between groups of equal priority
+  const size_t nGroups = this->groups.size();
+  SonarTaskGroup *selected = nullptr;
+  size_t selectedIndex = 0;
+  for (size_t i = 0; i < nGroups; i++)
+  {
+    const size_t index = (this->nextGroup + i) % nGroups;
+    SonarTaskGroup *group = this->groups[index];
+    if (group->queue.empty())
+      continue;
+    if (!selected || group->priority > selected->priority)
+    {
+      selected = group;
+      selectedIndex = index;
+    }
+  }
+  if (!selected)
+    return false;
+
+  this->nextGroup = selectedIndex + 1;
+  _item.task = std::move(selected->queue.front());
+  _item.group = selected;
+  selected->queue.pop_front();
+  return true;
+}
+
+/////////////////////////////////////////////////
+bool SonarExecutor::PopLocal(int _index, SonarTaskGroup *_only, Item &_item)
+{
+  if (_index < 0)
+    return false;
+  Worker &worker = *this->workers[_index];
+  std::lock_guard<std::mutex> guard(worker.mutex);
+  if (worker.tasks.empty() || (_only && worker.tasks.back().group != _only))
+    return false;
+  _item = std::move(worker.tasks.back());
+  worker.tasks.pop_back();
+  return true;
+}
+
+/////////////////////////////////////////////////
+bool SonarExecutor::Steal(int _index, SonarTaskGroup *_only, Item &_item)
+{
+  const int nWorkers = static_cast<int>(this->workers.size());
+  for (int i = 1; i <= nWorkers; i++)
+  {
+    const int victim = (std::max(_index, 0) + i) % nWorkers;
+    if (victim == _index)
+      continue;
+    Worker &worker = *this->workers[victim];
+    std::lock_guard<std::mutex> guard(worker.mutex);
+    for (auto it = worker.tasks.begin(); it != worker.tasks.end(); ++it)
+    {
+      if (_only && it->group != _only)
+        continue;
+      _item = std::move(*it);
+      worker.tasks.erase(it);
+      return true;
+    }
+  }
+  return false;
+}
+
+/////////////////////////////////////////////////
+bool SonarExecutor::RunOne(int _index, SonarTaskGroup *_only)
+{
+  Item item;
+  if (!this->PopLocal(_index, _only, item) &&
+      !this->PopGroupTask(_only, item) &&
+      !this->Steal(_index, _only, item))
+    return false;
+
+  this->queued--;
+  item.task();
+  Finish(item.group);
+  return true;
+}
+
+/////////////////////////////////////////////////
+void SonarExecutor::Finish(SonarTaskGroup *_group)
+{
+  if (--_group->pending <= 0)
+  {
+    std::lock_guard<std::mutex> lock(_group->doneMutex);
+    _group->doneCondition.notify_all();
+  }
+}
+
+/////////////////////////////////////////////////
+void SonarExecutor::WorkerLoop(int _index)
+{
+  workerIndex = _index;
+  while (!this->stop)
+  {
+    if (this->RunOne(_index, nullptr))
+      continue;
+
+    std::unique_lock<std::mutex> lock(this->queueMutex);
+    this->queueCondition.wait_for(lock, std::chrono::milliseconds(10),
+        [this]() { return this->stop || this->queued > 0; });
+  }
+}
+}  // namespace NpsGazeboSonar
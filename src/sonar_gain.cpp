@@ -0,0 +1,123 @@
+/*
+ * Copyright 2020 Naval Postgraduate School
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+
+#include <nps_uw_sensors_gazebo/sonar_gain.hh>
+
+#include <math.h>
+#include <algorithm>
+
+namespace NpsGazeboSonar
+{
+/////////////////////////////////////////////////
+bool ParseCompressionMode(const std::string &_name, CompressionMode &_mode)
+{
+  if (_name == "linear")
+    _mode = CompressionMode::LINEAR;
+  else if (_name == "log")
+    _mode = CompressionMode::LOG;
+  else
+    return false;
+  return true;
+}
+
+/////////////////////////////////////////////////
+SonarGainStage::SonarGainStage(const SonarGainConfig &_config,
+                               const std::vector<float> &_ranges)
+  : mode(_config.mode), dynamicRange(std::max(_config.dynamicRange, 1.0))
+{
+  // R^(n/20) undoes n log10(R) dB of spreading, exp(2 alpha R) the two
+  // way absorption applied by the echo synthesis
+  const double minRange = std::max(_config.minRange, 1e-3);
+  this->gain.resize(_ranges.size());
+  for (size_t bin = 0; bin < _ranges.size(); bin++)
+  {
+    const double range = std::max(static_cast<double>(_ranges[bin]),
+                                  minRange);
+    this->gain[bin] = pow(range, _config.spreading / 20.0)
+                      * exp(2.0 * _config.absorption * range);
+  }
+}
+
+/////////////////////////////////////////////////
+float SonarGainStage::Peak(const float *_amplitude, int _nBeams) const
+{
+  const int nBins = static_cast<int>(this->gain.size());
+  const float *gain = this->gain.data();
+  float peak = 0.0f;
+  for (int beam = 0; beam < _nBeams; beam++)
+  {
+    const float *amplitude = _amplitude + beam * nBins;
+    for (int bin = 0; bin < nBins; bin++)
+      peak = std::max(peak, amplitude[bin] * gain[bin]);
+  }
+  return peak;
+}
+
+/////////////////////////////////////////////////
+void SonarGainStage::Apply(const float *_amplitude, int _nBeams,
+                           float _ceiling, float *_level) const
+{
+  const int nBins = static_cast<int>(this->gain.size());
+  const float *gain = this->gain.data();
+  if (_ceiling <= 0.0f)
+  {
+    std::fill(_level, _level + _nBeams * nBins, 0.0f);
+    return;
+  }
+
+  if (this->mode == CompressionMode::LINEAR)
+  {
+    const float scale = 255.0f / _ceiling;
+    for (int beam = 0; beam < _nBeams; beam++)
+    {
+      const float *amplitude = _amplitude + beam * nBins;
+      float *level = _level + beam * nBins;
+      for (int bin = 0; bin < nBins; bin++)
+        level[bin] = std::min(amplitude[bin] * gain[bin] * scale, 255.0f);
+    }
+    return;
+  }
+
+  // 20 log10(a / ceiling) mapped from -dynamicRange..0 dB to 0..255
+  const float scale = 255.0f * 20.0f / this->dynamicRange;
+  const float offset = 255.0f - scale * log10f(_ceiling);
+  const float floor = 1e-30f;
+  for (int beam = 0; beam < _nBeams; beam++)
+  {
+    const float *amplitude = _amplitude + beam * nBins;
+    float *level = _level + beam * nBins;
+    for (int bin = 0; bin < nBins; bin++)
+    {
+      const float value = scale
+          * log10f(std::max(amplitude[bin] * gain[bin], floor)) + offset;
+      level[bin] = std::min(std::max(value, 0.0f), 255.0f);
+    }
+  }
+}
+
+/////////////////////////////////////////////////
+const std::vector<float> &SonarGainStage::Gain() const
+{
+  return this->gain;
+}
+
+/////////////////////////////////////////////////
+CompressionMode SonarGainStage::Mode() const
+{
+  return this->mode;
+}
+}  // namespace NpsGazeboSonar
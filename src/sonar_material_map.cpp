@@ -0,0 +1,206 @@
+/*
+ * Copyright 2020 Naval Postgraduate School
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+
+#include <nps_uw_sensors_gazebo/sonar_material_map.hh>
+
+#include <gazebo/rendering/Camera.hh>
+
+#include <math.h>
+#include <algorithm>
+#include <typeinfo>
+
+namespace NpsGazeboSonar
+{
+// Ogre material scheme used by the material ID viewport
+static const char *MATERIAL_SCHEME = "sonar_material_id";
+
+/////////////////////////////////////////////////
+SonarMaterialTable &SonarMaterialTable::Instance()
+{
+  static SonarMaterialTable instance;
+  return instance;
+}
+
+/////////////////////////////////////////////////
+SonarMaterialTable::SonarMaterialTable()
+  : sqrtMu(1, 0.0f), revision(0)
+{
+}
+
+/////////////////////////////////////////////////
+int SonarMaterialTable::Add(const std::string &_target, double _mu)
+{
+  std::lock_guard<std::mutex> guard(this->mutex);
+  int id;
+  auto found = this->ids.find(_target);
+  if (found != this->ids.end())
+  {
+    id = found->second;
+  }
+  else
+  {
+    if (static_cast<int>(this->sqrtMu.size()) > MAX_ID)
+      return 0;
+    id = this->sqrtMu.size();
+    this->ids[_target] = id;
+    this->sqrtMu.push_back(0.0f);
+  }
+  this->sqrtMu[id] = sqrt(_mu);
+  this->revision++;
+  return id;
+}
+
+/////////////////////////////////////////////////
+int SonarMaterialTable::Lookup(const std::string &_modelName,
+                               const std::string &_materialName) const
+{
+  std::lock_guard<std::mutex> guard(this->mutex);
+  auto found = this->ids.find(_modelName);
+  if (found != this->ids.end())
+    return found->second;
+  found = this->ids.find(_materialName);
+  if (found != this->ids.end())
+    return found->second;
+  return 0;
+}
+
+/////////////////////////////////////////////////
+void SonarMaterialTable::SqrtReflectivity(double _defaultMu,
+                                          std::vector<float> &_table) const
+{
+  std::lock_guard<std::mutex> guard(this->mutex);
+  _table.assign(MAX_ID + 1, 0.0f);
+  std::copy(this->sqrtMu.begin(), this->sqrtMu.end(), _table.begin());
+  _table[0] = sqrt(_defaultMu);
+}
+
+/////////////////////////////////////////////////
+uint64_t SonarMaterialTable::Revision() const
+{
+  std::lock_guard<std::mutex> guard(this->mutex);
+  return this->revision;
+}
+
+/////////////////////////////////////////////////
+SonarMaterialPass::SonarMaterialPass(gazebo::rendering::CameraPtr _camera)
+  : camera(_camera), renderTexture(nullptr), plainColor(nullptr),
+    tableRevision(0)
+{
+  const unsigned int width = this->camera->ImageWidth();
+  const unsigned int height = this->camera->ImageHeight();
+
+  this->texture = Ogre::TextureManager::getSingleton().createManual(
+      this->camera->ScopedName() + "::sonar_material_id",
+      Ogre::ResourceGroupManager::DEFAULT_RESOURCE_GROUP_NAME,
+      Ogre::TEX_TYPE_2D, width, height, 0, Ogre::PF_R8G8B8,
+      Ogre::TU_RENDERTARGET);
+  this->renderTexture = this->texture->getBuffer()->getRenderTarget();
+  this->renderTexture->setAutoUpdated(false);
+
+  // Same view as the depth camera, flat colors only
+  Ogre::Viewport *viewport =
+      this->renderTexture->addViewport(this->camera->OgreCamera());
+  viewport->setClearEveryFrame(true);
+  viewport->setBackgroundColour(Ogre::ColourValue::Black);
+  viewport->setOverlaysEnabled(false);
+  viewport->setShadowsEnabled(false);
+  viewport->setSkiesEnabled(false);
+  viewport->setMaterialScheme(MATERIAL_SCHEME);
+  viewport->setVisibilityMask(
+      this->camera->OgreViewport()->getVisibilityMask());
+
+  // Same flat shader as Gazebo's selection buffer, the color comes from
+  // custom parameter 1 of each sub entity
+  Ogre::MaterialPtr material = Ogre::MaterialManager::getSingleton().load(
+      "gazebo/plain_color",
+      Ogre::ResourceGroupManager::DEFAULT_RESOURCE_GROUP_NAME).
+      staticCast<Ogre::Material>();
+  this->plainColor = material->getTechnique(0);
+
+  this->rgb = cv::Mat(height, width, CV_8UC3);
+}
+
+/////////////////////////////////////////////////
+SonarMaterialPass::~SonarMaterialPass()
+{
+  if (this->renderTexture)
+    this->renderTexture->removeAllViewports();
+  if (!this->texture.isNull())
+    Ogre::TextureManager::getSingleton().remove(this->texture->getName());
+}
+
+/////////////////////////////////////////////////
+void SonarMaterialPass::Render(cv::Mat &_ids)
+{
+  // Targets added since the last frame may match entities seen before
+  const uint64_t revision = SonarMaterialTable::Instance().Revision();
+  if (revision != this->tableRevision)
+  {
+    this->entityIds.clear();
+    this->tableRevision = revision;
+  }
+
+  Ogre::MaterialManager::getSingleton().addListener(this);
+  this->renderTexture->update();
+  Ogre::MaterialManager::getSingleton().removeListener(this);
+
+  Ogre::PixelBox box(this->rgb.cols, this->rgb.rows, 1,
+                     Ogre::PF_BYTE_RGB, this->rgb.data);
+  this->texture->getBuffer()->blitToMemory(box);
+  cv::extractChannel(this->rgb, _ids, 0);
+}
+
+/////////////////////////////////////////////////
+Ogre::Technique *SonarMaterialPass::handleSchemeNotFound(
+    unsigned short /*_schemeIndex*/, const Ogre::String &_schemeName,
+    Ogre::Material *_originalMaterial, unsigned short /*_lodIndex*/,
+    const Ogre::Renderable *_rend)
+{
+  if (_schemeName != MATERIAL_SCHEME || !_rend ||
+      typeid(*_rend) != typeid(Ogre::SubEntity))
+    return nullptr;
+
+  const Ogre::SubEntity *subEntity =
+      static_cast<const Ogre::SubEntity *>(_rend);
+  std::string visualName;
+  const Ogre::Any &userAny =
+      subEntity->getParent()->getUserObjectBindings().getUserAny();
+  if (!userAny.isEmpty() && userAny.getType() == typeid(std::string))
+    visualName = Ogre::any_cast<std::string>(userAny);
+  const std::string materialName =
+      _originalMaterial ? _originalMaterial->getName() : std::string();
+
+  const std::string key = visualName + "|" + materialName;
+  auto found = this->entityIds.find(key);
+  int id;
+  if (found != this->entityIds.end())
+  {
+    id = found->second;
+  }
+  else
+  {
+    // Top level model of a scoped visual name, model::link::visual
+    const std::string modelName = visualName.substr(0, visualName.find("::"));
+    id = SonarMaterialTable::Instance().Lookup(modelName, materialName);
+    this->entityIds[key] = id;
+  }
+
+  const_cast<Ogre::SubEntity *>(subEntity)->setCustomParameter(1,
+      Ogre::Vector4(id / 255.0, 0.0, 0.0, 1.0));
+  return this->plainColor;
+}
+}  // namespace NpsGazeboSonar
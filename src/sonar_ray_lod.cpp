@@ -0,0 +1,147 @@
+/*
+ * Copyright 2020 Naval Postgraduate School
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+
+#include <nps_uw_sensors_gazebo/sonar_ray_lod.hh>
+
+#include <math.h>
+#include <algorithm>
+#include <limits>
+
+namespace NpsGazeboSonar
+{
+/////////////////////////////////////////////////
+SonarRayLOD::SonarRayLOD(int _nRays, int _raySkips, int _maxLevel,
+                         double _nearRange, double _rangeResolution,
+                         double _focalLength, bool _jitter)
+  : nRays(_nRays), raySkips(std::max(_raySkips, 1)),
+    maxLevel(std::max(_maxLevel, 0)), nearRange(_nearRange),
+    rangeResolution(_rangeResolution), jitter(_jitter)
+{
+  // Pinhole rows, the ones at the image edges span smaller angles
+  this->rowEdge.resize(this->nRays + 1);
+  for (int edge = 0; edge <= this->nRays; edge++)
+    this->rowEdge[edge] = atan2(edge - 0.5 * this->nRays, _focalLength);
+
+  // Full detail until the first frame has been seen
+  this->Update(std::vector<cv::Mat>());
+}
+
+/////////////////////////////////////////////////
+void SonarRayLOD::Sample(uint64_t _seed, std::vector<float> &_rowWeight) const
+{
+  _rowWeight.assign(this->nRays, 0.0f);
+  // One stratum is raySkips rows of the mean elevation angle per row,
+  // the area the engine assigns to a sampled row
+  const double stratum = this->raySkips
+      * (this->rowEdge[this->nRays] - this->rowEdge[0]) / this->nRays;
+  cv::RNG rng(_seed);
+  for (const std::pair<int, int> &segment : this->segments)
+  {
+    int row = segment.first;
+    if (this->jitter)
+      row += rng.uniform(0, segment.second);
+    // Elevation angle of the segment in units of one stratum, so the
+    // weights add up to the field of view
+    const int end = segment.first + segment.second;
+    _rowWeight[row] = static_cast<float>(
+        (this->rowEdge[end] - this->rowEdge[segment.first]) / stratum);
+  }
+}
+
+/////////////////////////////////////////////////
+int SonarRayLOD::SampledRows() const
+{
+  return static_cast<int>(this->segments.size());
+}
+
+/////////////////////////////////////////////////
+void SonarRayLOD::Update(const std::vector<cv::Mat> &_ranges)
+{
+  // Segments do not depend on range without level of detail
+  if (this->maxLevel == 0 && !this->segments.empty())
+    return;
+
+  // Nearest return of every row over all views, and the median change
+  // of range to the next row where both have a return
+  std::vector<float> nearest(this->nRays, std::numeric_limits<float>::max());
+  std::vector<float> rowStep(this->nRays, 0.0f);
+  std::vector<float> steps;
+  for (int row = 0; row < this->nRays; row++)
+  {
+    steps.clear();
+    for (const cv::Mat &range : _ranges)
+    {
+      if (row >= range.rows)
+        continue;
+      const float *values = range.ptr<float>(row);
+      const float *next =
+          row + 1 < range.rows ? range.ptr<float>(row + 1) : nullptr;
+      for (int column = 0; column < range.cols; column++)
+      {
+        if (values[column] > 0.0f)
+        {
+          nearest[row] = std::min(nearest[row], values[column]);
+          if (next && next[column] > 0.0f)
+            steps.push_back(fabs(next[column] - values[column]));
+        }
+      }
+    }
+    // The median ignores object edges, a grazing seabed spans the row
+    if (!steps.empty())
+    {
+      std::nth_element(steps.begin(), steps.begin() + steps.size() / 2,
+                       steps.end());
+      rowStep[row] = steps[steps.size() / 2];
+    }
+  }
+
+  // Level of detail of each row from its nearest return
+  std::vector<int> rowLevel(this->nRays, 0);
+  for (int row = 0; row < this->nRays && !_ranges.empty(); row++)
+  {
+    if (nearest[row] == std::numeric_limits<float>::max())
+      rowLevel[row] = this->maxLevel;
+    else if (nearest[row] > this->nearRange)
+      rowLevel[row] = std::min(this->maxLevel, static_cast<int>(
+                               floor(log2(nearest[row] / this->nearRange))));
+
+    // Grazing surface: the range a segment sweeps stays within one bin,
+    // or within one stratum if that already sweeps more
+    const double stratumSweep = rowStep[row] * this->raySkips;
+    if (rowLevel[row] > 0 && stratumSweep > 0.0)
+    {
+      const double coarsest =
+          floor(log2(std::max(this->rangeResolution / stratumSweep, 1.0)));
+      rowLevel[row] = std::min(rowLevel[row], static_cast<int>(coarsest));
+    }
+  }
+
+  // Split the rows into segments, a segment is never coarser than its
+  // finest row
+  this->segments.clear();
+  for (int row = 0; row < this->nRays;)
+  {
+    int level = rowLevel[row];
+    for (int next = row;
+         next < std::min(row + (this->raySkips << level), this->nRays); next++)
+      level = std::min(level, rowLevel[next]);
+    const int stride = this->raySkips << level;
+    this->segments.emplace_back(row, std::min(stride, this->nRays - row));
+    row += stride;
+  }
+}
+}  // namespace NpsGazeboSonar
@@ -0,0 +1,360 @@
+/*
+ * Copyright 2020 Naval Postgraduate School
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+
+#include <nps_uw_sensors_gazebo/sonar_refraction.hh>
+
+#include <cmath>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <tuple>
+#include <utility>
+
+namespace NpsGazeboSonar
+{
+/////////////////////////////////////////////////
+double SoundSpeedProfile::Speed(double _depth) const
+{
+  if (this->depth.empty())
+    return 0.0;
+  if (_depth <= this->depth.front())
+    return this->speed.front();
+  if (_depth >= this->depth.back())
+    return this->speed.back();
+  const size_t upper = std::upper_bound(this->depth.begin(),
+      this->depth.end(), _depth) - this->depth.begin();
+  const double t = (_depth - this->depth[upper - 1]) /
+                   (this->depth[upper] - this->depth[upper - 1]);
+  return this->speed[upper - 1] * (1.0 - t) + this->speed[upper] * t;
+}
+
+/////////////////////////////////////////////////
+bool SoundSpeedProfile::operator<(const SoundSpeedProfile &_other) const
+{
+  return std::tie(depth, speed) < std::tie(_other.depth, _other.speed);
+}
+
+/////////////////////////////////////////////////
+bool SoundSpeedProfile::operator!=(const SoundSpeedProfile &_other) const
+{
+  return depth != _other.depth || speed != _other.speed;
+}
+
+/////////////////////////////////////////////////
+bool MakeSoundSpeedProfile(const std::vector<double> &_pairs,
+                           SoundSpeedProfile &_profile)
+{
+  if (_pairs.empty() || _pairs.size() % 2 != 0)
+    return false;
+  std::vector<std::pair<double, double>> samples;
+  for (size_t i = 0; i < _pairs.size(); i += 2)
+  {
+    if (_pairs[i + 1] <= 0.0)
+      return false;
+    samples.push_back(std::make_pair(_pairs[i], _pairs[i + 1]));
+  }
+
+  // Sorted by depth, repeated depths dropped
+  std::sort(samples.begin(), samples.end());
+  SoundSpeedProfile profile;
+  for (const auto &sample : samples)
+  {
+    if (!profile.depth.empty() && sample.first <= profile.depth.back())
+      continue;
+    profile.depth.push_back(sample.first);
+    profile.speed.push_back(sample.second);
+  }
+  _profile = profile;
+  return true;
+}
+
+/////////////////////////////////////////////////
+bool ParseSoundSpeedProfile(const std::string &_list,
+                            SoundSpeedProfile &_profile)
+{
+  std::vector<double> pairs;
+  std::istringstream stream(_list);
+  double value;
+  while (stream >> value)
+    pairs.push_back(value);
+  if (!stream.eof())
+    return false;
+  return MakeSoundSpeedProfile(pairs, _profile);
+}
+
+/////////////////////////////////////////////////
+bool LoadSoundSpeedProfile(const std::string &_file,
+                           SoundSpeedProfile &_profile)
+{
+  std::ifstream file(_file);
+  if (!file)
+    return false;
+  std::vector<double> pairs;
+  std::string line;
+  while (std::getline(file, line))
+  {
+    std::replace(line.begin(), line.end(), ',', ' ');
+    std::istringstream stream(line);
+    double depth, speed;
+    if (line.empty() || line[0] == '#' || !(stream >> depth))
+      continue;
+    if (!(stream >> speed))
+      return false;
+    pairs.push_back(depth);
+    pairs.push_back(speed);
+  }
+  return MakeSoundSpeedProfile(pairs, _profile);
+}
+
+/////////////////////////////////////////////////
+bool SonarRefractionKey::operator<(const SonarRefractionKey &_other) const
+{
+  return std::tie(profile, soundSpeed, maxDistance, minElevation,
+                  maxElevation, nDepths, nElevations, nDistances) <
+         std::tie(_other.profile, _other.soundSpeed, _other.maxDistance,
+                  _other.minElevation, _other.maxElevation, _other.nDepths,
+                  _other.nElevations, _other.nDistances);
+}
+
+/////////////////////////////////////////////////
+SonarRefractionTable::SonarRefractionTable(const SonarRefractionKey &_key)
+  : key(_key)
+{
+  this->key.nDepths = std::max(this->key.nDepths, 1);
+  this->key.nElevations = std::max(this->key.nElevations, 2);
+  this->key.nDistances = std::max(this->key.nDistances, 2);
+  const int nDepths = this->key.nDepths;
+  const size_t sliceSize = this->key.nElevations * this->key.nDistances;
+  this->path.assign(nDepths * sliceSize, 0.0f);
+  this->delay.assign(nDepths * sliceSize, 0.0f);
+
+  // Sensor depths spanning the profile samples
+  const double top = std::max(0.0, this->key.profile.depth.empty() ?
+                                   0.0 : this->key.profile.depth.front());
+  const double bottom = this->key.profile.depth.empty() ?
+                        top : std::max(top, this->key.profile.depth.back());
+  this->depths.resize(nDepths);
+  for (int d = 0; d < nDepths; d++)
+  {
+    this->depths[d] = nDepths > 1 ?
+        top + (bottom - top) * d / (nDepths - 1) : top;
+    this->Trace(d);
+  }
+}
+
+/////////////////////////////////////////////////
+void SonarRefractionTable::Trace(int _slice)
+{
+  const SoundSpeedProfile &profile = this->key.profile;
+  const int nElevations = this->key.nElevations;
+  const int nDistances = this->key.nDistances;
+  const double source = this->depths[_slice];
+  const double c0 = this->key.soundSpeed;
+  const double elevationStep = (this->key.maxElevation -
+                                this->key.minElevation) / (nElevations - 1);
+  const double distanceStep = this->key.maxDistance / (nDistances - 1);
+
+  // Fan of launch angles a little wider than the table, so rays bent
+  // back into it are traced as well
+  const int nRays = 4 * nElevations;
+  const double margin = 0.2;
+  const double firstLaunch = std::max(this->key.minElevation - margin,
+                                      -M_PI / 2.0 + 1e-3);
+  const double lastLaunch = std::min(this->key.maxElevation + margin,
+                                     M_PI / 2.0 - 1e-3);
+  const double ds = distanceStep / 4.0;
+  const int maxSteps = static_cast<int>(2.0 * this->key.maxDistance / ds);
+
+  // Depression angle and travel time x c0 of each ray where its chord
+  // crosses each distance of the grid
+  std::vector<float> chordElevation(nRays * nDistances, NAN);
+  std::vector<float> rayDelay(nRays * nDistances, NAN);
+  std::vector<float> rayPath(nRays * nDistances, NAN);
+  for (int r = 0; r < nRays; r++)
+  {
+    double angle = firstLaunch + (lastLaunch - firstLaunch) * r / (nRays - 1);
+    // Snell invariant cos(angle) / c along the ray
+    const double invariant = cos(angle) / profile.Speed(source);
+    double x = 0.0, z = source, time = 0.0, s = 0.0;
+    double chord = 0.0;
+    int next = 1;
+    chordElevation[r * nDistances] = angle;
+    rayDelay[r * nDistances] = 0.0f;
+    rayPath[r * nDistances] = 0.0f;
+    for (int step = 0; step < maxSteps && next < nDistances; step++)
+    {
+      const double previousChord = chord;
+      const double previousTime = time;
+      const double px = x, pz = z;
+      x += cos(angle) * ds;
+      z += sin(angle) * ds;
+      // Surface reflection
+      if (z < 0.0)
+      {
+        z = -z;
+        angle = -angle;
+      }
+      time += ds / profile.Speed(0.5 * (pz + z));
+      s += ds;
+
+      // Bend to the local sound speed, turning back at a vertex
+      const double grazing = invariant * profile.Speed(z);
+      if (grazing >= 1.0)
+        angle = angle > 0.0 ? -1e-4 : 1e-4;
+      else
+        angle = (angle >= 0.0 ? 1.0 : -1.0) * acos(grazing);
+
+      chord = sqrt(x * x + (z - source) * (z - source));
+      while (next < nDistances && chord >= next * distanceStep)
+      {
+        const double t = (next * distanceStep - previousChord) /
+                         std::max(chord - previousChord, 1e-9);
+        const double cx = px + (x - px) * t;
+        const double cz = pz + (z - pz) * t;
+        const int index = r * nDistances + next;
+        chordElevation[index] = atan2(cz - source, cx);
+        rayDelay[index] = c0 * (previousTime + (time - previousTime) * t);
+        rayPath[index] = s - ds * (1.0 - t);
+        next++;
+      }
+    }
+  }
+
+  // Resample the fan at the table's depression angles: between two
+  // neighbouring rays whose chords bracket the angle, the earliest such
+  // arrival when surface reflections fold the fan, the nearest ray in
+  // shadow zones
+  const double launchStep = (lastLaunch - firstLaunch) / (nRays - 1);
+  float *slicePath = &this->path[_slice * nElevations * nDistances];
+  float *sliceDelay = &this->delay[_slice * nElevations * nDistances];
+  for (int j = 1; j < nDistances; j++)
+  {
+    const double distance = j * distanceStep;
+    for (int e = 0; e < nElevations; e++)
+    {
+      const double elevation = this->key.minElevation + e * elevationStep;
+      double bentDelay = distance, bentPath = distance;
+      double nearest = 1e9;
+      bool bracketed = false;
+      for (int r = 0; r + 1 < nRays; r++)
+      {
+        const int i0 = r * nDistances + j;
+        const int i1 = (r + 1) * nDistances + j;
+        const float e0 = chordElevation[i0];
+        const float e1 = chordElevation[i1];
+        if (std::isnan(e0))
+          continue;
+        if (!bracketed && fabs(e0 - elevation) < nearest)
+        {
+          nearest = fabs(e0 - elevation);
+          bentDelay = rayDelay[i0];
+          bentPath = rayPath[i0];
+        }
+        // Neighbouring rays split by a reflection or vertex do not
+        // bracket a continuous wavefront
+        if (std::isnan(e1) || (elevation - e0) * (elevation - e1) > 0.0 ||
+            e0 == e1 || fabs(e1 - e0) > 4.0 * launchStep)
+          continue;
+        const double t = (elevation - e0) / (e1 - e0);
+        const double arrival = rayDelay[i0] * (1.0 - t) + rayDelay[i1] * t;
+        if (bracketed && arrival >= bentDelay)
+          continue;
+        bentDelay = arrival;
+        bentPath = rayPath[i0] * (1.0 - t) + rayPath[i1] * t;
+        bracketed = true;
+      }
+      slicePath[e * nDistances + j] = bentPath - distance;
+      sliceDelay[e * nDistances + j] = bentDelay - distance;
+    }
+  }
+}
+
+/////////////////////////////////////////////////
+void SonarRefractionTable::Slice(double _depth, std::vector<float> &_path,
+                                 std::vector<float> &_delay) const
+{
+  const size_t sliceSize = this->key.nElevations * this->key.nDistances;
+  const int nDepths = this->key.nDepths;
+  int d0 = 0;
+  double t = 0.0;
+  if (nDepths > 1 && _depth > this->depths.front())
+  {
+    d0 = std::upper_bound(this->depths.begin(), this->depths.end(), _depth)
+         - this->depths.begin() - 1;
+    d0 = std::min(d0, nDepths - 2);
+    t = std::min((_depth - this->depths[d0]) /
+                 (this->depths[d0 + 1] - this->depths[d0]), 1.0);
+  }
+  const int d1 = std::min(d0 + 1, nDepths - 1);
+  _path.resize(sliceSize);
+  _delay.resize(sliceSize);
+  for (size_t i = 0; i < sliceSize; i++)
+  {
+    _path[i] = this->path[d0 * sliceSize + i] * (1.0 - t)
+               + this->path[d1 * sliceSize + i] * t;
+    _delay[i] = this->delay[d0 * sliceSize + i] * (1.0 - t)
+                + this->delay[d1 * sliceSize + i] * t;
+  }
+}
+
+/////////////////////////////////////////////////
+const SonarRefractionKey &SonarRefractionTable::Key() const
+{
+  return this->key;
+}
+
+/////////////////////////////////////////////////
+size_t SonarRefractionTable::Bytes() const
+{
+  return sizeof(float) * (this->path.size() + this->delay.size());
+}
+
+/////////////////////////////////////////////////
+SonarRefractionCache &SonarRefractionCache::Instance()
+{
+  static SonarRefractionCache instance;
+  return instance;
+}
+
+/////////////////////////////////////////////////
+SonarRefractionPtr SonarRefractionCache::Acquire(
+                              const SonarRefractionKey &_key)
+{
+  std::lock_guard<std::mutex> guard(this->mutex);
+
+  // Drop tables whose last user has moved on to another profile
+  for (auto it = this->entries.begin(); it != this->entries.end();)
+  {
+    if (it->second.expired())
+      it = this->entries.erase(it);
+    else
+      ++it;
+  }
+
+  auto found = this->entries.find(_key);
+  if (found != this->entries.end())
+  {
+    SonarRefractionPtr table = found->second.lock();
+    if (table)
+      return table;
+  }
+
+  SonarRefractionPtr table = std::make_shared<SonarRefractionTable>(_key);
+  this->entries[_key] = table;
+  return table;
+}
+}  // namespace NpsGazeboSonar
@@ -0,0 +1,86 @@
+/*
+ * Copyright 2020 Naval Postgraduate School
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+
+#include <nps_uw_sensors_gazebo/sonar_result_cache.hh>
+
+#include <math.h>
+#include <cstring>
+
+namespace NpsGazeboSonar
+{
+/////////////////////////////////////////////////
+bool SonarCacheKey::operator==(const SonarCacheKey &_other) const
+{
+  return valid && _other.valid && pose == _other.pose &&
+         scene == _other.scene && config == _other.config;
+}
+
+/////////////////////////////////////////////////
+uint64_t HashQuantized(const std::vector<double> &_values,
+                       double _resolution, uint64_t _hash)
+{
+  for (double value : _values)
+  {
+    const int64_t quantized = llround(value / _resolution);
+    unsigned char bytes[sizeof(quantized)];
+    memcpy(bytes, &quantized, sizeof(quantized));
+    for (unsigned char byte : bytes)
+    {
+      _hash ^= byte;
+      _hash *= 1099511628211ULL;
+    }
+  }
+  return _hash;
+}
+
+/////////////////////////////////////////////////
+bool SonarResultCache::Lookup(const SonarCacheKey &_key, CArray2D &_beams)
+{
+  std::lock_guard<std::mutex> guard(this->mutex);
+  if (_key == this->key)
+  {
+    _beams = this->beams;
+    this->hits++;
+    return true;
+  }
+  this->misses++;
+  return false;
+}
+
+/////////////////////////////////////////////////
+void SonarResultCache::Store(const SonarCacheKey &_key,
+                             const CArray2D &_beams)
+{
+  std::lock_guard<std::mutex> guard(this->mutex);
+  this->key = _key;
+  this->beams = _beams;
+}
+
+/////////////////////////////////////////////////
+uint64_t SonarResultCache::Hits() const
+{
+  std::lock_guard<std::mutex> guard(this->mutex);
+  return this->hits;
+}
+
+/////////////////////////////////////////////////
+uint64_t SonarResultCache::Misses() const
+{
+  std::lock_guard<std::mutex> guard(this->mutex);
+  return this->misses;
+}
+}  // namespace NpsGazeboSonar
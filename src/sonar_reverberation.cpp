@@ -0,0 +1,152 @@
+/*
+ * Copyright 2020 Naval Postgraduate School
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+
+#include <nps_uw_sensors_gazebo/sonar_reverberation.hh>
+
+#include <math.h>
+#include <algorithm>
+#include <sstream>
+
+namespace NpsGazeboSonar
+{
+/////////////////////////////////////////////////
+bool ParseScatteringLayers(const std::string &_list,
+                           std::vector<SonarScatteringLayer> &_layers)
+{
+  std::vector<SonarScatteringLayer> layers;
+  std::istringstream stream(_list);
+  SonarScatteringLayer layer;
+  while (stream >> layer.depth)
+  {
+    if (!(stream >> layer.strength))
+      return false;
+    layers.push_back(layer);
+  }
+  if (!stream.eof())
+    return false;
+  std::sort(layers.begin(), layers.end(),
+            [](const SonarScatteringLayer &_a, const SonarScatteringLayer &_b)
+            { return _a.depth < _b.depth; });
+  _layers = layers;
+  return true;
+}
+
+/////////////////////////////////////////////////
+SonarReverberation::SonarReverberation(
+    const SonarReverberationConfig &_config,
+    const std::vector<float> &_ranges, const std::vector<float> &_beamWidths)
+  : config(_config), ranges(_ranges), depth(0.0), declination(0.0)
+{
+  this->config.rangeCells = std::max(this->config.rangeCells, 1);
+  this->beamFactor.resize(_beamWidths.size());
+  for (size_t beam = 0; beam < _beamWidths.size(); beam++)
+    this->beamFactor[beam] = sqrt(std::max(_beamWidths[beam], 0.0f));
+  this->Build();
+}
+
+/////////////////////////////////////////////////
+bool SonarReverberation::Update(double _depth, double _declination)
+{
+  // A tenth of the range cell in depth, about a degree in tilt
+  const double cell = this->ranges.empty() ? 0.0 :
+      this->ranges.back() / this->config.rangeCells;
+  if (this->config.layers.empty() ||
+      (fabs(_depth - this->depth) < 0.1 * cell &&
+       fabs(_declination - this->declination) < 0.02))
+    return false;
+  this->depth = _depth;
+  this->declination = _declination;
+  this->Build();
+  return true;
+}
+
+/////////////////////////////////////////////////
+void SonarReverberation::Apply(int _beam, std::complex<float> *_echo,
+                               float _firstReturn,
+                               std::default_random_engine &_generator) const
+{
+  const float factor = this->beamFactor[_beam] * static_cast<float>(M_SQRT1_2);
+  std::normal_distribution<float> gaussian(0.0f, 1.0f);
+  const int nBins = static_cast<int>(this->ranges.size());
+  for (int bin = 0; bin < nBins && this->ranges[bin] < _firstReturn; bin++)
+  {
+    const float rms = this->profile[bin] * factor;
+    if (rms > 0.0f)
+      _echo[bin] += std::complex<float>(gaussian(_generator) * rms,
+                                        gaussian(_generator) * rms);
+  }
+}
+
+/////////////////////////////////////////////////
+float SonarReverberation::Level(int _beam, int _bin) const
+{
+  return this->profile[_bin] * this->beamFactor[_beam];
+}
+
+/////////////////////////////////////////////////
+double SonarReverberation::Strength(double _depth) const
+{
+  double strength = this->config.strength;
+  for (const SonarScatteringLayer &layer : this->config.layers)
+  {
+    if (_depth < layer.depth)
+      break;
+    strength = layer.strength;
+  }
+  return strength;
+}
+
+/////////////////////////////////////////////////
+void SonarReverberation::Build()
+{
+  const int nBins = static_cast<int>(this->ranges.size());
+  this->profile.assign(nBins, 0.0f);
+  if (nBins < 2)
+    return;
+
+  // sourceTerm of the ray model, one cell of length dR spans the beam
+  const double dR = this->ranges[1] - this->ranges[0];
+  const double maxRange = this->ranges.back();
+  const double nearest = std::max(this->config.minRange, dR);
+  const double source = pow(10.0, this->config.sourceLevel / 20.0) * 1e-6;
+  const double drop = sin(this->declination);
+  const int nCells = this->config.rangeCells;
+
+  // Log amplitude at the cell nodes, spreading and absorption are close
+  // to linear in it so the interpolation stays smooth
+  std::vector<double> node(nCells + 1);
+  for (int c = 0; c <= nCells; c++)
+  {
+    const double range = std::max(maxRange * c / nCells, nearest);
+    const double strength = this->Strength(this->depth + range * drop);
+    node[c] = log(this->config.scale * source)
+        + 0.5 * (strength / 10.0 * log(10.0)
+                 + log(this->config.elevationWidth * dR))
+        - log(range) - 2.0 * this->config.absorption * range;
+  }
+
+  for (int bin = 0; bin < nBins; bin++)
+  {
+    if (this->ranges[bin] < this->config.minRange)
+      continue;
+    const double position = this->ranges[bin] / maxRange * nCells;
+    const int c = std::min(static_cast<int>(position), nCells - 1);
+    const double t = position - c;
+    this->profile[bin] = exp(node[c] * (1.0 - t) + node[c + 1] * t);
+  }
+}
+}  // namespace NpsGazeboSonar
@@ -0,0 +1,124 @@
+/*
+ * Copyright 2020 Naval Postgraduate School
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+
+#include <nps_uw_sensors_gazebo/sonar_stitching.hh>
+
+#include <math.h>
+#include <algorithm>
+
+namespace NpsGazeboSonar
+{
+// Pinhole azimuth of an image column, positive to the right
+static double ColumnAzimuth(int _column, int _width, double _hFOV)
+{
+  if (_width <= 1)
+    return 0.0;
+  const double fl = static_cast<double>(_width) / (2.0 * tan(_hFOV/2.0));
+  return atan2(static_cast<double>(_column) -
+               0.5 * static_cast<double>(_width-1), fl);
+}
+
+/////////////////////////////////////////////////
+double StitchedFOV(const std::vector<SonarCameraGeometry> &_cameras)
+{
+  double extent = 0.0;
+  for (const SonarCameraGeometry &camera : _cameras)
+    extent = std::max(extent, fabs(camera.yaw) + camera.hFOV/2.0);
+  return 2.0 * extent;
+}
+
+/////////////////////////////////////////////////
+std::vector<SonarColumnMap> BuildColumnMaps(
+                    const std::vector<SonarCameraGeometry> &_cameras,
+                    int _nBeams, double _fov)
+{
+  const double beamWidth = _fov / _nBeams;
+  std::vector<SonarColumnMap> maps(_cameras.size());
+  for (size_t c = 0; c < _cameras.size(); c++)
+  {
+    const SonarCameraGeometry &camera = _cameras[c];
+    SonarColumnMap &map = maps[c];
+    map.beam.assign(camera.width, -1);
+    map.slot.assign(camera.width, 0);
+    map.pattern.assign(camera.width, 0.0f);
+    std::vector<int> count(_nBeams, 0);
+    for (int column = 0; column < camera.width; column++)
+    {
+      // Sonar azimuth of this column, the camera yaw turns it left
+      const double local = ColumnAzimuth(column, camera.width, camera.hFOV);
+      const double azimuth = local - camera.yaw;
+      const int beam = static_cast<int>(floor((azimuth + _fov/2.0) / beamWidth));
+      if (beam < 0 || beam >= _nBeams)
+        continue;
+
+      // Overlap goes to the camera looking most directly at it
+      bool closest = true;
+      for (size_t other = 0; other < _cameras.size() && closest; other++)
+      {
+        const double offset = azimuth + _cameras[other].yaw;
+        if (other != c && fabs(offset) < fabs(local) &&
+            fabs(offset) <= _cameras[other].hFOV/2.0)
+          closest = false;
+      }
+      if (!closest)
+        continue;
+
+      map.beam[column] = beam;
+      map.slot[column] = count[beam]++;
+      const double center = -_fov/2.0 + (beam + 0.5) * beamWidth;
+      const double t = M_PI * 0.884 / beamWidth * sin(azimuth - center);
+      map.pattern[column] = (fabs(t) < 1E-8) ? 1.0 : sin(t)/t;
+    }
+    map.nSlots = *std::max_element(count.begin(), count.end());
+  }
+  return maps;
+}
+
+/////////////////////////////////////////////////
+void DepthToRange(const float *_depth, int _width, int _height,
+                  double _hFOV, double _cutoff, cv::Mat &_range)
+{
+  _range.create(_height, _width, CV_32FC1);
+  const double fl = static_cast<double>(_width) / (2.0 * tan(_hFOV/2.0));
+  std::vector<double> tanAzimuth(_width);
+  for (int column = 0; column < _width; column++)
+    tanAzimuth[column] = tan(ColumnAzimuth(column, _width, _hFOV));
+  for (int row = 0; row < _height; row++)
+  {
+    double elevation = 0.0;
+    if (_height > 1)
+      elevation = atan2(static_cast<double>(row) -
+                        0.5 * static_cast<double>(_height-1), fl);
+    const double tanElevation = tan(elevation);
+    float *range = _range.ptr<float>(row);
+    for (int column = 0; column < _width; column++)
+    {
+      const double depth = _depth[row * _width + column];
+      if (depth > _cutoff)
+      {
+        const double x = depth * tanAzimuth[column];
+        const double y = depth * tanElevation;
+        range[column] = sqrt(x * x + y * y + depth * depth);
+      }
+      else
+      {
+        range[column] = 0.0;
+      }
+    }
+  }
+}
+}  // namespace NpsGazeboSonar
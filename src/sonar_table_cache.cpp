@@ -0,0 +1,293 @@
+/*
+ * Copyright 2020 Naval Postgraduate School
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+
+#include <nps_uw_sensors_gazebo/sonar_table_cache.hh>
+
+#include <math.h>
+#include <algorithm>
+#include <tuple>
+
+namespace NpsGazeboSonar
+{
+/////////////////////////////////////////////////
+bool SonarTableKey::operator<(const SonarTableKey &_other) const
+{
+  return std::tie(nBeams, nFreq, azimuthRaysPerBeam,
+                  hFOV, bandwidth, soundSpeed, beamAngles, renderedUniform) <
+         std::tie(_other.nBeams, _other.nFreq, _other.azimuthRaysPerBeam,
+                  _other.hFOV, _other.bandwidth, _other.soundSpeed,
+                  _other.beamAngles, _other.renderedUniform);
+}
+
+/////////////////////////////////////////////////
+size_t SonarTables::Bytes() const
+{
+  return sizeof(float) * (rangeVector.size() + window.size()
+                          + beamCorrector.size() + azimuthAngles.size()
+                          + renderedAngles.size()
+                          + bearingBegin.size() + bearingEnd.size()
+                          + azimuthBeamPattern.size())
+         + sizeof(int) * (columnBeam.size() + columnSlot.size());
+}
+
+/////////////////////////////////////////////////
+SonarTableCache &SonarTableCache::Instance()
+{
+  static SonarTableCache instance;
+  return instance;
+}
+
+/////////////////////////////////////////////////
+SonarTablesPtr SonarTableCache::Acquire(const SonarTableKey &_key)
+{
+  std::lock_guard<std::mutex> guard(this->mutex);
+
+  // Drop entries whose last user has unloaded
+  for (auto it = this->entries.begin(); it != this->entries.end();)
+  {
+    if (it->second.expired())
+      it = this->entries.erase(it);
+    else
+      ++it;
+  }
+
+  auto found = this->entries.find(_key);
+  if (found != this->entries.end())
+  {
+    SonarTablesPtr tables = found->second.lock();
+    if (tables)
+      return tables;
+  }
+
+  SonarTablesPtr tables = Build(_key);
+  this->entries[_key] = tables;
+  return tables;
+}
+
+/////////////////////////////////////////////////
+size_t SonarTableCache::BytesSaved() const
+{
+  std::lock_guard<std::mutex> guard(this->mutex);
+  size_t saved = 0;
+  for (const auto &entry : this->entries)
+  {
+    SonarTablesPtr tables = entry.second.lock();
+    // use_count includes the local copy made by lock()
+    if (tables && tables.use_count() > 2)
+      saved += (tables.use_count() - 2) * tables->Bytes();
+  }
+  return saved;
+}
+
+/////////////////////////////////////////////////
+size_t SonarTableCache::BytesInUse() const
+{
+  std::lock_guard<std::mutex> guard(this->mutex);
+  size_t bytes = 0;
+  for (const auto &entry : this->entries)
+  {
+    SonarTablesPtr tables = entry.second.lock();
+    if (tables)
+      bytes += tables->Bytes();
+  }
+  return bytes;
+}
+
+/////////////////////////////////////////////////
+int SonarTableCache::Users() const
+{
+  std::lock_guard<std::mutex> guard(this->mutex);
+  int users = 0;
+  for (const auto &entry : this->entries)
+    users += entry.second.use_count();
+  return users;
+}
+
+/////////////////////////////////////////////////
+std::shared_ptr<SonarTables> SonarTableCache::Build(
+                                  const SonarTableKey &_key)
+{
+  std::shared_ptr<SonarTables> tables = std::make_shared<SonarTables>();
+  tables->key = _key;
+  const int nFreq = _key.nFreq;
+  const int nBeams = _key.nBeams;
+
+  // Range vector
+  const float delta_t = 1.0/_key.bandwidth;
+  tables->rangeVector.resize(nFreq);
+  for (int i = 0; i < nFreq; i++)
+    tables->rangeVector[i] = delta_t*i*_key.soundSpeed/2.0;
+
+  // Hamming window
+  tables->window.resize(nFreq);
+  float windowSum = 0;
+  for (int f = 0; f < nFreq; f++)
+  {
+    tables->window[f] = 0.54 - 0.46 * cos(2.0*M_PI*(f+1)/nFreq);
+    windowSum += pow(tables->window[f], 2.0);
+  }
+  for (int f = 0; f < nFreq; f++)
+    tables->window[f] = tables->window[f]/sqrt(windowSum);
+
+  // Rendered beam centers follow the pinhole geometry of the camera, or
+  // a uniform grid when several cameras are stitched into one fan
+  const double fl = static_cast<double>(nBeams) / (2.0 * tan(_key.hFOV/2.0));
+  tables->renderedAngles.resize(nBeams);
+  for (int beam = 0; beam < nBeams; beam ++)
+  {
+    if (_key.renderedUniform)
+      tables->renderedAngles[beam] =
+          -(_key.hFOV/2.0) + (beam + 0.5) * _key.hFOV / nBeams;
+    else if (nBeams > 1)
+      tables->renderedAngles[beam] = atan2(static_cast<double>(beam) -
+                              0.5 * static_cast<double>(nBeams-1), fl);
+    else
+      tables->renderedAngles[beam] = 0.0;
+  }
+
+  // Output beam azimuths: pinhole, or the requested beam angle table
+  const bool resample = !_key.beamAngles.empty();
+  if (resample)
+    tables->azimuthAngles.assign(_key.beamAngles.begin(),
+                                 _key.beamAngles.end());
+  else
+    tables->azimuthAngles = tables->renderedAngles;
+
+  // Beam culling correction
+  const double hPixelSize = _key.hFOV / nBeams;
+  std::vector<float> corrector(nBeams * nBeams);
+  tables->beamCorrectorSum = 0.0;
+  for (int beam = 0; beam < nBeams; beam ++)
+  {
+    float beam_azimuthAngle =
+          -(_key.hFOV/2.0) + beam * hPixelSize + hPixelSize/2.0;
+    if (resample)
+      beam_azimuthAngle = _key.beamAngles[beam];
+    for (int beam_other = 0; beam_other < nBeams; beam_other ++)
+    {
+      float beam_azimuthAngle_other =
+          -(_key.hFOV/2.0) + beam_other * hPixelSize + hPixelSize/2.0;
+      if (resample)
+        beam_azimuthAngle_other = _key.beamAngles[beam_other];
+      double t = M_PI * 0.884 / hPixelSize
+                 * sin(beam_azimuthAngle-beam_azimuthAngle_other);
+      float azimuthBeamPattern = (fabs(t) < 1E-8) ? 1.0 : sin(t)/t;
+      corrector[beam * nBeams + beam_other] = azimuthBeamPattern;
+      tables->beamCorrectorSum += pow(azimuthBeamPattern, 2);
+    }
+  }
+  tables->beamCorrectorSum = sqrt(tables->beamCorrectorSum);
+
+  if (!resample)
+  {
+    tables->beamCorrector = corrector;
+  }
+  else
+  {
+    // Linear interpolation of each output beam between the two rendered
+    // beams around it, folded into the corrector so that the engine
+    // applies correction and resampling in one pass:
+    // beamCorrector = corrector (out x out) * resampling (out x rendered)
+    std::vector<int> index(nBeams);
+    std::vector<float> weight(nBeams);
+    for (int beam = 0; beam < nBeams; beam ++)
+    {
+      const float angle = tables->azimuthAngles[beam];
+      auto upper = std::upper_bound(tables->renderedAngles.begin(),
+                                    tables->renderedAngles.end(), angle);
+      int i0 = static_cast<int>(upper - tables->renderedAngles.begin()) - 1;
+      i0 = std::min(std::max(i0, 0), std::max(nBeams - 2, 0));
+      float w1 = 0.0;
+      if (nBeams > 1)
+      {
+        w1 = (angle - tables->renderedAngles[i0]) /
+             (tables->renderedAngles[i0 + 1] - tables->renderedAngles[i0]);
+        w1 = std::min(std::max(w1, 0.0f), 1.0f);
+      }
+      index[beam] = i0;
+      weight[beam] = w1;
+    }
+    tables->beamCorrector.assign(nBeams * nBeams, 0.0f);
+    for (int beam = 0; beam < nBeams; beam ++)
+    {
+      float *row = &tables->beamCorrector[beam * nBeams];
+      for (int beam_other = 0; beam_other < nBeams; beam_other ++)
+      {
+        const float c = corrector[beam * nBeams + beam_other];
+        row[index[beam_other]] += c * (1.0 - weight[beam_other]);
+        if (nBeams > 1)
+          row[index[beam_other] + 1] += c * weight[beam_other];
+      }
+    }
+  }
+
+  // Scan conversion map (output beam azimuths and fan sector bounds)
+  tables->bearingBegin.resize(nBeams);
+  tables->bearingEnd.resize(nBeams);
+  for (int b = 0; b < nBeams; ++b)
+  {
+    const float center = tables->azimuthAngles[b];
+    float begin = 0.0, end = 0.0;
+    if (nBeams == 1)
+    {
+      begin = center - _key.hFOV/2.0;
+      end = center + _key.hFOV/2.0;
+    }
+    else if (b == 0)
+    {
+      end = (tables->azimuthAngles[b + 1] + center) / 2.0;
+      begin = 2 * center - end;
+    }
+    else if (b == nBeams - 1)
+    {
+      begin = tables->bearingEnd[b - 1];
+      end = 2 * center - begin;
+    }
+    else
+    {
+      begin = tables->bearingEnd[b - 1];
+      end = (tables->azimuthAngles[b + 1] + center) / 2.0;
+    }
+    tables->bearingBegin[b] = begin;
+    tables->bearingEnd[b] = end;
+  }
+
+  // Azimuth beam pattern of the supersampled columns of each beam
+  const int nRaysPerBeam = std::max(_key.azimuthRaysPerBeam, 1);
+  const int nColumns = nBeams * nRaysPerBeam;
+  const double flColumns =
+      static_cast<double>(nColumns) / (2.0 * tan(_key.hFOV/2.0));
+  tables->azimuthBeamPattern.resize(nColumns);
+  tables->columnBeam.resize(nColumns);
+  tables->columnSlot.resize(nColumns);
+  for (int column = 0; column < nColumns; column++)
+  {
+    const int beam = column / nRaysPerBeam;
+    tables->columnBeam[column] = beam;
+    tables->columnSlot[column] = column % nRaysPerBeam;
+    double azimuth = 0.0;
+    if (nColumns > 1)
+      azimuth = atan2(static_cast<double>(column) -
+                      0.5 * static_cast<double>(nColumns-1), flColumns);
+    double t = M_PI * 0.884 / hPixelSize
+               * sin(azimuth - tables->renderedAngles[beam]);
+    tables->azimuthBeamPattern[column] = (fabs(t) < 1E-8) ? 1.0 : sin(t)/t;
+  }
+
+  return tables;
+}
+}  // namespace NpsGazeboSonar
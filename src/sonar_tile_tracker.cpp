@@ -0,0 +1,131 @@
+/*
+ * Copyright 2020 Naval Postgraduate School
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+
+#include <nps_uw_sensors_gazebo/sonar_tile_tracker.hh>
+
+#include <algorithm>
+
+namespace NpsGazeboSonar
+{
+// FNV-1a over a rectangle of an image
+static uint64_t HashTile(const cv::Mat &_image, int _row, int _column,
+                         int _rows, int _columns, uint64_t _hash)
+{
+  if (_image.empty())
+    return _hash;
+  const size_t pixelBytes = _image.elemSize();
+  for (int row = _row; row < _row + _rows; row++)
+  {
+    const unsigned char *data = _image.ptr(row) + _column * pixelBytes;
+    const size_t bytes = _columns * pixelBytes;
+    for (size_t i = 0; i < bytes; i++)
+    {
+      _hash ^= data[i];
+      _hash *= 1099511628211ULL;
+    }
+  }
+  return _hash;
+}
+
+/////////////////////////////////////////////////
+SonarTileTracker::SonarTileTracker(int _tileSize, int _refreshInterval)
+  : tileSize(std::max(_tileSize, 1)),
+    refreshInterval(std::max(_refreshInterval, 1)),
+    framesSinceRefresh(0), invalid(true), changedFraction(1.0)
+{
+}
+
+/////////////////////////////////////////////////
+bool SonarTileTracker::Update(std::vector<SonarView> &_views)
+{
+  bool refresh = this->invalid || this->hashes.size() != _views.size() ||
+                 ++this->framesSinceRefresh >= this->refreshInterval;
+  this->hashes.resize(_views.size());
+
+  int nTiles = 0;
+  int nChanged = 0;
+  for (size_t v = 0; v < _views.size(); v++)
+  {
+    SonarView &view = _views[v];
+    const int rows = view.depth_image.rows;
+    const int columns = view.depth_image.cols;
+    const int tilesPerRow = (columns + this->tileSize - 1) / this->tileSize;
+    const int tilesPerColumn = (rows + this->tileSize - 1) / this->tileSize;
+    std::vector<uint64_t> &hashes = this->hashes[v];
+    if (static_cast<int>(hashes.size()) != tilesPerRow * tilesPerColumn)
+    {
+      hashes.assign(tilesPerRow * tilesPerColumn, 0);
+      refresh = true;
+    }
+
+    view.changedTiles.assign(hashes.size(), 0);
+    for (int tileRow = 0; tileRow < tilesPerColumn; tileRow++)
+    {
+      for (int tileColumn = 0; tileColumn < tilesPerRow; tileColumn++)
+      {
+        const int row = tileRow * this->tileSize;
+        const int column = tileColumn * this->tileSize;
+        const int tileRows = std::min(this->tileSize, rows - row);
+        const int tileColumns = std::min(this->tileSize, columns - column);
+        uint64_t hash = 14695981039346656037ULL;
+        hash = HashTile(view.depth_image, row, column, tileRows,
+                        tileColumns, hash);
+        hash = HashTile(view.normal_image, row, column, tileRows,
+                        tileColumns, hash);
+        hash = HashTile(view.material_image, row, column, tileRows,
+                        tileColumns, hash);
+        const int tile = tileRow * tilesPerRow + tileColumn;
+        if (hash != hashes[tile])
+        {
+          hashes[tile] = hash;
+          view.changedTiles[tile] = 1;
+          nChanged++;
+        }
+      }
+    }
+    nTiles += static_cast<int>(hashes.size());
+  }
+
+  if (refresh)
+  {
+    this->invalid = false;
+    this->framesSinceRefresh = 0;
+    nChanged = nTiles;
+  }
+  this->changedFraction =
+      nTiles > 0 ? static_cast<double>(nChanged) / nTiles : 0.0;
+  return refresh;
+}
+
+/////////////////////////////////////////////////
+void SonarTileTracker::Invalidate()
+{
+  this->invalid = true;
+}
+
+/////////////////////////////////////////////////
+int SonarTileTracker::TileSize() const
+{
+  return this->tileSize;
+}
+
+/////////////////////////////////////////////////
+double SonarTileTracker::ChangedFraction() const
+{
+  return this->changedFraction;
+}
+}  // namespace NpsGazeboSonar
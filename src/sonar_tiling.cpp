@@ -0,0 +1,90 @@
+/*
+ * Copyright 2020 Naval Postgraduate School
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+
+#include <nps_uw_sensors_gazebo/sonar_tiling.hh>
+
+#include <opencv2/imgproc.hpp>
+
+#include <algorithm>
+
+namespace NpsGazeboSonar
+{
+// Rows around a band read by the gradient filters (1) and the two
+// erosions of the no-reading mask (2)
+static const int BAND_HALO = 2;
+
+// Bytes per pixel held by a band: depth, both gradients, mask and its
+// erosion, normal and noise
+static const size_t BAND_PIXEL_BYTES = 4 + 2 * 4 + 2 * 1 + 12 + 8;
+
+/////////////////////////////////////////////////
+int BandRows(int _cols, size_t _cacheBytes)
+{
+  const size_t rowBytes = std::max(_cols, 1) * BAND_PIXEL_BYTES;
+  return std::max(1, static_cast<int>(_cacheBytes / rowBytes) - 2 * BAND_HALO);
+}
+
+/////////////////////////////////////////////////
+void ComputeNormalBand(const cv::Mat &_depth, int _begin, int _end,
+                       double _focalLength, cv::Mat &_normal)
+{
+  // filters
+  cv::Mat_<float> f1 = (cv::Mat_<float>(3, 3) << 1,  2,  1,
+                                                 0,  0,  0,
+                                                -1, -2, -1) / 8;
+
+  cv::Mat_<float> f2 = (cv::Mat_<float>(3, 3) << 1, 0, -1,
+                                                 2, 0, -2,
+                                                 1, 0, -1) / 8;
+
+  cv::Mat f1m, f2m;
+  cv::flip(f1, f1m, 0);
+  cv::flip(f2, f2m, 1);
+
+  // The filters read the rows around the band from the parent image, the
+  // erosion is only wrong within BAND_HALO rows of a cut, outside the band
+  const int first = std::max(_begin - BAND_HALO, 0);
+  const int last = std::min(_end + BAND_HALO, _depth.rows);
+  const cv::Mat depth = _depth.rowRange(first, last);
+
+  cv::Mat n1, n2;
+  cv::filter2D(depth, n1, -1, f1m, cv::Point(-1, -1), 0, cv::BORDER_REPLICATE);
+  cv::filter2D(depth, n2, -1, f2m, cv::Point(-1, -1), 0, cv::BORDER_REPLICATE);
+
+  cv::Mat no_readings;
+  cv::erode(depth == 0, no_readings, cv::Mat(), cv::Point(-1, -1), 2, 1, 1);
+
+  // Masking, channel merge and normalization in one pass over the band
+  const float scale = 1.0 / _focalLength;
+  for (int i = _begin; i < _end; ++i)
+  {
+    const int row = i - first;
+    const float *dz = depth.ptr<float>(row);
+    const float *dx = n1.ptr<float>(row);
+    const float *dy = n2.ptr<float>(row);
+    const unsigned char *mask = no_readings.ptr<unsigned char>(row);
+    cv::Vec3f *normal = _normal.ptr<cv::Vec3f>(i);
+    for (int j = 0; j < depth.cols; ++j)
+    {
+      const bool masked = mask[j] != 0;
+      normal[j] = cv::normalize(cv::Vec3f(masked ? 0.0f : dx[j],
+                                          masked ? 0.0f : dy[j],
+                                          scale * dz[j]));
+    }
+  }
+}
+}  // namespace NpsGazeboSonar
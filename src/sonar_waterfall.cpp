@@ -0,0 +1,66 @@
+/*
+ * Copyright 2020 Naval Postgraduate School
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+
+#include <nps_uw_sensors_gazebo/sonar_waterfall.hh>
+
+#include <algorithm>
+
+namespace NpsGazeboSonar
+{
+/////////////////////////////////////////////////
+SonarWaterfall::SonarWaterfall(int _lines, int _binsPerSide)
+  : binsPerSide(std::max(_binsPerSide, 1)), lines(std::max(_lines, 1)),
+    head(0), count(0)
+{
+  this->ring = cv::Mat::zeros(2 * this->lines, 2 * this->binsPerSide,
+                              CV_8UC1);
+}
+
+/////////////////////////////////////////////////
+void SonarWaterfall::Push(const float *_port, const float *_starboard,
+                          float _gain)
+{
+  // The head moves up, the line below it is the previous ping
+  this->head = (this->head + this->lines - 1) % this->lines;
+  this->count = std::min(this->count + 1, this->lines);
+
+  uchar *line = this->ring.ptr<uchar>(this->head);
+  const int n = this->binsPerSide;
+  for (int bin = 0; bin < n; bin++)
+  {
+    line[n - 1 - bin] =
+        _port ? cv::saturate_cast<uchar>(_port[bin] * _gain) : 0;
+    line[n + bin] =
+        _starboard ? cv::saturate_cast<uchar>(_starboard[bin] * _gain) : 0;
+  }
+  // Same line in the second copy
+  std::copy(line, line + this->ring.cols,
+            this->ring.ptr<uchar>(this->head + this->lines));
+}
+
+/////////////////////////////////////////////////
+cv::Mat SonarWaterfall::Image() const
+{
+  return this->ring.rowRange(this->head, this->head + this->lines);
+}
+
+/////////////////////////////////////////////////
+int SonarWaterfall::Lines() const
+{
+  return this->count;
+}
+}  // namespace NpsGazeboSonar
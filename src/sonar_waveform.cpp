@@ -0,0 +1,197 @@
+/*
+ * Copyright 2020 Naval Postgraduate School
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+
+#include <nps_uw_sensors_gazebo/sonar_waveform.hh>
+
+#include <math.h>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+
+namespace NpsGazeboSonar
+{
+/////////////////////////////////////////////////
+bool ParseWaveformType(const std::string &_name, WaveformType &_type)
+{
+  if (_name == "flat")
+    _type = WaveformType::FLAT;
+  else if (_name == "cw")
+    _type = WaveformType::CW;
+  else if (_name == "lfm")
+    _type = WaveformType::LFM;
+  else if (_name == "file")
+    _type = WaveformType::FILE;
+  else
+    return false;
+  return true;
+}
+
+/////////////////////////////////////////////////
+std::string WaveformStatusText(WaveformStatus _status)
+{
+  switch (_status)
+  {
+    case WaveformStatus::OK:
+      return "ok";
+    case WaveformStatus::FILE_NOT_FOUND:
+      return "spectrum file cannot be opened";
+    case WaveformStatus::NO_SAMPLES:
+      return "spectrum file has no \"frequency real imag\" line";
+    case WaveformStatus::UNSORTED:
+      return "spectrum file frequencies are not ascending";
+    case WaveformStatus::OUT_OF_BAND:
+      return "nothing is transmitted within the sonar bandwidth";
+  }
+  return "unknown waveform status";
+}
+
+/////////////////////////////////////////////////
+WaveformStatus TransmitSpectrum(const SonarWaveform &_waveform,
+                                double _sonarFreq, double _deltaF,
+                                int _nFreq,
+                                std::vector<std::complex<float>> &_spectrum)
+{
+  _spectrum.assign(_nFreq, std::complex<float>(1.0f, 0.0f));
+  if (_waveform.type == WaveformType::FLAT)
+    return WaveformStatus::OK;
+
+  // Baseband frequency of each bin, same bins as the echo synthesis
+  std::vector<double> offset(_nFreq);
+  for (int f = 0; f < _nFreq; f++)
+  {
+    if (_nFreq % 2 == 0)
+      offset[f] = _deltaF * (-_nFreq / 2.0 + f + 1.0);
+    else
+      offset[f] = _deltaF * (-(_nFreq - 1) / 2.0 + f + 1.0);
+  }
+
+  const double T = std::max(_waveform.pulseLength, 1e-9);
+  if (_waveform.type == WaveformType::CW)
+  {
+    // Rectangular pulse: T sinc(f T)
+    for (int f = 0; f < _nFreq; f++)
+    {
+      const double x = M_PI * offset[f] * T;
+      const double sinc = (fabs(x) < 1e-8) ? 1.0 : sin(x) / x;
+      _spectrum[f] = std::complex<float>(T * sinc, 0.0);
+    }
+  }
+  else if (_waveform.type == WaveformType::LFM)
+  {
+    // Stationary phase spectrum of a chirp with time bandwidth product
+    // well above one: constant magnitude over the sweep, quadratic phase
+    double B = _waveform.chirpBandwidth;
+    if (B <= 0.0)
+      B = _deltaF * _nFreq;
+    const double magnitude = sqrt(T / B);
+    for (int f = 0; f < _nFreq; f++)
+    {
+      if (fabs(offset[f]) > B / 2.0)
+        _spectrum[f] = 0.0f;
+      else
+        _spectrum[f] = std::polar(magnitude,
+                                  -M_PI * offset[f] * offset[f] * T / B
+                                  + M_PI / 4.0);
+    }
+  }
+  else
+  {
+    std::ifstream file(_waveform.spectrumFile);
+    if (!file)
+      return WaveformStatus::FILE_NOT_FOUND;
+    std::vector<double> frequency;
+    std::vector<std::complex<double>> sample;
+    std::string line;
+    while (std::getline(file, line))
+    {
+      line = line.substr(0, line.find('#'));
+      std::istringstream values(line);
+      double freq, re, im;
+      if (values >> freq >> re >> im)
+      {
+        frequency.push_back(freq);
+        sample.push_back(std::complex<double>(re, im));
+      }
+    }
+    if (frequency.empty())
+      return WaveformStatus::NO_SAMPLES;
+    if (!std::is_sorted(frequency.begin(), frequency.end()))
+      return WaveformStatus::UNSORTED;
+
+    // Linear interpolation, nothing is transmitted outside the file
+    for (int f = 0; f < _nFreq; f++)
+    {
+      const double freq = _sonarFreq + offset[f];
+      auto upper = std::upper_bound(frequency.begin(), frequency.end(), freq);
+      if (upper == frequency.begin() ||
+          (upper == frequency.end() && freq > frequency.back()))
+      {
+        _spectrum[f] = 0.0f;
+        continue;
+      }
+      const size_t i1 = std::min<size_t>(upper - frequency.begin(),
+                                         frequency.size() - 1);
+      const size_t i0 = i1 > 0 ? i1 - 1 : 0;
+      double w = 0.0;
+      if (frequency[i1] > frequency[i0])
+        w = (freq - frequency[i0]) / (frequency[i1] - frequency[i0]);
+      _spectrum[f] = std::complex<float>(
+          sample[i0] * (1.0 - w) + sample[i1] * w);
+    }
+  }
+  return WaveformStatus::OK;
+}
+
+/////////////////////////////////////////////////
+WaveformStatus WaveformWeights(
+                     const SonarWaveform &_waveform,
+                     const std::vector<float> &_window,
+                     double _sonarFreq, double _deltaF,
+                     std::vector<std::complex<float>> &_transmit,
+                     std::vector<std::complex<float>> &_matchedFilter)
+{
+  const int nFreq = static_cast<int>(_window.size());
+  _matchedFilter.clear();
+  const WaveformStatus status =
+    TransmitSpectrum(_waveform, _sonarFreq, _deltaF, nFreq, _transmit);
+  if (status != WaveformStatus::OK)
+  {
+    _transmit.clear();
+    return status;
+  }
+
+  // Peak of the compressed spectrum |S|^2, only for the normalization
+  float peak = 0.0f;
+  for (int f = 0; f < nFreq; f++)
+    peak = std::max(peak, std::norm(_transmit[f]));
+  if (peak <= 0.0f)
+  {
+    _transmit.clear();
+    return WaveformStatus::OUT_OF_BAND;
+  }
+
+  // The echo carries the windowed transmit spectrum, phase included, the
+  // matched filter (conjugate replica) then compresses that echo
+  _matchedFilter.resize(nFreq);
+  for (int f = 0; f < nFreq; f++)
+  {
+    _matchedFilter[f] = std::conj(_transmit[f]) / peak;
+    _transmit[f] *= _window[f];
+  }
+  return WaveformStatus::OK;
+}
+}  // namespace NpsGazeboSonar